@@ -0,0 +1,343 @@
+// Benchmark harness for the interpreter. Runs each workload a number of
+// times and reports median and minimum wall time, peak RSS and the number of
+// allocations the program made. Results can be written as JSON and compared
+// against a saved baseline.
+//
+// Usage: bench [--runs N] [--interpreter PATH] [--json FILE]
+//              [--compare BASELINE] [--threshold PERCENT] [workload.scm ...]
+//
+// With no workloads, runs every bench/suite/*.scm plus parse-large, a large
+// generated program that measures tokenizing and parsing. Run it from the
+// directory that holds the interpreter. With --compare, exits with status 1
+// if any workload regressed by more than the threshold (default 10%).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <glob.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define MAX_WORKLOADS 64
+#define MAX_RUNS 101
+// size of the generated parse-large program
+#define PARSE_LARGE_BYTES (4 * 1024 * 1024)
+
+typedef struct {
+    char name[64];
+    char path[4096];
+    double medianMs;
+    double minMs;
+    long maxRssKb;
+    long allocations;
+    long allocBytes;
+    bool failed;
+} Result;
+
+/* Milliseconds on the monotonic clock */
+static double nowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Names a workload after its file, without directory or extension */
+static void workloadName(const char *path, char *name, size_t size) {
+    const char *base = strrchr(path, '/');
+    base = base != NULL ? base + 1 : path;
+    snprintf(name, size, "%s", base);
+    char *dot = strrchr(name, '.');
+    if (dot != NULL) {
+        *dot = '\0';
+    }
+}
+
+/* Writes the parse-large program: one definition of a big quoted datum of
+   nested lists, symbols, numbers and strings, built from a fixed seed so
+   every run parses the same text */
+static bool writeParseLarge(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        return false;
+    }
+    unsigned seed = 12345;
+    long written = fprintf(out, "(define data (quote (");
+    int depth = 0;
+    while (written < PARSE_LARGE_BYTES) {
+        seed = seed * 1103515245 + 12345;
+        int pick = (seed >> 16) % 10;
+        if (pick < 2 && depth < 30) {
+            written += fprintf(out, "(");
+            depth++;
+        } else if (pick < 4 && depth > 0) {
+            written += fprintf(out, ") ");
+            depth--;
+        } else if (pick < 6) {
+            written += fprintf(out, "sym%u ", (seed >> 8) % 1000);
+        } else if (pick < 8) {
+            written += fprintf(out, "%d ", (int)((seed >> 8) % 100000) - 50000);
+        } else if (pick < 9) {
+            written += fprintf(out, "%d.%02d ", (seed >> 8) % 1000, (seed >> 4) % 100);
+        } else {
+            written += fprintf(out, "\"str%u\" ", (seed >> 8) % 1000);
+        }
+    }
+    while (depth-- > 0) {
+        fprintf(out, ")");
+    }
+    fprintf(out, ")))\n(null? data)\n");
+    return fclose(out) == 0;
+}
+
+/* Runs the interpreter once on a workload, adding its measurements to
+   result. Returns the wall time in ms, or -1 if the run failed. */
+static double runOnce(const char *interpreter, Result *result) {
+    int errPipe[2];
+    if (pipe(errPipe) < 0) {
+        return -1;
+    }
+
+    double start = nowMs();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        dup2(errPipe[1], STDERR_FILENO);
+        close(errPipe[0]);
+        execl(interpreter, interpreter, "--alloc-stats", result->path, (char *)NULL);
+        _exit(127);
+    }
+    close(errPipe[1]);
+
+    char output[4096];
+    size_t used = 0;
+    ssize_t n;
+    while ((n = read(errPipe[0], output + used, sizeof(output) - 1 - used)) > 0) {
+        used += n;
+        if (used == sizeof(output) - 1) {
+            // keep the tail, where the statistics line is
+            memmove(output, output + used / 2, used - used / 2);
+            used -= used / 2;
+        }
+    }
+    output[used] = '\0';
+    close(errPipe[0]);
+
+    int status;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    double elapsed = nowMs() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+
+    if (usage.ru_maxrss > result->maxRssKb) {
+        result->maxRssKb = usage.ru_maxrss;
+    }
+    char *stats = strstr(output, "allocations: ");
+    if (stats != NULL) {
+        sscanf(stats, "allocations: %ld (%ld bytes)", &result->allocations, &result->allocBytes);
+    }
+    return elapsed;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Runs a workload runs times and fills in result */
+static void runWorkload(const char *interpreter, int runs, Result *result) {
+    double times[MAX_RUNS];
+    for (int i = 0; i < runs; i++) {
+        times[i] = runOnce(interpreter, result);
+        if (times[i] < 0) {
+            result->failed = true;
+            return;
+        }
+    }
+    qsort(times, runs, sizeof(double), compareDoubles);
+    result->minMs = times[0];
+    result->medianMs = runs % 2 ? times[runs / 2] : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+}
+
+/* Writes results as JSON, one workload per line */
+static bool writeJson(const char *path, const char *interpreter, int runs,
+                      Result *results, int count) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        return false;
+    }
+    fprintf(out, "{\n  \"interpreter\": \"%s\",\n  \"runs\": %d,\n  \"results\": [\n",
+            interpreter, runs);
+    for (int i = 0; i < count; i++) {
+        Result *r = &results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"failed\": %s, \"median_ms\": %.3f, "
+                "\"min_ms\": %.3f, \"max_rss_kb\": %ld, \"allocations\": %ld, "
+                "\"alloc_bytes\": %ld}%s\n",
+                r->name, r->failed ? "true" : "false", r->medianMs, r->minMs,
+                r->maxRssKb, r->allocations, r->allocBytes, i + 1 < count ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+    return fclose(out) == 0;
+}
+
+/* Reads results written by writeJson. Returns how many were read, or -1 */
+static int readJson(const char *path, Result *results) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        return -1;
+    }
+    char line[1024];
+    int count = 0;
+    while (count < MAX_WORKLOADS && fgets(line, sizeof(line), in) != NULL) {
+        Result *r = &results[count];
+        char failed[8];
+        memset(r, 0, sizeof(Result));
+        if (sscanf(line, " {\"name\": \"%63[^\"]\", \"failed\": %7[a-z], \"median_ms\": %lf, "
+                   "\"min_ms\": %lf, \"max_rss_kb\": %ld, \"allocations\": %ld, "
+                   "\"alloc_bytes\": %ld}",
+                   r->name, failed, &r->medianMs, &r->minMs, &r->maxRssKb,
+                   &r->allocations, &r->allocBytes) == 7) {
+            r->failed = !strcmp(failed, "true");
+            count++;
+        }
+    }
+    fclose(in);
+    return count;
+}
+
+/* Percentage change from base to value */
+static double change(double value, double base) {
+    return base > 0 ? (value - base) / base * 100 : 0;
+}
+
+/* Prints each workload against the baseline; returns the number of
+   regressions. Time (the minimum, which is the least noisy) and RSS regress
+   beyond threshold percent; allocation counts are deterministic, so any
+   growth beyond 1% counts. */
+static int compare(Result *results, int count, Result *baseline, int baseCount,
+                   double threshold) {
+    int regressions = 0;
+    printf("\n%-14s %12s %12s %12s\n", "vs baseline", "min", "max rss", "allocs");
+    for (int i = 0; i < count; i++) {
+        Result *r = &results[i];
+        Result *b = NULL;
+        for (int j = 0; j < baseCount; j++) {
+            if (!strcmp(baseline[j].name, r->name)) {
+                b = &baseline[j];
+            }
+        }
+        if (b == NULL || b->failed || r->failed) {
+            printf("%-14s %12s\n", r->name, r->failed ? "FAILED" : "(no baseline)");
+            regressions += r->failed;
+            continue;
+        }
+        double time = change(r->minMs, b->minMs);
+        double rss = change(r->maxRssKb, b->maxRssKb);
+        double allocs = change(r->allocations, b->allocations);
+        bool regressed = time > threshold || rss > threshold || allocs > 1;
+        printf("%-14s %+11.1f%% %+11.1f%% %+11.1f%%%s\n", r->name, time, rss, allocs,
+               regressed ? "  REGRESSION" : "");
+        regressions += regressed;
+    }
+    return regressions;
+}
+
+int main(int argc, char **argv) {
+    int runs = 5;
+    const char *interpreter = "./interpreter";
+    const char *jsonPath = NULL;
+    const char *baselinePath = NULL;
+    double threshold = 10;
+    Result *results = calloc(MAX_WORKLOADS, sizeof(Result));
+    int count = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--runs") && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--interpreter") && i + 1 < argc) {
+            interpreter = argv[++i];
+        } else if (!strcmp(argv[i], "--json") && i + 1 < argc) {
+            jsonPath = argv[++i];
+        } else if (!strcmp(argv[i], "--compare") && i + 1 < argc) {
+            baselinePath = argv[++i];
+        } else if (!strcmp(argv[i], "--threshold") && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        } else if (count < MAX_WORKLOADS) {
+            snprintf(results[count].path, sizeof(results[count].path), "%s", argv[i]);
+            workloadName(argv[i], results[count].name, sizeof(results[count].name));
+            count++;
+        }
+    }
+    if (runs < 1 || runs > MAX_RUNS) {
+        fprintf(stderr, "--runs must be between 1 and %d\n", MAX_RUNS);
+        return 2;
+    }
+
+    char parseLarge[] = "/tmp/bench-parse-large-XXXXXX.scm";
+    bool generated = false;
+    if (count == 0) {
+        glob_t files;
+        if (glob("bench/suite/*.scm", 0, NULL, &files) == 0) {
+            for (size_t i = 0; i < files.gl_pathc && count < MAX_WORKLOADS - 1; i++) {
+                snprintf(results[count].path, sizeof(results[count].path), "%s",
+                         files.gl_pathv[i]);
+                workloadName(files.gl_pathv[i], results[count].name,
+                             sizeof(results[count].name));
+                count++;
+            }
+            globfree(&files);
+        }
+        int fd = mkstemps(parseLarge, 4);
+        if (fd >= 0) {
+            close(fd);
+            generated = writeParseLarge(parseLarge);
+        }
+        if (generated) {
+            snprintf(results[count].path, sizeof(results[count].path), "%s", parseLarge);
+            snprintf(results[count].name, sizeof(results[count].name), "parse-large");
+            count++;
+        }
+    }
+
+    printf("%-14s %10s %10s %12s %12s\n", "workload", "median ms", "min ms", "max rss KB",
+           "allocs");
+    for (int i = 0; i < count; i++) {
+        Result *r = &results[i];
+        runWorkload(interpreter, runs, r);
+        if (r->failed) {
+            printf("%-14s %10s\n", r->name, "FAILED");
+        } else {
+            printf("%-14s %10.1f %10.1f %12ld %12ld\n", r->name, r->medianMs, r->minMs,
+                   r->maxRssKb, r->allocations);
+        }
+        fflush(stdout);
+    }
+    if (generated) {
+        unlink(parseLarge);
+    }
+
+    if (jsonPath != NULL && !writeJson(jsonPath, interpreter, runs, results, count)) {
+        perror(jsonPath);
+        return 2;
+    }
+
+    if (baselinePath != NULL) {
+        Result *baseline = calloc(MAX_WORKLOADS, sizeof(Result));
+        int baseCount = readJson(baselinePath, baseline);
+        if (baseCount < 0) {
+            perror(baselinePath);
+            return 2;
+        }
+        int regressions = compare(results, count, baseline, baseCount, threshold);
+        printf("%d regression%s (threshold %.0f%%)\n", regressions,
+               regressions == 1 ? "" : "s", threshold);
+        return regressions > 0 ? 1 : 0;
+    }
+    return 0;
+}
@@ -0,0 +1,32 @@
+; Evaluator comparison workload: call-heavy (fib 22), a tail-recursive loop
+; and a non-tail recursion, each 5000 calls deep. The recursive evaluator
+; does not run tail calls in constant space, so the depth is kept to about a
+; third of what an unoptimised build without the JIT reaches on an 8 MB
+; stack. Run with `just bench-cek`, which times it with and without --cek.
+(define fib
+  (lambda (n)
+    (if (< n 2)
+        n
+        (+ (fib (+ n -1)) (fib (+ n -2))))))
+
+(define count-up
+  (lambda (n acc)
+    (if (< n 1)
+        acc
+        (count-up (+ n -1) (+ acc 1)))))
+
+(define build
+  (lambda (n)
+    (if (< n 1)
+        (quote ())
+        (cons n (build (+ n -1))))))
+
+(define sum
+  (lambda (lst)
+    (if (null? lst)
+        0
+        (+ (car lst) (sum (cdr lst))))))
+
+(fib 22)
+(count-up 5000 0)
+(sum (build 5000))
@@ -0,0 +1,22 @@
+; Futures scaling workload: starts 32 independent (fib 19) computations as
+; futures and sums their results. Run with `just bench-futures`, which times
+; it with increasing numbers of pool workers.
+(define fib
+  (lambda (n)
+    (if (< n 2)
+        n
+        (+ (fib (+ n -1)) (fib (+ n -2))))))
+
+(define start-all
+  (lambda (n)
+    (if (< n 1)
+        (quote ())
+        (cons (future (fib 19)) (start-all (+ n -1))))))
+
+(define touch-all
+  (lambda (futures)
+    (if (null? futures)
+        0
+        (+ (touch (car futures)) (touch-all (cdr futures))))))
+
+(touch-all (start-all 32))
@@ -0,0 +1,190 @@
+// Load-test client for the interpreter's --serve mode. Starts a number of
+// client threads, each sending the same program over its own connection a
+// number of times, and reports throughput and latency percentiles.
+//
+// Usage: loadtest SOCKET FILE [clients] [requests-per-client]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "../server.h"
+
+typedef struct {
+    const char *socketPath;
+    const char *program;
+    uint32_t length;
+    int requests;
+    double *latencies;   // seconds, one per request
+    int completed;
+    int failed;          // responses with a status other than JOB_OK
+    bool broken;         // connection failed part way
+} Client;
+
+/* Seconds on the monotonic clock */
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Reads exactly size bytes; false on end of file or error */
+static bool readFull(int fd, void *buffer, size_t size) {
+    char *p = buffer;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+/* Writes exactly size bytes; false on error */
+static bool writeFull(int fd, const void *buffer, size_t size) {
+    const char *p = buffer;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+/* Body of a client thread */
+static void *runClient(void *arg) {
+    Client *client = arg;
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", client->socketPath);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        client->broken = true;
+        return NULL;
+    }
+
+    uint32_t length = htonl(client->length);
+    char *output = NULL;
+    for (int i = 0; i < client->requests; i++) {
+        double start = now();
+        uint32_t header[2];
+        if (!writeFull(fd, &length, sizeof(length)) ||
+            !writeFull(fd, client->program, client->length) ||
+            !readFull(fd, header, sizeof(header))) {
+            client->broken = true;
+            break;
+        }
+        uint32_t size = ntohl(header[1]);
+        output = realloc(output, size > 0 ? size : 1);
+        if (!readFull(fd, output, size)) {
+            client->broken = true;
+            break;
+        }
+        client->latencies[client->completed++] = now() - start;
+        if (ntohl(header[0]) != JOB_OK) {
+            client->failed++;
+        }
+    }
+    free(output);
+    close(fd);
+    return NULL;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Returns the p-th percentile of sorted values */
+static double percentile(double *sorted, int count, double p) {
+    int index = (int)(p / 100 * count);
+    if (index >= count) {
+        index = count - 1;
+    }
+    return sorted[index];
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s SOCKET FILE [clients] [requests-per-client]\n", argv[0]);
+        return 2;
+    }
+    int clients = argc > 3 ? atoi(argv[3]) : 4;
+    int requests = argc > 4 ? atoi(argv[4]) : 100;
+
+    FILE *file = fopen(argv[2], "r");
+    if (file == NULL) {
+        perror(argv[2]);
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    rewind(file);
+    char *program = malloc(length + 1);
+    if (fread(program, 1, length, file) != (size_t)length) {
+        perror(argv[2]);
+        return 1;
+    }
+    fclose(file);
+
+    Client *state = calloc(clients, sizeof(Client));
+    pthread_t *threads = calloc(clients, sizeof(pthread_t));
+    double start = now();
+    for (int i = 0; i < clients; i++) {
+        state[i].socketPath = argv[1];
+        state[i].program = program;
+        state[i].length = (uint32_t)length;
+        state[i].requests = requests;
+        state[i].latencies = calloc(requests, sizeof(double));
+        pthread_create(&threads[i], NULL, runClient, &state[i]);
+    }
+
+    int completed = 0, failed = 0, broken = 0;
+    for (int i = 0; i < clients; i++) {
+        pthread_join(threads[i], NULL);
+        completed += state[i].completed;
+        failed += state[i].failed;
+        broken += state[i].broken;
+    }
+    double elapsed = now() - start;
+
+    double *all = malloc((completed > 0 ? completed : 1) * sizeof(double));
+    int n = 0;
+    for (int i = 0; i < clients; i++) {
+        memcpy(all + n, state[i].latencies, state[i].completed * sizeof(double));
+        n += state[i].completed;
+    }
+    qsort(all, n, sizeof(double), compareDoubles);
+
+    printf("clients:     %d\n", clients);
+    printf("requests:    %d completed, %d not ok, %d connections broken\n",
+           completed, failed, broken);
+    printf("elapsed:     %.3f s\n", elapsed);
+    printf("throughput:  %.1f requests/s\n", completed / elapsed);
+    if (n > 0) {
+        printf("latency:     p50 %.2f ms  p90 %.2f ms  p99 %.2f ms  max %.2f ms\n",
+               percentile(all, n, 50) * 1e3, percentile(all, n, 90) * 1e3,
+               percentile(all, n, 99) * 1e3, all[n - 1] * 1e3);
+    }
+    return broken > 0 ? 1 : 0;
+}
@@ -0,0 +1,313 @@
+// Microbenchmarks for the tokenizer, parser and evaluator. Each stage is timed
+// on its own, on synthetic programs generated in memory, so a change can be
+// attributed to the stage it affected. Reports nanoseconds per token for
+// tokenize, per parse-tree node for parse, and per evaluation step (a call to
+// eval or a closure application) for eval.
+//
+// Usage: microbench [--size N] [--reps N] [stage or shape ...]
+//
+// Stages are tokenize, parse and eval; shapes are deep (nesting 500-1000
+// levels), flat (long lists), symbols (many distinct names) and numeric
+// (integer and real arithmetic). Naming stages or shapes runs only those.
+// --size is roughly the number of tokens or eval steps per input (default
+// 200000); each measurement is the fastest of --reps runs (default 5). Build
+// it with `just microbench`.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include "../schemeval.h"
+#include "../tokenizer.h"
+#include "../parser.h"
+#include "../interpreter.h"
+#include "../linkedlist.h"
+#include "../talloc.h"
+#include "../quota.h"
+
+#define DEEP_NESTING 1000
+#define DEEP_EVAL_NESTING 500
+#define FLAT_LENGTH 1000
+#define SYMBOL_COUNT 1000
+#define LOOP_LENGTH 1000
+
+typedef struct {
+    const char *name;
+    // writes a program of about size tokens, for tokenize and parse
+    void (*syntax)(FILE *out, long size);
+    // writes definitions evaluated before timing starts, or NULL
+    void (*prelude)(FILE *out, long size);
+    // writes a program taking about size eval steps
+    void (*body)(FILE *out, long size);
+} Shape;
+
+/* Nanoseconds on the monotonic clock */
+static long long nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Nested lists DEEP_NESTING levels deep, repeated: (a (a (a ...))) */
+static void deepSyntax(FILE *out, long size) {
+    for (long written = 0; written < size; written += 3 * DEEP_NESTING) {
+        for (int i = 0; i < DEEP_NESTING; i++) {
+            fputs("(a ", out);
+        }
+        for (int i = 0; i < DEEP_NESTING; i++) {
+            fputc(')', out);
+        }
+        fputc('\n', out);
+    }
+}
+
+/* (+ 1 (+ 1 ... (+ 1 0))) DEEP_EVAL_NESTING levels deep, repeated */
+static void deepBody(FILE *out, long size) {
+    for (long steps = 0; steps < size; steps += 4 * DEEP_EVAL_NESTING) {
+        for (int i = 0; i < DEEP_EVAL_NESTING; i++) {
+            fputs("(+ 1 ", out);
+        }
+        fputc('0', out);
+        for (int i = 0; i < DEEP_EVAL_NESTING; i++) {
+            fputc(')', out);
+        }
+        fputc('\n', out);
+    }
+}
+
+/* Quoted lists of FLAT_LENGTH short symbols */
+static void flatSyntax(FILE *out, long size) {
+    for (long written = 0; written < size; written += FLAT_LENGTH + 3) {
+        fputs("'(", out);
+        for (int i = 0; i < FLAT_LENGTH; i++) {
+            fprintf(out, "x%d ", i % 10);
+        }
+        fputs(")\n", out);
+    }
+}
+
+/* Applications of + to FLAT_LENGTH arguments */
+static void flatBody(FILE *out, long size) {
+    for (long steps = 0; steps < size; steps += FLAT_LENGTH + 2) {
+        fputs("(+", out);
+        for (int i = 0; i < FLAT_LENGTH; i++) {
+            fprintf(out, " %d", i);
+        }
+        fputs(")\n", out);
+    }
+}
+
+/* Long, mostly distinct symbol names */
+static void symbolsSyntax(FILE *out, long size) {
+    for (long i = 0; i < size; i++) {
+        fprintf(out, "%s-symbol-%ld%c", i % 2 ? "some" : "another", i, i % 16 ? ' ' : '\n');
+    }
+}
+
+/* Defines SYMBOL_COUNT global variables */
+static void symbolsPrelude(FILE *out, long size) {
+    for (int i = 0; i < SYMBOL_COUNT; i++) {
+        fprintf(out, "(define variable-%d %d)\n", i, i);
+    }
+}
+
+/* Sums of every variable symbolsPrelude defines, so each step is a lookup */
+static void symbolsBody(FILE *out, long size) {
+    for (long steps = 0; steps < size; steps += SYMBOL_COUNT + 2) {
+        fputs("(+", out);
+        for (int i = 0; i < SYMBOL_COUNT; i++) {
+            fprintf(out, " variable-%d", i);
+        }
+        fputs(")\n", out);
+    }
+}
+
+/* Arithmetic on integer and real literals */
+static void numericSyntax(FILE *out, long size) {
+    unsigned seed = 12345;
+    for (long written = 0; written < size; written += 6) {
+        seed = seed * 1103515245 + 12345;
+        fprintf(out, "(+ %d %u.%03u -%u)\n", (int)(seed >> 16) % 1000000,
+                (seed >> 8) % 1000, seed % 1000, (seed >> 4) % 100000);
+    }
+}
+
+/* A counting loop accumulating a real sum */
+static void numericPrelude(FILE *out, long size) {
+    fputs("(define loop (lambda (i n acc)"
+          " (if (< i n) (loop (+ i 1) n (+ acc i 0.5)) acc)))\n", out);
+}
+
+/* Runs of LOOP_LENGTH iterations; each takes about 14 steps */
+static void numericBody(FILE *out, long size) {
+    for (long steps = 0; steps < size; steps += 14 * LOOP_LENGTH) {
+        fprintf(out, "(loop 0 %d 0)\n", LOOP_LENGTH);
+    }
+}
+
+static const Shape shapes[] = {
+    {"deep", deepSyntax, NULL, deepBody},
+    {"flat", flatSyntax, NULL, flatBody},
+    {"symbols", symbolsSyntax, symbolsPrelude, symbolsBody},
+    {"numeric", numericSyntax, numericPrelude, numericBody},
+};
+
+static const char *stages[] = {"tokenize", "parse", "eval"};
+
+/* Generates text with a shape's generator into a malloc'd string */
+static char *generate(void (*generator)(FILE *, long), long size, size_t *length) {
+    char *text = NULL;
+    FILE *out = open_memstream(&text, length);
+    if (generator != NULL) {
+        generator(out, size);
+    }
+    fclose(out);
+    return text;
+}
+
+/* Tokenizes text held in memory */
+static SchemeVal *tokenizeText(char *text, size_t length) {
+    if (length == 0) {
+        return makeEmpty();
+    }
+    FILE *input = fmemopen(text, length, "r");
+    SchemeVal *tokens = tokenizeFile(input);
+    fclose(input);
+    return tokens;
+}
+
+/* Counts the nodes of a parse tree: every pair and every atom but () */
+static long countNodes(SchemeVal *tree) {
+    long count = 0;
+    while (tree->type == CONS_TYPE) {
+        count += 1 + countNodes(car(tree));
+        tree = cdr(tree);
+    }
+    return count + (tree->type != EMPTY_TYPE);
+}
+
+/* Times one run of a stage on a shape. units is set to the number of
+   tokens, nodes or steps the run covered.
+   Output: elapsed nanoseconds */
+static long long runStage(const char *stage, const Shape *shape, long size, long *units) {
+    long long start, elapsed;
+    size_t textLength;
+    if (!strcmp(stage, "tokenize")) {
+        char *text = generate(shape->syntax, size, &textLength);
+        start = nowNs();
+        SchemeVal *tokens = tokenizeText(text, textLength);
+        elapsed = nowNs() - start;
+        *units = length(tokens);
+        free(text);
+    } else if (!strcmp(stage, "parse")) {
+        char *text = generate(shape->syntax, size, &textLength);
+        SchemeVal *tokens = tokenizeText(text, textLength);
+        free(text);
+        start = nowNs();
+        SchemeVal *tree = parse(tokens);
+        elapsed = nowNs() - start;
+        *units = countNodes(tree);
+    } else {
+        Frame *global = makeGlobalFrame();
+        char *text = generate(shape->prelude, size, &textLength);
+        for (SchemeVal *forms = parse(tokenizeText(text, textLength)); !isEmpty(forms);
+             forms = cdr(forms)) {
+            eval(car(forms), global);
+        }
+        free(text);
+        text = generate(shape->body, size, &textLength);
+        SchemeVal *tree = parse(tokenizeText(text, textLength));
+        free(text);
+
+        disarmQuota();
+        start = nowNs();
+        for (SchemeVal *forms = tree; !isEmpty(forms); forms = cdr(forms)) {
+            eval(car(forms), global);
+        }
+        elapsed = nowNs() - start;
+        *units = stepsSinceDisarm();
+    }
+    tfree();
+    return elapsed;
+}
+
+/* True if name is one of the count names in kind */
+static bool member(const char *name, const char **kind, int count) {
+    for (int i = 0; i < count; i++) {
+        if (!strcmp(name, kind[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* True if name was given on the command line, or no name of its kind was */
+static bool selected(const char *name, const char **names, int nameCount,
+                     const char **kind, int kindCount) {
+    bool any = false;
+    for (int i = 0; i < nameCount; i++) {
+        if (member(names[i], kind, kindCount)) {
+            any = true;
+            if (!strcmp(names[i], name)) {
+                return true;
+            }
+        }
+    }
+    return !any;
+}
+
+int main(int argc, char **argv) {
+    long size = 200000;
+    int reps = 5;
+    const char *names[64];
+    int nameCount = 0;
+    const char *shapeNames[sizeof(shapes) / sizeof(shapes[0])];
+    int shapeCount = sizeof(shapes) / sizeof(shapes[0]);
+    int stageCount = sizeof(stages) / sizeof(stages[0]);
+    for (int i = 0; i < shapeCount; i++) {
+        shapeNames[i] = shapes[i].name;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--size") && i + 1 < argc) {
+            size = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "--reps") && i + 1 < argc) {
+            reps = atoi(argv[++i]);
+        } else if (nameCount < 64 && (member(argv[i], stages, stageCount) ||
+                                      member(argv[i], shapeNames, shapeCount))) {
+            names[nameCount++] = argv[i];
+        } else {
+            fprintf(stderr, "usage: %s [--size N] [--reps N] [stage or shape ...]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (size < 1 || reps < 1) {
+        fprintf(stderr, "--size and --reps must be positive\n");
+        return 2;
+    }
+
+    static const char *unitNames[] = {"token", "node", "step"};
+    printf("%-10s %-10s %12s %12s\n", "stage", "shape", "units", "ns/unit");
+    for (int s = 0; s < stageCount; s++) {
+        if (!selected(stages[s], names, nameCount, stages, stageCount)) {
+            continue;
+        }
+        for (int i = 0; i < shapeCount; i++) {
+            if (!selected(shapes[i].name, names, nameCount, shapeNames, shapeCount)) {
+                continue;
+            }
+            long long best = -1;
+            long units = 0;
+            for (int r = 0; r < reps; r++) {
+                long long elapsed = runStage(stages[s], &shapes[i], size, &units);
+                if (best < 0 || elapsed < best) {
+                    best = elapsed;
+                }
+            }
+            printf("%-10s %-10s %12ld %9.1f ns/%s\n", stages[s], shapes[i].name, units,
+                   units > 0 ? (double)best / units : 0.0, unitNames[s]);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,24 @@
+; Quota regression check: work handed to pool threads runs under the quota of
+; the form that started it. Run with `just quota-check`, which runs it under
+; --max-time 500 and expects each runaway form to fail with a time limit
+; error well before the check's own timeout.
+(define spin
+  (lambda (x)
+    (let loop ((i 0))
+      (if (< i 2000000000) (loop (+ i 1)) x))))
+
+(define range
+  (lambda (n)
+    (if (< n 1)
+        (quote ())
+        (cons n (range (+ n -1))))))
+
+; the future runs on a worker while this thread does other work
+(define runaway (future (spin 0)))
+(null? (range 1000))
+(touch runaway)
+
+; each chunk spins on its own worker
+(parallel-map spin (range 256))
+
+(quote finished)
@@ -0,0 +1,2 @@
+; Job sent by the load test client on every request.
+(fib 15)
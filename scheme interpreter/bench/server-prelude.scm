@@ -0,0 +1,7 @@
+; Prelude for the server load test: evaluated once by `interpreter --serve`,
+; before the workers are forked.
+(define fib
+  (lambda (n)
+    (if (< n 2)
+        n
+        (+ (fib (+ n -1)) (fib (+ n -2))))))
@@ -0,0 +1,11 @@
+; Ackermann function: deeply nested non-tail recursion.
+(define ack
+  (lambda (m n)
+    (if (< m 1)
+        (+ n 1)
+        (if (< n 1)
+            (ack (+ m -1) 1)
+            (ack (+ m -1) (ack m (+ n -1)))))))
+
+(ack 2 9)
+(ack 3 5)
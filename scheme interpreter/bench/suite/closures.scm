@@ -0,0 +1,30 @@
+; Deeply nested closures: a 2000-deep chain of composed lambdas, each
+; capturing the previous one, and counters kept in closed-over variables.
+(define chain
+  (lambda (n f)
+    (if (< n 1)
+        f
+        (chain (+ n -1) (lambda (x) (f (+ x 1)))))))
+
+(define run-chain
+  (lambda (times f acc)
+    (if (< times 1) acc (run-chain (+ times -1) f (f acc)))))
+
+(run-chain 20 (chain 2000 (lambda (x) x)) 0)
+
+(define make-counter
+  (lambda ()
+    (let ((count 0))
+      (lambda ()
+        (set! count (+ count 1))
+        count))))
+
+(define tick
+  (lambda (counter n)
+    (if (< n 1) (counter) (let ((ignored (counter))) (tick counter (+ n -1))))))
+
+(define tick-all
+  (lambda (counter times)
+    (if (< times 1) (counter) (let ((ignored (tick counter 1000))) (tick-all counter (+ times -1))))))
+
+(tick-all (make-counter) 30)
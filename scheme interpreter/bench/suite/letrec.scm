@@ -0,0 +1,19 @@
+; letrec-heavy code: local mutually recursive procedures, rebuilt on every
+; call of the outer procedure.
+(define parity-sum
+  (lambda (n)
+    (letrec ((even? (lambda (k) (if (< k 1) #t (odd? (+ k -1)))))
+             (odd? (lambda (k) (if (< k 1) #f (even? (+ k -1)))))
+             (loop (lambda (i acc)
+                     (if (< i 1)
+                         acc
+                         (loop (+ i -1) (if (even? i) (+ acc 1) acc))))))
+      (loop n 0))))
+
+(define outer
+  (lambda (times acc)
+    (if (< times 1)
+        acc
+        (outer (+ times -1) (+ acc (parity-sum 60))))))
+
+(outer 80 0)
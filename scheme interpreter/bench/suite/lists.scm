@@ -0,0 +1,22 @@
+; List building, map and reversal over 2000-element lists.
+(define iota
+  (lambda (n acc)
+    (if (< n 1) acc (iota (+ n -1) (cons n acc)))))
+
+(define reverse-onto
+  (lambda (lst acc)
+    (if (null? lst) acc (reverse-onto (cdr lst) (cons (car lst) acc)))))
+
+(define sum
+  (lambda (lst acc)
+    (if (null? lst) acc (sum (cdr lst) (+ acc (car lst))))))
+
+(define round
+  (lambda (lst)
+    (reverse-onto (map (lambda (x) (+ x 1)) lst) (quote ()))))
+
+(define repeat
+  (lambda (n lst)
+    (if (< n 1) lst (repeat (+ n -1) (round lst)))))
+
+(sum (repeat 40 (iota 2000 (quote ()))) 0)
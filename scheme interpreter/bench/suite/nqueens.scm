@@ -0,0 +1,37 @@
+; Counts the solutions of the 8 queens problem: list search with
+; backtracking.
+(define same?
+  (lambda (a b)
+    (if (< a b) #f (if (< b a) #f #t))))
+
+(define safe?
+  (lambda (q placed dist)
+    (if (null? placed)
+        #t
+        (let ((p (car placed)))
+          (if (same? p q)
+              #f
+              (if (same? p (+ q dist))
+                  #f
+                  (if (same? (+ p dist) q)
+                      #f
+                      (safe? q (cdr placed) (+ dist 1)))))))))
+
+(define try-columns
+  (lambda (q n placed)
+    (if (< q n)
+        (+ (if (safe? q placed 1) (place n (cons q placed)) 0)
+           (try-columns (+ q 1) n placed))
+        0)))
+
+(define count-placed
+  (lambda (placed)
+    (if (null? placed) 0 (+ 1 (count-placed (cdr placed))))))
+
+(define place
+  (lambda (n placed)
+    (if (< (count-placed placed) n)
+        (try-columns 0 n placed)
+        1)))
+
+(place 8 (quote ()))
@@ -0,0 +1,581 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <setjmp.h>
+#include "cek.h"
+#include "schemeval.h"
+#include "interpreter.h"
+#include "talloc.h"
+#include "error.h"
+#include "linkedlist.h"
+#include "quota.h"
+#include "stats.h"
+#include "trace.h"
+#include "loop.h"
+
+// What is left to do once the current expression has a value. Frames are
+// never changed after they are pushed, so a captured continuation can be
+// resumed any number of times.
+typedef enum {
+    IF_KONT,      // exprs: the branches
+    ARGS_KONT,    // exprs: operands still to evaluate; values: those done, reversed
+    BODY_KONT,    // exprs: body expressions still to evaluate
+    LET_KONT,     // exprs: bindings still to evaluate; values: those done, reversed
+    LETREC_KONT,  // as LET_KONT, with frame the letrec's own frame
+    DEFINE_KONT,  // exprs: the variable
+    SET_KONT      // exprs: the variable
+} KontKind;
+
+typedef struct Kont {
+    KontKind kind;
+    SchemeVal *exprs;
+    SchemeVal *values;
+    // let and letrec: the whole (bindings body ...) of the form
+    SchemeVal *form;
+    Frame *frame;
+    struct Kont *next;
+} Kont;
+
+typedef enum {
+    EVAL_STATE,    // evaluate control in frame
+    RETURN_STATE,  // pass the value control to kont
+    APPLY_STATE    // apply the procedure control to args
+} MachineState;
+
+// One run of the machine. Its registers live here rather than in locals, so
+// they survive the longjmp that delivers a continuation to the run.
+typedef struct CekRun {
+    MachineState state;
+    SchemeVal *control;
+    SchemeVal *args;
+    Frame *frame;
+    Kont *kont;
+    // root runs evaluate top-level expressions and can resume each other's
+    // continuations; the others run closures for primitives
+    bool root;
+    bool active;
+} CekRun;
+
+// The state behind a CONTINUATION_TYPE value.
+typedef struct {
+    Kont *kont;
+    CekRun *run;
+    // made by call/cc outside the evaluator: can only unwind to that call,
+    // and only while it is active
+    bool escapeOnly;
+    bool active;
+    // value being delivered while the stack unwinds
+    SchemeVal *value;
+} Continuation;
+
+static bool enabled = false;
+// number of root runs on this thread's stack
+static _Thread_local int rootRuns = 0;
+
+// Switches evaluation over to the explicit-stack evaluator
+void setCekEnabled(bool enable) {
+    enabled = enable;
+}
+
+// Checks if the explicit-stack evaluator is in use
+bool cekEnabled() {
+    return enabled;
+}
+
+/* Pushes a continuation frame onto run's continuation */
+static void push(CekRun *run, KontKind kind, SchemeVal *exprs, SchemeVal *values,
+                 SchemeVal *form, Frame *frame) {
+    Kont *kont = talloc(sizeof(Kont));
+    kont->kind = kind;
+    kont->exprs = exprs;
+    kont->values = values;
+    kont->form = form;
+    kont->frame = frame;
+    kont->next = run->kont;
+    run->kont = kont;
+}
+
+/* Makes value the result of the current expression */
+static void returnValue(CekRun *run, SchemeVal *value) {
+    run->state = RETURN_STATE;
+    run->control = value;
+}
+
+/* Starts on a non-empty body; only the expressions before the last one need
+   a frame, so calls in tail position do not grow the continuation */
+static void enterBody(CekRun *run, SchemeVal *body, Frame *frame) {
+    if (!isEmpty(cdr(body))) {
+        push(run, BODY_KONT, cdr(body), NULL, NULL, frame);
+    }
+    run->state = EVAL_STATE;
+    run->control = car(body);
+    run->frame = frame;
+}
+
+/* Creates a continuation value */
+static SchemeVal *makeContinuation(Kont *kont, CekRun *run, bool escapeOnly) {
+    Continuation *continuation = talloc(sizeof(Continuation));
+    continuation->kont = kont;
+    continuation->run = run;
+    continuation->escapeOnly = escapeOnly;
+    continuation->active = true;
+    continuation->value = NULL;
+
+    SchemeVal *result = talloc(sizeof(SchemeVal));
+    result->type = CONTINUATION_TYPE;
+    result->ptr = continuation;
+    return result;
+}
+
+/* Checks if continuation can be resumed by run without unwinding */
+static bool resumableIn(Continuation *continuation, CekRun *run) {
+    if (continuation->escapeOnly) {
+        return false;
+    }
+    return continuation->run == run || (continuation->run->root && run->root);
+}
+
+/* Returns the single value passed to a continuation */
+static SchemeVal *continuationValue(SchemeVal *args) {
+    if (length(args) != 1) {
+        evalError("continuation requires exactly one argument");
+    }
+    return car(args);
+}
+
+// Unwinds to the run or call/cc that made continuation, passing it the
+// value in args.
+void throwToContinuation(SchemeVal *value, SchemeVal *args) {
+    Continuation *continuation = value->ptr;
+    SchemeVal *delivered = continuationValue(args);
+
+    bool reachable;
+    if (continuation->escapeOnly) {
+        reachable = continuation->active;
+    } else if (continuation->run->root) {
+        reachable = rootRuns > 0;
+    } else {
+        reachable = continuation->run->active;
+    }
+    if (!reachable) {
+        evalError("continuation called outside its extent");
+    }
+    continuation->value = delivered;
+    raiseCondition(value);
+}
+
+/* Evaluates a special form the machine knows how to suspend, or hands it
+   to eval */
+static void evalSpecialForm(CekRun *run, SchemeVal *expr) {
+    char *name = car(expr)->s;
+    SchemeVal *args = cdr(expr);
+    Frame *frame = run->frame;
+
+    if (!strcmp(name, "quote")) {
+        countEval(EVAL_QUOTE);
+        if (isEmpty(args) || !isEmpty(cdr(args))) {
+            evalError("quote requires one expression");
+        }
+        returnValue(run, car(args));
+    }
+    else if (!strcmp(name, "lambda")) {
+        countEval(EVAL_LAMBDA);
+        returnValue(run, evalLambda(args, frame));
+    }
+    else if (!strcmp(name, "if")) {
+        countEval(EVAL_IF);
+        int count = length(args);
+        if (count != 2 && count != 3) {
+            evalError("if requires 2 or 3 expressions");
+        }
+        push(run, IF_KONT, cdr(args), NULL, NULL, frame);
+        run->control = car(args);
+    }
+    else if (!strcmp(name, "define")) {
+        countEval(EVAL_DEFINE);
+        SchemeVal *var = checkDefine(args, frame);
+        push(run, DEFINE_KONT, var, NULL, NULL, frame);
+        run->control = car(cdr(args));
+    }
+    else if (!strcmp(name, "set!")) {
+        countEval(EVAL_SET);
+        SchemeVal *var = checkSet(args);
+        push(run, SET_KONT, var, NULL, NULL, frame);
+        run->control = car(cdr(args));
+    }
+    else if (!strcmp(name, "let") || !strcmp(name, "letrec")) {
+        bool letrec = !strcmp(name, "letrec");
+        countEval(letrec ? EVAL_LETREC : EVAL_LET);
+        if (!letrec && args->type == CONS_TYPE && car(args)->type == SYMBOL_TYPE) {
+            // a named let is evaluated as the procedure call it stands for
+            run->control = expandLoop(expr);
+            return;
+        }
+        if (isEmpty(args)) {
+            evalError("%s needs bindings and body", name);
+        }
+        SchemeVal *bindings = car(args);
+        checkBindings(bindings);
+        if (isEmpty(cdr(args))) {
+            evalError("%s body missing", name);
+        }
+
+        Frame *newFrame;
+        if (letrec) {
+            newFrame = makeLetrecFrame(bindings, frame);
+        } else {
+            runtimeStats.frames++;
+            newFrame = talloc(sizeof(Frame));
+            newFrame->parent = frame;
+            newFrame->bindings = makeEmpty();
+        }
+        if (isEmpty(bindings)) {
+            enterBody(run, cdr(args), newFrame);
+            return;
+        }
+        // a let's right-hand sides are evaluated outside its frame, so the
+        // frame is built once they all have values
+        push(run, letrec ? LETREC_KONT : LET_KONT, bindings, makeEmpty(), args,
+             letrec ? newFrame : frame);
+        run->control = car(cdr(car(bindings)));
+        run->frame = letrec ? newFrame : frame;
+    }
+    else if (!strcmp(name, "do")) {
+        countEval(EVAL_DO);
+        run->control = expandLoop(expr);
+    }
+    else {
+        // eval counts the form itself
+        returnValue(run, eval(expr, frame));
+    }
+}
+
+/* Checks if expr is a constant or a variable, which are evaluated on the
+   spot rather than through a continuation frame */
+static bool isSimple(SchemeVal *expr) {
+    switch (expr->type) {
+        case INT_TYPE:
+        case DOUBLE_TYPE:
+        case STR_TYPE:
+        case BOOL_TYPE:
+        case SYMBOL_TYPE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Evaluates an expression for which isSimple holds */
+static SchemeVal *evalSimple(SchemeVal *expr, Frame *frame) {
+    return expr->type == SYMBOL_TYPE ? lookUpSymbol(expr, frame) : expr;
+}
+
+/* Starts on an application whose operator and operands are all simple,
+   building the argument list in order with no continuation frame. Returns
+   false, having done nothing, if some of them are not simple. */
+static bool applySimple(CekRun *run, SchemeVal *expr) {
+    for (SchemeVal *rest = expr; !isEmpty(rest); rest = cdr(rest)) {
+        if (!isSimple(car(rest))) {
+            return false;
+        }
+    }
+
+    SchemeVal *args = makeEmpty();
+    SchemeVal **tail = &args;
+    for (SchemeVal *rest = cdr(expr); !isEmpty(rest); rest = cdr(rest)) {
+        *tail = cons(evalSimple(car(rest), run->frame), *tail);
+        tail = &(*tail)->cdr;
+    }
+    run->state = APPLY_STATE;
+    run->control = evalSimple(car(expr), run->frame);
+    run->args = args;
+    return true;
+}
+
+/* Carries on evaluating the operator and operands of an application: exprs
+   are those left and values, reversed, those done. Simple ones are
+   evaluated straight away; a frame is pushed only for the others. */
+static void continueArgs(CekRun *run, SchemeVal *exprs, SchemeVal *values, Frame *frame) {
+    while (!isEmpty(exprs) && isSimple(car(exprs))) {
+        values = cons(evalSimple(car(exprs), frame), values);
+        exprs = cdr(exprs);
+    }
+
+    if (isEmpty(exprs)) {
+        SchemeVal *call = reverse(values);
+        run->state = APPLY_STATE;
+        run->control = car(call);
+        run->args = cdr(call);
+    } else {
+        push(run, ARGS_KONT, cdr(exprs), values, NULL, frame);
+        run->state = EVAL_STATE;
+        run->control = car(exprs);
+        run->frame = frame;
+    }
+}
+
+/* Takes one step from EVAL_STATE */
+static void evalStep(CekRun *run) {
+    useFuel();
+    SchemeVal *expr = run->control;
+    TRACE_EVAL(expr);
+    switch (expr->type) {
+        case INT_TYPE:
+        case DOUBLE_TYPE:
+        case STR_TYPE:
+        case BOOL_TYPE:
+            countEval(EVAL_CONSTANT);
+            returnValue(run, expr);
+            return;
+
+        case SYMBOL_TYPE:
+            countEval(EVAL_VARIABLE);
+            returnValue(run, lookUpSymbol(expr, run->frame));
+            return;
+
+        case CONS_TYPE:
+            break;
+
+        default:
+            evalError("unsupported expression type");
+    }
+
+    SchemeVal *first = car(expr);
+    if (first->type == SYMBOL_TYPE && isSpecialForm(first)) {
+        evalSpecialForm(run, expr);
+    }
+    else if (first->type != SYMBOL_TYPE && first->type != CONS_TYPE) {
+        evalError("bad form");
+    }
+    else {
+        countEval(EVAL_APPLICATION);
+        if (!applySimple(run, expr)) {
+            continueArgs(run, expr, makeEmpty(), run->frame);
+        }
+    }
+}
+
+/* Takes one step from RETURN_STATE, popping the top continuation frame */
+static void returnStep(CekRun *run) {
+    SchemeVal *value = run->control;
+    Kont *kont = run->kont;
+    run->kont = kont->next;
+
+    switch (kont->kind) {
+        case IF_KONT: {
+            bool condition = !(value->type == BOOL_TYPE && !value->b);
+            SchemeVal *branches = kont->exprs;
+            if (!condition) {
+                if (isEmpty(cdr(branches))) {
+                    evalError("missing else clause");
+                }
+                branches = cdr(branches);
+            }
+            run->state = EVAL_STATE;
+            run->control = car(branches);
+            run->frame = kont->frame;
+            break;
+        }
+
+        case ARGS_KONT:
+            continueArgs(run, kont->exprs, cons(value, kont->values), kont->frame);
+            break;
+
+        case BODY_KONT:
+            enterBody(run, kont->exprs, kont->frame);
+            break;
+
+        case LET_KONT:
+        case LETREC_KONT: {
+            SchemeVal *values = cons(value, kont->values);
+            SchemeVal *rest = cdr(kont->exprs);
+            if (!isEmpty(rest)) {
+                push(run, kont->kind, rest, values, kont->form, kont->frame);
+                run->state = EVAL_STATE;
+                run->control = car(cdr(car(rest)));
+                run->frame = kont->frame;
+                break;
+            }
+
+            SchemeVal *bindings = car(kont->form);
+            values = reverse(values);
+            Frame *newFrame = kont->frame;
+            if (kont->kind == LETREC_KONT) {
+                assignLetrec(bindings, values, newFrame);
+            } else {
+                newFrame = talloc(sizeof(Frame));
+                newFrame->parent = kont->frame;
+                newFrame->bindings = makeEmpty();
+                while (!isEmpty(bindings)) {
+                    newFrame->bindings = cons(cons(car(car(bindings)), car(values)),
+                                              newFrame->bindings);
+                    bindings = cdr(bindings);
+                    values = cdr(values);
+                }
+            }
+            enterBody(run, cdr(kont->form), newFrame);
+            break;
+        }
+
+        case DEFINE_KONT:
+            defineVariable(kont->exprs, value, kont->frame);
+            returnValue(run, makeVoid());
+            break;
+
+        case SET_KONT:
+            setVariable(kont->exprs, value, kont->frame);
+            returnValue(run, makeVoid());
+            break;
+    }
+}
+
+/* Takes one step from APPLY_STATE */
+static void applyStep(CekRun *run) {
+    SchemeVal *function = run->control;
+    SchemeVal *args = run->args;
+
+    if (function->type == CLOSURE_TYPE) {
+        useFuel();
+        runtimeStats.closureCalls++;
+        enterBody(run, function->functionCode, bindArguments(function, args));
+    }
+    else if (function->type == PRIMITIVE_TYPE && function->pf == primitiveCallCC) {
+        if (length(args) != 1) {
+            evalError("call/cc requires exactly one argument");
+        }
+        run->control = car(args);
+        run->args = cons(makeContinuation(run->kont, run, false), makeEmpty());
+    }
+    else if (function->type == PRIMITIVE_TYPE) {
+        countPrimitiveCall(function);
+        returnValue(run, function->pf(args));
+    }
+    else if (function->type == CONTINUATION_TYPE) {
+        Continuation *continuation = function->ptr;
+        if (!resumableIn(continuation, run)) {
+            throwToContinuation(function, args);
+        }
+        run->kont = continuation->kont;
+        returnValue(run, continuationValue(args));
+    }
+    else {
+        evalError("not a procedure");
+    }
+}
+
+/* Steps the machine until its continuation is empty */
+static SchemeVal *execute(CekRun *run) {
+    for (;;) {
+        switch (run->state) {
+            case EVAL_STATE:
+                evalStep(run);
+                break;
+            case RETURN_STATE:
+                if (run->kont == NULL) {
+                    return run->control;
+                }
+                returnStep(run);
+                break;
+            case APPLY_STATE:
+                applyStep(run);
+                break;
+        }
+    }
+}
+
+/* Runs the machine from its current state. Continuations thrown from
+   deeper in the C stack (from inside a primitive) are caught here and
+   resumed; everything else raised is passed on. */
+static SchemeVal *runMachine(CekRun *run) {
+    run->active = true;
+    if (run->root) {
+        rootRuns++;
+    }
+
+    ErrorHandler handler;
+    for (;;) {
+        pushHandler(&handler);
+        if (setjmp(handler.env) == 0) {
+            SchemeVal *result = execute(run);
+            popHandler(&handler);
+            run->active = false;
+            if (run->root) {
+                rootRuns--;
+            }
+            return result;
+        }
+        popHandler(&handler);
+
+        SchemeVal *condition = lastCondition();
+        if (condition == NULL || condition->type != CONTINUATION_TYPE ||
+            !resumableIn(condition->ptr, run)) {
+            run->active = false;
+            if (run->root) {
+                rootRuns--;
+            }
+            raiseCondition(condition);
+        }
+        Continuation *continuation = condition->ptr;
+        run->kont = continuation->kont;
+        returnValue(run, continuation->value);
+    }
+}
+
+/* Creates a run with an empty continuation */
+static CekRun *makeRun(bool root, Frame *frame) {
+    CekRun *run = talloc(sizeof(CekRun));
+    memset(run, 0, sizeof(CekRun));
+    run->root = root;
+    run->frame = frame;
+    return run;
+}
+
+// Evaluates a top-level expression on the explicit-stack machine
+// Input: SchemeVal* expr, Frame* frame
+// Output: SchemeVal* - its value
+SchemeVal *evalCek(SchemeVal *expr, Frame *frame) {
+    CekRun *run = makeRun(true, frame);
+    run->state = EVAL_STATE;
+    run->control = expr;
+    return runMachine(run);
+}
+
+// Applies a closure on the explicit-stack machine
+// Input: SchemeVal* function, SchemeVal* args - evaluated arguments
+// Output: SchemeVal* - value of the closure's body
+SchemeVal *applyCek(SchemeVal *function, SchemeVal *args) {
+    CekRun *run = makeRun(false, NULL);
+    run->state = APPLY_STATE;
+    run->control = function;
+    run->args = args;
+    return runMachine(run);
+}
+
+// call/cc when called directly, as by map: calls proc with an escape-only
+// continuation
+// Input: SchemeVal* args - procedure of one argument
+// Output: SchemeVal* - value of proc, or the value passed to the continuation
+SchemeVal *primitiveCallCC(SchemeVal *args) {
+    if (length(args) != 1) {
+        evalError("call/cc requires exactly one argument");
+    }
+
+    SchemeVal *value = makeContinuation(NULL, NULL, true);
+    Continuation *continuation = value->ptr;
+    ErrorHandler handler;
+    SchemeVal *volatile result;
+    pushHandler(&handler);
+    if (setjmp(handler.env) == 0) {
+        result = apply(car(args), cons(value, makeEmpty()), NULL);
+        popHandler(&handler);
+    } else {
+        popHandler(&handler);
+        continuation->active = false;
+        if (lastCondition() != value) {
+            raiseCondition(lastCondition());
+        }
+        result = continuation->value;
+    }
+    continuation->active = false;
+    return result;
+}
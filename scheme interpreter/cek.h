@@ -0,0 +1,35 @@
+#include <stdbool.h>
+#include "schemeval.h"
+
+#ifndef _CEK
+#define _CEK
+
+// An evaluator that keeps its continuation in heap-allocated frames instead
+// of on the C stack, so recursion depth is limited only by memory, calls in
+// tail position run in constant space, and call/cc can capture and re-enter
+// the whole continuation. It is used in place of eval once enabled.
+
+// Switches the interpreter to this evaluator. Call it once, before any
+// evaluation starts.
+void setCekEnabled(bool enabled);
+bool cekEnabled();
+
+// Evaluates a top-level expression. Continuations captured here stay
+// re-enterable from later top-level expressions.
+SchemeVal *evalCek(SchemeVal *expr, Frame *frame);
+
+// Applies a closure for a primitive (such as map) that calls back into
+// Scheme. Continuations captured inside can be re-entered only while the
+// primitive is still running, and escaped from at any time.
+SchemeVal *applyCek(SchemeVal *function, SchemeVal *args);
+
+// (call/cc proc) calls proc with the current continuation. Called directly
+// rather than from the evaluator, it makes an escape-only continuation that
+// is valid until call/cc returns.
+SchemeVal *primitiveCallCC(SchemeVal *args);
+
+// Invokes a continuation from outside the evaluator that captured it, by
+// unwinding the C stack to that evaluator.
+_Noreturn void throwToContinuation(SchemeVal *continuation, SchemeVal *args);
+
+#endif
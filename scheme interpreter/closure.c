@@ -0,0 +1,425 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "closure.h"
+#include "schemeval.h"
+#include "interpreter.h"
+#include "linkedlist.h"
+#include "talloc.h"
+#include "position.h"
+#include "stats.h"
+#include "loop.h"
+
+static bool enabled = true;
+
+// State of one run of the pass over a top-level form. The scope a form is
+// rewritten in is a list of entries, innermost first, one per local binding
+// around it: a pair of the bound symbol and one of the two markers below.
+// Uses are lists of the entries a form refers to, each once.
+typedef struct {
+    SchemeVal *closureSymbol;
+    // bound by a define in a body, so perhaps not yet when the form runs
+    SchemeVal *defined;
+    // bound by a lambda, let or letrec from the start
+    SchemeVal *bound;
+} FlattenPass;
+
+void setFlatClosuresEnabled(bool enable) {
+    enabled = enable;
+}
+
+bool flatClosuresEnabled() {
+    return enabled;
+}
+
+/* A new symbol named name */
+static SchemeVal *makeSymbol(char *name) {
+    SchemeVal *symbol = talloc(sizeof(SchemeVal));
+    symbol->type = SYMBOL_TYPE;
+    symbol->s = name;
+    return symbol;
+}
+
+/* Checks if item is in list, comparing pointers */
+static bool containsItem(SchemeVal *list, SchemeVal *item) {
+    for (; !isEmpty(list); list = cdr(list)) {
+        if (car(list) == item) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Checks if expr is a pair whose first element is the symbol name */
+static bool isForm(SchemeVal *expr, const char *name) {
+    return expr->type == CONS_TYPE && car(expr)->type == SYMBOL_TYPE &&
+           !strcmp(car(expr)->s, name);
+}
+
+/* Number of elements of a proper list, or -1 */
+static int properLength(SchemeVal *list) {
+    int count = 0;
+    for (; list->type == CONS_TYPE; list = cdr(list)) {
+        count++;
+    }
+    return isEmpty(list) ? count : -1;
+}
+
+/* Adds to uses the entry in scope that symbol refers to as a variable.
+   Until a define has run, the name still refers to the binding further
+   out, so the entries beyond a defined one are added too. */
+static void addUse(FlattenPass *pass, SchemeVal *symbol, SchemeVal *scope, SchemeVal **uses) {
+    for (; !isEmpty(scope); scope = cdr(scope)) {
+        SchemeVal *entry = car(scope);
+        if (strcmp(car(entry)->s, symbol->s)) {
+            continue;
+        }
+        if (!containsItem(*uses, entry)) {
+            *uses = cons(entry, *uses);
+        }
+        if (cdr(entry) != pass->defined) {
+            return;
+        }
+    }
+}
+
+/* Adds to uses every symbol in expr at any depth, for a form the pass does
+   not take apart */
+static void addAllUses(FlattenPass *pass, SchemeVal *expr, SchemeVal *scope, SchemeVal **uses) {
+    while (expr->type == CONS_TYPE) {
+        addAllUses(pass, car(expr), scope, uses);
+        expr = cdr(expr);
+    }
+    if (expr->type == SYMBOL_TYPE) {
+        addUse(pass, expr, scope, uses);
+    }
+}
+
+/* Adds an entry for every symbol that expr, at any depth, defines, marked
+   defined, to scope. Quoted data and nested bodies are searched too, which
+   only makes the pass more cautious. */
+static SchemeVal *addDefines(FlattenPass *pass, SchemeVal *expr, SchemeVal *scope) {
+    while (expr->type == CONS_TYPE) {
+        if (isForm(expr, "define") && cdr(expr)->type == CONS_TYPE &&
+            car(cdr(expr))->type == SYMBOL_TYPE) {
+            scope = cons(cons(car(cdr(expr)), pass->defined), scope);
+        }
+        scope = addDefines(pass, car(expr), scope);
+        expr = cdr(expr);
+    }
+    return scope;
+}
+
+/* Adds an entry for each symbol in params, a lambda parameter list or a
+   single symbol, to scope, or returns NULL if params is malformed */
+static SchemeVal *addParameters(FlattenPass *pass, SchemeVal *params, SchemeVal *scope) {
+    if (params->type == SYMBOL_TYPE) {
+        return cons(cons(params, pass->bound), scope);
+    }
+    for (; params->type == CONS_TYPE; params = cdr(params)) {
+        if (car(params)->type != SYMBOL_TYPE) {
+            return NULL;
+        }
+        scope = cons(cons(car(params), pass->bound), scope);
+    }
+    return isEmpty(params) ? scope : NULL;
+}
+
+// A copy of a list made as its elements are rewritten front to back, once
+// the first of them changes; until then nothing is allocated.
+typedef struct {
+    bool changed;
+    SchemeVal *head;
+    SchemeVal *last;
+} ListCopy;
+
+/* Adds element to the end of copy */
+static void appendCopy(ListCopy *copy, SchemeVal *element) {
+    SchemeVal *cell = cons(element, makeEmpty());
+    if (copy->last == NULL) {
+        copy->head = cell;
+    } else {
+        copy->last->cdr = cell;
+    }
+    copy->last = cell;
+}
+
+/* Takes element as the new value of the element of list at part, copying
+   the elements before it the first time one changes */
+static void keepElement(ListCopy *copy, SchemeVal *list, SchemeVal *part, SchemeVal *element) {
+    if (!copy->changed) {
+        if (element == car(part)) {
+            return;
+        }
+        copy->changed = true;
+        for (SchemeVal *before = list; before != part; before = cdr(before)) {
+            appendCopy(copy, car(before));
+        }
+    }
+    appendCopy(copy, element);
+}
+
+/* The copy of list, positioned like it, or list itself if nothing changed */
+static SchemeVal *finishCopy(ListCopy *copy, SchemeVal *list) {
+    if (!copy->changed) {
+        return list;
+    }
+    copyPosition(copy->head, list);
+    return copy->head;
+}
+
+/* list with its element at index at replaced by element */
+static SchemeVal *replaceElement(SchemeVal *list, int at, SchemeVal *element) {
+    ListCopy copy = {false, NULL, NULL};
+    int i = 0;
+    for (SchemeVal *part = list; !isEmpty(part); part = cdr(part), i++) {
+        keepElement(&copy, list, part, i == at ? element : car(part));
+    }
+    return finishCopy(&copy, list);
+}
+
+static SchemeVal *rewrite(FlattenPass *pass, SchemeVal *expr, SchemeVal *scope, SchemeVal **uses);
+
+/* Rewrites the elements of list from index from on in scope, returning list
+   itself if none changed */
+static SchemeVal *rewriteElements(FlattenPass *pass, SchemeVal *list, int from,
+                                  SchemeVal *scope, SchemeVal **uses) {
+    ListCopy copy = {false, NULL, NULL};
+    int i = 0;
+    for (SchemeVal *part = list; !isEmpty(part); part = cdr(part), i++) {
+        keepElement(&copy, list, part,
+                    i < from ? car(part) : rewrite(pass, car(part), scope, uses));
+    }
+    return finishCopy(&copy, list);
+}
+
+/* Checks that bindings is a proper list of (symbol expression) pairs */
+static bool isBindingList(SchemeVal *bindings) {
+    if (properLength(bindings) < 0) {
+        return false;
+    }
+    for (; !isEmpty(bindings); bindings = cdr(bindings)) {
+        SchemeVal *binding = car(bindings);
+        if (properLength(binding) != 2 || car(binding)->type != SYMBOL_TYPE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Rewrites a let or letrec form, or a named let, whose bindings are its
+   element at index at: the right-hand sides in initScope and the body in
+   bodyScope */
+static SchemeVal *rewriteLet(FlattenPass *pass, SchemeVal *expr, int at, SchemeVal *initScope,
+                             SchemeVal *bodyScope, SchemeVal **uses) {
+    SchemeVal *bindings = expr;
+    for (int i = 0; i < at; i++) {
+        bindings = cdr(bindings);
+    }
+    bindings = car(bindings);
+    ListCopy newBindings = {false, NULL, NULL};
+    for (SchemeVal *part = bindings; !isEmpty(part); part = cdr(part)) {
+        keepElement(&newBindings, bindings, part,
+                    rewriteElements(pass, car(part), 1, initScope, uses));
+    }
+    SchemeVal *rewritten = rewriteElements(pass, expr, at + 1, bodyScope, uses);
+    return replaceElement(rewritten, at, finishCopy(&newBindings, bindings));
+}
+
+/* Rewrites a well-formed do form: the initial values in scope, and the
+   steps, test clause and commands in the scope of its variables */
+static SchemeVal *rewriteDo(FlattenPass *pass, SchemeVal *expr, SchemeVal *scope,
+                            SchemeVal **uses) {
+    SchemeVal *specs = car(cdr(expr));
+    SchemeVal *inner = addDefines(pass, cdr(cdr(expr)), scope);
+    for (SchemeVal *spec = specs; !isEmpty(spec); spec = cdr(spec)) {
+        inner = cons(cons(car(car(spec)), pass->bound), inner);
+    }
+    ListCopy newSpecs = {false, NULL, NULL};
+    for (SchemeVal *part = specs; !isEmpty(part); part = cdr(part)) {
+        SchemeVal *spec = car(part);
+        SchemeVal *newSpec = replaceElement(spec, 1, rewrite(pass, car(cdr(spec)), scope, uses));
+        if (!isEmpty(cdr(cdr(spec)))) {
+            newSpec = replaceElement(newSpec, 2, rewrite(pass, car(cdr(cdr(spec))), inner, uses));
+        }
+        keepElement(&newSpecs, specs, part, newSpec);
+    }
+    SchemeVal *clause = rewriteElements(pass, car(cdr(cdr(expr))), 0, inner, uses);
+    SchemeVal *rewritten = rewriteElements(pass, expr, 3, inner, uses);
+    rewritten = replaceElement(rewritten, 1, finishCopy(&newSpecs, specs));
+    return replaceElement(rewritten, 2, clause);
+}
+
+/* Checks if another entry further out in scope than entry binds the same
+   name */
+static bool isShadowing(SchemeVal *scope, SchemeVal *entry) {
+    while (car(scope) != entry) {
+        scope = cdr(scope);
+    }
+    for (scope = cdr(scope); !isEmpty(scope); scope = cdr(scope)) {
+        if (!strcmp(car(car(scope))->s, car(entry)->s)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Rewrites a lambda form in scope, as a #closure form unless it is made at
+   top level or captures a name that is defined in a body and bound further
+   out too. The entries it captures are added to uses, since the frame it
+   is made in must have them. */
+static SchemeVal *rewriteLambda(FlattenPass *pass, SchemeVal *expr, SchemeVal *scope,
+                                SchemeVal **uses) {
+    SchemeVal *inner = properLength(expr) < 3 ? NULL : addDefines(pass, cdr(cdr(expr)), scope);
+    inner = inner != NULL ? addParameters(pass, car(cdr(expr)), inner) : NULL;
+    if (inner == NULL) {
+        // left for evalLambda to report
+        addAllUses(pass, expr, scope, uses);
+        return expr;
+    }
+    SchemeVal *innerUses = makeEmpty();
+    SchemeVal *lambda = rewriteElements(pass, expr, 2, inner, &innerUses);
+
+    bool flat = !isEmpty(scope);
+    SchemeVal *names = makeEmpty();
+    for (SchemeVal *use = innerUses; !isEmpty(use); use = cdr(use)) {
+        SchemeVal *entry = car(use);
+        if (!containsItem(scope, entry)) {
+            continue;
+        }
+        if (!containsItem(*uses, entry)) {
+            *uses = cons(entry, *uses);
+        }
+        flat = flat && !(cdr(entry) == pass->defined && isShadowing(scope, entry));
+        names = cons(car(entry), names);
+    }
+    if (!flat) {
+        return lambda;
+    }
+    SchemeVal *closure = cons(pass->closureSymbol, cons(names, cons(lambda, makeEmpty())));
+    copyPosition(closure, expr);
+    return closure;
+}
+
+/* Rewrites expr in scope, adding the entries it refers to, in it or in
+   the closures it makes, to uses. Malformed forms are left alone for eval
+   to report, and every symbol in them counts as used. */
+static SchemeVal *rewrite(FlattenPass *pass, SchemeVal *expr, SchemeVal *scope, SchemeVal **uses) {
+    if (expr->type == SYMBOL_TYPE) {
+        addUse(pass, expr, scope, uses);
+        return expr;
+    }
+    if (expr->type != CONS_TYPE) {
+        return expr;
+    }
+    int count = properLength(expr);
+    SchemeVal *first = car(expr);
+    if (count < 0 || (first->type != SYMBOL_TYPE && first->type != CONS_TYPE)) {
+        addAllUses(pass, expr, scope, uses);
+        return expr;
+    }
+    if (first->type == CONS_TYPE || !isSpecialForm(first)) {
+        return rewriteElements(pass, expr, 0, scope, uses);
+    }
+    if (isForm(expr, "quote")) {
+        return expr;
+    }
+    if (isForm(expr, "lambda")) {
+        return rewriteLambda(pass, expr, scope, uses);
+    }
+    if (isForm(expr, "#inline") && count == 5) {
+        // the binding and closure are data, not code
+        return rewriteElements(pass, expr, 3, scope, uses);
+    }
+    if (isForm(expr, "let") && count >= 4 && car(cdr(expr))->type == SYMBOL_TYPE &&
+        isBindingList(car(cdr(cdr(expr))))) {
+        // a named let: its name is bound in the body too
+        SchemeVal *inner = addDefines(pass, cdr(cdr(cdr(expr))), scope);
+        inner = cons(cons(car(cdr(expr)), pass->bound), inner);
+        for (SchemeVal *binding = car(cdr(cdr(expr))); !isEmpty(binding);
+             binding = cdr(binding)) {
+            inner = cons(cons(car(car(binding)), pass->bound), inner);
+        }
+        return rewriteLet(pass, expr, 2, scope, inner, uses);
+    }
+    if ((isForm(expr, "let") || isForm(expr, "letrec")) && count >= 3 &&
+        isBindingList(car(cdr(expr)))) {
+        SchemeVal *inner = addDefines(pass, cdr(cdr(expr)), scope);
+        for (SchemeVal *binding = car(cdr(expr)); !isEmpty(binding); binding = cdr(binding)) {
+            inner = cons(cons(car(car(binding)), pass->bound), inner);
+        }
+        return rewriteLet(pass, expr, 1, isForm(expr, "let") ? scope : inner, inner, uses);
+    }
+    char buffer[100];
+    if (isForm(expr, "do") && doError(cdr(expr), buffer, sizeof(buffer)) == NULL) {
+        return rewriteDo(pass, expr, scope, uses);
+    }
+    if ((isForm(expr, "define") || isForm(expr, "set!")) && count == 3 &&
+        car(cdr(expr))->type == SYMBOL_TYPE) {
+        if (isForm(expr, "set!")) {
+            addUse(pass, car(cdr(expr)), scope, uses);
+        }
+        return rewriteElements(pass, expr, 2, scope, uses);
+    }
+    if (isForm(expr, "if") || isForm(expr, "future") || isForm(expr, "time")) {
+        // evaluated in place
+        return rewriteElements(pass, expr, 1, scope, uses);
+    }
+    addAllUses(pass, expr, scope, uses);
+    return expr;
+}
+
+// Rewrites the lambdas of a top-level form, whose scope has no entries
+SchemeVal *flattenClosures(SchemeVal *form) {
+    if (!enabled) {
+        return form;
+    }
+    FlattenPass pass;
+    pass.closureSymbol = makeSymbol("#closure");
+    pass.defined = makeSymbol("defined");
+    pass.bound = makeSymbol("bound");
+    SchemeVal *uses = makeEmpty();
+    return rewrite(&pass, form, makeEmpty(), &uses);
+}
+
+/* The binding of symbol in frame or the frames around it short of the
+   global frame, or NULL */
+static SchemeVal *localBinding(SchemeVal *symbol, Frame *frame) {
+    runtimeStats.lookups++;
+    for (; frame->parent != NULL; frame = frame->parent) {
+        runtimeStats.framesWalked++;
+        SchemeVal *bindings = __atomic_load_n(&frame->bindings, __ATOMIC_ACQUIRE);
+        for (; !isEmpty(bindings); bindings = cdr(bindings)) {
+            if (!strcmp(car(car(bindings))->s, symbol->s)) {
+                return car(bindings);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Makes the closure in a frame of the captured bindings, or in frame if one
+// of them is not there yet
+SchemeVal *evalClosure(SchemeVal *args, Frame *frame) {
+    SchemeVal *lambda = car(cdr(args));
+    SchemeVal *bindings = makeEmpty();
+    for (SchemeVal *name = car(args); !isEmpty(name); name = cdr(name)) {
+        SchemeVal *binding = localBinding(car(name), frame);
+        if (binding == NULL) {
+            return evalLambda(cdr(lambda), frame);
+        }
+        bindings = cons(binding, bindings);
+    }
+    Frame *global = frame;
+    while (global->parent != NULL) {
+        global = global->parent;
+    }
+    if (isEmpty(bindings)) {
+        return evalLambda(cdr(lambda), global);
+    }
+    runtimeStats.frames++;
+    Frame *flat = talloc(sizeof(Frame));
+    flat->bindings = bindings;
+    flat->parent = global;
+    return evalLambda(cdr(lambda), flat);
+}
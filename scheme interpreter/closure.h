@@ -0,0 +1,40 @@
+#include <stdbool.h>
+#include "schemeval.h"
+
+#ifndef _CLOSURE
+#define _CLOSURE
+
+// Flat closures. A closure made by a lambda keeps the frame it was made in,
+// and with it every binding of every frame around it, for as long as the
+// closure lives; its variables are found by searching the whole chain. A
+// pass over each top-level form, run after inlining (inline.h), works out
+// which variables bound by enclosing lambdas, lets, letrecs and loops each
+// nested lambda refers to, its own nested lambdas included, and rewrites the
+// lambda to (#closure CAPTURED LAMBDA), with CAPTURED the list of those
+// names. eval makes the closure of such a form in a frame of its own that
+// holds just the captured bindings, under the global frame.
+//
+// A binding is a (name . value) pair, which set! updates in place, so the
+// new frame shares the pairs rather than copying the values: a captured
+// variable that is assigned, by the closure or by the code around it, is
+// boxed in its pair, and both see every assignment. A name defined inside
+// a body may not have been defined yet when the closure is made; eval then
+// makes the closure in the whole chain, as a lambda does. A lambda is left
+// alone if a name it captures is defined in a body and bound further out as
+// well, as the closure would see the outer binding until the define runs.
+//
+// The pass does not run under --cek, and --no-flat-closures turns it off.
+
+// On by default. Call before evaluation starts.
+void setFlatClosuresEnabled(bool enabled);
+bool flatClosuresEnabled();
+
+// Returns form with its nested lambdas made flat closures where that is
+// safe; form itself is left unchanged, and returned as is if nothing was
+// rewritten.
+SchemeVal *flattenClosures(SchemeVal *form);
+
+// Evaluates the arguments of a #closure form: makes the closure.
+SchemeVal *evalClosure(SchemeVal *args, Frame *frame);
+
+#endif
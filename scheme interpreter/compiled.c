@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include "compiled.h"
+#include "schemeval.h"
+#include "interpreter.h"
+#include "linkedlist.h"
+#include "parser.h"
+#include "talloc.h"
+#include "error.h"
+#include "position.h"
+
+SchemeVal trueValue = {.type = BOOL_TYPE, .b = true};
+SchemeVal falseValue = {.type = BOOL_TYPE, .b = false};
+SchemeVal voidValue = {.type = VOID_TYPE};
+SchemeVal unspecifiedValue = {.type = UNSPECIFIED_TYPE};
+
+/* The position of line and column in source, or 0 if line is 0 */
+static SourcePosition compiledPosition(const char *source, int line, int column) {
+    if (line == 0) {
+        return 0;
+    }
+    setSourceName(source);
+    return makePosition(line, column);
+}
+
+// Runs each top-level form under its own error handler, like interpretIn
+// Input: initialize - sets up globals, forms - the program, count - its length
+// Output: exit status, 1 if any form raised an error
+int runCompiled(void (*initialize)(void), const CompiledForm *forms, int count) {
+    initialize();
+    int errors = 0;
+    for (int i = 0; i < count; i++) {
+        ErrorHandler handler;
+        pushHandler(&handler);
+        if (setjmp(handler.env) == 0) {
+            SchemeVal *result = forms[i].run();
+            popHandler(&handler);
+            printTreeHelper(result);
+            printf("\n");
+        } else {
+            popHandler(&handler);
+            // errors that could not say where they happened point at the form
+            SchemeVal *condition = lastCondition();
+            if (condition != NULL && condition->type == ERROR_TYPE && !hasPosition(condition)) {
+                setPosition(condition, compiledPosition(forms[i].source, forms[i].line,
+                                                        forms[i].column));
+            }
+            printCondition(stdout, condition);
+            errors++;
+        }
+    }
+    tfree();
+    return errors > 0 ? 1 : 0;
+}
+
+// Makes a procedure, with its captured values in the same allocation
+SchemeVal *makeCompiled(CompiledCode code, const char *name, int count, SchemeVal **captured) {
+    SchemeVal *function = talloc(sizeof(SchemeVal) + count * sizeof(SchemeVal *));
+    function->type = COMPILED_TYPE;
+    function->code = code;
+    function->name = name;
+    function->captured = (SchemeVal **)(function + 1);
+    memcpy(function->captured, captured, count * sizeof(SchemeVal *));
+    return function;
+}
+
+// Looks a primitive up in the primitive table by name
+SchemeVal *compiledPrimitive(const char *name) {
+    for (int i = 0; i < primitiveCount(); i++) {
+        if (!strcmp(primitiveName(i), name)) {
+            SchemeVal *value = talloc(sizeof(SchemeVal));
+            value->type = PRIMITIVE_TYPE;
+            value->pf = primitiveFunction(i);
+            value->primitive = i;
+            return value;
+        }
+    }
+    evalError("no primitive %s", name);
+}
+
+SchemeVal *compiledSymbol(const char *name) {
+    SchemeVal *symbol = talloc(sizeof(SchemeVal));
+    symbol->type = SYMBOL_TYPE;
+    symbol->s = (char *)name;
+    return symbol;
+}
+
+SchemeVal **makeBox(SchemeVal *value) {
+    SchemeVal **box = talloc(sizeof(SchemeVal *));
+    *box = value;
+    return box;
+}
+
+// Spreads a list of arguments into an array for the procedure's code
+SchemeVal *applyCompiled(SchemeVal *function, SchemeVal *args) {
+    int argc = length(args);
+    SchemeVal *argv[argc > 0 ? argc : 1];
+    for (int i = 0; i < argc; i++) {
+        argv[i] = car(args);
+        args = cdr(args);
+    }
+    return function->code(function, argc, argv);
+}
+
+// Gathers an array of arguments into a list for apply
+SchemeVal *applyArray(SchemeVal *function, int argc, SchemeVal **argv) {
+    SchemeVal *args = makeEmpty();
+    for (int i = argc - 1; i >= 0; i--) {
+        args = cons(argv[i], args);
+    }
+    return apply(function, args, NULL);
+}
+
+SchemeVal *compiledError(const char *message) {
+    evalError("%s", message);
+}
+
+// Raises the error lookUpSymbol would, at the variable's position
+SchemeVal *unboundVariable(const char *name, const char *source, int line, int column) {
+    SchemeVal *symbol = compiledSymbol(name);
+    setPosition(symbol, compiledPosition(source, line, column));
+    evalErrorAt(symbol, "unbound variable %s", name);
+}
+
+SchemeVal *wrongArgumentCount() {
+    evalError("incorrect number of arguments");
+}
+
+void checkUndefined(SchemeVal *value, const char *name) {
+    if (value != NULL) {
+        evalError("%s already defined", name);
+    }
+}
+
+void checkLetrec(SchemeVal *value) {
+    if (value->type == UNSPECIFIED_TYPE) {
+        evalError("circular reference in letrec");
+    }
+}
+
+void setGlobal(SchemeVal **global, SchemeVal *value, const char *name, const char *source,
+               int line, int column) {
+    if (*global == NULL) {
+        unboundVariable(name, source, line, column);
+    }
+    *global = value;
+}
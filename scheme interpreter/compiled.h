@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include "schemeval.h"
+#include "interpreter.h"
+#include "linkedlist.h"
+#include "talloc.h"
+#include "error.h"
+#include "stats.h"
+
+#ifndef _COMPILED
+#define _COMPILED
+
+// The runtime of programs translated to C by compiler.c. The generated file
+// includes only this header and is linked with every interpreter source but
+// main.c, so compiled code shares values, the heap, errors and primitives
+// with the interpreter, and the two kinds of procedure can call each other.
+//
+// A lambda becomes a COMPILED_TYPE value whose code takes the value itself
+// and an array of arguments; the variables it closed over are copied into
+// its captured array when it is made. Variables that are ever assigned live
+// in boxes (a SchemeVal * allocated on the heap) so every closure sees the
+// same binding.
+
+typedef SchemeVal *(*CompiledCode)(SchemeVal *self, int argc, SchemeVal **argv);
+
+// One top-level form of a compiled program and where it starts.
+typedef struct {
+    SchemeVal *(*run)(void);
+    const char *source;
+    int line;
+    int column;
+} CompiledForm;
+
+// Values shared by all compiled code.
+extern SchemeVal trueValue, falseValue, voidValue, unspecifiedValue;
+
+// Runs the forms of a compiled program in order, printing each result or
+// error as interpretIn does, after initialize has set up its globals and
+// quoted data. Returns the program's exit status.
+int runCompiled(void (*initialize)(void), const CompiledForm *forms, int count);
+
+// A procedure of code with count captured values, named name for profiles.
+SchemeVal *makeCompiled(CompiledCode code, const char *name, int count, SchemeVal **captured);
+
+// The primitive called name, for the global variable of that name.
+SchemeVal *compiledPrimitive(const char *name);
+
+// A symbol, for quoted data.
+SchemeVal *compiledSymbol(const char *name);
+
+// A new box holding value.
+SchemeVal **makeBox(SchemeVal *value);
+
+// The value in a box kept in a captured array.
+#define BOX(slot) (*(SchemeVal **)(slot))
+
+// Applies a compiled procedure to a list of arguments, for apply.
+SchemeVal *applyCompiled(SchemeVal *function, SchemeVal *args);
+
+// Calls any procedure with an array of arguments.
+SchemeVal *applyArray(SchemeVal *function, int argc, SchemeVal **argv);
+
+// Errors raised by compiled code. Each is declared to return a value so it
+// can stand in any expression.
+_Noreturn SchemeVal *compiledError(const char *message);
+_Noreturn SchemeVal *unboundVariable(const char *name, const char *source, int line,
+                                     int column);
+_Noreturn SchemeVal *wrongArgumentCount();
+
+// Raises "x already defined" if value, a variable defined by define, has
+// been defined already.
+void checkUndefined(SchemeVal *value, const char *name);
+
+// Raises an error if a letrec right-hand side read a variable of its own
+// letrec.
+void checkLetrec(SchemeVal *value);
+
+// Assigns a global for set!; the variable must be defined already.
+void setGlobal(SchemeVal **global, SchemeVal *value, const char *name, const char *source,
+               int line, int column);
+
+static inline bool isTrue(SchemeVal *value) {
+    return !(value->type == BOOL_TYPE && !value->b);
+}
+
+// value, or an unbound variable error if it is not defined yet.
+static inline SchemeVal *checkBound(SchemeVal *value, const char *name, const char *source,
+                                    int line, int column) {
+    return value != NULL ? value : unboundVariable(name, source, line, column);
+}
+
+// Calls function with argc arguments; compiled procedures directly, anything
+// else through apply.
+static inline SchemeVal *callProcedure(SchemeVal *function, int argc, SchemeVal **argv) {
+    if (function->type == COMPILED_TYPE) {
+        return function->code(function, argc, argv);
+    }
+    return applyArray(function, argc, argv);
+}
+
+// Calls the primitive function with argc arguments.
+static inline SchemeVal *callPrimitive(SchemeVal *function, int argc, SchemeVal **argv) {
+    SchemeVal *args = makeEmpty();
+    for (int i = argc - 1; i >= 0; i--) {
+        args = cons(argv[i], args);
+    }
+    return function->pf(args);
+}
+
+// Primitives compiled inline for the common case, falling back on the
+// primitive function (passed as primitive) for anything else, errors
+// included.
+static inline SchemeVal *compiledAdd(SchemeVal *a, SchemeVal *b, SchemeVal *primitive) {
+    if (a->type == INT_TYPE && b->type == INT_TYPE) {
+        SchemeVal *result = talloc(sizeof(SchemeVal));
+        result->type = INT_TYPE;
+        result->i = (int)((unsigned)a->i + (unsigned)b->i);
+        return result;
+    }
+    return callPrimitive(primitive, 2, (SchemeVal *[]){a, b});
+}
+
+static inline SchemeVal *compiledLessThan(SchemeVal *a, SchemeVal *b, SchemeVal *primitive) {
+    if (a->type == INT_TYPE && b->type == INT_TYPE) {
+        return a->i < b->i ? &trueValue : &falseValue;
+    }
+    return callPrimitive(primitive, 2, (SchemeVal *[]){a, b});
+}
+
+static inline SchemeVal *compiledNull(SchemeVal *a) {
+    return a->type == EMPTY_TYPE ? &trueValue : &falseValue;
+}
+
+static inline SchemeVal *compiledCar(SchemeVal *a, SchemeVal *primitive) {
+    return a->type == CONS_TYPE ? a->car : callPrimitive(primitive, 1, &a);
+}
+
+static inline SchemeVal *compiledCdr(SchemeVal *a, SchemeVal *primitive) {
+    return a->type == CONS_TYPE ? a->cdr : callPrimitive(primitive, 1, &a);
+}
+
+#endif
@@ -0,0 +1,1068 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include "compiler.h"
+#include "schemeval.h"
+#include "linkedlist.h"
+#include "interpreter.h"
+#include "position.h"
+#include "loop.h"
+
+// A variable as the compiler sees it. Globals are static variables of the
+// generated file, NULL until defined. Locals are C variables of the function
+// that binds them (the owner); nested functions reach them through their
+// captured arrays.
+typedef struct Variable {
+    char *name;
+    int id;
+    bool global;
+    // kept in a box: set! assigns it somewhere, or it is bound before its
+    // value exists, by letrec or by a define in a body
+    bool boxed;
+    // bound by a define in a body: NULL until the define runs, and until
+    // then reads and set! reach the variable it shadows instead
+    bool defined;
+    // a global primitive, which is never NULL
+    bool primitive;
+    struct Function *owner;
+    // the lambda the variable is bound to, if that is known; calls whose
+    // operator is still that lambda's procedure go straight to its code
+    struct Function *known;
+    // next variable out in the scope chain
+    struct Variable *next;
+} Variable;
+
+// A lambda being compiled, or a top-level form (which has no parent and
+// captures nothing).
+typedef struct Function {
+    int id;
+    char *cName;
+    char *name;
+    // number of parameters, or -1 if the lambda is malformed
+    int arity;
+    // the lambda's parameters and body
+    SchemeVal *lambda;
+    Variable **captures;
+    int captureCount;
+    int captureCapacity;
+} Function;
+
+// Text the compiler writes a piece at a time and copies out at the end.
+typedef struct {
+    FILE *out;
+    char *text;
+    size_t size;
+} Buffer;
+
+typedef struct {
+    // globals, constants and prototypes
+    Buffer declarations;
+    // the C functions of lambdas, finished ones first
+    Buffer functions;
+    // statements that set up globals and quoted data
+    Buffer initialize;
+    Variable *globals;
+    // names some set! assigns, anywhere in the program
+    char **assigned;
+    int assignedCount;
+    int assignedCapacity;
+    int nextId;
+    int errors;
+} Compiler;
+
+static void compileExpr(Compiler *c, SchemeVal *expr, Variable *scope, Function *f, FILE *out);
+static void compileBody(Compiler *c, SchemeVal *body, Variable *scope, Variable *frameEnd,
+                        Function *f, FILE *out);
+
+/* Opens a buffer for writing */
+static void openBuffer(Buffer *buffer) {
+    buffer->text = NULL;
+    buffer->out = open_memstream(&buffer->text, &buffer->size);
+}
+
+/* Closes a buffer, copies it to out and frees it */
+static void flushBuffer(Buffer *buffer, FILE *out) {
+    fclose(buffer->out);
+    fwrite(buffer->text, 1, buffer->size, out);
+    free(buffer->text);
+}
+
+/* Reports a construct the compiler cannot translate */
+static void compileError(Compiler *c, SchemeVal *datum, const char *message) {
+    char where[300];
+    if (formatPosition(datum, where, sizeof(where))) {
+        fprintf(stderr, "%s: %s\n", where, message);
+    } else {
+        fprintf(stderr, "%s\n", message);
+    }
+    c->errors++;
+}
+
+/* Writes s as a C string literal */
+static void emitString(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s != '\0'; s++) {
+        unsigned char ch = *s;
+        if (ch == '"' || ch == '\\' || ch == '?') {
+            fprintf(out, "\\%c", ch);
+        } else if (isprint(ch)) {
+            fputc(ch, out);
+        } else {
+            fprintf(out, "\\%03o", ch);
+        }
+    }
+    fputc('"', out);
+}
+
+/* Writes a runtime error raising message, as the interpreter would */
+static void emitError(FILE *out, const char *message) {
+    fputs("compiledError(", out);
+    emitString(out, message);
+    fputc(')', out);
+}
+
+/* Writes the source, line and column of datum as C arguments */
+static void emitPosition(FILE *out, SchemeVal *datum) {
+    SourcePosition position = positionOf(datum);
+    if (position == 0) {
+        fputs("NULL, 0, 0", out);
+        return;
+    }
+    if (positionSource(position) != NULL) {
+        emitString(out, positionSource(position));
+    } else {
+        fputs("NULL", out);
+    }
+    fprintf(out, ", %d, %d", positionLine(position), positionColumn(position));
+}
+
+/* Checks if expr is a list starting with the symbol name */
+static bool isForm(SchemeVal *expr, const char *name) {
+    return expr->type == CONS_TYPE && car(expr)->type == SYMBOL_TYPE &&
+           !strcmp(car(expr)->s, name);
+}
+
+/* Checks if expr is a list of exactly count elements */
+static bool hasLength(SchemeVal *expr, int count) {
+    for (; count > 0; count--) {
+        if (expr->type != CONS_TYPE) {
+            return false;
+        }
+        expr = cdr(expr);
+    }
+    return isEmpty(expr);
+}
+
+/* Collects the variables set! assigns anywhere in expr */
+static void findAssigned(Compiler *c, SchemeVal *expr) {
+    if (expr->type != CONS_TYPE) {
+        return;
+    }
+    if (isForm(expr, "set!") && cdr(expr)->type == CONS_TYPE &&
+        car(cdr(expr))->type == SYMBOL_TYPE) {
+        if (c->assignedCount == c->assignedCapacity) {
+            c->assignedCapacity = c->assignedCapacity ? 2 * c->assignedCapacity : 16;
+            c->assigned = realloc(c->assigned, c->assignedCapacity * sizeof(char *));
+        }
+        c->assigned[c->assignedCount++] = car(cdr(expr))->s;
+    }
+    for (; expr->type == CONS_TYPE; expr = cdr(expr)) {
+        findAssigned(c, car(expr));
+    }
+}
+
+/* Checks if some set! assigns a variable called name */
+static bool isAssigned(Compiler *c, const char *name) {
+    for (int i = 0; i < c->assignedCount; i++) {
+        if (!strcmp(c->assigned[i], name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* The error evalLambda raises for the parameters and body of a lambda, or
+   NULL if they are well formed */
+static const char *lambdaError(SchemeVal *args, char *buffer, size_t size) {
+    if (args->type != CONS_TYPE || cdr(args)->type != CONS_TYPE) {
+        return "lambda needs parameters and body";
+    }
+    SchemeVal *params = car(args);
+    if (params->type == SYMBOL_TYPE) {
+        return NULL;
+    }
+    for (SchemeVal *param = params; !isEmpty(param); param = cdr(param)) {
+        if (param->type != CONS_TYPE || car(param)->type != SYMBOL_TYPE) {
+            return "lambda parameters must be symbols";
+        }
+        for (SchemeVal *seen = params; seen != param; seen = cdr(seen)) {
+            if (!strcmp(car(seen)->s, car(param)->s)) {
+                snprintf(buffer, size, "duplicate parameter %s", car(param)->s);
+                return buffer;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* The error checkBindings raises for the bindings of a let or letrec, or
+   NULL if they are well formed */
+static const char *bindingsError(SchemeVal *bindings, char *buffer, size_t size) {
+    if (bindings->type != CONS_TYPE && bindings->type != EMPTY_TYPE) {
+        return "malformed bindings";
+    }
+    for (SchemeVal *current = bindings; !isEmpty(current); current = cdr(current)) {
+        SchemeVal *binding = car(current);
+        if (binding->type != CONS_TYPE || isEmpty(cdr(binding)) || !isEmpty(cdr(cdr(binding)))) {
+            return "invalid binding form";
+        }
+        if (car(binding)->type != SYMBOL_TYPE) {
+            return "binding name must be a symbol";
+        }
+        for (SchemeVal *seen = bindings; seen != current; seen = cdr(seen)) {
+            if (!strcmp(car(car(seen))->s, car(binding)->s)) {
+                snprintf(buffer, size, "duplicate binding '%s'", car(binding)->s);
+                return buffer;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Creates a function for a lambda's parameters and body, and declares its C
+   functions: the code itself, taking its arguments as C parameters, and an
+   entry point taking an argument array */
+static Function *newFunction(Compiler *c, SchemeVal *lambda, const char *name) {
+    Function *f = calloc(1, sizeof(Function));
+    f->id = c->nextId++;
+    f->name = strdup(name);
+    f->lambda = lambda;
+    char buffer[300];
+    if (lambdaError(lambda, buffer, sizeof(buffer)) != NULL) {
+        f->arity = -1;
+    } else {
+        f->arity = car(lambda)->type == SYMBOL_TYPE ? 1 : length(car(lambda));
+    }
+
+    // named after the variable, so C debuggers and profilers show it
+    char cName[32];
+    int length = 0;
+    for (const char *s = name; *s != '\0' && length < 16; s++) {
+        cName[length++] = isalnum((unsigned char)*s) ? *s : '_';
+    }
+    cName[length] = '\0';
+    size_t size = strlen(cName) + 32;
+    f->cName = malloc(size);
+    snprintf(f->cName, size, "scheme_%s_%d", cName, f->id);
+
+    if (f->arity >= 0) {
+        FILE *out = c->declarations.out;
+        fprintf(out, "static SchemeVal *%s(SchemeVal *self", f->cName);
+        for (int i = 0; i < f->arity; i++) {
+            fputs(", SchemeVal *", out);
+        }
+        fputs(");\n", out);
+        fprintf(out, "static SchemeVal *%s_entry(SchemeVal *self, int argc, SchemeVal **argv);\n",
+                f->cName);
+    }
+    return f;
+}
+
+/* The function a lambda expression with a name would compile to, if it is a
+   well-formed lambda bound to a variable that is never assigned */
+static Function *knownFunction(Compiler *c, SchemeVal *value, const char *name) {
+    if (!isForm(value, "lambda") || isAssigned(c, name)) {
+        return NULL;
+    }
+    Function *f = newFunction(c, cdr(value), name);
+    if (f->arity < 0) {
+        return NULL;
+    }
+    return f;
+}
+
+/* Creates a local of f, inside scope */
+static Variable *newLocal(Compiler *c, const char *name, Function *f, Variable *scope,
+                          bool boxed) {
+    Variable *var = calloc(1, sizeof(Variable));
+    var->name = strdup(name);
+    var->id = c->nextId++;
+    var->owner = f;
+    var->boxed = boxed || isAssigned(c, name);
+    var->next = scope;
+    return var;
+}
+
+/* Finds the global called name, declaring it if this is its first use */
+static Variable *globalVariable(Compiler *c, const char *name) {
+    for (Variable *var = c->globals; var != NULL; var = var->next) {
+        if (!strcmp(var->name, name)) {
+            return var;
+        }
+    }
+    Variable *var = calloc(1, sizeof(Variable));
+    var->name = strdup(name);
+    var->id = c->nextId++;
+    var->global = true;
+    var->next = c->globals;
+    c->globals = var;
+    fprintf(c->declarations.out, "static SchemeVal *global_%d; // ", var->id);
+    emitString(c->declarations.out, name);
+    fputc('\n', c->declarations.out);
+    return var;
+}
+
+/* Finds the variable name refers to in scope, or the global of that name */
+static Variable *resolve(Compiler *c, const char *name, Variable *scope) {
+    for (Variable *var = scope; var != NULL; var = var->next) {
+        if (!strcmp(var->name, name)) {
+            return var;
+        }
+    }
+    return globalVariable(c, name);
+}
+
+/* Finds name among the variables of scope bound by one frame, the ones
+   before frameEnd */
+static Variable *resolveInFrame(const char *name, Variable *scope, Variable *frameEnd) {
+    for (Variable *var = scope; var != frameEnd; var = var->next) {
+        if (!strcmp(var->name, name)) {
+            return var;
+        }
+    }
+    return NULL;
+}
+
+/* Index of var in the captured array of f, adding it if new */
+static int captureIndex(Function *f, Variable *var) {
+    for (int i = 0; i < f->captureCount; i++) {
+        if (f->captures[i] == var) {
+            return i;
+        }
+    }
+    if (f->captureCount == f->captureCapacity) {
+        f->captureCapacity = f->captureCapacity ? 2 * f->captureCapacity : 8;
+        f->captures = realloc(f->captures, f->captureCapacity * sizeof(Variable *));
+    }
+    f->captures[f->captureCount] = var;
+    return f->captureCount++;
+}
+
+/* Writes what holds var's value (or its box) inside f */
+static void emitSlot(Variable *var, Function *f, FILE *out) {
+    if (var->global) {
+        fprintf(out, "global_%d", var->id);
+    } else if (var->owner == f) {
+        fprintf(out, "v%d", var->id);
+    } else {
+        fprintf(out, "self->captured[%d]", captureIndex(f, var));
+    }
+}
+
+/* Writes an lvalue for var's value inside f */
+static void emitPlace(Variable *var, Function *f, FILE *out) {
+    if (var->boxed && !var->global) {
+        fputs(var->owner == f ? "(*" : "BOX(", out);
+        emitSlot(var, f, out);
+        fputc(')', out);
+    } else {
+        emitSlot(var, f, out);
+    }
+}
+
+/* Writes the value of the variable symbol refers to, resolved as var */
+static void emitRead(Compiler *c, Variable *var, SchemeVal *symbol, Function *f, FILE *out) {
+    if (var->defined) {
+        // until its define runs, the name still means what it did outside
+        int id = c->nextId++;
+        fprintf(out, "({ SchemeVal *t%d = ", id);
+        emitPlace(var, f, out);
+        fprintf(out, "; t%d != NULL ? t%d : ", id, id);
+        emitRead(c, resolve(c, var->name, var->next), symbol, f, out);
+        fputs("; })", out);
+    } else if (var->global && !var->primitive) {
+        fputs("checkBound(", out);
+        emitPlace(var, f, out);
+        fputs(", ", out);
+        emitString(out, var->name);
+        fputs(", ", out);
+        emitPosition(out, symbol);
+        fputc(')', out);
+    } else {
+        emitPlace(var, f, out);
+    }
+}
+
+/* Writes a statement storing the C variable value in var, for set! */
+static void emitAssign(Compiler *c, Variable *var, const char *value, SchemeVal *symbol,
+                       Function *f, FILE *out) {
+    if (var->global) {
+        fprintf(out, "setGlobal(&global_%d, %s, ", var->id, value);
+        emitString(out, var->name);
+        fputs(", ", out);
+        emitPosition(out, symbol);
+        fputs("); ", out);
+    } else if (var->defined) {
+        fputs("if (", out);
+        emitPlace(var, f, out);
+        fputs(" != NULL) { ", out);
+        emitPlace(var, f, out);
+        fprintf(out, " = %s; } else { ", value);
+        emitAssign(c, resolve(c, var->name, var->next), value, symbol, f, out);
+        fputs("} ", out);
+    } else {
+        emitPlace(var, f, out);
+        fprintf(out, " = %s; ", value);
+    }
+}
+
+/* Writes a constant for a number, string or boolean datum */
+static void emitConstant(Compiler *c, SchemeVal *datum, FILE *out) {
+    if (datum->type == BOOL_TYPE) {
+        fputs(datum->b ? "&trueValue" : "&falseValue", out);
+        return;
+    }
+    if (datum->type == VOID_TYPE) {
+        // what the expansion of a do form without results returns
+        fputs("&voidValue", out);
+        return;
+    }
+    int id = c->nextId++;
+    FILE *declarations = c->declarations.out;
+    fprintf(declarations, "static SchemeVal constant_%d = ", id);
+    if (datum->type == INT_TYPE) {
+        fprintf(declarations, "{.type = INT_TYPE, .i = %d};\n", datum->i);
+    } else if (datum->type == DOUBLE_TYPE) {
+        fprintf(declarations, "{.type = DOUBLE_TYPE, .d = %.17g};\n", datum->d);
+    } else {
+        fputs("{.type = STR_TYPE, .s = ", declarations);
+        emitString(declarations, datum->s);
+        fputs("};\n", declarations);
+    }
+    fprintf(out, "&constant_%d", id);
+}
+
+/* Writes statements building quoted data into initialize, and an expression
+   for it to out */
+static void emitQuoted(Compiler *c, SchemeVal *datum, FILE *out) {
+    FILE *init = c->initialize.out;
+    if (datum->type == CONS_TYPE) {
+        // a list is built back to front into one variable, so long lists
+        // do not nest
+        int count = 0;
+        SchemeVal *tail = datum;
+        for (; tail->type == CONS_TYPE; tail = cdr(tail)) {
+            count++;
+        }
+        SchemeVal **items = malloc(count * sizeof(SchemeVal *));
+        count = 0;
+        for (SchemeVal *item = datum; item->type == CONS_TYPE; item = cdr(item)) {
+            items[count++] = car(item);
+        }
+        char *text;
+        size_t size;
+        FILE *value = open_memstream(&text, &size);
+        emitQuoted(c, tail, value);
+        fclose(value);
+        int id = c->nextId++;
+        fprintf(init, "    SchemeVal *q%d = %s;\n", id, text);
+        free(text);
+        for (int i = count - 1; i >= 0; i--) {
+            value = open_memstream(&text, &size);
+            emitQuoted(c, items[i], value);
+            fclose(value);
+            fprintf(init, "    q%d = cons(%s, q%d);\n", id, text, id);
+            free(text);
+        }
+        free(items);
+        fprintf(out, "q%d", id);
+    } else if (datum->type == EMPTY_TYPE) {
+        fputs("makeEmpty()", out);
+    } else if (datum->type == SYMBOL_TYPE) {
+        fputs("compiledSymbol(", out);
+        emitString(out, datum->s);
+        fputc(')', out);
+    } else {
+        emitConstant(c, datum, out);
+    }
+}
+
+/* Writes the value of a quote form's datum: constants directly, anything
+   else in a global built once at startup */
+static void emitQuote(Compiler *c, SchemeVal *datum, FILE *out) {
+    if (datum->type != CONS_TYPE && datum->type != SYMBOL_TYPE && datum->type != EMPTY_TYPE) {
+        emitConstant(c, datum, out);
+        return;
+    }
+    int id = c->nextId++;
+    fprintf(c->declarations.out, "static SchemeVal *quoted_%d;\n", id);
+    char *text;
+    size_t size;
+    FILE *value = open_memstream(&text, &size);
+    emitQuoted(c, datum, value);
+    fclose(value);
+    fprintf(c->initialize.out, "    quoted_%d = %s;\n", id, text);
+    free(text);
+    fprintf(out, "quoted_%d", id);
+}
+
+/* Writes the C functions of f, compiling its body with scope outside it */
+static void compileFunction(Compiler *c, Function *f, Variable *scope) {
+    SchemeVal *params = car(f->lambda);
+    if (params->type == SYMBOL_TYPE) {
+        params = cons(params, makeEmpty());
+    }
+    Variable *inner = scope;
+    for (SchemeVal *param = params; !isEmpty(param); param = cdr(param)) {
+        inner = newLocal(c, car(param)->s, f, inner, false);
+    }
+
+    Buffer body;
+    openBuffer(&body);
+    compileBody(c, cdr(f->lambda), inner, scope, f, body.out);
+    fclose(body.out);
+
+    // parameters are declared innermost first, like the scope
+    FILE *out = c->functions.out;
+    Variable **vars = malloc((f->arity > 0 ? f->arity : 1) * sizeof(Variable *));
+    Variable *var = inner;
+    for (int i = f->arity - 1; i >= 0; i--) {
+        vars[i] = var;
+        var = var->next;
+    }
+    fprintf(out, "\n// ");
+    emitString(out, f->name);
+    fprintf(out, "\nstatic SchemeVal *%s(SchemeVal *self", f->cName);
+    for (int i = 0; i < f->arity; i++) {
+        fprintf(out, ", SchemeVal *%c%d", vars[i]->boxed ? 'a' : 'v', vars[i]->id);
+    }
+    fputs(") {\n", out);
+    for (int i = 0; i < f->arity; i++) {
+        if (vars[i]->boxed) {
+            fprintf(out, "    SchemeVal **v%d = makeBox(a%d);\n", vars[i]->id, vars[i]->id);
+        }
+    }
+    fprintf(out, "    return %s;\n}\n\n", body.text);
+    fprintf(out, "static SchemeVal *%s_entry(SchemeVal *self, int argc, SchemeVal **argv) {\n"
+                 "    if (argc != %d) {\n"
+                 "        wrongArgumentCount();\n"
+                 "    }\n"
+                 "    return %s(self", f->cName, f->arity, f->cName);
+    for (int i = 0; i < f->arity; i++) {
+        fprintf(out, ", argv[%d]", i);
+    }
+    fputs(");\n}\n", out);
+    free(vars);
+    free(body.text);
+}
+
+/* Writes a lambda expression: compiles its function (f, or a new one named
+   name) and makes a procedure capturing what it uses of caller's scope.
+   Returns the function, or NULL if the lambda is malformed */
+static Function *compileLambda(Compiler *c, SchemeVal *args, Function *f, const char *name,
+                               Variable *scope, Function *caller, FILE *out) {
+    char buffer[300];
+    const char *error = lambdaError(args, buffer, sizeof(buffer));
+    if (error != NULL) {
+        emitError(out, error);
+        return NULL;
+    }
+    if (f == NULL) {
+        f = newFunction(c, args, name);
+    }
+    compileFunction(c, f, scope);
+
+    fprintf(out, "makeCompiled(%s_entry, ", f->cName);
+    emitString(out, f->name);
+    fprintf(out, ", %d, ", f->captureCount);
+    if (f->captureCount == 0) {
+        fputs("NULL)", out);
+        return f;
+    }
+    fputs("(SchemeVal *[]){", out);
+    for (int i = 0; i < f->captureCount; i++) {
+        Variable *var = f->captures[i];
+        fputs(i > 0 ? ", " : "", out);
+        if (var->owner == caller && var->boxed) {
+            fprintf(out, "(SchemeVal *)v%d", var->id);
+        } else {
+            emitSlot(var, caller, out);
+        }
+    }
+    fputs("})", out);
+    return f;
+}
+
+/* Writes the value a define or binding gives a variable: the known
+   function's procedure if it has one, naming lambdas after the variable */
+static void compileValue(Compiler *c, SchemeVal *value, Variable *var, Variable *scope,
+                         Function *f, FILE *out) {
+    if (isForm(value, "lambda")) {
+        Function *known = var->known != NULL && var->known->lambda == cdr(value) ? var->known
+                                                                                 : NULL;
+        Function *compiled = compileLambda(c, cdr(value), known, var->name, scope, f, out);
+        if (var->known == NULL && !var->global && !isAssigned(c, var->name)) {
+            var->known = compiled;
+        }
+    } else {
+        compileExpr(c, value, scope, f, out);
+    }
+}
+
+/* Checks that a define form has a symbol and a value, writing the error the
+   interpreter would raise if not */
+static bool checkDefineForm(SchemeVal *args, FILE *out) {
+    if (!hasLength(args, 2)) {
+        emitError(out, "define requires exactly 2 arguments");
+        return false;
+    }
+    if (car(args)->type != SYMBOL_TYPE) {
+        emitError(out, "define variable must be a symbol");
+        return false;
+    }
+    return true;
+}
+
+/* Writes a define in a body, whose variables run from scope to frameEnd */
+static void compileLocalDefine(Compiler *c, SchemeVal *args, Variable *scope,
+                               Variable *frameEnd, Function *f, FILE *out) {
+    if (!checkDefineForm(args, out)) {
+        return;
+    }
+    Variable *var = resolveInFrame(car(args)->s, scope, frameEnd);
+    if (!var->defined) {
+        char message[300];
+        snprintf(message, sizeof(message), "%s already defined", var->name);
+        emitError(out, message);
+        return;
+    }
+    int id = c->nextId++;
+    fputs("({ checkUndefined(", out);
+    emitPlace(var, f, out);
+    fputs(", ", out);
+    emitString(out, var->name);
+    fprintf(out, "); SchemeVal *t%d = ", id);
+    compileValue(c, car(cdr(args)), var, scope, f, out);
+    fputs("; ", out);
+    emitPlace(var, f, out);
+    fprintf(out, " = t%d; &voidValue; })", id);
+}
+
+/* Writes a body as a statement expression yielding its last value. Its
+   defines bind variables of the same frame as scope's variables up to
+   frameEnd, boxed and NULL until the define runs. */
+static void compileBody(Compiler *c, SchemeVal *body, Variable *scope, Variable *frameEnd,
+                        Function *f, FILE *out) {
+    fputs("({ ", out);
+    for (SchemeVal *form = body; !isEmpty(form); form = cdr(form)) {
+        if (!isForm(car(form), "define")) {
+            continue;
+        }
+        SchemeVal *args = cdr(car(form));
+        if (!hasLength(args, 2) || car(args)->type != SYMBOL_TYPE ||
+            resolveInFrame(car(args)->s, scope, frameEnd)) {
+            continue;
+        }
+        Variable *var = newLocal(c, car(args)->s, f, scope, true);
+        var->defined = true;
+        var->known = knownFunction(c, car(cdr(args)), var->name);
+        scope = var;
+        fprintf(out, "SchemeVal **v%d = makeBox(NULL); ", var->id);
+    }
+    for (SchemeVal *form = body; !isEmpty(form); form = cdr(form)) {
+        if (isForm(car(form), "define")) {
+            compileLocalDefine(c, cdr(car(form)), scope, frameEnd, f, out);
+        } else {
+            compileExpr(c, car(form), scope, f, out);
+        }
+        fputs("; ", out);
+    }
+    fputs("})", out);
+}
+
+/* Writes a let expression */
+static void compileLet(Compiler *c, SchemeVal *args, Variable *scope, Function *f, FILE *out) {
+    char buffer[300];
+    const char *error;
+    if (isEmpty(args)) {
+        emitError(out, "let needs bindings and body");
+        return;
+    }
+    if ((error = bindingsError(car(args), buffer, sizeof(buffer))) != NULL) {
+        emitError(out, error);
+        return;
+    }
+    Variable *inner = scope;
+    fputs("({ ", out);
+    for (SchemeVal *binding = car(args); !isEmpty(binding); binding = cdr(binding)) {
+        Variable *var = newLocal(c, car(car(binding))->s, f, inner, false);
+        fprintf(out, var->boxed ? "SchemeVal **v%d = makeBox(" : "SchemeVal *v%d = (", var->id);
+        // evaluated outside the let, like evalLet
+        compileValue(c, car(cdr(car(binding))), var, scope, f, out);
+        fputs("); ", out);
+        inner = var;
+    }
+    if (isEmpty(cdr(args))) {
+        emitError(out, "let body missing");
+    } else {
+        compileBody(c, cdr(args), inner, scope, f, out);
+    }
+    fputs("; })", out);
+}
+
+/* Writes a do form or named let as its expansion (see loop.h) */
+static void compileLoop(Compiler *c, SchemeVal *expr, Variable *scope, Function *f, FILE *out) {
+    char buffer[300];
+    const char *error = NULL;
+    SchemeVal *args = cdr(expr);
+    if (!strcmp(car(expr)->s, "do")) {
+        error = doError(args, buffer, sizeof(buffer));
+    } else if (isEmpty(cdr(args))) {
+        error = "let needs bindings and body";
+    } else if ((error = bindingsError(car(cdr(args)), buffer, sizeof(buffer))) == NULL &&
+               isEmpty(cdr(cdr(args)))) {
+        error = "let body missing";
+    }
+    if (error != NULL) {
+        emitError(out, error);
+        return;
+    }
+    compileExpr(c, expandLoop(expr), scope, f, out);
+}
+
+/* Writes a letrec expression: every variable is boxed and unspecified while
+   the right-hand sides are evaluated, then all are assigned */
+static void compileLetrec(Compiler *c, SchemeVal *args, Variable *scope, Function *f,
+                          FILE *out) {
+    char buffer[300];
+    const char *error;
+    if (isEmpty(args)) {
+        emitError(out, "letrec needs bindings and body");
+        return;
+    }
+    if ((error = bindingsError(car(args), buffer, sizeof(buffer))) != NULL) {
+        emitError(out, error);
+        return;
+    }
+    int count = length(car(args));
+    Variable **vars = malloc((count > 0 ? count : 1) * sizeof(Variable *));
+    Variable *inner = scope;
+    int i = 0;
+    fputs("({ ", out);
+    for (SchemeVal *binding = car(args); !isEmpty(binding); binding = cdr(binding), i++) {
+        inner = vars[i] = newLocal(c, car(car(binding))->s, f, inner, true);
+        inner->known = knownFunction(c, car(cdr(car(binding))), inner->name);
+        fprintf(out, "SchemeVal **v%d = makeBox(&unspecifiedValue); ", inner->id);
+    }
+    int first = c->nextId;
+    c->nextId += count;
+    i = 0;
+    for (SchemeVal *binding = car(args); !isEmpty(binding); binding = cdr(binding), i++) {
+        fprintf(out, "SchemeVal *t%d = ", first + i);
+        compileValue(c, car(cdr(car(binding))), vars[i], inner, f, out);
+        fputs("; ", out);
+    }
+    for (i = 0; i < count; i++) {
+        fprintf(out, "checkLetrec(t%d); ", first + i);
+    }
+    for (i = 0; i < count; i++) {
+        fprintf(out, "*v%d = t%d; ", vars[i]->id, first + i);
+    }
+    free(vars);
+    if (isEmpty(cdr(args))) {
+        emitError(out, "letrec body missing");
+    } else {
+        compileBody(c, cdr(args), inner, scope, f, out);
+    }
+    fputs("; })", out);
+}
+
+/* Writes an if expression */
+static void compileIf(Compiler *c, SchemeVal *args, Variable *scope, Function *f, FILE *out) {
+    if (!hasLength(args, 2) && !hasLength(args, 3)) {
+        emitError(out, "if requires 2 or 3 expressions");
+        return;
+    }
+    int id = c->nextId++;
+    fprintf(out, "({ SchemeVal *t%d = ", id);
+    compileExpr(c, car(args), scope, f, out);
+    fprintf(out, "; isTrue(t%d) ? ", id);
+    compileExpr(c, car(cdr(args)), scope, f, out);
+    fputs(" : ", out);
+    if (hasLength(args, 3)) {
+        compileExpr(c, car(cdr(cdr(args))), scope, f, out);
+    } else {
+        emitError(out, "missing else clause");
+    }
+    fputs("; })", out);
+}
+
+/* Writes a set! expression */
+static void compileSet(Compiler *c, SchemeVal *args, Variable *scope, Function *f, FILE *out) {
+    if (!hasLength(args, 2)) {
+        emitError(out, "set! requires exactly 2 arguments");
+        return;
+    }
+    if (car(args)->type != SYMBOL_TYPE) {
+        emitError(out, "set! variable must be a symbol");
+        return;
+    }
+    int id = c->nextId++;
+    fprintf(out, "({ SchemeVal *t%d = ", id);
+    compileExpr(c, car(cdr(args)), scope, f, out);
+    fputs("; ", out);
+    char value[32];
+    snprintf(value, sizeof(value), "t%d", id);
+    emitAssign(c, resolve(c, car(args)->s, scope), value, car(args), f, out);
+    fputs("&voidValue; })", out);
+}
+
+/* Writes a future expression, as a thunk applied on the thread pool */
+static void compileFuture(Compiler *c, SchemeVal *expr, SchemeVal *args, Variable *scope,
+                          Function *f, FILE *out) {
+    if (!hasLength(args, 1)) {
+        emitError(out, "future requires one expression");
+        return;
+    }
+    if (isForm(car(args), "define")) {
+        compileError(c, expr, "define inside future cannot be compiled");
+        emitError(out, "define inside future");
+        return;
+    }
+    fputs("applyFuture(", out);
+    compileLambda(c, cons(makeEmpty(), args), NULL, "future", scope, f, out);
+    fputc(')', out);
+}
+
+/* Writes a time expression */
+static void compileTime(Compiler *c, SchemeVal *args, Variable *scope, Function *f, FILE *out) {
+    if (!hasLength(args, 1)) {
+        emitError(out, "time requires one expression");
+        return;
+    }
+    int id = c->nextId++;
+    fprintf(out, "({ StatsMark m%d; markStats(&m%d); SchemeVal *t%d = ", id, id, id);
+    compileExpr(c, car(args), scope, f, out);
+    fprintf(out, "; fflush(stdout); printStatsSince(stdout, &m%d); t%d; })", id, id);
+}
+
+/* Writes a primitive application compiled inline, if name and the argument
+   count allow; the arguments are in t<first>... */
+static bool emitInline(const char *name, int count, int first, Variable *var, FILE *out) {
+    if (count == 2 && !strcmp(name, "+")) {
+        fprintf(out, "compiledAdd(t%d, t%d, global_%d)", first, first + 1, var->id);
+    } else if (count == 2 && !strcmp(name, "<")) {
+        fprintf(out, "compiledLessThan(t%d, t%d, global_%d)", first, first + 1, var->id);
+    } else if (count == 1 && !strcmp(name, "null?")) {
+        fprintf(out, "compiledNull(t%d)", first);
+    } else if (count == 1 && !strcmp(name, "car")) {
+        fprintf(out, "compiledCar(t%d, global_%d)", first, var->id);
+    } else if (count == 1 && !strcmp(name, "cdr")) {
+        fprintf(out, "compiledCdr(t%d, global_%d)", first, var->id);
+    } else if (count == 2 && !strcmp(name, "cons")) {
+        fprintf(out, "cons(t%d, t%d)", first, first + 1);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* Writes an application. The operator and the arguments are evaluated in
+   order into temporaries t<first>, t<first + 1>... */
+static void compileApplication(Compiler *c, SchemeVal *expr, Variable *scope, Function *f,
+                               FILE *out) {
+    SchemeVal *operator = car(expr);
+    SchemeVal *args = cdr(expr);
+    int count = length(args);
+    int first = c->nextId;
+    c->nextId += count + 1;
+    Variable *var = operator->type == SYMBOL_TYPE ? resolve(c, operator->s, scope) : NULL;
+    bool primitive = var != NULL && var->primitive;
+
+    fputs("({ ", out);
+    if (!primitive) {
+        fprintf(out, "SchemeVal *t%d = ", first);
+        compileExpr(c, operator, scope, f, out);
+        fputs("; ", out);
+    }
+    int i = first + 1;
+    for (SchemeVal *arg = args; !isEmpty(arg); arg = cdr(arg), i++) {
+        fprintf(out, "SchemeVal *t%d = ", i);
+        compileExpr(c, car(arg), scope, f, out);
+        fputs("; ", out);
+    }
+
+    if (primitive && emitInline(var->name, count, first + 1, var, out)) {
+        fputs("; })", out);
+        return;
+    }
+    Function *known = var != NULL ? var->known : NULL;
+    if (known != NULL && known->arity == count) {
+        fprintf(out, "t%d->type == COMPILED_TYPE && t%d->code == %s_entry ? %s(t%d", first,
+                first, known->cName, known->cName, first);
+        for (i = first + 1; i <= first + count; i++) {
+            fprintf(out, ", t%d", i);
+        }
+        fputs(") : ", out);
+    }
+    if (primitive) {
+        fprintf(out, "callPrimitive(global_%d, %d, ", var->id, count);
+    } else {
+        fprintf(out, "callProcedure(t%d, %d, ", first, count);
+    }
+    if (count == 0) {
+        fputs("NULL", out);
+    } else {
+        fputs("(SchemeVal *[]){", out);
+        for (i = first + 1; i <= first + count; i++) {
+            fprintf(out, i > first + 1 ? ", t%d" : "t%d", i);
+        }
+        fputc('}', out);
+    }
+    fputs("); })", out);
+}
+
+/* Writes the C expression for expr, in scope, inside function f */
+static void compileExpr(Compiler *c, SchemeVal *expr, Variable *scope, Function *f, FILE *out) {
+    switch (expr->type) {
+        case INT_TYPE:
+        case DOUBLE_TYPE:
+        case STR_TYPE:
+        case BOOL_TYPE:
+            emitConstant(c, expr, out);
+            return;
+
+        case SYMBOL_TYPE:
+            emitRead(c, resolve(c, expr->s, scope), expr, f, out);
+            return;
+
+        case CONS_TYPE:
+            break;
+
+        default:
+            emitError(out, "unsupported expression type");
+            return;
+    }
+
+    SchemeVal *first = car(expr);
+    SchemeVal *args = cdr(expr);
+    if (first->type == CONS_TYPE) {
+        compileApplication(c, expr, scope, f, out);
+    } else if (first->type != SYMBOL_TYPE) {
+        emitError(out, "bad form");
+    } else if (!strcmp(first->s, "if")) {
+        compileIf(c, args, scope, f, out);
+    } else if (!strcmp(first->s, "let") && args->type == CONS_TYPE &&
+               car(args)->type == SYMBOL_TYPE) {
+        compileLoop(c, expr, scope, f, out);
+    } else if (!strcmp(first->s, "let")) {
+        compileLet(c, args, scope, f, out);
+    } else if (!strcmp(first->s, "letrec")) {
+        compileLetrec(c, args, scope, f, out);
+    } else if (!strcmp(first->s, "define")) {
+        compileError(c, expr, "define is only compiled at the top level or directly in a body");
+        emitError(out, "define in expression");
+    } else if (!strcmp(first->s, "set!")) {
+        compileSet(c, args, scope, f, out);
+    } else if (!strcmp(first->s, "lambda")) {
+        compileLambda(c, args, NULL, "lambda", scope, f, out);
+    } else if (!strcmp(first->s, "future")) {
+        compileFuture(c, expr, args, scope, f, out);
+    } else if (!strcmp(first->s, "time")) {
+        compileTime(c, args, scope, f, out);
+    } else if (!strcmp(first->s, "do")) {
+        compileLoop(c, expr, scope, f, out);
+    } else if (!strcmp(first->s, "quote")) {
+        if (!hasLength(args, 1)) {
+            emitError(out, "quote requires one expression");
+        } else {
+            emitQuote(c, car(args), out);
+        }
+    } else {
+        compileApplication(c, expr, scope, f, out);
+    }
+}
+
+/* Writes a top-level define */
+static void compileGlobalDefine(Compiler *c, SchemeVal *args, Function *form, FILE *out) {
+    if (!checkDefineForm(args, out)) {
+        return;
+    }
+    Variable *var = globalVariable(c, car(args)->s);
+    int id = c->nextId++;
+    fprintf(out, "({ checkUndefined(global_%d, ", var->id);
+    emitString(out, var->name);
+    fprintf(out, "); SchemeVal *t%d = ", id);
+    compileValue(c, car(cdr(args)), var, NULL, form, out);
+    fprintf(out, "; global_%d = t%d; &voidValue; })", var->id, id);
+}
+
+// Translates a program to C
+// Input: SchemeVal* tree (list of top-level forms), FILE* out
+// Output: true if every form could be compiled
+bool compileProgram(SchemeVal *tree, FILE *out) {
+    Compiler compiler;
+    Compiler *c = &compiler;
+    memset(c, 0, sizeof(Compiler));
+    openBuffer(&c->declarations);
+    openBuffer(&c->functions);
+    openBuffer(&c->initialize);
+    for (SchemeVal *form = tree; !isEmpty(form); form = cdr(form)) {
+        findAssigned(c, car(form));
+    }
+
+    for (int i = 0; i < primitiveCount(); i++) {
+        Variable *var = globalVariable(c, primitiveName(i));
+        var->primitive = !isAssigned(c, var->name);
+        fprintf(c->initialize.out, "    global_%d = compiledPrimitive(", var->id);
+        emitString(c->initialize.out, var->name);
+        fputs(");\n", c->initialize.out);
+    }
+    // globals defined as lambdas are known before any use
+    for (SchemeVal *form = tree; !isEmpty(form); form = cdr(form)) {
+        SchemeVal *args = isForm(car(form), "define") ? cdr(car(form)) : makeEmpty();
+        if (hasLength(args, 2) && car(args)->type == SYMBOL_TYPE) {
+            Variable *var = globalVariable(c, car(args)->s);
+            if (var->known == NULL && !var->primitive) {
+                var->known = knownFunction(c, car(cdr(args)), var->name);
+            }
+        }
+    }
+
+    Buffer forms;
+    openBuffer(&forms);
+    int count = 0;
+    for (SchemeVal *form = tree; !isEmpty(form); form = cdr(form), count++) {
+        Function top = {.id = count};
+        char *text;
+        size_t size;
+        FILE *body = open_memstream(&text, &size);
+        if (isForm(car(form), "define")) {
+            compileGlobalDefine(c, cdr(car(form)), &top, body);
+        } else {
+            compileExpr(c, car(form), NULL, &top, body);
+        }
+        fclose(body);
+        fprintf(c->functions.out, "\nstatic SchemeVal *form_%d() {\n    return %s;\n}\n",
+                count, text);
+        free(text);
+        fprintf(forms.out, "    {form_%d, ", count);
+        emitPosition(forms.out, car(form));
+        fputs("},\n", forms.out);
+    }
+
+    fputs("// Generated by the Scheme compiler (compiler.c); do not edit.\n"
+          "#include \"compiled.h\"\n\n", out);
+    flushBuffer(&c->declarations, out);
+    flushBuffer(&c->functions, out);
+    fprintf(out, "\nstatic const CompiledForm forms[%d] = {\n", count > 0 ? count : 1);
+    flushBuffer(&forms, out);
+    fputs("};\n\nstatic void initialize() {\n", out);
+    flushBuffer(&c->initialize, out);
+    fprintf(out, "}\n\nint main() {\n"
+                 "    return runCompiled(initialize, forms, %d);\n}\n", count);
+    free(c->assigned);
+    return c->errors == 0;
+}
@@ -0,0 +1,28 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include "schemeval.h"
+
+#ifndef _COMPILER
+#define _COMPILER
+
+// An ahead-of-time compiler from Scheme to C. It translates a parsed program
+// into a C file that runs on the interpreter's own runtime (compiled.h):
+// every lambda becomes a C function, its parameters and let variables C
+// locals, and calls of a variable bound to a known lambda call that C
+// function directly once a type check passes. +, <, null?, car, cdr and cons
+// are compiled inline and other primitives are called directly. Linked with
+// every interpreter source but main.c, the program prints what the
+// interpreter would, errors included; `just compile-scheme FILE` does both
+// steps.
+//
+// What the compiled program does not do: it has no step or allocation
+// quotas, no --cek evaluator, no profiler or tracing of Scheme calls and no
+// runtime-stats counts beyond time and allocation, and define must appear at
+// the top level or directly in a body, which is checked when compiling.
+
+// Writes the C translation of tree, a list of top-level forms from parse,
+// to out. Problems found while compiling are printed to stderr; returns
+// false if there were any.
+bool compileProgram(SchemeVal *tree, FILE *out);
+
+#endif
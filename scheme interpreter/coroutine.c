@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "coroutine.h"
+#include "schemeval.h"
+#include "talloc.h"
+#include "linkedlist.h"
+#include "error.h"
+#include "interpreter.h"
+#include "profiler.h"
+#include "escape.h"
+
+// Stack reserved for each task. Only the pages a task actually touches are
+// backed by memory, so a task that stays shallow costs a few KB; the lowest
+// page is left unmapped so an overflow faults instead of corrupting memory.
+#define TASK_STACK_SIZE (256 * 1024)
+
+typedef struct Coroutine {
+    ucontext_t context;
+    void *stack;
+    SchemeVal *thunk;
+    SchemeVal *result;
+    SchemeVal *condition;
+    bool failed;
+    bool done;
+    bool queued;
+    // per-stack thread state, swapped in and out with the context
+    ErrorHandler *handlers;
+    Heap *heap;
+    ProfileFrame *profileTop;
+    FrameStack frameStack;
+    // link in the run queue or in the list of waiters it is blocked on
+    struct Coroutine *next;
+    // coroutines blocked in join on this one
+    struct Coroutine *joiners;
+} Coroutine;
+
+typedef struct {
+    SchemeVal *head;
+    SchemeVal *tail;
+    Coroutine *waiters;
+} Channel;
+
+// Scheduler state belongs to the OS thread, so contexts on different
+// threads each get their own scheduler.
+static _Thread_local Coroutine mainCoroutine;
+static _Thread_local Coroutine *running = NULL;
+static _Thread_local Coroutine *readyHead = NULL;
+static _Thread_local Coroutine *readyTail = NULL;
+// a finished task whose stack can be unmapped once we are off it
+static _Thread_local Coroutine *zombie = NULL;
+
+/* Returns the coroutine running on this thread */
+static Coroutine *self() {
+    if (running == NULL) {
+        running = &mainCoroutine;
+    }
+    return running;
+}
+
+/* Adds a coroutine to the back of the run queue */
+static void makeReady(Coroutine *co) {
+    if (co->queued) {
+        return;
+    }
+    co->queued = true;
+    co->next = NULL;
+    if (readyTail == NULL) {
+        readyHead = co;
+    } else {
+        readyTail->next = co;
+    }
+    readyTail = co;
+}
+
+/* Takes the coroutine at the front of the run queue, or NULL */
+static Coroutine *nextReady() {
+    Coroutine *co = readyHead;
+    if (co != NULL) {
+        readyHead = co->next;
+        if (readyHead == NULL) {
+            readyTail = NULL;
+        }
+        co->queued = false;
+    }
+    return co;
+}
+
+/* Unmaps the stack of a task that finished before the last switch */
+static void buryZombie() {
+    if (zombie != NULL) {
+        munmap(zombie->stack, TASK_STACK_SIZE);
+        zombie->stack = NULL;
+        zombie = NULL;
+    }
+}
+
+/* Saves the running coroutine's thread state and resumes another one */
+static void switchTo(Coroutine *next) {
+    Coroutine *current = self();
+    if (next == current) {
+        return;
+    }
+    current->handlers = currentHandler();
+    current->heap = tallocHeap();
+    current->profileTop = profileTop;
+    current->frameStack = frameStack;
+
+    running = next;
+    restoreHandler(next->handlers);
+    useHeap(next->heap);
+    profileTop = next->profileTop;
+    frameStack = next->frameStack;
+    swapcontext(&current->context, &next->context);
+    buryZombie();
+}
+
+/* Suspends the running coroutine until someone makes it ready again. If
+   nothing else can run, every coroutine is blocked: the main program gets
+   control back to report it. Returns false if the main program is the one
+   that is blocked with nothing left to run. */
+static bool block() {
+    Coroutine *next = nextReady();
+    if (next == NULL) {
+        if (self() == &mainCoroutine) {
+            return false;
+        }
+        next = &mainCoroutine;
+    }
+    switchTo(next);
+    return true;
+}
+
+/* Entry point of every task's stack */
+static void taskMain() {
+    buryZombie();
+    Coroutine *task = self();
+
+    ErrorHandler handler;
+    pushHandler(&handler);
+    if (setjmp(handler.env) == 0) {
+        task->result = apply(task->thunk, makeEmpty(), NULL);
+        popHandler(&handler);
+    } else {
+        popHandler(&handler);
+        task->failed = true;
+        task->condition = lastCondition();
+    }
+    task->done = true;
+
+    while (task->joiners != NULL) {
+        Coroutine *joiner = task->joiners;
+        task->joiners = joiner->next;
+        makeReady(joiner);
+    }
+
+    // Never returns: the stack is freed by whoever runs next.
+    zombie = task;
+    Coroutine *next = nextReady();
+    if (next == NULL) {
+        next = &mainCoroutine;
+    }
+    running = next;
+    restoreHandler(next->handlers);
+    useHeap(next->heap);
+    profileTop = next->profileTop;
+    frameStack = next->frameStack;
+    setcontext(&next->context);
+}
+
+/* Checks that args holds a single value of the given type and returns it */
+static SchemeVal *singleArg(SchemeVal *args, objectType type, char *message) {
+    if (length(args) != 1 || car(args)->type != type) {
+        evalError("%s", message);
+    }
+    return car(args);
+}
+
+// Creates a task with its own stack, queued to run after the running code
+// next yields or blocks.
+SchemeVal *primitiveSpawn(SchemeVal *args) {
+    if (length(args) != 1 || !isProcedure(car(args))) {
+        evalError("spawn requires a procedure of no arguments");
+    }
+
+    Coroutine *task = talloc(sizeof(Coroutine));
+    memset(task, 0, sizeof(Coroutine));
+    task->thunk = car(args);
+    task->heap = tallocHeap();
+    // tasks take turns on one thread, so they could not pop the frame stack
+    // in order; they make their frames with talloc
+    task->frameStack.none = true;
+
+    task->stack = mmap(NULL, TASK_STACK_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (task->stack == MAP_FAILED) {
+        evalError("spawn could not allocate a stack");
+    }
+    mprotect(task->stack, getpagesize(), PROT_NONE);
+
+    getcontext(&task->context);
+    task->context.uc_stack.ss_sp = task->stack;
+    task->context.uc_stack.ss_size = TASK_STACK_SIZE;
+    task->context.uc_link = NULL;
+    makecontext(&task->context, taskMain, 0);
+    makeReady(task);
+
+    SchemeVal *result = talloc(sizeof(SchemeVal));
+    result->type = TASK_TYPE;
+    result->ptr = task;
+    return result;
+}
+
+// Moves the running coroutine to the back of the run queue.
+SchemeVal *primitiveYield(SchemeVal *args) {
+    if (!isEmpty(args)) {
+        evalError("yield takes no arguments");
+    }
+    if (readyHead != NULL) {
+        makeReady(self());
+        switchTo(nextReady());
+    }
+    return makeVoid();
+}
+
+// Waits for a task to finish.
+SchemeVal *primitiveJoin(SchemeVal *args) {
+    Coroutine *task = singleArg(args, TASK_TYPE, "join requires a task")->ptr;
+    while (!task->done) {
+        Coroutine *current = self();
+        current->next = task->joiners;
+        task->joiners = current;
+        if (!block()) {
+            task->joiners = current->next;
+            evalError("deadlock: join with every task blocked");
+        }
+    }
+    if (task->failed) {
+        raiseCondition(task->condition);
+    }
+    return task->result;
+}
+
+// Creates an empty channel.
+SchemeVal *primitiveMakeChannel(SchemeVal *args) {
+    if (!isEmpty(args)) {
+        evalError("make-channel takes no arguments");
+    }
+    Channel *channel = talloc(sizeof(Channel));
+    channel->head = makeEmpty();
+    channel->tail = NULL;
+    channel->waiters = NULL;
+
+    SchemeVal *result = talloc(sizeof(SchemeVal));
+    result->type = CHANNEL_TYPE;
+    result->ptr = channel;
+    return result;
+}
+
+// Appends a value to a channel and wakes one waiting receiver.
+SchemeVal *primitiveChannelSend(SchemeVal *args) {
+    if (length(args) != 2 || car(args)->type != CHANNEL_TYPE) {
+        evalError("channel-send requires a channel and a value");
+    }
+    Channel *channel = car(args)->ptr;
+
+    SchemeVal *cell = cons(car(cdr(args)), makeEmpty());
+    if (channel->tail == NULL) {
+        channel->head = cell;
+    } else {
+        channel->tail->cdr = cell;
+    }
+    channel->tail = cell;
+
+    if (channel->waiters != NULL) {
+        Coroutine *waiter = channel->waiters;
+        channel->waiters = waiter->next;
+        makeReady(waiter);
+    }
+    return makeVoid();
+}
+
+// Removes and returns the oldest value of a channel, blocking while empty.
+SchemeVal *primitiveChannelRecv(SchemeVal *args) {
+    Channel *channel = singleArg(args, CHANNEL_TYPE, "channel-recv requires a channel")->ptr;
+    while (isEmpty(channel->head)) {
+        Coroutine *current = self();
+        current->next = channel->waiters;
+        channel->waiters = current;
+        if (!block()) {
+            channel->waiters = current->next;
+            evalError("deadlock: channel-recv with every task blocked");
+        }
+    }
+
+    SchemeVal *value = car(channel->head);
+    channel->head = cdr(channel->head);
+    if (isEmpty(channel->head)) {
+        channel->tail = NULL;
+    }
+    return value;
+}
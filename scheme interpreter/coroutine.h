@@ -0,0 +1,31 @@
+#include "schemeval.h"
+
+#ifndef _COROUTINE
+#define _COROUTINE
+
+// Green threads: each task spawned from Scheme runs on its own small stack
+// and is multiplexed with the others (and the main program) on the calling
+// OS thread by a cooperative scheduler. Tasks switch only when they yield,
+// block on a channel or in join, or finish.
+
+// (spawn thunk) creates a task that will call thunk, and returns it.
+SchemeVal *primitiveSpawn(SchemeVal *args);
+
+// (yield) lets every other runnable task run before carrying on.
+SchemeVal *primitiveYield(SchemeVal *args);
+
+// (join task) waits for task to finish and returns its value, raising again
+// any error it raised.
+SchemeVal *primitiveJoin(SchemeVal *args);
+
+// (make-channel) creates an unbounded FIFO channel.
+SchemeVal *primitiveMakeChannel(SchemeVal *args);
+
+// (channel-send ch value) queues value on ch without blocking.
+SchemeVal *primitiveChannelSend(SchemeVal *args);
+
+// (channel-recv ch) takes the oldest value from ch, waiting for one if ch is
+// empty.
+SchemeVal *primitiveChannelRecv(SchemeVal *args);
+
+#endif
@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include "error.h"
+#include "schemeval.h"
+#include "talloc.h"
+#include "linkedlist.h"
+#include "parser.h"
+#include "profiler.h"
+#include "position.h"
+#include "trace.h"
+#include "escape.h"
+
+#define MAX_MESSAGE_LENGTH 300
+
+static _Thread_local ErrorHandler *topHandler = NULL;
+static _Thread_local SchemeVal *condition = NULL;
+
+// Makes handler the innermost place errors on this thread unwind to.
+void pushHandler(ErrorHandler *handler) {
+    handler->previous = topHandler;
+    handler->previousExit = setExitHandler(&handler->env);
+    handler->profileTop = profileTop;
+    // reserves the region first, or popping back to the mark would drop it
+    handler->frameStackTop = markFrameStack();
+    topHandler = handler;
+}
+
+// Removes handler, which must be the innermost one. On the error path this
+// also drops the shadow stack entries and the frame stack space of the
+// calls that were unwound.
+void popHandler(ErrorHandler *handler) {
+    profileTop = handler->profileTop;
+    popFrameStack(handler->frameStackTop);
+    topHandler = handler->previous;
+    setExitHandler(handler->previousExit);
+}
+
+// Returns the innermost handler on this thread.
+ErrorHandler *currentHandler() {
+    return topHandler;
+}
+
+// Makes handler (and the handlers it was pushed over) this thread's chain.
+void restoreHandler(ErrorHandler *handler) {
+    topHandler = handler;
+    setExitHandler(handler != NULL ? &handler->env : NULL);
+}
+
+// Creates an error object
+// Input: kind of error, message string value, list of irritants
+// Output: SchemeVal* of ERROR_TYPE
+SchemeVal *makeErrorObject(char *kind, SchemeVal *message, SchemeVal *irritants) {
+    SchemeVal *error = talloc(sizeof(SchemeVal));
+    error->type = ERROR_TYPE;
+    error->kind = kind;
+    error->message = message;
+    error->irritants = irritants;
+    return error;
+}
+
+// Unwinds to the innermost handler with the given condition, or reports it
+// and exits if there is none.
+void raiseCondition(SchemeVal *raised) {
+    condition = raised;
+    TRACE_ERROR(raised);
+    if (topHandler == NULL) {
+        printCondition(stdout, raised);
+    }
+    texit(1);
+    abort();
+}
+
+/* Formats a message into an error object of the given kind and raises it,
+   placed at the position of datum if it is not NULL */
+static _Noreturn void raiseFormatted(char *kind, SchemeVal *datum, const char *format,
+                                     va_list args) {
+    char buffer[MAX_MESSAGE_LENGTH + 1];
+    vsnprintf(buffer, sizeof(buffer), format, args);
+
+    SchemeVal *message = talloc(sizeof(SchemeVal));
+    message->type = STR_TYPE;
+    message->s = talloc(strlen(buffer) + 1);
+    strcpy(message->s, buffer);
+    SchemeVal *error = makeErrorObject(kind, message, makeEmpty());
+    if (datum != NULL) {
+        copyPosition(error, datum);
+    }
+    raiseCondition(error);
+}
+
+// Raises an "Evaluation error: ..." error.
+void evalError(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    raiseFormatted("Evaluation error", NULL, format, args);
+}
+
+// Raises an "Evaluation error: ..." error at the source position of datum.
+void evalErrorAt(SchemeVal *datum, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    raiseFormatted("Evaluation error", datum, format, args);
+}
+
+// Raises a "Syntax error: ..." error.
+void syntaxError(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    raiseFormatted("Syntax error", NULL, format, args);
+}
+
+// Returns the value raised by the latest error on this thread.
+SchemeVal *lastCondition() {
+    return condition;
+}
+
+// Prints "kind: message irritant ..." for error objects, or the raised value
+// for anything else.
+void printCondition(FILE *out, SchemeVal *raised) {
+    if (raised == NULL) {
+        fprintf(out, "Error\n");
+        return;
+    }
+    if (raised->type != ERROR_TYPE) {
+        fprintf(out, "Error: uncaught exception ");
+        fprintTree(out, raised);
+        fprintf(out, "\n");
+        return;
+    }
+
+    fprintf(out, "%s: ", raised->kind);
+    if (raised->message->type == STR_TYPE) {
+        fprintf(out, "%s", raised->message->s);
+    } else {
+        fprintTree(out, raised->message);
+    }
+    SchemeVal *irritants = raised->irritants;
+    while (!isEmpty(irritants)) {
+        fprintf(out, " ");
+        fprintTree(out, car(irritants));
+        irritants = cdr(irritants);
+    }
+    char where[300];
+    if (formatPosition(raised, where, sizeof(where))) {
+        fprintf(out, " (at %s)", where);
+    }
+    fprintf(out, "\n");
+}
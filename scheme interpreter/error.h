@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <setjmp.h>
+#include "schemeval.h"
+
+#ifndef _ERROR
+#define _ERROR
+
+// A place errors unwind to. Install one with pushHandler and call setjmp on
+// its env straight after; remove it with popHandler on both the normal path
+// and the error path. With no handler installed, an error prints its message
+// and exits the process, as texit always used to.
+typedef struct ErrorHandler {
+    jmp_buf env;
+    jmp_buf *previousExit;
+    // the profiler's shadow stack when the handler was pushed
+    struct ProfileFrame *profileTop;
+    // the top of the frame stack (escape.h) when the handler was pushed
+    char *frameStackTop;
+    struct ErrorHandler *previous;
+} ErrorHandler;
+
+void pushHandler(ErrorHandler *handler);
+void popHandler(ErrorHandler *handler);
+
+// The innermost handler of the calling thread, and a way to put back a whole
+// chain of handlers. Coroutines use these to keep one chain per stack.
+ErrorHandler *currentHandler();
+void restoreHandler(ErrorHandler *handler);
+
+// Raises an evaluation or syntax error with a printf-style message.
+_Noreturn void evalError(const char *format, ...);
+_Noreturn void syntaxError(const char *format, ...);
+
+// Raises an evaluation error that reports the source position of datum, a
+// piece of the parse tree.
+_Noreturn void evalErrorAt(SchemeVal *datum, const char *format, ...);
+
+// Raises any value as a condition, unwinding to the nearest handler.
+_Noreturn void raiseCondition(SchemeVal *condition);
+
+// Creates an ERROR_TYPE value. kind names the error in uncaught reports, for
+// example "Evaluation error" or "Error".
+SchemeVal *makeErrorObject(char *kind, SchemeVal *message, SchemeVal *irritants);
+
+// The value raised by the most recent error on the calling thread.
+SchemeVal *lastCondition();
+
+// Prints a condition as an uncaught error report, followed by the error's
+// source position if it has one and a newline.
+void printCondition(FILE *out, SchemeVal *condition);
+
+#endif
@@ -0,0 +1,169 @@
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "escape.h"
+#include "schemeval.h"
+#include "linkedlist.h"
+#include "talloc.h"
+
+// Under AddressSanitizer, space above the top of the frame stack is
+// poisoned, so a frame used after it was popped (one that escaped after
+// all) is reported.
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#else
+#define ASAN_POISON_MEMORY_REGION(address, size) ((void)(address), (void)(size))
+#define ASAN_UNPOISON_MEMORY_REGION(address, size) ((void)(address), (void)(size))
+#endif
+
+// Entries in each thread's cache of answers.
+#define ESCAPE_CACHE 256
+
+static bool enabled = true;
+
+// Bumped whenever a heap is freed, since a new body may then be allocated
+// where an old one was; a thread whose cache is from an older generation
+// empties it before use.
+static unsigned long generation = 0;
+static _Thread_local unsigned long cacheGeneration
+    __attribute__((tls_model("initial-exec"))) = 0;
+static _Thread_local struct {
+    SchemeVal *body;
+    bool escapes;
+} escapeCache[ESCAPE_CACHE] __attribute__((tls_model("initial-exec")));
+
+_Thread_local FrameStack frameStack __attribute__((tls_model("initial-exec"))) = {0};
+
+// The region of each thread's frame stack, unmapped when the thread exits
+static _Thread_local char *frameStackBase = NULL;
+static pthread_key_t regionKey;
+static pthread_once_t regionKeyOnce = PTHREAD_ONCE_INIT;
+
+void setStackFramesEnabled(bool enable) {
+    enabled = enable;
+}
+
+bool stackFramesEnabled() {
+    return enabled;
+}
+
+/* Checks if expr contains, at any depth outside quoted data, a lambda,
+   future or named let form, or a lambda or future symbol in another
+   position, which is taken as one to be safe. A named let makes its
+   procedure in a frame whose parent is this one, and the body may hand it
+   out */
+static bool mayCapture(SchemeVal *expr) {
+    if (expr->type == CONS_TYPE && car(expr)->type == SYMBOL_TYPE) {
+        if (!strcmp(car(expr)->s, "quote")) {
+            return false;
+        }
+        if (!strcmp(car(expr)->s, "let") && cdr(expr)->type == CONS_TYPE &&
+            car(cdr(expr))->type == SYMBOL_TYPE) {
+            return true;
+        }
+    }
+    while (expr->type == CONS_TYPE) {
+        SchemeVal *first = car(expr);
+        if (first->type == SYMBOL_TYPE &&
+            (!strcmp(first->s, "lambda") || !strcmp(first->s, "future"))) {
+            return true;
+        }
+        if (first->type == CONS_TYPE && mayCapture(first)) {
+            return true;
+        }
+        expr = cdr(expr);
+    }
+    return expr->type == SYMBOL_TYPE &&
+           (!strcmp(expr->s, "lambda") || !strcmp(expr->s, "future"));
+}
+
+// Looks body up in the calling thread's cache, analysing it on a miss
+bool bodyCaptures(SchemeVal *body) {
+    unsigned long current = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+    if (cacheGeneration != current) {
+        memset(escapeCache, 0, sizeof(escapeCache));
+        cacheGeneration = current;
+    }
+    size_t slot = ((uintptr_t)body >> 4) & (ESCAPE_CACHE - 1);
+    if (escapeCache[slot].body != body) {
+        escapeCache[slot].body = body;
+        bool escapes = false;
+        for (SchemeVal *form = body; form->type == CONS_TYPE && !escapes; form = cdr(form)) {
+            escapes = mayCapture(car(form));
+        }
+        escapeCache[slot].escapes = escapes;
+    }
+    return escapeCache[slot].escapes;
+}
+
+bool frameEscapes(SchemeVal *body) {
+    return !enabled || bodyCaptures(body);
+}
+
+// Empties every thread's cache
+void forgetEscapes(Heap *heap) {
+    (void)heap;
+    __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+}
+
+/* Unmaps the region of a thread that exits */
+static void unmapRegion(void *region) {
+    munmap(region, FRAME_STACK_SIZE);
+}
+
+static void makeRegionKey() {
+    pthread_key_create(&regionKey, unmapRegion);
+}
+
+/* Reserves the calling thread's region the first time it is needed */
+static void reserveRegion() {
+    if (frameStackBase != NULL || frameStack.none) {
+        return;
+    }
+    void *region = mmap(NULL, FRAME_STACK_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+        frameStack.none = true;
+        return;
+    }
+    pthread_once(&regionKeyOnce, makeRegionKey);
+    pthread_setspecific(regionKey, region);
+    ASAN_POISON_MEMORY_REGION(region, FRAME_STACK_SIZE);
+    frameStackBase = region;
+    frameStack.top = region;
+    frameStack.limit = frameStackBase + FRAME_STACK_SIZE;
+}
+
+// Reserves the region on first use, so the mark is never NULL where there
+// is one
+char *markFrameStack() {
+    if (frameStack.top == NULL) {
+        reserveRegion();
+    }
+    return frameStack.top;
+}
+
+// Takes bytes from the top, keeping it 16-byte aligned
+void *pushFrameStack(size_t bytes) {
+    bytes = (bytes + 15) & ~(size_t)15;
+    if (frameStack.top == NULL || (size_t)(frameStack.limit - frameStack.top) < bytes) {
+        return NULL;
+    }
+    void *space = frameStack.top;
+    frameStack.top += bytes;
+    ASAN_UNPOISON_MEMORY_REGION(space, bytes);
+    return space;
+}
+
+bool onFrameStack(void *pointer) {
+    return frameStackBase != NULL && (char *)pointer >= frameStackBase &&
+           (char *)pointer < frameStack.top;
+}
+
+void popFrameStack(char *mark) {
+    if (mark != NULL && mark < frameStack.top) {
+        ASAN_POISON_MEMORY_REGION(mark, frameStack.top - mark);
+    }
+    frameStack.top = mark;
+}
@@ -0,0 +1,70 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include "schemeval.h"
+#include "talloc.h"
+
+#ifndef _ESCAPE
+#define _ESCAPE
+
+// Escape analysis for environment frames. The frame apply makes for a
+// closure call, or evalLet for a let, is only reachable from outside its
+// body once something keeps a pointer to it: a lambda made in the body
+// closes over it, a future started in the body evaluates in it, and the
+// procedure of a named let is made in a frame below it. A body with none of
+// these forms anywhere in it outside quoted data cannot let its frame
+// escape. Since eval makes no tail calls, the frame is dead once the C
+// function that made it returns, so such frames and their bindings are
+// made on the frame stack below instead of with talloc, and popped on the
+// way out. The argument lists of closure calls, which bindArguments only
+// copies values out of, go there too.
+//
+// The answer for each body is computed once per thread and cached by the
+// body's address. --no-stack-frames makes every frame with talloc.
+
+// On by default. Call before evaluation starts.
+void setStackFramesEnabled(bool enabled);
+bool stackFramesEnabled();
+
+// Checks if the frame that body, a list of forms, is evaluated in may be
+// referred to after the last form has been evaluated.
+bool frameEscapes(SchemeVal *body);
+
+// Checks if body, a list of forms, may make a closure or start a future
+// that keeps the frame it is evaluated in: frameEscapes whatever
+// --no-stack-frames says.
+bool bodyCaptures(SchemeVal *body);
+
+// Drops the cached answers, as the bodies of heap are freed, for tfreeHeap.
+void forgetEscapes(Heap *heap);
+
+// The frame stack of the running coroutine: a region reserved when the
+// thread first uses it, and filled from the bottom up. Green threads, which
+// interleave on one OS thread, have none (none is set), and neither does a
+// thread whose region is full; frames are then made with talloc.
+typedef struct {
+    char *top;
+    char *limit;
+    bool none;
+} FrameStack;
+
+extern _Thread_local FrameStack frameStack __attribute__((tls_model("initial-exec")));
+
+// Bytes reserved for each thread's frame stack. Only the pages used are
+// backed by memory.
+#define FRAME_STACK_SIZE (32 * 1024 * 1024)
+
+// The top of the frame stack, to pop back to with popFrameStack.
+char *markFrameStack();
+
+// Room for bytes on the frame stack, or NULL if there is no room.
+void *pushFrameStack(size_t bytes);
+
+// Checks if pointer is into the space in use on the frame stack.
+bool onFrameStack(void *pointer);
+
+// Frees everything pushed since mark was taken. Error handlers pop back to
+// the mark of when they were pushed, which frees the space of the calls an
+// error unwinds.
+void popFrameStack(char *mark);
+
+#endif
@@ -0,0 +1,566 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fasl.h"
+#include "schemeval.h"
+#include "linkedlist.h"
+#include "talloc.h"
+#include "tokenizer.h"
+#include "parser.h"
+#include "interpreter.h"
+#include "position.h"
+
+// A fasl file is a header, followed by a table of fixed-size nodes, followed
+// by a table of NUL-terminated strings. Every reference between nodes is an
+// index into the node table and every string is an offset into the string
+// table, so the file can be mapped and read in place.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t sourceHash;
+    uint32_t nodeCount;
+    uint32_t stringBytes;
+    uint32_t root;
+    uint32_t kind;
+} FaslHeader;
+
+// What the root node of a file is: the list of forms of a parsed program, or
+// the global frame of a heap image.
+enum { FASL_PROGRAM, FASL_IMAGE };
+
+// One serialised SchemeVal or Frame. For CONS_TYPE, x is the car index and y
+// the cdr index; for INT_TYPE and BOOL_TYPE the value is in y; for
+// DOUBLE_TYPE y holds the bits of the double; for STR_TYPE and SYMBOL_TYPE y
+// is a string table offset. A CLOSURE_TYPE keeps its parameters in x, and its
+// body and frame in the low and high halves of y. A PRIMITIVE_TYPE stores its
+// index in the primitive table in y. A FASL_FRAME node keeps its bindings in
+// x and its parent in y (FASL_NONE for the global frame).
+typedef struct {
+    uint32_t type;
+    uint32_t x;
+    uint64_t y;
+} FaslNode;
+
+#define FASL_FRAME 0x100
+#define FASL_NONE 0xffffffffu
+
+// Decoded frames are placed in the SchemeVal slot of their node.
+_Static_assert(sizeof(Frame) <= sizeof(SchemeVal), "Frame must fit in a node slot");
+
+static const char faslMagic[4] = {'S', 'F', 'S', 'L'};
+
+// Open-addressing map from object pointers (or string contents) to the
+// index they were assigned while writing.
+typedef struct {
+    const void **keys;
+    uint32_t *values;
+    size_t capacity;
+    size_t count;
+} FaslMap;
+
+typedef struct {
+    void **objects;
+    bool *isFrame;
+    FaslNode *nodes;
+    size_t count;
+    size_t capacity;
+    FaslMap pointers;
+    FaslMap strings;
+    char *stringTable;
+    size_t stringBytes;
+    size_t stringCapacity;
+    int64_t emptyIndex;
+    bool failed;
+} FaslWriter;
+
+/* FNV-1a over the source text */
+uint64_t hashSource(const char *text, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)text[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static size_t hashPointer(const void *key) {
+    uintptr_t k = (uintptr_t)key;
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    return (size_t)k;
+}
+
+static size_t hashString(const void *key) {
+    return (size_t)hashSource(key, strlen(key));
+}
+
+/* Finds the slot for key; byContent compares keys as C strings */
+static size_t mapSlot(FaslMap *map, const void *key, bool byContent) {
+    size_t mask = map->capacity - 1;
+    size_t slot = (byContent ? hashString(key) : hashPointer(key)) & mask;
+    while (map->keys[slot] != NULL) {
+        if (byContent ? !strcmp(map->keys[slot], key) : map->keys[slot] == key) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static void mapGrow(FaslMap *map, bool byContent) {
+    FaslMap old = *map;
+    map->capacity = old.capacity ? old.capacity * 2 : 1024;
+    map->keys = calloc(map->capacity, sizeof(void *));
+    map->values = malloc(map->capacity * sizeof(uint32_t));
+    assert(map->keys != NULL && map->values != NULL);
+    for (size_t i = 0; i < old.capacity; i++) {
+        if (old.keys[i] != NULL) {
+            size_t slot = mapSlot(map, old.keys[i], byContent);
+            map->keys[slot] = old.keys[i];
+            map->values[slot] = old.values[i];
+        }
+    }
+    free(old.keys);
+    free(old.values);
+}
+
+/* Returns the value stored for key, inserting value if absent */
+static uint32_t mapFindOrInsert(FaslMap *map, const void *key, uint32_t value,
+                                bool byContent, bool *inserted) {
+    if ((map->count + 1) * 2 > map->capacity) {
+        mapGrow(map, byContent);
+    }
+    size_t slot = mapSlot(map, key, byContent);
+    if (map->keys[slot] != NULL) {
+        *inserted = false;
+        return map->values[slot];
+    }
+    map->keys[slot] = key;
+    map->values[slot] = value;
+    map->count++;
+    *inserted = true;
+    return value;
+}
+
+static void mapFree(FaslMap *map) {
+    free(map->keys);
+    free(map->values);
+}
+
+/* Adds a string to the string table (once per distinct content) */
+static uint32_t internString(FaslWriter *writer, const char *s) {
+    bool inserted;
+    uint32_t offset = mapFindOrInsert(&writer->strings, s, (uint32_t)writer->stringBytes,
+                                      true, &inserted);
+    if (!inserted) {
+        return offset;
+    }
+    size_t len = strlen(s) + 1;
+    if (writer->stringBytes + len > writer->stringCapacity) {
+        writer->stringCapacity = (writer->stringBytes + len) * 2;
+        writer->stringTable = realloc(writer->stringTable, writer->stringCapacity);
+        assert(writer->stringTable != NULL);
+    }
+    memcpy(writer->stringTable + writer->stringBytes, s, len);
+    writer->stringBytes += len;
+    return offset;
+}
+
+/* Returns the node index of a SchemeVal or Frame, queueing it if new */
+static uint32_t queueNode(FaslWriter *writer, void *ptr, bool isFrame) {
+    bool inserted;
+    uint32_t index = mapFindOrInsert(&writer->pointers, ptr, (uint32_t)writer->count,
+                                     false, &inserted);
+    if (!inserted) {
+        return index;
+    }
+
+    if (writer->count == writer->capacity) {
+        writer->capacity = writer->capacity ? writer->capacity * 2 : 1024;
+        writer->objects = realloc(writer->objects, writer->capacity * sizeof(void *));
+        writer->isFrame = realloc(writer->isFrame, writer->capacity * sizeof(bool));
+        writer->nodes = realloc(writer->nodes, writer->capacity * sizeof(FaslNode));
+        assert(writer->objects != NULL && writer->isFrame != NULL && writer->nodes != NULL);
+    }
+    writer->isFrame[writer->count] = isFrame;
+    writer->objects[writer->count++] = ptr;
+    return index;
+}
+
+/* Returns the node index of obj, queueing it for serialisation if new */
+static uint32_t nodeIndex(FaslWriter *writer, SchemeVal *obj) {
+    // every empty list is interchangeable, so they all share one node
+    if (obj->type == EMPTY_TYPE && writer->emptyIndex >= 0) {
+        return (uint32_t)writer->emptyIndex;
+    }
+    uint32_t index = queueNode(writer, obj, false);
+    if (obj->type == EMPTY_TYPE) {
+        writer->emptyIndex = index;
+    }
+    return index;
+}
+
+/* Returns the node index of frame, or FASL_NONE for a missing parent */
+static uint32_t frameIndex(FaslWriter *writer, Frame *frame) {
+    return frame == NULL ? FASL_NONE : queueNode(writer, frame, true);
+}
+
+/* Fills in the node for an already-queued object, queueing its children */
+static void encodeNode(FaslWriter *writer, size_t index) {
+    if (writer->isFrame[index]) {
+        Frame *frame = writer->objects[index];
+        uint32_t bindingsIndex = nodeIndex(writer, frame->bindings);
+        uint32_t parentIndex = frameIndex(writer, frame->parent);
+        writer->nodes[index] = (FaslNode){.type = FASL_FRAME, .x = bindingsIndex,
+                                          .y = parentIndex};
+        return;
+    }
+
+    SchemeVal *obj = writer->objects[index];
+    FaslNode node = {.type = obj->type, .x = 0, .y = 0};
+
+    switch (obj->type) {
+        case INT_TYPE:
+            node.y = (uint64_t)(int64_t)obj->i;
+            break;
+        case DOUBLE_TYPE:
+            memcpy(&node.y, &obj->d, sizeof(double));
+            break;
+        case BOOL_TYPE:
+            node.y = obj->b;
+            break;
+        case STR_TYPE:
+        case SYMBOL_TYPE:
+            node.y = internString(writer, obj->s);
+            break;
+        case EMPTY_TYPE:
+        case VOID_TYPE:
+        case UNSPECIFIED_TYPE:
+            break;
+        case CONS_TYPE: {
+            uint32_t carIndex = nodeIndex(writer, obj->car);
+            uint32_t cdrIndex = nodeIndex(writer, obj->cdr);
+            node.x = carIndex;
+            node.y = cdrIndex;
+            break;
+        }
+        case CLOSURE_TYPE: {
+            uint32_t paramsIndex = nodeIndex(writer, obj->paramNames);
+            uint32_t codeIndex = nodeIndex(writer, obj->functionCode);
+            uint32_t envIndex = frameIndex(writer, obj->frame);
+            node.x = paramsIndex;
+            node.y = codeIndex | ((uint64_t)envIndex << 32);
+            break;
+        }
+        case PRIMITIVE_TYPE: {
+            int primitive = primitiveIndex(obj->pf);
+            if (primitive < 0) {
+                writer->failed = true;
+            }
+            node.y = (uint64_t)primitive;
+            break;
+        }
+        default:
+            writer->failed = true;
+            break;
+    }
+    // nodeIndex may have moved the node table
+    writer->nodes[index] = node;
+}
+
+/* Writes everything reachable from root to path. Returns false if the graph
+   holds an object that cannot be serialised or the file cannot be written. */
+static bool writeGraph(void *root, uint32_t kind, const char *path, uint64_t hash) {
+    FaslWriter writer = {0};
+    writer.emptyIndex = -1;
+
+    uint32_t rootIndex = kind == FASL_IMAGE ? frameIndex(&writer, root)
+                                            : nodeIndex(&writer, root);
+    // the object table doubles as the work queue, so deep lists never recurse
+    for (size_t i = 0; i < writer.count && !writer.failed; i++) {
+        encodeNode(&writer, i);
+    }
+
+    bool ok = !writer.failed;
+    if (ok) {
+        size_t tmpLen = strlen(path) + 5;
+        char *tmpPath = malloc(tmpLen);
+        assert(tmpPath != NULL);
+        snprintf(tmpPath, tmpLen, "%s.tmp", path);
+
+        FaslHeader header = {0};
+        memcpy(header.magic, faslMagic, sizeof(faslMagic));
+        header.version = FASL_VERSION;
+        header.sourceHash = hash;
+        header.nodeCount = (uint32_t)writer.count;
+        header.stringBytes = (uint32_t)writer.stringBytes;
+        header.root = rootIndex;
+        header.kind = kind;
+
+        FILE *out = fopen(tmpPath, "wb");
+        ok = out != NULL;
+        if (ok) {
+            ok = fwrite(&header, sizeof(header), 1, out) == 1;
+            ok = ok && fwrite(writer.nodes, sizeof(FaslNode), writer.count, out) == writer.count;
+            ok = ok && fwrite(writer.stringTable, 1, writer.stringBytes, out) == writer.stringBytes;
+            ok = (fclose(out) == 0) && ok;
+        }
+        // rename last, so a reader never sees a half-written cache
+        ok = ok && rename(tmpPath, path) == 0;
+        if (!ok) {
+            unlink(tmpPath);
+        }
+        free(tmpPath);
+    }
+
+    free(writer.objects);
+    free(writer.isFrame);
+    free(writer.nodes);
+    free(writer.stringTable);
+    mapFree(&writer.pointers);
+    mapFree(&writer.strings);
+    return ok;
+}
+
+// Writes a parsed program to path in the fasl format.
+// Input: parse tree, output path, hash of the source text the tree came from
+// Output: true if the whole file was written
+bool writeFasl(SchemeVal *tree, const char *path, uint64_t sourceHash) {
+    return writeGraph(tree, FASL_PROGRAM, path, sourceHash);
+}
+
+/* Identifies the primitive table an image was written against, since images
+   refer to primitives by index. */
+static uint64_t primitiveTableHash() {
+    uint64_t hash = 0;
+    for (int i = 0; i < primitiveCount(); i++) {
+        char *name = primitiveName(i);
+        hash = hash * 31 + hashSource(name, strlen(name) + 1);
+    }
+    return hash;
+}
+
+/* Checks that index refers to a frame node (or is FASL_NONE if allowed) */
+static bool isFrameRef(const FaslNode *nodes, size_t count, uint64_t index, bool allowNone) {
+    if (index == FASL_NONE) {
+        return allowNone;
+    }
+    return index < count && nodes[index].type == FASL_FRAME;
+}
+
+/* Rebuilds the objects of a mapped fasl file and returns its root node, which
+   is a Frame for images. Returns NULL if any node is malformed. */
+static void *decodeNodes(const FaslHeader *header, const FaslNode *nodes,
+                         const char *strings) {
+    size_t count = header->nodeCount;
+    SchemeVal *objects = talloc(count * sizeof(SchemeVal));
+    char *stringTable = talloc(header->stringBytes);
+    memcpy(stringTable, strings, header->stringBytes);
+
+    for (size_t i = 0; i < count; i++) {
+        const FaslNode *node = &nodes[i];
+        SchemeVal *obj = &objects[i];
+        obj->type = node->type;
+        switch (node->type) {
+            case INT_TYPE:
+                obj->i = (int)(int64_t)node->y;
+                break;
+            case DOUBLE_TYPE:
+                memcpy(&obj->d, &node->y, sizeof(double));
+                break;
+            case BOOL_TYPE:
+                obj->b = node->y != 0;
+                break;
+            case STR_TYPE:
+            case SYMBOL_TYPE:
+                if (node->y >= header->stringBytes) return NULL;
+                obj->s = stringTable + node->y;
+                break;
+            case EMPTY_TYPE:
+            case VOID_TYPE:
+            case UNSPECIFIED_TYPE:
+                break;
+            case CONS_TYPE:
+                if (node->x >= count || node->y >= count) return NULL;
+                obj->car = &objects[node->x];
+                obj->cdr = &objects[node->y];
+                break;
+            case CLOSURE_TYPE: {
+                uint64_t code = node->y & 0xffffffffu;
+                uint64_t env = node->y >> 32;
+                if (node->x >= count || code >= count || !isFrameRef(nodes, count, env, false)) {
+                    return NULL;
+                }
+                obj->paramNames = &objects[node->x];
+                obj->functionCode = &objects[code];
+                obj->frame = (Frame *)&objects[env];
+                break;
+            }
+            case PRIMITIVE_TYPE:
+                if (node->y >= (uint64_t)primitiveCount()) return NULL;
+                obj->pf = primitiveFunction((int)node->y);
+                obj->primitive = (int)node->y;
+                break;
+            case FASL_FRAME: {
+                if (node->x >= count || !isFrameRef(nodes, count, node->y, true)) return NULL;
+                Frame *frame = (Frame *)obj;
+                frame->bindings = &objects[node->x];
+                frame->parent = node->y == FASL_NONE ? NULL : (Frame *)&objects[node->y];
+                break;
+            }
+            default:
+                return NULL;
+        }
+    }
+    return &objects[header->root];
+}
+
+/* Maps a fasl file of the given kind and rebuilds the graph stored in it.
+   Returns NULL if the file is missing, malformed, or has a different hash. */
+static void *readGraph(const char *path, uint32_t kind, uint64_t hash) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(FaslHeader)) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    void *image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        return NULL;
+    }
+
+    const FaslHeader *header = image;
+    void *root = NULL;
+    bool valid = !memcmp(header->magic, faslMagic, sizeof(faslMagic))
+        && header->version == FASL_VERSION
+        && header->kind == kind
+        && header->sourceHash == hash
+        && header->root < header->nodeCount
+        && size == sizeof(FaslHeader) + (size_t)header->nodeCount * sizeof(FaslNode)
+                   + header->stringBytes;
+
+    if (valid) {
+        const FaslNode *nodes = (const FaslNode *)(header + 1);
+        const char *strings = (const char *)(nodes + header->nodeCount);
+        // every string offset must land on a terminated string
+        bool stringsOk = header->stringBytes == 0 || strings[header->stringBytes - 1] == '\0';
+        bool rootOk = (nodes[header->root].type == FASL_FRAME) == (kind == FASL_IMAGE);
+        if (stringsOk && rootOk) {
+            root = decodeNodes(header, nodes, strings);
+        }
+    }
+
+    munmap(image, size);
+    return root;
+}
+
+// Maps a fasl file and rebuilds the parse tree stored in it.
+// Input: path of the cache file, hash of the current source text
+// Output: the parse tree, or NULL if the cache is missing or stale
+SchemeVal *readFasl(const char *path, uint64_t sourceHash) {
+    return readGraph(path, FASL_PROGRAM, sourceHash);
+}
+
+// Writes everything reachable from the global frame to an image file.
+// Input: global frame, output path
+// Output: true if the whole image was written
+bool saveImage(Frame *global, const char *path) {
+    return writeGraph(global, FASL_IMAGE, path, primitiveTableHash());
+}
+
+// Maps a heap image written by saveImage and rebuilds its global frame.
+// Input: path of the image file
+// Output: the global frame, or NULL if the image is missing, malformed, or
+// was written by an interpreter with different primitives
+Frame *loadImage(const char *path) {
+    return readGraph(path, FASL_IMAGE, primitiveTableHash());
+}
+
+/* A file loadSource reads for the cache: the data read so far, newest first,
+   are kept to be written out once the whole file has been read */
+typedef struct {
+    FormAction action;
+    void *context;
+    SchemeVal *forms;
+    int actionErrors;
+} CachingRead;
+
+/* Keeps form for the cache, then hands it on to the caller's action */
+static int keepForm(SchemeVal *form, void *context) {
+    CachingRead *read = context;
+    read->forms = cons(form, read->forms);
+    int errors = read->action(form, read->context);
+    read->actionErrors += errors;
+    return errors;
+}
+
+// Reads a Scheme source file a top-level datum at a time, going through the
+// fasl cache when asked to, and hands each datum to action.
+// Input: path of the source file, whether to read and write "<path>.fasl",
+// and what to do with each datum
+// Output: the number of syntax errors plus the errors action returned
+int loadSource(const char *path, bool useCache, FormAction action, void *context) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        printf("Error: could not open %s\n", path);
+        texit(1);
+    }
+
+    size_t capacity = 4096;
+    size_t len = 0;
+    char *text = malloc(capacity);
+    assert(text != NULL);
+    size_t n;
+    while ((n = fread(text + len, 1, capacity - len, file)) > 0) {
+        len += n;
+        if (len == capacity) {
+            capacity *= 2;
+            text = realloc(text, capacity);
+            assert(text != NULL);
+        }
+    }
+    fclose(file);
+
+    uint64_t hash = hashSource(text, len);
+    size_t cacheLen = strlen(path) + 6;
+    char *cachePath = malloc(cacheLen);
+    assert(cachePath != NULL);
+    snprintf(cachePath, cacheLen, "%s.fasl", path);
+
+    int errors = 0;
+    SchemeVal *tree = useCache ? readFasl(cachePath, hash) : NULL;
+    if (tree != NULL) {
+        for (; !isEmpty(tree); tree = cdr(tree)) {
+            errors += action(car(tree), context);
+        }
+    } else {
+        CachingRead read = {action, context, makeEmpty(), 0};
+        if (len > 0) {
+            FILE *input = fmemopen(text, len, "r");
+            errors = useCache ? readForms(input, path, keepForm, &read)
+                              : readForms(input, path, action, context);
+            fclose(input);
+        }
+        // a file with syntax errors is read again next time, to report them
+        if (useCache && errors == read.actionErrors &&
+            !writeFasl(reverse(read.forms), cachePath, hash)) {
+            fprintf(stderr, "Warning: could not write %s\n", cachePath);
+        }
+    }
+
+    free(cachePath);
+    free(text);
+    return errors;
+}
@@ -0,0 +1,44 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "schemeval.h"
+#include "parser.h"
+
+#ifndef _FASL
+#define _FASL
+
+// Bumped whenever the on-disk layout changes, so that caches written by an
+// older interpreter are treated as stale.
+#define FASL_VERSION 2
+
+// Computes the hash used to validate a cache file against its source text.
+uint64_t hashSource(const char *text, size_t len);
+
+// Writes a parsed program to path in the fasl ("fast load") format. Pointers
+// are stored as node indices, so the file needs no relocation table. Returns
+// false if the file could not be written.
+bool writeFasl(SchemeVal *tree, const char *path, uint64_t sourceHash);
+
+// Maps a fasl file written by writeFasl and rebuilds the parse tree from it.
+// Returns NULL if the file is missing, malformed, or was written for source
+// text with a different hash.
+SchemeVal *readFasl(const char *path, uint64_t sourceHash);
+
+// Writes the heap reachable from a global frame (bindings, closures and the
+// frames they capture) to an image file. Primitives are stored by their index
+// in the primitive table. Returns false if the image could not be written.
+bool saveImage(Frame *global, const char *path);
+
+// Maps an image written by saveImage and rebuilds its global frame in a
+// single pass over the nodes. Returns NULL if the image is missing, malformed,
+// or was written by an interpreter with a different primitive table.
+Frame *loadImage(const char *path);
+
+// Reads the Scheme file at path a top-level datum at a time with readForms,
+// handing each to action. When useCache is set, the data of a valid
+// "<path>.fasl" are handed over instead, and a fresh one is written after
+// reading if it was missing or stale and the file had no syntax errors.
+// Returns the number of syntax errors plus the errors action returned.
+int loadSource(const char *path, bool useCache, FormAction action, void *context);
+
+#endif
@@ -0,0 +1,673 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "inline.h"
+#include "schemeval.h"
+#include "interpreter.h"
+#include "linkedlist.h"
+#include "talloc.h"
+#include "position.h"
+#include "loop.h"
+
+static bool enabled = true;
+static bool folding = true;
+
+// State of one run of the pass over a top-level form.
+typedef struct {
+    Frame *frame;
+    // every symbol the form set!s anywhere
+    SchemeVal *assigned;
+    SchemeVal *inlineSymbol;
+    SchemeVal *quoteSymbol;
+    // whether calls are inlined and folded; inlined copies are only folded
+    bool inlining;
+    bool folding;
+} InlinePass;
+
+// What a pure primitive accepts as arguments
+typedef enum { ANY_ARGS, NUMBER_ARGS, PAIR_ARGS } ArgKind;
+
+// Primitives without effects, which the pass may call on constant arguments.
+// An argument list they would report an error for is never passed to them.
+static const struct {
+    const char *name;
+    int minArgs;
+    // -1 for any number
+    int maxArgs;
+    ArgKind kind;
+} purePrimitives[] = {
+    {"+", 0, -1, NUMBER_ARGS},
+    {"<", 2, -1, NUMBER_ARGS},
+    {"null?", 1, 1, ANY_ARGS},
+    {"car", 1, 1, PAIR_ARGS},
+    {"cdr", 1, 1, PAIR_ARGS},
+};
+
+void setInliningEnabled(bool enable) {
+    enabled = enable;
+}
+
+bool inliningEnabled() {
+    return enabled;
+}
+
+void setFoldingEnabled(bool enable) {
+    folding = enable;
+}
+
+bool foldingEnabled() {
+    return folding;
+}
+
+/* A new symbol named name */
+static SchemeVal *makeSymbol(char *name) {
+    SchemeVal *symbol = talloc(sizeof(SchemeVal));
+    symbol->type = SYMBOL_TYPE;
+    symbol->s = name;
+    return symbol;
+}
+
+/* Checks if symbol is in the list symbols */
+static bool containsSymbol(SchemeVal *symbols, SchemeVal *symbol) {
+    for (; !isEmpty(symbols); symbols = cdr(symbols)) {
+        if (!strcmp(car(symbols)->s, symbol->s)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Checks if expr is a pair whose first element is the symbol name */
+static bool isForm(SchemeVal *expr, const char *name) {
+    return expr->type == CONS_TYPE && car(expr)->type == SYMBOL_TYPE &&
+           !strcmp(car(expr)->s, name);
+}
+
+/* Number of elements of a proper list, or -1 */
+static int properLength(SchemeVal *list) {
+    int count = 0;
+    for (; list->type == CONS_TYPE; list = cdr(list)) {
+        count++;
+    }
+    return isEmpty(list) ? count : -1;
+}
+
+/* Checks if expr is a number, string or boolean, which evaluate to
+   themselves */
+static bool isLiteral(SchemeVal *expr) {
+    return expr->type == INT_TYPE || expr->type == DOUBLE_TYPE || expr->type == STR_TYPE ||
+           expr->type == BOOL_TYPE;
+}
+
+/* Adds to symbols every symbol that expr, at any depth, assigns with the
+   special form name (set! or define). Quoted data is searched too, which
+   only makes the answer more cautious. */
+static SchemeVal *findTargets(SchemeVal *expr, const char *name, SchemeVal *symbols) {
+    while (expr->type == CONS_TYPE) {
+        if (isForm(expr, name) && cdr(expr)->type == CONS_TYPE &&
+            car(cdr(expr))->type == SYMBOL_TYPE) {
+            symbols = cons(car(cdr(expr)), symbols);
+        }
+        symbols = findTargets(car(expr), name, symbols);
+        expr = cdr(expr);
+    }
+    return symbols;
+}
+
+// A copy of a list made as its elements are rewritten front to back, once
+// the first of them changes; until then nothing is allocated.
+typedef struct {
+    bool changed;
+    SchemeVal *head;
+    SchemeVal *last;
+} ListCopy;
+
+/* Adds element to the end of copy */
+static void appendCopy(ListCopy *copy, SchemeVal *element) {
+    SchemeVal *cell = cons(element, makeEmpty());
+    if (copy->last == NULL) {
+        copy->head = cell;
+    } else {
+        copy->last->cdr = cell;
+    }
+    copy->last = cell;
+}
+
+/* Takes element as the new value of the element of list at part, copying
+   the elements before it the first time one changes */
+static void keepElement(ListCopy *copy, SchemeVal *list, SchemeVal *part, SchemeVal *element) {
+    if (!copy->changed) {
+        if (element == car(part)) {
+            return;
+        }
+        copy->changed = true;
+        for (SchemeVal *before = list; before != part; before = cdr(before)) {
+            appendCopy(copy, car(before));
+        }
+    }
+    appendCopy(copy, element);
+}
+
+/* The copy of list, positioned like it, or list itself if nothing changed */
+static SchemeVal *finishCopy(ListCopy *copy, SchemeVal *list) {
+    if (!copy->changed) {
+        return list;
+    }
+    copyPosition(copy->head, list);
+    return copy->head;
+}
+
+/* list with its element at index at replaced by element */
+static SchemeVal *replaceElement(SchemeVal *list, int at, SchemeVal *element) {
+    ListCopy copy = {false, NULL, NULL};
+    int i = 0;
+    for (SchemeVal *part = list; !isEmpty(part); part = cdr(part), i++) {
+        keepElement(&copy, list, part, i == at ? element : car(part));
+    }
+    return finishCopy(&copy, list);
+}
+
+/* The global binding of symbol, if it is bound directly in frame */
+static SchemeVal *frameBinding(Frame *frame, SchemeVal *symbol) {
+    SchemeVal *bindings = __atomic_load_n(&frame->bindings, __ATOMIC_ACQUIRE);
+    for (; !isEmpty(bindings); bindings = cdr(bindings)) {
+        if (!strcmp(car(car(bindings))->s, symbol->s)) {
+            return car(bindings);
+        }
+    }
+    return NULL;
+}
+
+/* Checks that expr is made only of forms the pass can copy, spending one
+   unit of budget per node */
+static bool isCopyable(SchemeVal *expr, int *budget) {
+    if (--*budget < 0) {
+        return false;
+    }
+    switch (expr->type) {
+        case INT_TYPE:
+        case DOUBLE_TYPE:
+        case STR_TYPE:
+        case BOOL_TYPE:
+        case SYMBOL_TYPE:
+            return true;
+        case CONS_TYPE:
+            break;
+        default:
+            return false;
+    }
+    int count = properLength(expr);
+    SchemeVal *first = car(expr);
+    SchemeVal *rest = cdr(expr);
+    if (count < 0) {
+        return false;
+    }
+    if (isForm(expr, "quote")) {
+        return count == 2;
+    }
+    if (isForm(expr, "#inline")) {
+        // the binding and closure are data, not code
+        return isCopyable(car(cdr(cdr(rest))), budget) &&
+               isCopyable(car(cdr(cdr(cdr(rest)))), budget);
+    }
+    if (isForm(expr, "if")) {
+        if (count != 3 && count != 4) {
+            return false;
+        }
+    } else if (first->type == SYMBOL_TYPE ? isSpecialForm(first) : first->type != CONS_TYPE) {
+        return false;
+    }
+    for (SchemeVal *part = isForm(expr, "if") ? rest : expr; !isEmpty(part); part = cdr(part)) {
+        if (!isCopyable(car(part), budget)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Checks if expr, a copyable expression, uses as a variable any symbol in
+   names other than the parameters params */
+static bool usesAny(SchemeVal *expr, SchemeVal *names, SchemeVal *params) {
+    if (expr->type == SYMBOL_TYPE) {
+        return containsSymbol(names, expr) && !containsSymbol(params, expr);
+    }
+    if (expr->type != CONS_TYPE || isForm(expr, "quote")) {
+        return false;
+    }
+    if (isForm(expr, "#inline")) {
+        SchemeVal *rest = cdr(cdr(cdr(expr)));
+        return usesAny(car(rest), names, params) || usesAny(car(cdr(rest)), names, params);
+    }
+    for (SchemeVal *part = isForm(expr, "if") ? cdr(expr) : expr; !isEmpty(part);
+         part = cdr(part)) {
+        if (usesAny(car(part), names, params)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Checks if the copyable expression expr calls the variable param */
+static bool callsParameter(SchemeVal *expr, SchemeVal *param) {
+    if (expr->type != CONS_TYPE || isForm(expr, "quote")) {
+        return false;
+    }
+    if (isForm(expr, "#inline")) {
+        SchemeVal *rest = cdr(cdr(cdr(expr)));
+        return callsParameter(car(rest), param) || callsParameter(car(cdr(rest)), param);
+    }
+    if (!isForm(expr, "if") && car(expr)->type == SYMBOL_TYPE &&
+        !strcmp(car(expr)->s, param->s)) {
+        return true;
+    }
+    for (SchemeVal *part = isForm(expr, "if") ? cdr(expr) : expr; !isEmpty(part);
+         part = cdr(part)) {
+        if (callsParameter(car(part), param)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* A copy of the copyable expression expr with each parameter in params
+   replaced by its entry in values, where that is not NULL */
+static SchemeVal *substitute(SchemeVal *expr, SchemeVal *params, SchemeVal **values) {
+    if (expr->type == SYMBOL_TYPE) {
+        int i = 0;
+        for (SchemeVal *param = params; !isEmpty(param); param = cdr(param), i++) {
+            if (!strcmp(car(param)->s, expr->s)) {
+                return values[i] != NULL ? values[i] : expr;
+            }
+        }
+        return expr;
+    }
+    if (expr->type != CONS_TYPE || isForm(expr, "quote")) {
+        return expr;
+    }
+    // always a copy, even where nothing is substituted
+    ListCopy copy = {true, NULL, NULL};
+    bool special = isForm(expr, "if") || isForm(expr, "#inline");
+    int i = 0;
+    for (SchemeVal *part = expr; !isEmpty(part); part = cdr(part), i++) {
+        // the head of a special form, and an #inline's binding and closure
+        bool data = special && (i == 0 || (isForm(expr, "#inline") && i < 3));
+        appendCopy(&copy, data ? car(part) : substitute(car(part), params, values));
+    }
+    return finishCopy(&copy, expr);
+}
+
+/* Checks if an argument can be put straight into the body: a constant, or
+   a local variable that nothing assigns, under a name that is not a special
+   form's */
+static bool isSubstitutable(InlinePass *pass, SchemeVal *arg, SchemeVal *scope) {
+    switch (arg->type) {
+        case INT_TYPE:
+        case DOUBLE_TYPE:
+        case STR_TYPE:
+        case BOOL_TYPE:
+            return true;
+        case SYMBOL_TYPE:
+            return containsSymbol(scope, arg) && !containsSymbol(pass->assigned, arg) &&
+                   !isSpecialForm(arg);
+        default:
+            return isForm(arg, "quote") && properLength(arg) == 2;
+    }
+}
+
+static SchemeVal *rewrite(InlinePass *pass, SchemeVal *expr, SchemeVal *scope);
+
+/* The value expr evaluates to if it is a constant, a quote, or an #inline
+   form whose copy is one of these in turn, or NULL. The guards of the
+   #inline forms are added to guards as (binding . value) pairs. */
+static SchemeVal *constantValue(SchemeVal *expr, SchemeVal **guards) {
+    while (isForm(expr, "#inline")) {
+        SchemeVal *args = cdr(expr);
+        *guards = cons(cons(car(args), car(cdr(args))), *guards);
+        expr = car(cdr(cdr(args)));
+    }
+    if (isLiteral(expr)) {
+        return expr;
+    }
+    return isForm(expr, "quote") && properLength(expr) == 2 ? car(cdr(expr)) : NULL;
+}
+
+/* expr guarded by each (binding . value) pair in guards, falling back to
+   original when any binding no longer holds its value */
+static SchemeVal *guarded(InlinePass *pass, SchemeVal *guards, SchemeVal *expr,
+                          SchemeVal *original) {
+    SchemeVal *seen = makeEmpty();
+    for (; !isEmpty(guards); guards = cdr(guards)) {
+        SchemeVal *binding = car(car(guards));
+        bool repeated = false;
+        for (SchemeVal *other = seen; !isEmpty(other); other = cdr(other)) {
+            repeated = repeated || car(other) == binding;
+        }
+        if (repeated) {
+            continue;
+        }
+        seen = cons(binding, seen);
+        expr = cons(pass->inlineSymbol,
+                    cons(binding, cons(cdr(car(guards)),
+                                       cons(expr, cons(original, makeEmpty())))));
+        copyPosition(expr, original);
+    }
+    return expr;
+}
+
+/* The guarded value of call, an application whose operator and arguments
+   have been rewritten already, if it calls a pure primitive on constants,
+   or call itself */
+static SchemeVal *foldCall(InlinePass *pass, SchemeVal *call, SchemeVal *scope) {
+    SchemeVal *op = car(call);
+    if (op->type != SYMBOL_TYPE || containsSymbol(scope, op)) {
+        return call;
+    }
+    SchemeVal *binding = frameBinding(pass->frame, op);
+    if (binding == NULL) {
+        return call;
+    }
+    SchemeVal *primitive = __atomic_load_n(&binding->cdr, __ATOMIC_ACQUIRE);
+    if (primitive->type != PRIMITIVE_TYPE) {
+        return call;
+    }
+    size_t entry = 0;
+    size_t entries = sizeof(purePrimitives) / sizeof(purePrimitives[0]);
+    while (entry < entries && strcmp(purePrimitives[entry].name, primitiveName(primitive->primitive))) {
+        entry++;
+    }
+    int count = properLength(cdr(call));
+    if (entry == entries || count < purePrimitives[entry].minArgs ||
+        (purePrimitives[entry].maxArgs >= 0 && count > purePrimitives[entry].maxArgs)) {
+        return call;
+    }
+
+    SchemeVal *guards = cons(cons(binding, primitive), makeEmpty());
+    SchemeVal *values = makeEmpty();
+    for (SchemeVal *arg = cdr(call); !isEmpty(arg); arg = cdr(arg)) {
+        SchemeVal *value = constantValue(car(arg), &guards);
+        if (value == NULL) {
+            return call;
+        }
+        ArgKind kind = purePrimitives[entry].kind;
+        if ((kind == NUMBER_ARGS && value->type != INT_TYPE && value->type != DOUBLE_TYPE) ||
+            (kind == PAIR_ARGS && value->type != CONS_TYPE)) {
+            return call;
+        }
+        values = cons(value, values);
+    }
+    SchemeVal *result = primitive->pf(reverse(values));
+    if (!isLiteral(result)) {
+        result = cons(pass->quoteSymbol, cons(result, makeEmpty()));
+        copyPosition(result, call);
+    }
+    return guarded(pass, guards, result, call);
+}
+
+/* The branch of an if form, with its parts rewritten already, that its
+   test selects if the test is constant, guarded like the test, or expr */
+static SchemeVal *pruneIf(InlinePass *pass, SchemeVal *expr) {
+    SchemeVal *guards = makeEmpty();
+    SchemeVal *test = constantValue(car(cdr(expr)), &guards);
+    if (test == NULL) {
+        return expr;
+    }
+    SchemeVal *branches = cdr(cdr(expr));
+    if (!(test->type == BOOL_TYPE && !test->b)) {
+        return guarded(pass, guards, car(branches), expr);
+    }
+    // an if without an else is left to report its missing else clause
+    return isEmpty(cdr(branches)) ? expr : guarded(pass, guards, car(cdr(branches)), expr);
+}
+
+/* The guarded inline copy of call, an application whose operator and
+   arguments have been rewritten already, or call if it cannot be inlined */
+static SchemeVal *inlineCall(InlinePass *pass, SchemeVal *call, SchemeVal *scope) {
+    SchemeVal *op = car(call);
+    SchemeVal *args = cdr(call);
+    if (op->type != SYMBOL_TYPE || containsSymbol(scope, op)) {
+        return call;
+    }
+    SchemeVal *binding = frameBinding(pass->frame, op);
+    if (binding == NULL) {
+        return call;
+    }
+    SchemeVal *closure = __atomic_load_n(&binding->cdr, __ATOMIC_ACQUIRE);
+    if (closure->type != CLOSURE_TYPE || closure->frame != pass->frame ||
+        !isEmpty(cdr(closure->functionCode))) {
+        return call;
+    }
+    SchemeVal *params = closure->paramNames;
+    SchemeVal *body = car(closure->functionCode);
+    int budget = INLINE_BUDGET;
+    int count = length(params);
+    if (properLength(args) != count || !isCopyable(body, &budget) ||
+        usesAny(body, cons(op, makeEmpty()), params) || usesAny(body, scope, params)) {
+        return call;
+    }
+
+    // arguments that are not substituted are bound by a let
+    SchemeVal **values = talloc((count > 0 ? count : 1) * sizeof(SchemeVal *));
+    SchemeVal *letNames = makeEmpty();
+    SchemeVal *bindings = makeEmpty();
+    SchemeVal *param = params;
+    for (int i = 0; i < count; i++, param = cdr(param), args = cdr(args)) {
+        SchemeVal *arg = car(args);
+        if (isSubstitutable(pass, arg, scope) &&
+            (arg->type == SYMBOL_TYPE || !callsParameter(body, car(param)))) {
+            values[i] = arg;
+        } else {
+            values[i] = NULL;
+            letNames = cons(car(param), letNames);
+            bindings = cons(cons(car(param), cons(arg, makeEmpty())), bindings);
+        }
+    }
+    // a substituted variable must not be captured by the let
+    for (int i = 0; i < count; i++) {
+        if (values[i] != NULL && values[i]->type == SYMBOL_TYPE &&
+            containsSymbol(letNames, values[i])) {
+            return call;
+        }
+    }
+
+    SchemeVal *copy = substitute(body, params, values);
+    if (pass->folding) {
+        // fold what the substituted constants make constant, but inline
+        // nothing more into the copy
+        SchemeVal *inner = scope;
+        for (; !isEmpty(letNames); letNames = cdr(letNames)) {
+            inner = cons(car(letNames), inner);
+        }
+        pass->inlining = false;
+        copy = rewrite(pass, copy, inner);
+        pass->inlining = true;
+    }
+    if (!isEmpty(bindings)) {
+        copy = cons(makeSymbol("let"), cons(reverse(bindings), cons(copy, makeEmpty())));
+        copyPosition(copy, call);
+    }
+    SchemeVal *guard = cons(pass->inlineSymbol,
+                            cons(binding, cons(closure, cons(copy, cons(call, makeEmpty())))));
+    copyPosition(guard, call);
+    return guard;
+}
+
+/* Adds the symbols in params, a lambda parameter list or a single symbol,
+   to scope */
+static SchemeVal *addParameters(SchemeVal *params, SchemeVal *scope) {
+    if (params->type == SYMBOL_TYPE) {
+        return cons(params, scope);
+    }
+    for (; params->type == CONS_TYPE; params = cdr(params)) {
+        if (car(params)->type == SYMBOL_TYPE) {
+            scope = cons(car(params), scope);
+        }
+    }
+    return scope;
+}
+
+/* Rewrites the elements of list from index from on in scope, returning list
+   itself if none changed */
+static SchemeVal *rewriteElements(InlinePass *pass, SchemeVal *list, int from,
+                                  SchemeVal *scope) {
+    ListCopy copy = {false, NULL, NULL};
+    int i = 0;
+    for (SchemeVal *part = list; !isEmpty(part); part = cdr(part), i++) {
+        keepElement(&copy, list, part, i < from ? car(part) : rewrite(pass, car(part), scope));
+    }
+    return finishCopy(&copy, list);
+}
+
+/* Rewrites a let or letrec form, or a named let, whose bindings are its
+   element at index at: the right-hand sides in initScope and the body in
+   bodyScope */
+static SchemeVal *rewriteLet(InlinePass *pass, SchemeVal *expr, int at, SchemeVal *initScope,
+                             SchemeVal *bodyScope) {
+    SchemeVal *bindings = expr;
+    for (int i = 0; i < at; i++) {
+        bindings = cdr(bindings);
+    }
+    bindings = car(bindings);
+    ListCopy newBindings = {false, NULL, NULL};
+    for (SchemeVal *part = bindings; !isEmpty(part); part = cdr(part)) {
+        keepElement(&newBindings, bindings, part, rewriteElements(pass, car(part), 1, initScope));
+    }
+    SchemeVal *rewritten = rewriteElements(pass, expr, at + 1, bodyScope);
+    return replaceElement(rewritten, at, finishCopy(&newBindings, bindings));
+}
+
+/* Rewrites a well-formed do form: the initial values in scope, and the
+   steps, test clause and commands in the scope of its variables */
+static SchemeVal *rewriteDo(InlinePass *pass, SchemeVal *expr, SchemeVal *scope) {
+    SchemeVal *specs = car(cdr(expr));
+    SchemeVal *inner = findTargets(cdr(cdr(expr)), "define", scope);
+    for (SchemeVal *spec = specs; !isEmpty(spec); spec = cdr(spec)) {
+        inner = cons(car(car(spec)), inner);
+    }
+    ListCopy newSpecs = {false, NULL, NULL};
+    for (SchemeVal *part = specs; !isEmpty(part); part = cdr(part)) {
+        SchemeVal *spec = car(part);
+        SchemeVal *newSpec = replaceElement(spec, 1, rewrite(pass, car(cdr(spec)), scope));
+        if (!isEmpty(cdr(cdr(spec)))) {
+            newSpec = replaceElement(newSpec, 2, rewrite(pass, car(cdr(cdr(spec))), inner));
+        }
+        keepElement(&newSpecs, specs, part, newSpec);
+    }
+    SchemeVal *clause = rewriteElements(pass, car(cdr(cdr(expr))), 0, inner);
+    SchemeVal *rewritten = rewriteElements(pass, expr, 3, inner);
+    rewritten = replaceElement(rewritten, 1, finishCopy(&newSpecs, specs));
+    return replaceElement(rewritten, 2, clause);
+}
+
+/* Checks that bindings is a proper list of (symbol expression) pairs */
+static bool isBindingList(SchemeVal *bindings) {
+    if (properLength(bindings) < 0) {
+        return false;
+    }
+    for (; !isEmpty(bindings); bindings = cdr(bindings)) {
+        SchemeVal *binding = car(bindings);
+        if (properLength(binding) != 2 || car(binding)->type != SYMBOL_TYPE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Rewrites expr, whose enclosing lambdas, lets and letrecs bind the symbols
+   in scope. Malformed forms are left alone for eval to report. */
+static SchemeVal *rewrite(InlinePass *pass, SchemeVal *expr, SchemeVal *scope) {
+    if (expr->type != CONS_TYPE || properLength(expr) < 0) {
+        return expr;
+    }
+    SchemeVal *first = car(expr);
+    int count = properLength(expr);
+    if (first->type == SYMBOL_TYPE && isSpecialForm(first)) {
+        if (isForm(expr, "quote") || isForm(expr, "#inline")) {
+            return expr;
+        }
+        if (isForm(expr, "lambda")) {
+            if (count < 3) {
+                return expr;
+            }
+            // names defined in the body are local too
+            SchemeVal *inner = addParameters(car(cdr(expr)), scope);
+            inner = findTargets(cdr(cdr(expr)), "define", inner);
+            return rewriteElements(pass, expr, 2, inner);
+        }
+        if (isForm(expr, "let") && count >= 4 && car(cdr(expr))->type == SYMBOL_TYPE) {
+            // a named let: its name is bound in the body too
+            SchemeVal *bindings = car(cdr(cdr(expr)));
+            if (!isBindingList(bindings)) {
+                return expr;
+            }
+            SchemeVal *inner = findTargets(cdr(cdr(cdr(expr))), "define", scope);
+            inner = cons(car(cdr(expr)), inner);
+            for (SchemeVal *binding = bindings; !isEmpty(binding); binding = cdr(binding)) {
+                inner = cons(car(car(binding)), inner);
+            }
+            return rewriteLet(pass, expr, 2, scope, inner);
+        }
+        if (isForm(expr, "let") || isForm(expr, "letrec")) {
+            if (count < 3 || !isBindingList(car(cdr(expr)))) {
+                return expr;
+            }
+            SchemeVal *inner = findTargets(cdr(cdr(expr)), "define", scope);
+            for (SchemeVal *binding = car(cdr(expr)); !isEmpty(binding);
+                 binding = cdr(binding)) {
+                inner = cons(car(car(binding)), inner);
+            }
+            return rewriteLet(pass, expr, 1, isForm(expr, "let") ? scope : inner, inner);
+        }
+        if (isForm(expr, "do")) {
+            char buffer[100];
+            if (doError(cdr(expr), buffer, sizeof(buffer)) != NULL) {
+                return expr;
+            }
+            return rewriteDo(pass, expr, scope);
+        }
+        // if, define, set!, future and time evaluate their operands in place
+        SchemeVal *rewritten = rewriteElements(
+            pass, expr, isForm(expr, "define") || isForm(expr, "set!") ? 2 : 1, scope);
+        if (pass->folding && isForm(expr, "if") && (count == 3 || count == 4)) {
+            return pruneIf(pass, rewritten);
+        }
+        return rewritten;
+    }
+    if (first->type != SYMBOL_TYPE && first->type != CONS_TYPE) {
+        return expr;
+    }
+    SchemeVal *call = rewriteElements(pass, expr, 0, scope);
+    if (pass->folding) {
+        SchemeVal *folded = foldCall(pass, call, scope);
+        if (folded != call) {
+            return folded;
+        }
+    }
+    return pass->inlining ? inlineCall(pass, call, scope) : call;
+}
+
+// Inlines the calls in a top-level form and folds its constants
+SchemeVal *inlineCalls(SchemeVal *form, Frame *frame) {
+    if (!enabled && !folding) {
+        return form;
+    }
+    InlinePass pass;
+    pass.frame = frame;
+    pass.assigned = findTargets(form, "set!", makeEmpty());
+    pass.inlineSymbol = makeSymbol("#inline");
+    pass.quoteSymbol = makeSymbol("quote");
+    pass.inlining = enabled;
+    pass.folding = folding;
+    return rewrite(&pass, form, makeEmpty());
+}
+
+// Evaluates the copy while the binding still holds the inlined closure, and
+// the original call otherwise
+SchemeVal *evalInline(SchemeVal *args, Frame *frame) {
+    SchemeVal *binding = car(args);
+    SchemeVal *closure = car(cdr(args));
+    SchemeVal *rest = cdr(cdr(args));
+    if (__atomic_load_n(&binding->cdr, __ATOMIC_ACQUIRE) == closure) {
+        return eval(car(rest), frame);
+    }
+    return eval(car(cdr(rest)), frame);
+}
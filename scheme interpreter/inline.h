@@ -0,0 +1,57 @@
+#include <stdbool.h>
+#include "schemeval.h"
+
+#ifndef _INLINE
+#define _INLINE
+
+// An inlining pass, run on each top-level form just before it is evaluated,
+// once the definitions before it have run. A call (f arg ...) is replaced by
+// a copy of f's body with the arguments put in for the parameters when:
+//   - f is not bound locally around the call, and is defined in the frame
+//     the form runs in, to a closure made in that frame;
+//   - the closure's body is one expression of at most INLINE_BUDGET nodes,
+//     made only of constants, variables, quote, if, applications and calls
+//     inlined into it in turn, so it never assigns anything;
+//   - the body does not refer to f, and none of its other variables are
+//     bound locally around the call;
+//   - the call has as many arguments as f has parameters.
+// Constants, and local variables nothing assigns, are substituted into the
+// body directly; other arguments are bound to the parameters with a let
+// around it, so each is still evaluated once, in order.
+//
+// Since f may still be set! later, the copy is guarded: the call becomes
+// (#inline BINDING CLOSURE COPY CALL), where BINDING is f's binding in the
+// global frame. eval evaluates COPY while the binding still holds CLOSURE
+// and the original CALL otherwise. No program can write #inline, as the
+// tokenizer reads no symbol starting with #.
+//
+// The same pass folds constants. A call of a primitive without effects (+,
+// <, null?, car or cdr) on constant arguments it accepts is replaced by its
+// value, and an if whose test is constant by the branch the test selects.
+// Constants here are literals, quotes, and #inline forms whose copy is a
+// constant, as folding and inlining make them. Each fold is guarded like an
+// inlined call, on the binding of the primitive and on the guards of any
+// #inline form it took a constant from, so rebinding + with set! makes the
+// original call again.
+//
+// The pass does not run under --cek. --no-inline turns off inlining and
+// --no-fold folding.
+
+// Nodes (pairs, symbols and constants) a body may have to be inlined.
+#define INLINE_BUDGET 24
+
+// Both on by default. Call before evaluation starts.
+void setInliningEnabled(bool enabled);
+bool inliningEnabled();
+void setFoldingEnabled(bool enabled);
+bool foldingEnabled();
+
+// Returns form with calls inlined and constants folded, for evaluation in
+// frame; form itself is left unchanged, and returned as is if nothing was
+// rewritten.
+SchemeVal *inlineCalls(SchemeVal *form, Frame *frame);
+
+// Evaluates the arguments of an #inline form.
+SchemeVal *evalInline(SchemeVal *args, Frame *frame);
+
+#endif
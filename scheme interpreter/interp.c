@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include "interp.h"
+#include "schemeval.h"
+#include "talloc.h"
+#include "linkedlist.h"
+#include "tokenizer.h"
+#include "parser.h"
+#include "interpreter.h"
+#include "fasl.h"
+#include "error.h"
+#include "quota.h"
+#include "inline.h"
+#include "closure.h"
+
+struct Interp {
+    Heap heap;
+    Frame *global;
+    // stream being tokenized, closed if an error unwinds out of the tokenizer
+    FILE *input;
+    bool failed;
+    char error[256];
+    // limits on each call, all zero (unlimited) unless set
+    Quota quota;
+};
+
+// Thread state saved while a context is running on the calling thread, so
+// that calls into different contexts can nest on one thread.
+typedef struct {
+    Heap *previousHeap;
+    ErrorHandler handler;
+} InterpCall;
+
+/* Makes interp the running context of this thread. The caller must setjmp on
+   call->handler.env straight after, since errors unwind there. */
+static void enterInterp(Interp *interp, InterpCall *call) {
+    interp->failed = false;
+    interp->error[0] = '\0';
+    call->previousHeap = useHeap(&interp->heap);
+    armQuota(&interp->quota);
+    pushHandler(&call->handler);
+}
+
+/* Restores the thread state saved by enterInterp */
+static void leaveInterp(InterpCall *call) {
+    popHandler(&call->handler);
+    disarmQuota();
+    useHeap(call->previousHeap);
+}
+
+/* Records the error that unwound the current call */
+static void recordError(Interp *interp) {
+    if (interp->input != NULL) {
+        fclose(interp->input);
+        interp->input = NULL;
+    }
+    interp->failed = true;
+
+    char *text = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&text, &size);
+    if (out != NULL) {
+        printCondition(out, lastCondition());
+        fclose(out);
+        // drop the trailing newline of the report
+        if (size > 0 && text[size - 1] == '\n') {
+            text[size - 1] = '\0';
+        }
+        snprintf(interp->error, sizeof(interp->error), "%s", text);
+        free(text);
+    }
+}
+
+/* Tokenizes and parses source; must run inside enterInterp/leaveInterp */
+static SchemeVal *parseSource(Interp *interp, const char *source) {
+    size_t len = strlen(source);
+    if (len == 0) {
+        return makeEmpty();
+    }
+    interp->input = fmemopen((void *)source, len, "r");
+    SchemeVal *forms = parse(tokenizeFile(interp->input));
+    fclose(interp->input);
+    interp->input = NULL;
+    return forms;
+}
+
+// Creates a context with its own heap and global environment.
+// Input: path of a heap image to start from, or NULL for a fresh environment
+// Output: the new context, or NULL if the image could not be loaded
+Interp *interpCreate(const char *imagePath) {
+    Interp *interp = calloc(1, sizeof(Interp));
+    if (interp == NULL) {
+        return NULL;
+    }
+
+    InterpCall call;
+    enterInterp(interp, &call);
+    if (setjmp(call.handler.env) == 0) {
+        interp->global = imagePath != NULL ? loadImage(imagePath) : makeGlobalFrame();
+    }
+    leaveInterp(&call);
+
+    if (interp->global == NULL) {
+        interpDestroy(interp);
+        return NULL;
+    }
+    return interp;
+}
+
+// Frees a context along with everything allocated in its heap.
+void interpDestroy(Interp *interp) {
+    tfreeHeap(&interp->heap);
+    free(interp);
+}
+
+// Parses source into a list of data.
+// Output: the list of forms, or NULL on a syntax error
+SchemeVal *interpRead(Interp *interp, const char *source) {
+    InterpCall call;
+    SchemeVal *volatile forms = NULL;
+    enterInterp(interp, &call);
+    if (setjmp(call.handler.env) == 0) {
+        forms = parseSource(interp, source);
+    } else {
+        recordError(interp);
+    }
+    leaveInterp(&call);
+    return forms;
+}
+
+// Evaluates one datum in the global environment.
+// Output: its value, or NULL on error
+SchemeVal *interpEval(Interp *interp, SchemeVal *datum) {
+    InterpCall call;
+    SchemeVal *volatile result = NULL;
+    enterInterp(interp, &call);
+    if (setjmp(call.handler.env) == 0) {
+        result = eval(flattenClosures(inlineCalls(datum, interp->global)), interp->global);
+    } else {
+        recordError(interp);
+    }
+    leaveInterp(&call);
+    return result;
+}
+
+// Parses and evaluates every form in source.
+// Output: the value of the last form, or NULL on error
+SchemeVal *interpEvalString(Interp *interp, const char *source) {
+    InterpCall call;
+    SchemeVal *volatile result = NULL;
+    enterInterp(interp, &call);
+    if (setjmp(call.handler.env) == 0) {
+        SchemeVal *forms = parseSource(interp, source);
+        SchemeVal *last = makeVoid();
+        while (!isEmpty(forms)) {
+            last = eval(flattenClosures(inlineCalls(car(forms), interp->global)),
+                        interp->global);
+            forms = cdr(forms);
+        }
+        result = last;
+    } else {
+        recordError(interp);
+    }
+    leaveInterp(&call);
+    return result;
+}
+
+// Prints value into a string owned by the context.
+char *interpToString(Interp *interp, SchemeVal *value) {
+    char *buffer = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&buffer, &size);
+    if (out == NULL) {
+        return NULL;
+    }
+    fprintTree(out, value);
+    fclose(out);
+
+    Heap *previous = useHeap(&interp->heap);
+    char *text = talloc(size + 1);
+    useHeap(previous);
+    if (text != NULL) {
+        memcpy(text, buffer, size + 1);
+    }
+    free(buffer);
+    return text;
+}
+
+// Sets the limits each later call on this context runs under.
+void interpSetQuota(Interp *interp, const Quota *quota) {
+    interp->quota = *quota;
+}
+
+// Describes why the last call on this context failed.
+const char *interpError(Interp *interp) {
+    return interp->failed ? interp->error : NULL;
+}
@@ -0,0 +1,55 @@
+#include <stdbool.h>
+#include "schemeval.h"
+#include "quota.h"
+
+#ifndef _INTERP
+#define _INTERP
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// An interpreter context for embedding. A context owns its heap, its global
+// environment and its error state, so independent contexts can be used from
+// different threads at the same time without locking. A single context must
+// only be used by one thread at a time.
+typedef struct Interp Interp;
+
+// Creates a context. If imagePath is not NULL the global environment is
+// restored from a heap image written with --save-image; otherwise it starts
+// with only the primitives bound. Returns NULL if the image cannot be loaded.
+Interp *interpCreate(const char *imagePath);
+
+// Frees a context and every value it allocated.
+void interpDestroy(Interp *interp);
+
+// Parses source, evaluates each form in the global environment, and returns
+// the value of the last one. Returns NULL on error; see interpError.
+SchemeVal *interpEvalString(Interp *interp, const char *source);
+
+// Evaluates a single datum (for example one built with interpRead) in the
+// global environment. Returns NULL on error; see interpError.
+SchemeVal *interpEval(Interp *interp, SchemeVal *datum);
+
+// Parses source into a list of data without evaluating them. Returns NULL on
+// a syntax error.
+SchemeVal *interpRead(Interp *interp, const char *source);
+
+// Prints a value the way the interpreter prints results, into a string that
+// stays valid until the context is destroyed.
+char *interpToString(Interp *interp, SchemeVal *value);
+
+// Limits every later call on this context to the steps, allocated bytes and
+// wall-clock time in quota (zero fields are unlimited). A call that exceeds
+// them returns NULL with an error such as "step limit exceeded".
+void interpSetQuota(Interp *interp, const Quota *quota);
+
+// Describes the error that made the last call return NULL, or NULL if the
+// last call succeeded.
+const char *interpError(Interp *interp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -2,12 +2,28 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <setjmp.h>
 #include "schemeval.h"
 #include "interpreter.h"
 #include "talloc.h"
+#include "error.h"
 #include "linkedlist.h"
 #include "tokenizer.h"
 #include "parser.h"
+#include "threadpool.h"
+#include "coroutine.h"
+#include "cek.h"
+#include "quota.h"
+#include "profiler.h"
+#include "position.h"
+#include "stats.h"
+#include "trace.h"
+#include "compiled.h"
+#include "jit.h"
+#include "inline.h"
+#include "escape.h"
+#include "closure.h"
+#include "loop.h"
 
 
 
@@ -30,8 +46,7 @@ SchemeVal *primitiveAdd(SchemeVal *args) {
     while (!isEmpty(args)) {
         SchemeVal *arg = car(args);
         if (arg->type != INT_TYPE && arg->type != DOUBLE_TYPE) {
-            printf("Evaluation error: + requires numbers\n");
-            texit(1);
+            evalError("+ requires numbers");
         }
         
         if (arg->type == DOUBLE_TYPE) {
@@ -60,8 +75,7 @@ SchemeVal *primitiveAdd(SchemeVal *args) {
 // Output: SchemeVal* - bool_TYPE true if all arguments are in increasing order, false otherwise
 SchemeVal *primitiveLessThan(SchemeVal *args) {
     if (isEmpty(args) || isEmpty(cdr(args))) {
-        printf("Evaluation error: < requires at least 2 arguments\n");
-        texit(1);
+        evalError("< requires at least 2 arguments");
     }
 
     SchemeVal *result = talloc(sizeof(SchemeVal));
@@ -73,16 +87,14 @@ SchemeVal *primitiveLessThan(SchemeVal *args) {
     current = cdr(current);
 
     if (prev->type != INT_TYPE && prev->type != DOUBLE_TYPE) {
-        printf("Evaluation error: < requires numbers\n");
-        texit(1);
+        evalError("< requires numbers");
     }
 
     while (!isEmpty(current)) {
         SchemeVal *next = car(current);
 
         if (next->type != INT_TYPE && next->type != DOUBLE_TYPE) {
-            printf("Evaluation error: < requires numbers\n");
-            texit(1);
+            evalError("< requires numbers");
         }
 
         bool comparison;
@@ -111,8 +123,7 @@ SchemeVal *primitiveLessThan(SchemeVal *args) {
 // Output: SchemeVal* - bool_TYPE true if arg is empty list, false otherwise
 SchemeVal *primitiveNull(SchemeVal *args) {
     if (length(args) != 1) {
-        printf("Evaluation error: null? requires exactly one argument\n");
-        texit(1);
+        evalError("null? requires exactly one argument");
     }
     
     SchemeVal *result = talloc(sizeof(SchemeVal));
@@ -126,14 +137,12 @@ SchemeVal *primitiveNull(SchemeVal *args) {
 // Output: SchemeVal* - first element of the pair
 SchemeVal *primitiveCar(SchemeVal *args) {
     if (length(args) != 1) {
-        printf("Evaluation error: car requires exactly one argument\n");
-        texit(1);
+        evalError("car requires exactly one argument");
     }
     
     SchemeVal *pair = car(args);
     if (pair->type != CONS_TYPE) {
-        printf("Evaluation error: car requires a pair\n");
-        texit(1);
+        evalError("car requires a pair");
     }
     
     return pair->car;
@@ -144,14 +153,12 @@ SchemeVal *primitiveCar(SchemeVal *args) {
 // Output: SchemeVal* - second element of the pair
 SchemeVal *primitiveCdr(SchemeVal *args) {
     if (length(args) != 1) {
-        printf("Evaluation error: cdr requires exactly one argument\n");
-        texit(1);
+        evalError("cdr requires exactly one argument");
     }
     
     SchemeVal *pair = car(args);
     if (pair->type != CONS_TYPE) {
-        printf("Evaluation error: cdr requires a pair\n");
-        texit(1);
+        evalError("cdr requires a pair");
     }
     
     return pair->cdr;
@@ -162,8 +169,7 @@ SchemeVal *primitiveCdr(SchemeVal *args) {
 // output: SchemeVal* - new pair (CONS_TYPE) with car and cdr from args
 SchemeVal *primitiveCons(SchemeVal *args) {
     if (length(args) != 2) {
-        printf("Evaluation error: cons requires exactly two arguments\n");
-        texit(1);
+        evalError("cons requires exactly two arguments");
     }
     
     SchemeVal *pair = talloc(sizeof(SchemeVal));
@@ -178,16 +184,14 @@ SchemeVal *primitiveCons(SchemeVal *args) {
 // Output: SchemeVal* - list of results after applying function to each element
 SchemeVal *primitiveMap(SchemeVal *args) {
     if (length(args) != 2) {
-        printf("Evaluation error: map requires exactly two arguments\n");
-        texit(1);
+        evalError("map requires exactly two arguments");
     }
     
     SchemeVal *func = car(args);
     SchemeVal *lst = car(cdr(args));
     
-    if (func->type != CLOSURE_TYPE && func->type != PRIMITIVE_TYPE) {
-        printf("Evaluation error: first argument to map must be a function\n");
-        texit(1);
+    if (!isProcedure(func)) {
+        evalError("first argument to map must be a function");
     }
     
     SchemeVal *result = makeEmpty();
@@ -195,18 +199,18 @@ SchemeVal *primitiveMap(SchemeVal *args) {
     
     while (!isEmpty(lst)) {
         if (lst->type != CONS_TYPE) {
-            printf("Evaluation error: second argument to map must be a list\n");
-            texit(1);
+            evalError("second argument to map must be a list");
         }
         
         SchemeVal *arg = car(lst);
         SchemeVal *applied;
         
-        if (func->type == CLOSURE_TYPE) {
+        if (func->type != PRIMITIVE_TYPE) {
             SchemeVal *argList = cons(arg, makeEmpty());
             applied = apply(func, argList, func->frame);
         } else {
             SchemeVal *argList = cons(arg, makeEmpty());
+            countPrimitiveCall(func);
             applied = func->pf(argList);
         }
         
@@ -224,6 +228,350 @@ SchemeVal *primitiveMap(SchemeVal *args) {
     return result;
 }
 
+// Lists shorter than this are mapped serially, since waking the workers
+// costs more than applying the function to a handful of elements.
+#define PARALLEL_MIN_ITEMS 64
+// Each worker gets a few chunks, so stealing can even out uneven chunks.
+#define PARALLEL_CHUNKS_PER_WORKER 4
+
+// A slice of the list handed to one pool task. Each chunk allocates from its
+// own heap so workers never contend on the caller's heap.
+typedef struct {
+    Task task;
+    SchemeVal *func;
+    SchemeVal *items;
+    int count;
+    SchemeVal **results;
+    Heap heap;
+    QuotaBudget *budget;
+    bool failed;
+    SchemeVal *condition;
+} MapChunk;
+
+/* Applies the chunk's function to each of its items, catching any error */
+static void runMapChunk(Task *task) {
+    MapChunk *chunk = (MapChunk *)task;
+    Heap *previous = useHeap(&chunk->heap);
+    QuotaBudget *previousBudget = joinQuota(chunk->budget);
+
+    ErrorHandler handler;
+    pushHandler(&handler);
+    if (setjmp(handler.env) == 0) {
+        SchemeVal *items = chunk->items;
+        for (int i = 0; i < chunk->count; i++) {
+            chunk->results[i] = apply(chunk->func, cons(car(items), makeEmpty()), NULL);
+            items = cdr(items);
+        }
+        popHandler(&handler);
+    } else {
+        popHandler(&handler);
+        chunk->failed = true;
+        chunk->condition = lastCondition();
+    }
+    leaveQuota(previousBudget);
+    useHeap(previous);
+}
+
+// Applies a function to every element of a list on the thread pool.
+// Input: SchemeVal* args - function and list, name of the calling primitive,
+//        int* count - set to the length of the list
+// Output: SchemeVal** - array of results, in list order
+SchemeVal **parallelApply(SchemeVal *args, char *name, int *count) {
+    if (length(args) != 2) {
+        evalError("%s requires exactly two arguments", name);
+    }
+
+    SchemeVal *func = car(args);
+    SchemeVal *lst = car(cdr(args));
+    if (!isProcedure(func)) {
+        evalError("first argument to %s must be a function", name);
+    }
+
+    int n = 0;
+    for (SchemeVal *check = lst; !isEmpty(check); check = cdr(check)) {
+        if (check->type != CONS_TYPE) {
+            evalError("second argument to %s must be a list", name);
+        }
+        n++;
+    }
+    *count = n;
+    SchemeVal **results = talloc((n > 0 ? n : 1) * sizeof(SchemeVal *));
+
+    if (n < PARALLEL_MIN_ITEMS || poolSize() == 1) {
+        for (int i = 0; i < n; i++) {
+            results[i] = apply(func, cons(car(lst), makeEmpty()), NULL);
+            lst = cdr(lst);
+        }
+        return results;
+    }
+
+    int chunkCount = poolSize() * PARALLEL_CHUNKS_PER_WORKER;
+    if (chunkCount > n) {
+        chunkCount = n;
+    }
+    MapChunk *chunks = calloc(chunkCount, sizeof(MapChunk));
+    assert(chunks != NULL);
+    atomic_int pending = chunkCount;
+    // the chunks count against the caller's quota
+    QuotaBudget *budget = shareQuota();
+
+    int start = 0;
+    for (int c = 0; c < chunkCount; c++) {
+        int end = (int)((long)n * (c + 1) / chunkCount);
+        chunks[c].task.run = runMapChunk;
+        chunks[c].task.pending = &pending;
+        chunks[c].func = func;
+        chunks[c].items = lst;
+        chunks[c].count = end - start;
+        chunks[c].results = results + start;
+        chunks[c].budget = budget;
+        nestHeap(&chunks[c].heap);
+        for (int i = start; i < end; i++) {
+            lst = cdr(lst);
+        }
+        start = end;
+        poolSubmit(&chunks[c].task);
+    }
+    poolWait(&pending);
+    releaseQuota(budget);
+
+    SchemeVal *condition = NULL;
+    bool failed = false;
+    for (int c = 0; c < chunkCount; c++) {
+        adoptHeap(&chunks[c].heap);
+        if (chunks[c].failed && !failed) {
+            failed = true;
+            condition = chunks[c].condition;
+        }
+    }
+    free(chunks);
+    if (failed) {
+        raiseCondition(condition);
+    }
+    return results;
+}
+
+// parallel-map is map for pure functions: chunks of the list are mapped on
+// the thread pool, and the results come back in list order
+// Input: SchemeVal* args - function and list
+// Output: SchemeVal* - list of results
+SchemeVal *primitiveParallelMap(SchemeVal *args) {
+    int count;
+    SchemeVal **results = parallelApply(args, "parallel-map", &count);
+    SchemeVal *result = makeEmpty();
+    for (int i = count - 1; i >= 0; i--) {
+        result = cons(results[i], result);
+    }
+    return result;
+}
+
+// parallel-for-each applies a pure function to each element on the thread
+// pool for its effect
+// Input: SchemeVal* args - function and list
+// Output: SchemeVal* - void
+SchemeVal *primitiveParallelForEach(SchemeVal *args) {
+    int count;
+    parallelApply(args, "parallel-for-each", &count);
+    return makeVoid();
+}
+
+// The state behind a FUTURE_TYPE value. The expression is evaluated, or the
+// thunk applied, by a pool task that allocates from the future's own heap;
+// that heap is a child of the heap that created the future, so it is freed
+// along with it. The task runs under the quota armed where the future was
+// made, however long after.
+typedef struct {
+    Task task;
+    atomic_int pending;
+    SchemeVal *expr;
+    Frame *frame;
+    SchemeVal *thunk;
+    Heap heap;
+    QuotaBudget *budget;
+    SchemeVal *value;
+    bool failed;
+    SchemeVal *condition;
+} Future;
+
+/* Evaluates a future's expression, or applies its thunk, on whichever
+   thread picked it up */
+static void runFuture(Task *task) {
+    Future *future = (Future *)task;
+    Heap *previous = useHeap(&future->heap);
+    QuotaBudget *previousBudget = joinQuota(future->budget);
+
+    ErrorHandler handler;
+    pushHandler(&handler);
+    if (setjmp(handler.env) == 0) {
+        future->value = future->thunk != NULL ? apply(future->thunk, makeEmpty(), NULL)
+                                              : eval(future->expr, future->frame);
+        popHandler(&handler);
+    } else {
+        popHandler(&handler);
+        future->failed = true;
+        future->condition = lastCondition();
+    }
+    leaveQuota(previousBudget);
+    releaseQuota(future->budget);
+    future->budget = NULL;
+    useHeap(previous);
+    atomic_store(&future->heap.busy, 0);
+}
+
+/* Submits a future that evaluates expr in frame, or applies thunk */
+static SchemeVal *startFuture(SchemeVal *expr, Frame *frame, SchemeVal *thunk) {
+    Future *future = talloc(sizeof(Future));
+    memset(future, 0, sizeof(Future));
+    future->task.run = runFuture;
+    future->task.pending = &future->pending;
+    atomic_store(&future->pending, 1);
+    future->expr = expr;
+    future->frame = frame;
+    future->thunk = thunk;
+    future->budget = shareQuota();
+    atomic_store(&future->heap.busy, 1);
+    attachHeap(&future->heap);
+
+    SchemeVal *result = talloc(sizeof(SchemeVal));
+    result->type = FUTURE_TYPE;
+    result->ptr = future;
+    poolSubmit(&future->task);
+    return result;
+}
+
+// Evaluates a future expression: starts evaluating expr on the thread pool
+// and returns at once.
+// Input: SchemeVal* args (single expression), Frame* frame
+// Output: SchemeVal* - a FUTURE_TYPE value to pass to touch
+SchemeVal *evalFuture(SchemeVal *args, Frame *frame) {
+    if (isEmpty(args) || !isEmpty(cdr(args))) {
+        evalError("future requires one expression");
+    }
+    return startFuture(car(args), frame, NULL);
+}
+
+// Starts applying thunk, a procedure of no arguments, on the thread pool;
+// the future of compiled code.
+SchemeVal *applyFuture(SchemeVal *thunk) {
+    return startFuture(NULL, NULL, thunk);
+}
+
+// touch waits for a future and returns its value; any other value is
+// returned unchanged
+// Input: SchemeVal* args - single argument list
+// Output: SchemeVal* - value of the future's expression (errors it raised
+// are raised again here)
+SchemeVal *primitiveTouch(SchemeVal *args) {
+    if (length(args) != 1) {
+        evalError("touch requires exactly one argument");
+    }
+    SchemeVal *arg = car(args);
+    if (arg->type != FUTURE_TYPE) {
+        return arg;
+    }
+
+    Future *future = arg->ptr;
+    // runs other queued tasks (possibly this future) while waiting
+    poolWait(&future->pending);
+    if (future->failed) {
+        raiseCondition(future->condition);
+    }
+    return future->value;
+}
+
+// error raises an error object built from a message and irritants
+// Input: SchemeVal* args - message (string or symbol) followed by any values
+// Output: does not return
+SchemeVal *primitiveError(SchemeVal *args) {
+    if (isEmpty(args)) {
+        evalError("error requires a message");
+    }
+    raiseCondition(makeErrorObject("Error", car(args), cdr(args)));
+}
+
+// raise raises any value as a condition
+// Input: SchemeVal* args - single value to raise
+// Output: does not return
+SchemeVal *primitiveRaise(SchemeVal *args) {
+    if (length(args) != 1) {
+        evalError("raise requires exactly one argument");
+    }
+    raiseCondition(car(args));
+}
+
+// with-exception-handler calls thunk; if anything is raised while it runs,
+// the stack is unwound back here and handler is called with the raised value.
+// Input: SchemeVal* args - handler procedure of one argument, thunk of none
+// Output: SchemeVal* - value of thunk, or of handler if an error was raised
+SchemeVal *primitiveWithExceptionHandler(SchemeVal *args) {
+    if (length(args) != 2) {
+        evalError("with-exception-handler requires exactly two arguments");
+    }
+
+    SchemeVal *handlerProc = car(args);
+    SchemeVal *thunk = car(cdr(args));
+    if (!isProcedure(handlerProc) || !isProcedure(thunk)) {
+        evalError("with-exception-handler requires two procedures");
+    }
+
+    ErrorHandler handler;
+    SchemeVal *volatile result;
+    pushHandler(&handler);
+    if (setjmp(handler.env) == 0) {
+        result = apply(thunk, makeEmpty(), NULL);
+        popHandler(&handler);
+    } else {
+        // errors raised by the handler itself go to the enclosing handler
+        popHandler(&handler);
+        if (lastCondition()->type == CONTINUATION_TYPE) {
+            // a continuation unwinding the stack, not an error
+            raiseCondition(lastCondition());
+        }
+        result = apply(handlerProc, cons(lastCondition(), makeEmpty()), NULL);
+    }
+    return result;
+}
+
+// error-object? checks if argument was created by error or by the interpreter
+// Input: SchemeVal* args - single argument list
+// Output: SchemeVal* - bool_TYPE true for error objects
+SchemeVal *primitiveIsErrorObject(SchemeVal *args) {
+    if (length(args) != 1) {
+        evalError("error-object? requires exactly one argument");
+    }
+
+    SchemeVal *result = talloc(sizeof(SchemeVal));
+    result->type = BOOL_TYPE;
+    result->b = (car(args)->type == ERROR_TYPE);
+    return result;
+}
+
+// error-object-message returns the message of an error object
+// Input: SchemeVal* args - single error object
+// Output: SchemeVal* - its message
+SchemeVal *primitiveErrorObjectMessage(SchemeVal *args) {
+    if (length(args) != 1 || car(args)->type != ERROR_TYPE) {
+        evalError("error-object-message requires an error object");
+    }
+    return car(args)->message;
+}
+
+// error-object-irritants returns the irritants of an error object
+// Input: SchemeVal* args - single error object
+// Output: SchemeVal* - list of irritants
+SchemeVal *primitiveErrorObjectIrritants(SchemeVal *args) {
+    if (length(args) != 1 || car(args)->type != ERROR_TYPE) {
+        evalError("error-object-irritants requires an error object");
+    }
+    return car(args)->irritants;
+}
+
+// Checks if value can be applied: a closure, primitive or compiled procedure
+bool isProcedure(SchemeVal *value) {
+    return value->type == CLOSURE_TYPE || value->type == PRIMITIVE_TYPE ||
+           value->type == COMPILED_TYPE;
+}
+
 //Creates and returns a VOID_TYPE SchemeVal (used for define expr)
 SchemeVal *makeVoid() {
     SchemeVal *voidVal = talloc(sizeof(SchemeVal));
@@ -255,48 +603,208 @@ SchemeVal *evalEach(SchemeVal *args, Frame *frame) {
     return result;
 }
 
-// Applies a closure to a list of argument values in a new environment.
-// Input: A function (closure), a list of evaluated arguments, and the current frame
-// Output: The result of evaluating the function body in the new frame
-SchemeVal *apply(SchemeVal *function, SchemeVal *args, Frame *frame) {
-    if (function->type == PRIMITIVE_TYPE) {
-        return function->pf(args);
+/* Room on the frame stack (escape.h) for the argument list of a call of
+   function with count arguments, linked up but with no values in it yet,
+   or NULL if the list must be made with talloc. A closure never keeps its
+   argument list, since binding its parameters copies the values out, but
+   other procedures may (error keeps it as its irritants). The list is
+   pushed last before the call, and applyFunction pops it, so the caller
+   can apply the closure as its last act. */
+static SchemeVal *argumentCells(SchemeVal *function, int count) {
+    if (function->type != CLOSURE_TYPE || cekEnabled() || !stackFramesEnabled()) {
+        return NULL;
     }
-    else if (function->type != CLOSURE_TYPE) {
-        printf("Evaluation error: not a procedure\n");
-        texit(1);
+    SchemeVal *cells = pushFrameStack((count + 1) * sizeof(SchemeVal));
+    if (cells != NULL) {
+        for (int i = 0; i < count; i++) {
+            cells[i].type = CONS_TYPE;
+            cells[i].cdr = &cells[i + 1];
+        }
+        cells[count].type = EMPTY_TYPE;
     }
+    return cells;
+}
 
-    Frame *newFrame = talloc(sizeof(Frame));
-    newFrame->parent = function->frame;
-    newFrame->bindings = makeEmpty();
+// Applies function to count already-evaluated argument values, as an
+// application does.
+// Input: SchemeVal* function, SchemeVal** values, int count, Frame* frame
+// Output: the result of the call
+SchemeVal *applyValues(SchemeVal *function, SchemeVal **values, int count, Frame *frame) {
+    SchemeVal *args = argumentCells(function, count);
+    if (args == NULL) {
+        args = makeEmpty();
+        for (int i = count - 1; i >= 0; i--) {
+            args = cons(values[i], args);
+        }
+    } else {
+        for (int i = 0; i < count; i++) {
+            args[i].car = values[i];
+        }
+    }
+    return apply(function, args, frame);
+}
+
+/* Evaluates an application: its operator, then its arguments in order,
+   and applies the one to the others */
+static SchemeVal *evalApplication(SchemeVal *expr, Frame *frame) {
+    SchemeVal *proc = eval(car(expr), frame);
+    SchemeVal *args = argumentCells(proc, length(cdr(expr)));
+    if (args == NULL) {
+        args = evalEach(cdr(expr), frame);
+    } else {
+        SchemeVal *cell = args;
+        for (SchemeVal *arg = cdr(expr); !isEmpty(arg); arg = cdr(arg)) {
+            cell->car = eval(car(arg), frame);
+            cell = cell->cdr;
+        }
+    }
+    return apply(proc, args, frame);
+}
+
+// Adds a binding of var to value to frame. With cells NULL the binding is
+// made with talloc; otherwise it is built in cells[0] and cells[1] on the
+// frame stack.
+void addBinding(Frame *frame, SchemeVal *var, SchemeVal *value, SchemeVal *cells) {
+    if (cells == NULL) {
+        frame->bindings = cons(cons(var, value), frame->bindings);
+        return;
+    }
+    cells[0].type = CONS_TYPE;
+    cells[0].car = var;
+    cells[0].cdr = value;
+    cells[1].type = CONS_TYPE;
+    cells[1].car = &cells[0];
+    cells[1].cdr = frame->bindings;
+    frame->bindings = &cells[1];
+}
+
+// Starts frame with no bindings, using cells[0] as its empty list unless
+// cells is NULL
+void startFrame(Frame *frame, Frame *parent, SchemeVal *cells) {
+    runtimeStats.frames++;
+    frame->parent = parent;
+    if (cells == NULL) {
+        frame->bindings = makeEmpty();
+    } else {
+        runtimeStats.stackFrames++;
+        cells[0].type = EMPTY_TYPE;
+        frame->bindings = &cells[0];
+    }
+}
+
+/* Binds the parameters of function to the values in args in frame. Unless
+   cells is NULL, the frame is built in it, which takes two cells per
+   parameter and one more (see startFrame and addBinding). */
+static void bindParameters(Frame *frame, SchemeVal *function, SchemeVal *args,
+                           SchemeVal *cells) {
+    startFrame(frame, function->frame, cells);
+    if (cells != NULL) {
+        cells++;
+    }
 
     SchemeVal *params = function->paramNames;
     SchemeVal *argVals = args;
 
     while (!isEmpty(params) && !isEmpty(argVals)) {
-        SchemeVal *param = car(params);
-        SchemeVal *argVal = car(argVals);
-
-        SchemeVal *binding = cons(param, argVal);
-        newFrame->bindings = cons(binding, newFrame->bindings);
-
+        addBinding(frame, car(params), car(argVals), cells);
+        if (cells != NULL) {
+            cells += 2;
+        }
         params = cdr(params);
         argVals = cdr(argVals);
     }
 
     if (!isEmpty(params) || !isEmpty(argVals)) {
-        printf("Evaluation error: incorrect number of arguments\n");
-        texit(1);
+        evalError("incorrect number of arguments");
+    }
+}
+
+// Creates the frame a closure's body runs in, binding its parameters to a
+// list of argument values.
+// Input: A function (closure), a list of evaluated arguments
+// Output: The new frame, whose parent is the closure's frame
+Frame *bindArguments(SchemeVal *function, SchemeVal *args) {
+    Frame *newFrame = talloc(sizeof(Frame));
+    bindParameters(newFrame, function, args, NULL);
+    return newFrame;
+}
+
+// Applies a closure to a list of argument values in a new environment. Once
+// the closure's body is hot it runs as machine code from the JIT (jit.h).
+// When nothing in the body can keep the environment, it is made on the
+// frame stack (escape.h).
+// Input: A function (closure), a list of evaluated arguments, and the current frame
+// Output: The result of evaluating the function body in the new frame
+static SchemeVal *applyFunction(SchemeVal *function, SchemeVal *args, Frame *frame) {
+    // the calling frame is unused, but trampolines pass it on
+    (void)frame;
+    if (function->type == PRIMITIVE_TYPE) {
+        countPrimitiveCall(function);
+        return function->pf(args);
+    }
+    else if (function->type == CONTINUATION_TYPE) {
+        throwToContinuation(function, args);
+    }
+    else if (function->type == COMPILED_TYPE) {
+        return applyCompiled(function, args);
+    }
+    else if (function->type != CLOSURE_TYPE) {
+        evalError("not a procedure");
+    }
+    if (cekEnabled()) {
+        return applyCek(function, args);
+    }
+    useFuel();
+    runtimeStats.closureCalls++;
+
+    // pops the argument list too if the caller pushed it (argumentCells)
+    char *mark = onFrameStack(args) ? (char *)args : markFrameStack();
+    Frame *newFrame = NULL;
+    if (!frameEscapes(function->functionCode)) {
+        size_t cells = 2 * length(function->paramNames) + 1;
+        newFrame = pushFrameStack(sizeof(Frame) + cells * sizeof(SchemeVal));
+        if (newFrame != NULL) {
+            bindParameters(newFrame, function, args, (SchemeVal *)(newFrame + 1));
+        }
+    }
+    if (newFrame == NULL) {
+        newFrame = bindArguments(function, args);
     }
 
     SchemeVal *result = NULL;
-    SchemeVal *body = function->functionCode;
-    while (!isEmpty(body)) {
-        result = eval(car(body), newFrame);
-        body = cdr(body);
+    JitCode code = jitEnabled() ? jitCode(function) : NULL;
+    if (code != NULL && mark == frameStack.top) {
+        // nothing to pop, so the code can take over this call
+        return code(newFrame, args);
+    } else if (code != NULL) {
+        result = code(newFrame, args);
+    } else {
+        for (SchemeVal *body = function->functionCode; !isEmpty(body); body = cdr(body)) {
+            result = eval(car(body), newFrame);
+        }
     }
+    popFrameStack(mark);
+    return result;
+}
 
+// Calls a closure or primitive with a list of already-evaluated arguments,
+// on the profiler's shadow stack while it runs, and through the closure's
+// perf trampoline with the perf map on.
+SchemeVal *apply(SchemeVal *function, SchemeVal *args, Frame *frame) {
+    TRACE_CALL(function);
+    SchemeVal *result;
+    if (profilingEnabled) {
+        ProfileFrame entry;
+        enterProfile(&entry, function);
+        Trampoline trampoline = perfMapEnabled && function->type == CLOSURE_TYPE
+                                ? perfTrampoline(function) : NULL;
+        result = trampoline != NULL ? trampoline(function, args, frame, applyFunction)
+                                    : applyFunction(function, args, frame);
+        leaveProfile(&entry);
+    } else {
+        result = applyFunction(function, args, frame);
+    }
+    TRACE_RETURN(function);
     return result;
 }
 
@@ -305,8 +813,7 @@ SchemeVal *apply(SchemeVal *function, SchemeVal *args, Frame *frame) {
 // output: A SchemeVal representing a closure
 SchemeVal *evalLambda(SchemeVal *args, Frame *frame) {
     if (isEmpty(args) || isEmpty(cdr(args))) {
-        printf("Evaluation error: lambda needs parameters and body\n");
-        texit(1);
+        evalError("lambda needs parameters and body");
     }
 
     SchemeVal *params = car(args);
@@ -320,15 +827,13 @@ SchemeVal *evalLambda(SchemeVal *args, Frame *frame) {
         SchemeVal *seen = makeEmpty();
         while (!isEmpty(temp)) {
             if (temp->type != CONS_TYPE || car(temp)->type != SYMBOL_TYPE) {
-                printf("Evaluation error: lambda parameters must be symbols\n");
-                texit(1);
+                evalError("lambda parameters must be symbols");
             }
             
             SchemeVal *check = seen;
             while (!isEmpty(check)) {
                 if (!strcmp(car(temp)->s, car(check)->s)) {
-                    printf("Evaluation error: duplicate parameter %s\n", car(temp)->s);
-                    texit(1);
+                    evalError("duplicate parameter %s", car(temp)->s);
                 }
                 check = cdr(check);
             }
@@ -346,29 +851,35 @@ SchemeVal *evalLambda(SchemeVal *args, Frame *frame) {
     return closure;
 }
 
+// Reads the bindings list of a frame. define publishes new bindings with a
+// release store, so this acquire load sees them fully built even when they
+// were added by a future on another thread.
+static SchemeVal *loadBindings(Frame *frame) {
+    return __atomic_load_n(&frame->bindings, __ATOMIC_ACQUIRE);
+}
+
 // Looks up the value of a symbol in the environment
 // Input: A SchemeVal symbol and the current frame
 // Output: The SchemeVal bound to the symbol, or an error if unbound
 SchemeVal *lookUpSymbol(SchemeVal *symbol, Frame *frame) {
+    runtimeStats.lookups++;
     Frame *curr = frame;
     while (curr != NULL) {
-        SchemeVal *bindings = curr->bindings;
+        runtimeStats.framesWalked++;
+        SchemeVal *bindings = loadBindings(curr);
         while (!isEmpty(bindings)) {
             SchemeVal *pair = car(bindings);
             SchemeVal *key = car(pair);
-            SchemeVal *value = cdr(pair);
 
             if (!strcmp(symbol->s, key->s)) {
-                return value;
+                return __atomic_load_n(&pair->cdr, __ATOMIC_ACQUIRE);
             }
             bindings = cdr(bindings);
         }
         curr = curr->parent;
     }
 
-    printf("Evaluation error: unbound variable %s\n", symbol->s);
-    texit(1);
-    return NULL;
+    evalErrorAt(symbol, "unbound variable %s", symbol->s);
 }
 
 // Evaluates an if expression.
@@ -383,8 +894,7 @@ SchemeVal *evalIf(SchemeVal *args, Frame *frame) {
     }
 
     if (count != 2 && count != 3) {
-        printf("Evaluation error: if requires 2 or 3 expressions\n");
-        texit(1);
+        evalError("if requires 2 or 3 expressions");
     }
 
     SchemeVal *testExpr = car(args);
@@ -398,74 +908,83 @@ SchemeVal *evalIf(SchemeVal *args, Frame *frame) {
         return eval(trueExpr, frame);
     } else {
         if (falseExpr == NULL) {
-            printf("Evaluation error: missing else clause\n");
-            texit(1);
+            evalError("missing else clause");
         }
         return eval(falseExpr, frame);
     }
 }
 
-// Evaluates a let expression.
-// Input: SchemeVal* args (bindings and body), Frame* parent
-// Output: result of evaluating the body
-SchemeVal *evalLet(SchemeVal *args, Frame *parent) {
-    if (isEmpty(args)) {
-        printf("Evaluation error: let needs bindings and body\n");
-        texit(1);
-    }
-
-    SchemeVal *bindings = car(args);
-    SchemeVal *body = cdr(args);
-
+// Checks the bindings list of a let or letrec: each binding must be a
+// (symbol expression) pair, and no symbol may be bound twice.
+// Input: SchemeVal* bindings
+void checkBindings(SchemeVal *bindings) {
     if (bindings->type != CONS_TYPE && bindings->type != EMPTY_TYPE) {
-        printf("Evaluation error: malformed bindings\n");
-        texit(1);
+        evalError("malformed bindings");
     }
 
-    Frame *newFrame = talloc(sizeof(Frame));
-    newFrame->parent = parent;
-    newFrame->bindings = makeEmpty();
-
     SchemeVal *seenBindings = makeEmpty();
     SchemeVal *current = bindings;
     while (!isEmpty(current)) {
         SchemeVal *binding = car(current);
         if (binding->type != CONS_TYPE || isEmpty(cdr(binding)) || !isEmpty(cdr(cdr(binding)))) {
-            printf("Evaluation error: invalid binding form\n");
-            texit(1);
+            evalError("invalid binding form");
         }
 
         SchemeVal *var = car(binding);
         if (var->type != SYMBOL_TYPE) {
-            printf("Evaluation error: binding name must be a symbol\n");
-            texit(1);
+            evalError("binding name must be a symbol");
         }
 
         SchemeVal *check = seenBindings;
         while (!isEmpty(check)) {
             if (!strcmp(car(check)->s, var->s)) {
-                printf("Evaluation error: duplicate binding '%s'\n", var->s);
-                texit(1);
+                evalError("duplicate binding '%s'", var->s);
             }
             check = cdr(check);
         }
         seenBindings = cons(var, seenBindings);
         current = cdr(current);
     }
+}
 
-    current = bindings;
-    while (!isEmpty(current)) {
+// Evaluates a let expression.
+// Input: SchemeVal* args (bindings and body), Frame* parent
+// Output: result of evaluating the body
+SchemeVal *evalLet(SchemeVal *args, Frame *parent) {
+    if (isEmpty(args)) {
+        evalError("let needs bindings and body");
+    }
+
+    SchemeVal *bindings = car(args);
+    SchemeVal *body = cdr(args);
+    checkBindings(bindings);
+
+    // a frame nothing in the body can keep is made on the frame stack
+    char *mark = markFrameStack();
+    Frame *newFrame = NULL;
+    SchemeVal *cells = NULL;
+    if (!frameEscapes(body)) {
+        size_t count = 2 * length(bindings) + 1;
+        newFrame = pushFrameStack(sizeof(Frame) + count * sizeof(SchemeVal));
+        cells = newFrame != NULL ? (SchemeVal *)(newFrame + 1) : NULL;
+    }
+    if (newFrame == NULL) {
+        newFrame = talloc(sizeof(Frame));
+    }
+    startFrame(newFrame, parent, cells);
+
+    SchemeVal *current = bindings;
+    for (int i = 0; !isEmpty(current); i++) {
         SchemeVal *binding = car(current);
         SchemeVal *var = car(binding);
         SchemeVal *valExpr = car(cdr(binding));
         SchemeVal *val = eval(valExpr, parent);
-        newFrame->bindings = cons(cons(var, val), newFrame->bindings);
+        addBinding(newFrame, var, val, cells != NULL ? &cells[2 * i + 1] : NULL);
         current = cdr(current);
     }
 
     if (isEmpty(body)) {
-        printf("Evaluation error: let body missing\n");
-        texit(1);
+        evalError("let body missing");
     }
 
     SchemeVal *result = NULL;
@@ -475,97 +994,57 @@ SchemeVal *evalLet(SchemeVal *args, Frame *parent) {
         currExpr = cdr(currExpr);
     }
 
+    popFrameStack(mark);
     return result;
 }
 
-// Evaluates a letrec expression.
-// Input: SchemeVal* args (bindings and body), Frame* parent
-// Output: result of evaluating the body
-SchemeVal *evalLetrec(SchemeVal *args, Frame *parent) {
-    if (isEmpty(args)) {
-        printf("Evaluation error: letrec needs bindings and body\n");
-        texit(1);
-    }
-
-    SchemeVal *bindings = car(args);
-    SchemeVal *body = cdr(args);
-
-    if (bindings->type != CONS_TYPE && bindings->type != EMPTY_TYPE) {
-        printf("Evaluation error: malformed bindings\n");
-        texit(1);
-    }
-
+// Creates the frame of a letrec, with every variable bound but unspecified.
+// Input: SchemeVal* bindings (already checked), Frame* parent
+// Output: the new frame
+Frame *makeLetrecFrame(SchemeVal *bindings, Frame *parent) {
+    runtimeStats.frames++;
     Frame *newFrame = talloc(sizeof(Frame));
     newFrame->parent = parent;
     newFrame->bindings = makeEmpty();
 
-    // create all bindings as unspecified
     SchemeVal *current = bindings;
     while (!isEmpty(current)) {
-        SchemeVal *binding = car(current);
-        if (binding->type != CONS_TYPE || isEmpty(cdr(binding)) || !isEmpty(cdr(cdr(binding)))) {
-            printf("Evaluation error: invalid binding form\n");
-            texit(1);
-        }
-
-        SchemeVal *var = car(binding);
-        if (var->type != SYMBOL_TYPE) {
-            printf("Evaluation error: binding name must be a symbol\n");
-            texit(1);
-        }
-
-        // Check for duplicate bindings
-        SchemeVal *existing = newFrame->bindings;
-        while (!isEmpty(existing)) {
-            SchemeVal *pair = car(existing);
-            if (!strcmp(var->s, car(pair)->s)) {
-                printf("Evaluation error: duplicate binding '%s'\n", var->s);
-                texit(1);
-            }
-            existing = cdr(existing);
-        }
-
+        SchemeVal *var = car(car(current));
         SchemeVal *unspecified = talloc(sizeof(SchemeVal));
         unspecified->type = UNSPECIFIED_TYPE;
         newFrame->bindings = cons(cons(var, unspecified), newFrame->bindings);
         current = cdr(current);
     }
+    return newFrame;
+}
 
-    // evaluate all right-hand sides first (without assigning)
-    SchemeVal *values = makeEmpty();
-    current = bindings;
-    while (!isEmpty(current)) {
-        SchemeVal *binding = car(current);
-        SchemeVal *valExpr = car(cdr(binding));
-        SchemeVal *val = eval(valExpr, newFrame);
-        values = cons(val, values);
-        current = cdr(current);
-    }
-    values = reverse(values);
-
+// Assigns the evaluated right-hand sides of a letrec to its variables.
+// Input: SchemeVal* bindings, SchemeVal* values (in binding order), Frame* frame
+// from makeLetrecFrame
+void assignLetrec(SchemeVal *bindings, SchemeVal *values, Frame *frame) {
     // check for circular references
-    current = values;
+    SchemeVal *current = values;
     while (!isEmpty(current)) {
         if (car(current)->type == UNSPECIFIED_TYPE) {
-            printf("Evaluation error: circular reference in letrec\n");
-            texit(1);
+            evalError("circular reference in letrec");
         }
         current = cdr(current);
     }
 
-    // assign all the values
     current = bindings;
     SchemeVal *vals = values;
     while (!isEmpty(current) && !isEmpty(vals)) {
-        SchemeVal *binding = car(current);
-        SchemeVal *var = car(binding);
-        
-        // Update the binding
-        SchemeVal *bindingsList = newFrame->bindings;
+        SchemeVal *var = car(car(current));
+
+        SchemeVal *bindingsList = frame->bindings;
         while (!isEmpty(bindingsList)) {
             SchemeVal *pair = car(bindingsList);
             if (!strcmp(var->s, car(pair)->s)) {
                 pair->cdr = car(vals);
+                if (profilingEnabled && car(vals)->type == CLOSURE_TYPE) {
+                    nameClosure(car(vals), var->s);
+                }
+                TRACE_NAME(car(vals), var->s);
                 break;
             }
             bindingsList = cdr(bindingsList);
@@ -573,11 +1052,36 @@ SchemeVal *evalLetrec(SchemeVal *args, Frame *parent) {
         current = cdr(current);
         vals = cdr(vals);
     }
+}
+
+// Evaluates a letrec expression.
+// Input: SchemeVal* args (bindings and body), Frame* parent
+// Output: result of evaluating the body
+SchemeVal *evalLetrec(SchemeVal *args, Frame *parent) {
+    if (isEmpty(args)) {
+        evalError("letrec needs bindings and body");
+    }
+
+    SchemeVal *bindings = car(args);
+    SchemeVal *body = cdr(args);
+    checkBindings(bindings);
+    Frame *newFrame = makeLetrecFrame(bindings, parent);
+
+    // evaluate all right-hand sides first (without assigning)
+    SchemeVal *values = makeEmpty();
+    SchemeVal *current = bindings;
+    while (!isEmpty(current)) {
+        SchemeVal *binding = car(current);
+        SchemeVal *valExpr = car(cdr(binding));
+        SchemeVal *val = eval(valExpr, newFrame);
+        values = cons(val, values);
+        current = cdr(current);
+    }
+    assignLetrec(bindings, reverse(values), newFrame);
 
     // Evaluate body
     if (isEmpty(body)) {
-        printf("Evaluation error: letrec body missing\n");
-        texit(1);
+        evalError("letrec body missing");
     }
 
     SchemeVal *result = NULL;
@@ -590,55 +1094,157 @@ SchemeVal *evalLetrec(SchemeVal *args, Frame *parent) {
     return result;
 }
 
-// Evaluates a set! expression.
-// Input: SchemeVal* args (variable and value), Frame* frame
-// Output: SchemeVal* - void value if successful, or error if variable not found
-SchemeVal *evalSet(SchemeVal *args, Frame *frame) {
+// Checks the form of a set! expression.
+// Input: SchemeVal* args (variable and value)
+// Output: SchemeVal* - the variable
+SchemeVal *checkSet(SchemeVal *args) {
     if (isEmpty(args) || isEmpty(cdr(args)) || !isEmpty(cdr(cdr(args)))) {
-        printf("Evaluation error: set! requires exactly 2 arguments\n");
-        texit(1);
+        evalError("set! requires exactly 2 arguments");
     }
 
     SchemeVal *var = car(args);
     if (var->type != SYMBOL_TYPE) {
-        printf("Evaluation error: set! variable must be a symbol\n");
-        texit(1);
+        evalError("set! variable must be a symbol");
     }
+    return var;
+}
 
-    SchemeVal *valExpr = car(cdr(args));
-    SchemeVal *value = eval(valExpr, frame);
-
+// Stores value in the innermost binding of var visible from frame.
+// Input: SchemeVal* var, SchemeVal* value, Frame* frame
+// Output: error if variable not found
+void setVariable(SchemeVal *var, SchemeVal *value, Frame *frame) {
     Frame *curr = frame;
     while (curr != NULL) {
-        SchemeVal *bindings = curr->bindings;
+        SchemeVal *bindings = loadBindings(curr);
         while (!isEmpty(bindings)) {
             SchemeVal *pair = car(bindings);
             if (!strcmp(var->s, car(pair)->s)) {
-                pair->cdr = value;
-                return makeVoid();
+                // release, so a future reading the variable sees the value whole
+                __atomic_store_n(&pair->cdr, value, __ATOMIC_RELEASE);
+                return;
             }
             bindings = cdr(bindings);
         }
         curr = curr->parent;
     }
 
-    printf("Evaluation error: unbound variable %s\n", var->s);
-    texit(1);
-    return NULL;
+    evalErrorAt(var, "unbound variable %s", var->s);
+}
+
+// Evaluates a set! expression.
+// Input: SchemeVal* args (variable and value), Frame* frame
+// Output: SchemeVal* - void value if successful, or error if variable not found
+SchemeVal *evalSet(SchemeVal *args, Frame *frame) {
+    SchemeVal *var = checkSet(args);
+    setVariable(var, eval(car(cdr(args)), frame), frame);
+    return makeVoid();
+}
+
+/* Checks that var is not already bound directly in the bindings list */
+static void checkNotDefined(SchemeVal *var, SchemeVal *bindings) {
+    while (!isEmpty(bindings)) {
+        SchemeVal *pair = car(bindings);
+        if (!strcmp(var->s, car(pair)->s)) {
+            evalError("%s already defined", var->s);
+        }
+        bindings = cdr(bindings);
+    }
+}
+
+// Checks the form of a define expression, and that its variable is not
+// already defined in frame.
+// Input: SchemeVal* args (variable and value), Frame* frame
+// Output: SchemeVal* - the variable
+SchemeVal *checkDefine(SchemeVal *args, Frame *frame) {
+    if (isEmpty(args) || isEmpty(cdr(args)) || !isEmpty(cdr(cdr(args)))) {
+        evalError("define requires exactly 2 arguments");
+    }
+
+    SchemeVal *var = car(args);
+    if (var->type != SYMBOL_TYPE) {
+        evalError("define variable must be a symbol");
+    }
+    checkNotDefined(var, loadBindings(frame));
+    return var;
+}
+
+// Adds a binding of var to value to frame.
+// Input: SchemeVal* var, SchemeVal* value, Frame* frame
+// Output: error if var was defined in frame meanwhile
+void defineVariable(SchemeVal *var, SchemeVal *value, Frame *frame) {
+    // Publish the new binding with a compare-and-swap, so futures defining
+    // into the same frame neither lose bindings nor see half-built ones.
+    if (profilingEnabled && value->type == CLOSURE_TYPE) {
+        nameClosure(value, var->s);
+    }
+    TRACE_NAME(value, var->s);
+    SchemeVal *head = loadBindings(frame);
+    SchemeVal *cell = cons(cons(var, value), head);
+    while (!__atomic_compare_exchange_n(&frame->bindings, &head, cell, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+        checkNotDefined(var, head);
+        cell->cdr = head;
+    }
+}
+
+// Evaluates a define expression.
+// Input: SchemeVal* args (variable and value), Frame* frame
+// Output: SchemeVal* - void value, or error if already defined in frame
+SchemeVal *evalDefine(SchemeVal *args, Frame *frame) {
+    SchemeVal *var = checkDefine(args, frame);
+    defineVariable(var, eval(car(cdr(args)), frame), frame);
+    return makeVoid();
+}
+
+// Evaluates a time expression: evaluates its expression, prints the time,
+// allocation and steps it took, and returns its value.
+// Input: SchemeVal* args (one expression), Frame* frame
+// Output: the value of the expression
+SchemeVal *evalTime(SchemeVal *args, Frame *frame) {
+    if (isEmpty(args) || !isEmpty(cdr(args))) {
+        evalError("time requires one expression");
+    }
+    StatsMark start;
+    markStats(&start);
+    SchemeVal *result = eval(car(args), frame);
+    fflush(stdout);
+    printStatsSince(stdout, &start);
+    return result;
+}
+
+// The symbols eval treats as special forms rather than applications; keep
+// in step with the dispatch in eval below.
+static const char *specialForms[] = {
+    "if", "let", "letrec", "define", "set!", "lambda", "future", "quote", "time", "#inline",
+    "#closure", "do",
+};
+
+// Checks if symbol names a special form
+bool isSpecialForm(SchemeVal *symbol) {
+    for (size_t i = 0; i < sizeof(specialForms) / sizeof(specialForms[0]); i++) {
+        if (!strcmp(symbol->s, specialForms[i])) {
+            return true;
+        }
+    }
+    return false;
 }
 
 // Evaluates a Scheme expression in the given frame.
 // Input: SchemeVal* expr (expression), Frame* frame (context)
 // Output: SchemeVal* (evaluated result)
 SchemeVal *eval(SchemeVal *expr, Frame *frame) {
+    useFuel();
+    TRACE_EVAL(expr);
     switch (expr->type) {
         case INT_TYPE:
         case DOUBLE_TYPE:
         case STR_TYPE:
         case BOOL_TYPE:
+            countEval(EVAL_CONSTANT);
             return expr;
 
         case SYMBOL_TYPE:
+            countEval(EVAL_VARIABLE);
             return lookUpSymbol(expr, frame);
 
         case CONS_TYPE: {
@@ -646,109 +1252,214 @@ SchemeVal *eval(SchemeVal *expr, Frame *frame) {
             SchemeVal *args = cdr(expr);
 
             if (first->type == CONS_TYPE) {
-                SchemeVal *proc = eval(first, frame);
-                SchemeVal *evalledArgs = evalEach(args, frame);
-                return apply(proc, evalledArgs, frame);
+                countEval(EVAL_APPLICATION);
+                return evalApplication(expr, frame);
             }
             else if (first->type != SYMBOL_TYPE) {
-                printf("Evaluation error: bad form\n");
-                texit(1);
+                evalError("bad form");
             }
 
             if (!strcmp(first->s, "if")) {
+                countEval(EVAL_IF);
                 return evalIf(args, frame);
             } 
             else if (!strcmp(first->s, "let")) {
+                countEval(EVAL_LET);
+                if (args->type == CONS_TYPE && car(args)->type == SYMBOL_TYPE) {
+                    return evalNamedLet(args, frame);
+                }
                 return evalLet(args, frame);
             }
             else if (!strcmp(first->s, "letrec")) {
+                countEval(EVAL_LETREC);
                 return evalLetrec(args, frame);
             }
             else if (!strcmp(first->s, "define")) {
-                if (isEmpty(args) || isEmpty(cdr(args)) || !isEmpty(cdr(cdr(args)))) {
-                    printf("Evaluation error: define requires exactly 2 arguments\n");
-                    texit(1);
-                }
-
-                SchemeVal *var = car(args);
-                if (var->type != SYMBOL_TYPE) {
-                    printf("Evaluation error: define variable must be a symbol\n");
-                    texit(1);
-                }
-
-                SchemeVal *bindings = frame->bindings;
-                while (!isEmpty(bindings)) {
-                    SchemeVal *pair = car(bindings);
-                    if (!strcmp(var->s, car(pair)->s)) {
-                        printf("Evaluation error: %s already defined\n", var->s);
-                        texit(1);
-                    }
-                    bindings = cdr(bindings);
-                }
-
-                SchemeVal *value = eval(car(cdr(args)), frame);
-                frame->bindings = cons(cons(var, value), frame->bindings);
-                return makeVoid();
+                countEval(EVAL_DEFINE);
+                return evalDefine(args, frame);
             }
             else if (!strcmp(first->s, "set!")) {
+                countEval(EVAL_SET);
                 return evalSet(args, frame);
             }
             else if (!strcmp(first->s, "lambda")) {
+                countEval(EVAL_LAMBDA);
                 return evalLambda(args, frame);
             }
+            else if (!strcmp(first->s, "future")) {
+                countEval(EVAL_FUTURE);
+                return evalFuture(args, frame);
+            }
+            else if (!strcmp(first->s, "time")) {
+                countEval(EVAL_TIME);
+                return evalTime(args, frame);
+            }
             else if (!strcmp(first->s, "quote")) {
+                countEval(EVAL_QUOTE);
                 if (isEmpty(args) || !isEmpty(cdr(args))) {
-                    printf("Evaluation error: quote requires one expression\n");
-                    texit(1);
+                    evalError("quote requires one expression");
                 }
                 return car(args);
             }
+            else if (!strcmp(first->s, "#inline")) {
+                countEval(EVAL_INLINE);
+                return evalInline(args, frame);
+            }
+            else if (!strcmp(first->s, "#closure")) {
+                countEval(EVAL_LAMBDA);
+                return evalClosure(args, frame);
+            }
+            else if (!strcmp(first->s, "do")) {
+                countEval(EVAL_DO);
+                return evalDo(args, frame);
+            }
             else {
-                SchemeVal *proc = eval(first, frame);
-                SchemeVal *evalledArgs = evalEach(args, frame);
-                return apply(proc, evalledArgs, frame);
+                countEval(EVAL_APPLICATION);
+                return evalApplication(expr, frame);
             }
         }
 
         default:
-            printf("Evaluation error: unsupported expression type\n");
-            texit(1);
-            return NULL;
+            evalError("unsupported expression type");
     }
 }
 
 // Binds a primitive function to a name in a frame
-void bind(char *name, SchemeVal *(*function)(SchemeVal *), Frame *frame) {
+static void bind(int index, Frame *frame) {
     SchemeVal *value = talloc(sizeof(SchemeVal));
     value->type = PRIMITIVE_TYPE;
-    value->pf = function;
+    value->pf = primitiveFunction(index);
+    value->primitive = index;
     
     SchemeVal *symbol = talloc(sizeof(SchemeVal));
     symbol->type = SYMBOL_TYPE;
-    symbol->s = name;
+    symbol->s = primitiveName(index);
     
     frame->bindings = cons(cons(symbol, value), frame->bindings);
 }
 
-// Interprets a list of Scheme expressions and prints results.
-// Input: SchemeVal* tree (list of expressions)
-void interpret(SchemeVal *tree) {
+// Every primitive bound in the global frame, in binding order. Heap images
+// refer to primitives by their index in this table.
+static const struct {
+    char *name;
+    SchemeVal *(*function)(SchemeVal *);
+} primitives[] = {
+    {"+", primitiveAdd},
+    {"<", primitiveLessThan},
+    {"null?", primitiveNull},
+    {"car", primitiveCar},
+    {"cdr", primitiveCdr},
+    {"cons", primitiveCons},
+    {"map", primitiveMap},
+    {"parallel-map", primitiveParallelMap},
+    {"parallel-for-each", primitiveParallelForEach},
+    {"touch", primitiveTouch},
+    {"spawn", primitiveSpawn},
+    {"yield", primitiveYield},
+    {"join", primitiveJoin},
+    {"make-channel", primitiveMakeChannel},
+    {"channel-send", primitiveChannelSend},
+    {"channel-recv", primitiveChannelRecv},
+    {"call/cc", primitiveCallCC},
+    {"call-with-current-continuation", primitiveCallCC},
+    {"error", primitiveError},
+    {"raise", primitiveRaise},
+    {"with-exception-handler", primitiveWithExceptionHandler},
+    {"error-object?", primitiveIsErrorObject},
+    {"error-object-message", primitiveErrorObjectMessage},
+    {"error-object-irritants", primitiveErrorObjectIrritants},
+    {"heap-report", primitiveHeapReport},
+    {"runtime-stats", primitiveRuntimeStats},
+};
+
+_Static_assert(sizeof(primitives) / sizeof(primitives[0]) <= MAX_PRIMITIVES,
+               "raise MAX_PRIMITIVES in stats.h");
+
+// Number of entries in the primitive table
+int primitiveCount() {
+    return sizeof(primitives) / sizeof(primitives[0]);
+}
+
+// Name of the primitive at index in the primitive table
+char *primitiveName(int index) {
+    assert(index >= 0 && index < primitiveCount());
+    return primitives[index].name;
+}
+
+// Function of the primitive at index in the primitive table
+SchemeVal *(*primitiveFunction(int index))(SchemeVal *) {
+    assert(index >= 0 && index < primitiveCount());
+    return primitives[index].function;
+}
+
+// Index of function in the primitive table, or -1 if it is not a primitive
+int primitiveIndex(SchemeVal *(*function)(SchemeVal *)) {
+    for (int i = 0; i < primitiveCount(); i++) {
+        if (primitives[i].function == function) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Creates a global frame with every primitive bound in it
+Frame *makeGlobalFrame() {
     Frame *global = talloc(sizeof(Frame));
     global->bindings = makeEmpty();
     global->parent = NULL;
 
-    bind("+", primitiveAdd, global);
-    bind("<", primitiveLessThan, global);
-    bind("null?", primitiveNull, global);
-    bind("car", primitiveCar, global);
-    bind("cdr", primitiveCdr, global);
-    bind("cons", primitiveCons, global);
-    bind("map", primitiveMap, global);
+    for (int i = 0; i < primitiveCount(); i++) {
+        bind(i, global);
+    }
+    return global;
+}
 
-    while (!isEmpty(tree)) {
-        SchemeVal *result = eval(car(tree), global);
+// Evaluates one top-level form in frame and prints its result, or the
+// error it raised. The form runs under the quota set with setFormQuota.
+// Input: SchemeVal* form, Frame* frame (usually global)
+// Output: 1 if the form raised an error, otherwise 0
+int interpretForm(SchemeVal *form, Frame *frame) {
+    ErrorHandler handler;
+    armQuota(formQuota());
+    pushHandler(&handler);
+    if (setjmp(handler.env) == 0) {
+        SchemeVal *result = cekEnabled()
+            ? evalCek(form, frame)
+            : eval(flattenClosures(inlineCalls(form, frame)), frame);
+        popHandler(&handler);
+        disarmQuota();
         printTreeHelper(result);
         printf("\n");
+        return 0;
+    }
+    popHandler(&handler);
+    disarmQuota();
+    // errors that could not say where they happened point at the form
+    SchemeVal *condition = lastCondition();
+    if (condition != NULL && condition->type == ERROR_TYPE && !hasPosition(condition)) {
+        copyPosition(condition, form);
+    }
+    printCondition(stdout, condition);
+    return 1;
+}
+
+// Evaluates a list of Scheme expressions in frame and prints the results.
+// An error in one expression is reported and evaluation carries on with the
+// next one.
+// Input: SchemeVal* tree (list of expressions), Frame* frame (usually global)
+// Output: number of expressions that raised an error
+int interpretIn(SchemeVal *tree, Frame *frame) {
+    int errors = 0;
+    while (!isEmpty(tree)) {
+        errors += interpretForm(car(tree), frame);
         tree = cdr(tree);
     }
-}
\ No newline at end of file
+    return errors;
+}
+
+// Interprets a list of Scheme expressions and prints results.
+// Input: SchemeVal* tree (list of expressions)
+// Output: number of expressions that raised an error
+int interpret(SchemeVal *tree) {
+    return interpretIn(tree, makeGlobalFrame());
+}
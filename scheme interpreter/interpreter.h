@@ -3,8 +3,57 @@
 
 #include "schemeval.h"
 
-void interpret(SchemeVal *tree);
+int interpret(SchemeVal *tree);
 SchemeVal *eval(SchemeVal *tree, Frame *frame);
 
+// Calls a closure or primitive with a list of already-evaluated arguments.
+SchemeVal *apply(SchemeVal *function, SchemeVal *args, Frame *frame);
+
+// Calls a procedure with count already-evaluated arguments, as an
+// application does; only builds the argument list on the heap when the
+// procedure may keep it.
+SchemeVal *applyValues(SchemeVal *function, SchemeVal **values, int count, Frame *frame);
+
+// Creates a fresh global frame with all primitives bound, and evaluates a
+// program, or a single top-level form, in an existing frame, printing each
+// result. The interpret functions return the number of top-level forms that
+// raised an error.
+Frame *makeGlobalFrame();
+int interpretIn(SchemeVal *tree, Frame *frame);
+int interpretForm(SchemeVal *form, Frame *frame);
+
+// Pieces of eval shared with the explicit-stack evaluator in cek.c. The
+// check functions raise an error for a malformed form.
+bool isSpecialForm(SchemeVal *symbol);
+SchemeVal *lookUpSymbol(SchemeVal *symbol, Frame *frame);
+SchemeVal *evalLambda(SchemeVal *args, Frame *frame);
+Frame *bindArguments(SchemeVal *function, SchemeVal *args);
+void startFrame(Frame *frame, Frame *parent, SchemeVal *cells);
+void addBinding(Frame *frame, SchemeVal *var, SchemeVal *value, SchemeVal *cells);
+void checkBindings(SchemeVal *bindings);
+Frame *makeLetrecFrame(SchemeVal *bindings, Frame *parent);
+void assignLetrec(SchemeVal *bindings, SchemeVal *values, Frame *frame);
+SchemeVal *checkDefine(SchemeVal *args, Frame *frame);
+void defineVariable(SchemeVal *var, SchemeVal *value, Frame *frame);
+SchemeVal *checkSet(SchemeVal *args);
+void setVariable(SchemeVal *var, SchemeVal *value, Frame *frame);
+
+// Creates the value returned by forms such as define.
+SchemeVal *makeVoid();
+
+// Checks if value is a procedure that apply can call; continuations, which
+// only some callers accept, are not counted.
+bool isProcedure(SchemeVal *value);
+
+// Starts a future that applies thunk, a procedure of no arguments, and
+// returns it; the future special form of compiled code (see compiler.h).
+SchemeVal *applyFuture(SchemeVal *thunk);
+
+// The table of primitives bound in every global frame.
+int primitiveCount();
+char *primitiveName(int index);
+SchemeVal *(*primitiveFunction(int index))(SchemeVal *);
+int primitiveIndex(SchemeVal *(*function)(SchemeVal *));
+
 #endif
 
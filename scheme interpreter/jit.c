@@ -0,0 +1,753 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "jit.h"
+#include "schemeval.h"
+#include "interpreter.h"
+#include "linkedlist.h"
+#include "talloc.h"
+#include "error.h"
+#include "quota.h"
+#include "stats.h"
+#include "profiler.h"
+#include "trace.h"
+
+// Entries in each thread's cache of the body table.
+#define JIT_CACHE 256
+
+// What the JIT knows about one lambda body.
+typedef struct {
+    SchemeVal *body;
+    long calls;
+    JitCode code;           // NULL until compiled
+    bool failed;            // compiling failed; never tried again
+    // the global frame whose bindings the code caches, or NULL if it caches
+    // none; the code is only run for closures made in that frame
+    Frame *global;
+    void *pages;
+    size_t pageBytes;
+    // cached bindings read by the code, one malloc'd cell per variable use
+    SchemeVal ***cells;
+    int cellCount;
+} JitEntry;
+
+static bool enabled = true;
+
+// An open-addressing table from lambda bodies to their entries, kept at
+// most half full, like the position table.
+static JitEntry **entries = NULL;
+static size_t capacity = 0;
+static size_t count = 0;
+static pthread_mutex_t tableLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Bumped whenever entries are freed; a thread whose cache is from an older
+// generation empties it before use.
+static unsigned long generation = 0;
+static _Thread_local unsigned long cacheGeneration
+    __attribute__((tls_model("initial-exec"))) = 0;
+static _Thread_local struct {
+    SchemeVal *body;
+    JitEntry *entry;
+} jitCache[JIT_CACHE] __attribute__((tls_model("initial-exec")));
+
+void setJitEnabled(bool enable) {
+    enabled = enable;
+}
+
+bool jitEnabled() {
+#if defined(__x86_64__)
+    return enabled;
+#else
+    return false;
+#endif
+}
+
+/* Home slot of a body */
+static size_t slotOf(SchemeVal *body) {
+    return ((uintptr_t)body >> 4) * 0x9E3779B97F4A7C15ULL >> 20 & (capacity - 1);
+}
+
+/* Finds the slot holding body's entry, or the empty slot it would go in */
+static size_t findSlot(SchemeVal *body) {
+    size_t i = slotOf(body);
+    while (entries[i] != NULL && entries[i]->body != body) {
+        i = (i + 1) & (capacity - 1);
+    }
+    return i;
+}
+
+/* Stores an entry, growing the table to stay at most half full */
+static void insert(JitEntry *entry) {
+    if (2 * (count + 1) > capacity) {
+        JitEntry **old = entries;
+        size_t oldCapacity = capacity;
+        capacity = capacity ? 2 * capacity : 1024;
+        entries = calloc(capacity, sizeof(JitEntry *));
+        count = 0;
+        for (size_t i = 0; i < oldCapacity; i++) {
+            if (old[i] != NULL) {
+                insert(old[i]);
+            }
+        }
+        free(old);
+    }
+    entries[findSlot(entry->body)] = entry;
+    count++;
+}
+
+/* Frees an entry, its code and its cells */
+static void freeEntry(JitEntry *entry) {
+    if (entry->pages != NULL) {
+        munmap(entry->pages, entry->pageBytes);
+    }
+    for (int i = 0; i < entry->cellCount; i++) {
+        free(entry->cells[i]);
+    }
+    free(entry->cells);
+    free(entry);
+}
+
+/* Removes body's entry, moving later entries of its probe run back into the
+   gap */
+static void removeBody(SchemeVal *body) {
+    size_t gap = findSlot(body);
+    if (entries[gap] == NULL) {
+        return;
+    }
+    freeEntry(entries[gap]);
+    entries[gap] = NULL;
+    count--;
+    for (size_t i = (gap + 1) & (capacity - 1); entries[i] != NULL;
+         i = (i + 1) & (capacity - 1)) {
+        size_t home = slotOf(entries[i]->body);
+        if (((i - home) & (capacity - 1)) >= ((i - gap) & (capacity - 1))) {
+            entries[gap] = entries[i];
+            entries[i] = NULL;
+            gap = i;
+        }
+    }
+}
+
+// Drops the entries of heap's lambda bodies
+void forgetJitCode(Heap *heap) {
+    pthread_mutex_lock(&tableLock);
+    if (count > 0) {
+        size_t before = count;
+        for (SchemeVal *node = heap->active_list; node != NULL; node = node->cdr) {
+            removeBody((SchemeVal *)node->car);
+        }
+        if (count != before) {
+            __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&tableLock);
+}
+
+// Helpers called from compiled code.
+
+/* Applies values[0] to the argc values after it, as eval's applications
+   do, so allocation is counted the same */
+static SchemeVal *jitApply(Frame *frame, int argc, SchemeVal **values) {
+    return applyValues(values[0], values + 1, argc, frame);
+}
+
+/* Reads a global variable from frame, the body's frame, whose parent is the
+   global frame, and caches its binding in cell once it is defined */
+static SchemeVal *jitLookUpGlobal(SchemeVal *symbol, Frame *frame, SchemeVal **cell) {
+    SchemeVal *bindings = __atomic_load_n(&frame->parent->bindings, __ATOMIC_ACQUIRE);
+    while (!isEmpty(bindings)) {
+        SchemeVal *pair = car(bindings);
+        if (!strcmp(symbol->s, car(pair)->s)) {
+            runtimeStats.lookups++;
+            runtimeStats.framesWalked += 2;
+            __atomic_store_n(cell, pair, __ATOMIC_RELEASE);
+            return __atomic_load_n(&pair->cdr, __ATOMIC_ACQUIRE);
+        }
+        bindings = cdr(bindings);
+    }
+    // raises the unbound variable error
+    return lookUpSymbol(symbol, frame);
+}
+
+static SchemeVal *jitMissingElse() {
+    evalError("missing else clause");
+}
+
+#if defined(__x86_64__)
+
+// The templates. Each is a run of x86-64 instructions with holes, marked by
+// zero bytes and the offset constants after it, that are patched with the
+// operands of each copy. Values live in rax; rbx holds the body's frame and
+// the stack frame below the saved rbx and r12 holds one slot per parameter
+// and per value an application is still collecting.
+
+static const unsigned char prologueTemplate[] = {
+    0x55,                               // push %rbp
+    0x48, 0x89, 0xe5,                   // mov %rsp, %rbp
+    0x53,                               // push %rbx
+    0x41, 0x54,                         // push %r12
+    0x48, 0x81, 0xec, 0, 0, 0, 0,       // sub $FRAME, %rsp
+    0x48, 0x89, 0xfb,                   // mov %rdi, %rbx
+    0x49, 0x89, 0xf4,                   // mov %rsi, %r12
+};
+#define PROLOGUE_FRAME 10
+
+// Copies the next argument into a parameter's slot.
+static const unsigned char parameterTemplate[] = {
+    0x49, 0x8b, 0x44, 0x24, 0x08,       // mov 8(%r12), %rax (car)
+    0x48, 0x89, 0x85, 0, 0, 0, 0,       // mov %rax, SLOT(%rbp)
+    0x4d, 0x8b, 0x64, 0x24, 0x10,       // mov 16(%r12), %r12 (cdr)
+};
+#define PARAMETER_SLOT 8
+
+static const unsigned char epilogueTemplate[] = {
+    0x48, 0x8d, 0x65, 0xf0,             // lea -16(%rbp), %rsp
+    0x41, 0x5c,                         // pop %r12
+    0x5b,                               // pop %rbx
+    0x5d,                               // pop %rbp
+    0xc3,                               // ret
+};
+
+// One evaluation step: useFuel and countEval.
+static const unsigned char stepTemplate[] = {
+    0x64, 0x48, 0xff, 0x0c, 0x25, 0, 0, 0, 0,   // decq %fs:fuelCountdown
+    0x79, 0x0c,                                 // jns 1f
+    0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0,         // mov $fuelCheck, %rax
+    0xff, 0xd0,                                 // call *%rax
+    0x64, 0x48, 0xff, 0x04, 0x25, 0, 0, 0, 0,   // 1: incq %fs:runtimeStats.evals[KIND]
+};
+#define STEP_FUEL 5
+#define STEP_CHECK 13
+#define STEP_COUNT 28
+
+static const unsigned char constantTemplate[] = {
+    0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0,         // mov $VALUE, %rax
+};
+#define CONSTANT_VALUE 2
+
+static const unsigned char loadSlotTemplate[] = {
+    0x48, 0x8b, 0x85, 0, 0, 0, 0,               // mov SLOT(%rbp), %rax
+};
+static const unsigned char storeSlotTemplate[] = {
+    0x48, 0x89, 0x85, 0, 0, 0, 0,               // mov %rax, SLOT(%rbp)
+};
+#define SLOT_OFFSET 3
+
+// Calls FUNCTION(ARGUMENT, frame): eval for forms without a template, and
+// lookUpSymbol for variables that cannot be cached.
+static const unsigned char callTemplate[] = {
+    0x48, 0xbf, 0, 0, 0, 0, 0, 0, 0, 0,         // mov $ARGUMENT, %rdi
+    0x48, 0x89, 0xde,                           // mov %rbx, %rsi
+    0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0,         // mov $FUNCTION, %rax
+    0xff, 0xd0,                                 // call *%rax
+};
+#define CALL_ARGUMENT 2
+#define CALL_FUNCTION 15
+
+// Reads a global through its cached binding, looking it up the first time.
+static const unsigned char globalTemplate[] = {
+    0x48, 0xa1, 0, 0, 0, 0, 0, 0, 0, 0,         // mov CELL, %rax
+    0x48, 0x85, 0xc0,                           // test %rax, %rax
+    0x74, 0x06,                                 // jz 1f
+    0x48, 0x8b, 0x40, 0x10,                     // mov 16(%rax), %rax (cdr)
+    0xeb, 0x23,                                 // jmp 2f
+    0x48, 0xbf, 0, 0, 0, 0, 0, 0, 0, 0,         // 1: mov $SYMBOL, %rdi
+    0x48, 0x89, 0xde,                           // mov %rbx, %rsi
+    0x48, 0xba, 0, 0, 0, 0, 0, 0, 0, 0,         // mov $CELL, %rdx
+    0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0,         // mov $jitLookUpGlobal, %rax
+    0xff, 0xd0,                                 // call *%rax
+};                                              // 2:
+#define GLOBAL_CELL 2
+#define GLOBAL_SYMBOL 23
+#define GLOBAL_CELL_AGAIN 36
+#define GLOBAL_LOOK_UP 46
+
+// Jumps to the false branch unless rax is true, as evalIf tests it.
+static const unsigned char testTemplate[] = {
+    0x83, 0x38, 0,                              // cmpl $BOOL_TYPE, (%rax)
+    0x75, 0x0a,                                 // jne 1f
+    0x80, 0x78, 0x08, 0x00,                     // cmpb $0, 8(%rax) (b)
+    0x0f, 0x84, 0, 0, 0, 0,                     // je FALSE
+};                                              // 1:
+#define TEST_TYPE 2
+#define TEST_FALSE 11
+
+// Jumps to the original call of an #inline form unless BINDING still holds
+// CLOSURE (see inline.h).
+static const unsigned char guardTemplate[] = {
+    0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0,         // mov $BINDING, %rax
+    0x48, 0x8b, 0x40, 0x10,                     // mov 16(%rax), %rax (cdr)
+    0x48, 0xb9, 0, 0, 0, 0, 0, 0, 0, 0,         // mov $CLOSURE, %rcx
+    0x48, 0x39, 0xc8,                           // cmp %rcx, %rax
+    0x0f, 0x85, 0, 0, 0, 0,                     // jne CALL
+};
+#define GUARD_BINDING 2
+#define GUARD_CLOSURE 16
+#define GUARD_CALL 29
+
+static const unsigned char jumpTemplate[] = {
+    0xe9, 0, 0, 0, 0,                           // jmp END
+};
+#define JUMP_TARGET 1
+
+static const unsigned char missingElseTemplate[] = {
+    0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0,         // mov $jitMissingElse, %rax
+    0xff, 0xd0,                                 // call *%rax
+};
+#define MISSING_ELSE_FUNCTION 2
+
+// Calls jitApply(frame, ARGC, &values[0]) on the values an application has
+// collected in its slots.
+static const unsigned char applyTemplate[] = {
+    0x48, 0x89, 0xdf,                           // mov %rbx, %rdi
+    0xbe, 0, 0, 0, 0,                           // mov $ARGC, %esi
+    0x48, 0x8d, 0x95, 0, 0, 0, 0,               // lea VALUES(%rbp), %rdx
+    0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0,         // mov $jitApply, %rax
+    0xff, 0xd0,                                 // call *%rax
+};
+#define APPLY_ARGC 4
+#define APPLY_VALUES 11
+#define APPLY_FUNCTION 17
+
+_Static_assert(offsetof(SchemeVal, car) == 8 && offsetof(SchemeVal, cdr) == 16 &&
+               offsetof(SchemeVal, b) == 8 && sizeof(bool) == 1,
+               "the templates assume this SchemeVal layout");
+
+// A body being compiled.
+typedef struct {
+    unsigned char *bytes;
+    size_t size;
+    size_t capacity;
+    bool failed;
+    SchemeVal *params;
+    // symbols set! or defined anywhere in the body; malloc'd, since talloc
+    // could raise a quota error while the table is locked
+    SchemeVal **assigned;
+    int assignedCount;
+    bool cacheGlobals;
+    int slots;
+    int maxSlots;
+    JitEntry *entry;
+} Compiler;
+
+/* Offset of a thread-local variable from the thread pointer; the same in
+   every thread for initial-exec variables of the executable */
+static long tlsOffset(void *variable) {
+    char *threadPointer;
+    __asm__("mov %%fs:0, %0" : "=r"(threadPointer));
+    return (char *)variable - threadPointer;
+}
+
+/* Appends a copy of a template, returning where it starts */
+static size_t paste(Compiler *compiler, const unsigned char *template, size_t size) {
+    if (compiler->size + size > compiler->capacity) {
+        size_t grown = compiler->capacity ? 2 * compiler->capacity : 4096;
+        while (grown < compiler->size + size) {
+            grown *= 2;
+        }
+        unsigned char *bytes = realloc(compiler->bytes, grown);
+        if (bytes == NULL) {
+            compiler->failed = true;
+            compiler->size = 0;
+            return 0;
+        }
+        compiler->bytes = bytes;
+        compiler->capacity = grown;
+    }
+    size_t at = compiler->size;
+    memcpy(compiler->bytes + at, template, size);
+    compiler->size += size;
+    return at;
+}
+
+static void patch8(Compiler *compiler, size_t at, uint8_t value) {
+    if (!compiler->failed) {
+        compiler->bytes[at] = value;
+    }
+}
+
+static void patch32(Compiler *compiler, size_t at, int32_t value) {
+    if (!compiler->failed) {
+        memcpy(compiler->bytes + at, &value, sizeof(value));
+    }
+}
+
+static void patch64(Compiler *compiler, size_t at, const void *value) {
+    if (!compiler->failed) {
+        memcpy(compiler->bytes + at, &value, sizeof(value));
+    }
+}
+
+/* Points the rel32 at at to target */
+static void patchJump(Compiler *compiler, size_t at, size_t target) {
+    patch32(compiler, at, (int32_t)(target - (at + 4)));
+}
+
+/* Offset of a slot from rbp */
+static int32_t slotOffset(int slot) {
+    return -24 - 8 * slot;
+}
+
+static void emitStep(Compiler *compiler, EvalKind kind) {
+    size_t at = paste(compiler, stepTemplate, sizeof(stepTemplate));
+    patch32(compiler, at + STEP_FUEL, (int32_t)tlsOffset(&fuelCountdown));
+    patch64(compiler, at + STEP_CHECK, (void *)fuelCheck);
+    patch32(compiler, at + STEP_COUNT, (int32_t)tlsOffset(&runtimeStats.evals[kind]));
+}
+
+static void emitConstant(Compiler *compiler, SchemeVal *value) {
+    size_t at = paste(compiler, constantTemplate, sizeof(constantTemplate));
+    patch64(compiler, at + CONSTANT_VALUE, value);
+}
+
+static void emitSlot(Compiler *compiler, const unsigned char *template, int slot) {
+    size_t at = paste(compiler, template, sizeof(loadSlotTemplate));
+    patch32(compiler, at + SLOT_OFFSET, slotOffset(slot));
+}
+
+static void emitCall(Compiler *compiler, void *argument, void *function) {
+    size_t at = paste(compiler, callTemplate, sizeof(callTemplate));
+    patch64(compiler, at + CALL_ARGUMENT, argument);
+    patch64(compiler, at + CALL_FUNCTION, function);
+}
+
+/* Checks if symbol is in the list symbols */
+static bool containsSymbol(SchemeVal *symbols, SchemeVal *symbol) {
+    for (; !isEmpty(symbols); symbols = cdr(symbols)) {
+        if (!strcmp(car(symbols)->s, symbol->s)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Checks if the body assigns symbol */
+static bool isAssigned(Compiler *compiler, SchemeVal *symbol) {
+    for (int i = 0; i < compiler->assignedCount; i++) {
+        if (!strcmp(compiler->assigned[i]->s, symbol->s)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Records every symbol that expr, at any depth, set!s or defines. Quoted
+   data and nested lambdas are searched too, which only makes the answer more
+   cautious. */
+static void findAssigned(Compiler *compiler, SchemeVal *expr) {
+    while (expr->type == CONS_TYPE) {
+        SchemeVal *first = car(expr);
+        if (first->type == SYMBOL_TYPE &&
+            (!strcmp(first->s, "set!") || !strcmp(first->s, "define")) &&
+            cdr(expr)->type == CONS_TYPE) {
+            SchemeVal *var = car(cdr(expr));
+            if (var->type == CONS_TYPE) {
+                var = car(var);
+            }
+            if (var->type == SYMBOL_TYPE) {
+                SchemeVal **assigned = realloc(compiler->assigned,
+                                               (compiler->assignedCount + 1) * sizeof(SchemeVal *));
+                if (assigned == NULL) {
+                    compiler->failed = true;
+                    return;
+                }
+                compiler->assigned = assigned;
+                compiler->assigned[compiler->assignedCount++] = var;
+            }
+        }
+        findAssigned(compiler, first);
+        expr = cdr(expr);
+    }
+}
+
+/* The slot of a parameter whose value can be read from the stack, or -1 */
+static int parameterSlot(Compiler *compiler, SchemeVal *symbol) {
+    int slot = 0;
+    for (SchemeVal *params = compiler->params; !isEmpty(params); params = cdr(params)) {
+        if (!strcmp(car(params)->s, symbol->s)) {
+            return isAssigned(compiler, symbol) ? -1 : slot;
+        }
+        slot++;
+    }
+    return -1;
+}
+
+/* A new cell for a cached binding, owned by the entry */
+static SchemeVal **newCell(Compiler *compiler) {
+    JitEntry *entry = compiler->entry;
+    SchemeVal ***cells = realloc(entry->cells, (entry->cellCount + 1) * sizeof(SchemeVal **));
+    SchemeVal **cell = calloc(1, sizeof(SchemeVal *));
+    if (cells == NULL || cell == NULL) {
+        free(cell);
+        if (cells != NULL) {
+            entry->cells = cells;
+        }
+        compiler->failed = true;
+        return NULL;
+    }
+    entry->cells = cells;
+    entry->cells[entry->cellCount++] = cell;
+    return cell;
+}
+
+static void compileVariable(Compiler *compiler, SchemeVal *symbol) {
+    int slot = parameterSlot(compiler, symbol);
+    if (slot >= 0) {
+        emitSlot(compiler, loadSlotTemplate, slot);
+    } else if (compiler->cacheGlobals && !containsSymbol(compiler->params, symbol) &&
+               !isAssigned(compiler, symbol)) {
+        SchemeVal **cell = newCell(compiler);
+        size_t at = paste(compiler, globalTemplate, sizeof(globalTemplate));
+        patch64(compiler, at + GLOBAL_CELL, cell);
+        patch64(compiler, at + GLOBAL_SYMBOL, symbol);
+        patch64(compiler, at + GLOBAL_CELL_AGAIN, cell);
+        patch64(compiler, at + GLOBAL_LOOK_UP, (void *)jitLookUpGlobal);
+    } else {
+        emitCall(compiler, symbol, (void *)lookUpSymbol);
+    }
+}
+
+static void compileExpression(Compiler *compiler, SchemeVal *expr);
+
+static void compileIf(Compiler *compiler, SchemeVal *args) {
+    SchemeVal *testExpr = car(args);
+    SchemeVal *trueExpr = car(cdr(args));
+    SchemeVal *rest = cdr(cdr(args));
+
+    compileExpression(compiler, testExpr);
+    size_t test = paste(compiler, testTemplate, sizeof(testTemplate));
+    patch8(compiler, test + TEST_TYPE, BOOL_TYPE);
+    compileExpression(compiler, trueExpr);
+    size_t jump = paste(compiler, jumpTemplate, sizeof(jumpTemplate));
+    patchJump(compiler, test + TEST_FALSE, compiler->size);
+    if (isEmpty(rest)) {
+        size_t at = paste(compiler, missingElseTemplate, sizeof(missingElseTemplate));
+        patch64(compiler, at + MISSING_ELSE_FUNCTION, (void *)jitMissingElse);
+    } else {
+        compileExpression(compiler, car(rest));
+    }
+    patchJump(compiler, jump + JUMP_TARGET, compiler->size);
+}
+
+/* Compiles the inlined copy of an #inline form and the original call it
+   falls back on */
+static void compileInline(Compiler *compiler, SchemeVal *args) {
+    size_t guard = paste(compiler, guardTemplate, sizeof(guardTemplate));
+    patch64(compiler, guard + GUARD_BINDING, car(args));
+    patch64(compiler, guard + GUARD_CLOSURE, car(cdr(args)));
+    compileExpression(compiler, car(cdr(cdr(args))));
+    size_t jump = paste(compiler, jumpTemplate, sizeof(jumpTemplate));
+    patchJump(compiler, guard + GUARD_CALL, compiler->size);
+    compileExpression(compiler, car(cdr(cdr(cdr(args)))));
+    patchJump(compiler, jump + JUMP_TARGET, compiler->size);
+}
+
+/* Evaluates the operator and then each argument into consecutive slots,
+   the operator lowest, and calls jitApply on them */
+static void compileApplication(Compiler *compiler, SchemeVal *expr, int argc) {
+    int base = compiler->slots;
+    compiler->slots += argc + 1;
+    if (compiler->slots > compiler->maxSlots) {
+        compiler->maxSlots = compiler->slots;
+    }
+    int i = 0;
+    for (SchemeVal *part = expr; !isEmpty(part); part = cdr(part), i++) {
+        compileExpression(compiler, car(part));
+        emitSlot(compiler, storeSlotTemplate, base + argc - i);
+    }
+    size_t at = paste(compiler, applyTemplate, sizeof(applyTemplate));
+    patch32(compiler, at + APPLY_ARGC, argc);
+    patch32(compiler, at + APPLY_VALUES, slotOffset(base + argc));
+    patch64(compiler, at + APPLY_FUNCTION, (void *)jitApply);
+    compiler->slots = base;
+}
+
+/* Number of elements of a proper list, or -1 */
+static int properLength(SchemeVal *list) {
+    int length = 0;
+    for (; list->type == CONS_TYPE; list = cdr(list)) {
+        length++;
+    }
+    return isEmpty(list) ? length : -1;
+}
+
+/* Emits code leaving the value of expr in rax. Anything the templates do
+   not cover, malformed forms included, is passed to eval, which counts its
+   own step. */
+static void compileExpression(Compiler *compiler, SchemeVal *expr) {
+    switch (expr->type) {
+        case INT_TYPE:
+        case DOUBLE_TYPE:
+        case STR_TYPE:
+        case BOOL_TYPE:
+            emitStep(compiler, EVAL_CONSTANT);
+            emitConstant(compiler, expr);
+            return;
+
+        case SYMBOL_TYPE:
+            emitStep(compiler, EVAL_VARIABLE);
+            compileVariable(compiler, expr);
+            return;
+
+        case CONS_TYPE: {
+            SchemeVal *first = car(expr);
+            SchemeVal *args = cdr(expr);
+            int length = properLength(args);
+            if (first->type == SYMBOL_TYPE && !strcmp(first->s, "if") &&
+                (length == 2 || length == 3)) {
+                emitStep(compiler, EVAL_IF);
+                compileIf(compiler, args);
+                return;
+            }
+            if (first->type == SYMBOL_TYPE && !strcmp(first->s, "#inline") && length == 4) {
+                emitStep(compiler, EVAL_INLINE);
+                compileInline(compiler, args);
+                return;
+            }
+            if (first->type == SYMBOL_TYPE && !strcmp(first->s, "quote") && length == 1) {
+                emitStep(compiler, EVAL_QUOTE);
+                emitConstant(compiler, car(args));
+                return;
+            }
+            if (length >= 0 && (first->type == CONS_TYPE ||
+                                (first->type == SYMBOL_TYPE && !isSpecialForm(first)))) {
+                emitStep(compiler, EVAL_APPLICATION);
+                compileApplication(compiler, expr, length);
+                return;
+            }
+            break;
+        }
+
+        default:
+            break;
+    }
+    emitCall(compiler, expr, (void *)eval);
+}
+
+/* Compiles function's body into executable pages of the entry */
+static void compileBody(JitEntry *entry, SchemeVal *function) {
+    Compiler compiler = {0};
+    compiler.params = function->paramNames;
+    compiler.cacheGlobals = function->frame->parent == NULL;
+    compiler.slots = properLength(compiler.params);
+    compiler.maxSlots = compiler.slots;
+    compiler.entry = entry;
+    findAssigned(&compiler, function->functionCode);
+
+    size_t prologue = paste(&compiler, prologueTemplate, sizeof(prologueTemplate));
+    for (int slot = 0; slot < compiler.slots; slot++) {
+        size_t at = paste(&compiler, parameterTemplate, sizeof(parameterTemplate));
+        patch32(&compiler, at + PARAMETER_SLOT, slotOffset(slot));
+    }
+    for (SchemeVal *body = function->functionCode; !isEmpty(body); body = cdr(body)) {
+        compileExpression(&compiler, car(body));
+    }
+    paste(&compiler, epilogueTemplate, sizeof(epilogueTemplate));
+    // the frame keeps rsp 16-byte aligned at every call
+    patch32(&compiler, prologue + PROLOGUE_FRAME, (8 * compiler.maxSlots + 15) & ~15);
+
+    free(compiler.assigned);
+    long tls = tlsOffset(&fuelCountdown);
+    if (compiler.failed || tls != (int32_t)tls) {
+        free(compiler.bytes);
+        entry->failed = true;
+        return;
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t pageBytes = (compiler.size + page - 1) / page * page;
+    void *pages = mmap(NULL, pageBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pages == MAP_FAILED) {
+        free(compiler.bytes);
+        entry->failed = true;
+        return;
+    }
+    memcpy(pages, compiler.bytes, compiler.size);
+    free(compiler.bytes);
+    if (mprotect(pages, pageBytes, PROT_READ | PROT_EXEC) != 0) {
+        munmap(pages, pageBytes);
+        entry->failed = true;
+        return;
+    }
+    __builtin___clear_cache((char *)pages, (char *)pages + compiler.size);
+    entry->pages = pages;
+    entry->pageBytes = pageBytes;
+    entry->global = compiler.cacheGlobals ? function->frame : NULL;
+    __atomic_store_n(&entry->code, (JitCode)pages, __ATOMIC_RELEASE);
+
+    if (perfMapEnabled) {
+        char *name = procedureName(function);
+        char jitName[256];
+        snprintf(jitName, sizeof(jitName), "jit:%s", name);
+        perfMapAdd(pages, compiler.size, jitName);
+        free(name);
+    }
+}
+
+#endif
+
+/* The entry for a body, made on first use */
+static JitEntry *entryFor(SchemeVal *body) {
+    unsigned long current = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+    if (cacheGeneration != current) {
+        memset(jitCache, 0, sizeof(jitCache));
+        cacheGeneration = current;
+    }
+    size_t slot = ((uintptr_t)body >> 4) & (JIT_CACHE - 1);
+    if (jitCache[slot].body == body) {
+        return jitCache[slot].entry;
+    }
+
+    pthread_mutex_lock(&tableLock);
+    JitEntry *entry = capacity > 0 ? entries[findSlot(body)] : NULL;
+    if (entry == NULL) {
+        entry = calloc(1, sizeof(JitEntry));
+        if (entry != NULL) {
+            entry->body = body;
+            insert(entry);
+        }
+    }
+    pthread_mutex_unlock(&tableLock);
+    if (entry != NULL) {
+        jitCache[slot].body = body;
+        jitCache[slot].entry = entry;
+    }
+    return entry;
+}
+
+// Counts a call of function, compiling its body on the call that makes it hot
+JitCode jitCode(SchemeVal *function) {
+#if defined(__x86_64__)
+#ifdef SCHEME_TRACE
+    // compiled code records no eval events
+    if (tracing) {
+        return NULL;
+    }
+#endif
+    JitEntry *entry = entryFor(function->functionCode);
+    if (entry == NULL) {
+        return NULL;
+    }
+    JitCode code = __atomic_load_n(&entry->code, __ATOMIC_ACQUIRE);
+    if (code != NULL) {
+        return entry->global == NULL || entry->global == function->frame ? code : NULL;
+    }
+    if (entry->failed ||
+        __atomic_add_fetch(&entry->calls, 1, __ATOMIC_RELAXED) < JIT_THRESHOLD) {
+        return NULL;
+    }
+    pthread_mutex_lock(&tableLock);
+    if (entry->code == NULL && !entry->failed) {
+        compileBody(entry, function);
+    }
+    pthread_mutex_unlock(&tableLock);
+    return NULL;
+#else
+    (void)function;
+    return NULL;
+#endif
+}
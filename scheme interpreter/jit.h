@@ -0,0 +1,47 @@
+#include <stdbool.h>
+#include "schemeval.h"
+#include "talloc.h"
+
+#ifndef _JIT
+#define _JIT
+
+// A template JIT for hot closures, on x86-64 only. apply counts the calls of
+// each lambda body, and once a body has been called JIT_THRESHOLD times its
+// forms are translated into machine code by pasting together fixed byte
+// templates, one per kind of expression, with the operands (constants,
+// symbols, helper addresses, stack slots, jump offsets) patched in. The code
+// is copied into pages of its own, which are then made executable and
+// never written again.
+//
+// Constants, variables, quote, if, applications and the guarded calls the
+// inliner makes (inline.h) get templates; every other form is handed to
+// eval, so everything else about the language stays with the interpreter.
+// Like eval, the code counts a step and an eval of its kind for each
+// expression, so quotas and (runtime-stats) see the same steps. What it
+// saves is dispatch on the form and variable lookup: parameters that are
+// never assigned are read from the machine stack, and in lambdas made at
+// top level, global variables are looked up once and then read straight
+// from their binding.
+//
+// The JIT stands aside for the --cek evaluator and while tracing, and can
+// be turned off with --no-jit.
+
+// Calls a body needs before it is compiled.
+#define JIT_THRESHOLD 64
+
+// Code for a lambda body: runs the body in frame, the frame bindArguments
+// made from the argument list args, and returns the value of its last form.
+typedef SchemeVal *(*JitCode)(Frame *frame, SchemeVal *args);
+
+// On by default where the JIT is supported. Call before evaluation starts.
+void setJitEnabled(bool enabled);
+bool jitEnabled();
+
+// Counts a call of the closure function and returns the machine code for
+// its body, or NULL if the body is not hot yet or cannot be compiled.
+JitCode jitCode(SchemeVal *function);
+
+// Drops the code compiled for bodies allocated from heap, for tfreeHeap.
+void forgetJitCode(Heap *heap);
+
+#endif
@@ -0,0 +1,811 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include "loop.h"
+#include "schemeval.h"
+#include "interpreter.h"
+#include "linkedlist.h"
+#include "talloc.h"
+#include "error.h"
+#include "escape.h"
+#include "quota.h"
+#include "position.h"
+#include "stats.h"
+#include "trace.h"
+
+static bool enabled = true;
+
+// Primitives that only make new values out of their arguments, which an
+// iteration in a scratch heap may call
+static const char *scratchPrimitives[] = {"+", "<", "null?", "car", "cdr", "cons"};
+
+// A do form or named let being run as a loop
+typedef struct Loop {
+    Frame *parent;
+    // the frame the variables are bound in, and the binding of each
+    Frame *frame;
+    SchemeVal **vars;
+    SchemeVal **bindings;
+    int count;
+    // bind the variables in a new frame each iteration
+    bool fresh;
+    // the do form's operands, or the named let's name and body
+    SchemeVal *args;
+    SchemeVal *name;
+    SchemeVal *body;
+    // what the loop ends with: a do form's results, or the expression a
+    // named let's body ends with
+    SchemeVal *results;
+    SchemeVal *last;
+    // (binding . value) pairs the primitives called in a scratch heap are
+    // looked up by, which must still hold for it to be used
+    SchemeVal *guards;
+    // iterating in a scratch heap: iteration, which is current, holds what
+    // the iteration allocated, kept the atoms that are values of the
+    // variables allocated by earlier ones, and built the pairs earlier
+    // iterations made for the values and what those refer to, which stay
+    // until the loop ends
+    volatile bool scratch;
+    Heap iteration;
+    Heap kept;
+    Heap built;
+    Heap *previous;
+} Loop;
+
+void setLoopsEnabled(bool enable) {
+    enabled = enable;
+}
+
+bool loopsEnabled() {
+    return enabled;
+}
+
+/* A new symbol named name */
+static SchemeVal *makeSymbol(char *name) {
+    SchemeVal *symbol = talloc(sizeof(SchemeVal));
+    symbol->type = SYMBOL_TYPE;
+    symbol->s = name;
+    return symbol;
+}
+
+/* Number of elements of a proper list, or -1 */
+static int properLength(SchemeVal *list) {
+    int count = 0;
+    for (; list->type == CONS_TYPE; list = cdr(list)) {
+        count++;
+    }
+    return isEmpty(list) ? count : -1;
+}
+
+/* Checks if expr is a proper list of at least min elements, and at most
+   max unless max is -1, whose first element is the symbol name */
+static bool isForm(SchemeVal *expr, const char *name, int min, int max) {
+    if (expr->type != CONS_TYPE || car(expr)->type != SYMBOL_TYPE ||
+        strcmp(car(expr)->s, name)) {
+        return false;
+    }
+    int count = properLength(expr);
+    return count >= min && (max < 0 || count <= max);
+}
+
+/* Checks if symbol is in the list symbols */
+static bool containsSymbol(SchemeVal *symbols, SchemeVal *symbol) {
+    for (; !isEmpty(symbols); symbols = cdr(symbols)) {
+        if (!strcmp(car(symbols)->s, symbol->s)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Checks if value is false */
+static bool isFalse(SchemeVal *value) {
+    return value->type == BOOL_TYPE && !value->b;
+}
+
+// Checks the operands of a do form as checkBindings does those of a let
+const char *doError(SchemeVal *args, char *buffer, size_t size) {
+    if (properLength(args) < 2) {
+        return "do needs bindings and a test clause";
+    }
+    SchemeVal *specs = car(args);
+    if (properLength(specs) < 0) {
+        return "malformed bindings";
+    }
+    for (SchemeVal *current = specs; !isEmpty(current); current = cdr(current)) {
+        SchemeVal *spec = car(current);
+        int count = properLength(spec);
+        if (count != 2 && count != 3) {
+            return "invalid do binding form";
+        }
+        if (car(spec)->type != SYMBOL_TYPE) {
+            return "binding name must be a symbol";
+        }
+        for (SchemeVal *seen = specs; seen != current; seen = cdr(seen)) {
+            if (!strcmp(car(car(seen))->s, car(spec)->s)) {
+                snprintf(buffer, size, "duplicate binding '%s'", car(spec)->s);
+                return buffer;
+            }
+        }
+    }
+    if (properLength(car(cdr(args))) < 1) {
+        return "do test clause must be a list starting with the test";
+    }
+    return NULL;
+}
+
+/* Raises the error doError finds, if any */
+static void checkDo(SchemeVal *args) {
+    char buffer[200];
+    const char *error = doError(args, buffer, sizeof(buffer));
+    if (error != NULL) {
+        evalError("%s", error);
+    }
+}
+
+/* Raises the error evalLet would for a named let's bindings and body */
+static void checkNamedLet(SchemeVal *args) {
+    if (isEmpty(cdr(args))) {
+        evalError("let needs bindings and body");
+    }
+    checkBindings(car(cdr(args)));
+    if (isEmpty(cdr(cdr(args)))) {
+        evalError("let body missing");
+    }
+}
+
+/* The call of a procedure named name, of params and body, bound by a
+   letrec, on inits */
+static SchemeVal *expandCall(SchemeVal *name, SchemeVal *params, SchemeVal *body,
+                             SchemeVal *inits) {
+    SchemeVal *lambda = cons(makeSymbol("lambda"), cons(params, body));
+    SchemeVal *binding = cons(name, cons(lambda, makeEmpty()));
+    SchemeVal *letrec = cons(makeSymbol("letrec"),
+                             cons(cons(binding, makeEmpty()), cons(name, makeEmpty())));
+    return cons(letrec, inits);
+}
+
+/* The expansion of a named let's operands */
+static SchemeVal *expandNamedLet(SchemeVal *args) {
+    SchemeVal *params = makeEmpty();
+    SchemeVal *inits = makeEmpty();
+    for (SchemeVal *binding = car(cdr(args)); !isEmpty(binding); binding = cdr(binding)) {
+        params = cons(car(car(binding)), params);
+        inits = cons(car(cdr(car(binding))), inits);
+    }
+    return expandCall(car(args), reverse(params), cdr(cdr(args)), reverse(inits));
+}
+
+/* The expansion of a do form's operands */
+static SchemeVal *expandDo(SchemeVal *args) {
+    SchemeVal *name = makeSymbol("#do");
+    SchemeVal *params = makeEmpty();
+    SchemeVal *inits = makeEmpty();
+    SchemeVal *steps = makeEmpty();
+    for (SchemeVal *spec = car(args); !isEmpty(spec); spec = cdr(spec)) {
+        SchemeVal *var = car(car(spec));
+        SchemeVal *step = cdr(cdr(car(spec)));
+        params = cons(var, params);
+        inits = cons(car(cdr(car(spec))), inits);
+        steps = cons(isEmpty(step) ? var : car(step), steps);
+    }
+
+    SchemeVal *clause = car(cdr(args));
+    SchemeVal *commands = cdr(cdr(args));
+    SchemeVal *again = cons(name, reverse(steps));
+    if (!isEmpty(commands)) {
+        SchemeVal *sequence = cons(again, makeEmpty());
+        for (SchemeVal *command = reverse(commands); !isEmpty(command); command = cdr(command)) {
+            sequence = cons(car(command), sequence);
+        }
+        again = cons(makeSymbol("let"), cons(makeEmpty(), sequence));
+    }
+    SchemeVal *results;
+    if (isEmpty(cdr(clause))) {
+        results = cons(makeSymbol("quote"), cons(makeVoid(), makeEmpty()));
+    } else {
+        results = cons(makeSymbol("let"), cons(makeEmpty(), cdr(clause)));
+    }
+    SchemeVal *body = cons(makeSymbol("if"),
+                           cons(car(clause), cons(results, cons(again, makeEmpty()))));
+    return expandCall(name, reverse(params), cons(body, makeEmpty()), reverse(inits));
+}
+
+// Checks expr and expands it as loop.h describes
+SchemeVal *expandLoop(SchemeVal *expr) {
+    SchemeVal *args = cdr(expr);
+    SchemeVal *expansion;
+    if (!strcmp(car(expr)->s, "do")) {
+        checkDo(args);
+        expansion = expandDo(args);
+    } else {
+        checkNamedLet(args);
+        expansion = expandNamedLet(args);
+    }
+    copyPosition(expansion, expr);
+    return expansion;
+}
+
+/* Checks if name occurs in expr only as the operator of calls with count
+   arguments, and those only in tail position if tail is true and nowhere
+   otherwise. Quoted data does not count, nor the binding and closure an
+   #inline form guards on. */
+static bool onlyTailCalls(SchemeVal *expr, SchemeVal *name, int count, bool tail) {
+    if (expr->type == SYMBOL_TYPE) {
+        return strcmp(expr->s, name->s) != 0;
+    }
+    if (expr->type != CONS_TYPE || isForm(expr, "quote", 2, 2)) {
+        return true;
+    }
+    if (isForm(expr, "if", 3, 4)) {
+        SchemeVal *branches = cdr(cdr(expr));
+        return onlyTailCalls(car(cdr(expr)), name, count, false) &&
+               onlyTailCalls(car(branches), name, count, tail) &&
+               (isEmpty(cdr(branches)) || onlyTailCalls(car(cdr(branches)), name, count, tail));
+    }
+    if (isForm(expr, "#inline", 5, 5)) {
+        SchemeVal *copy = cdr(cdr(cdr(expr)));
+        return onlyTailCalls(car(copy), name, count, tail) &&
+               onlyTailCalls(car(cdr(copy)), name, count, tail);
+    }
+    if (tail && car(expr)->type == SYMBOL_TYPE && !strcmp(car(expr)->s, name->s)) {
+        if (properLength(cdr(expr)) != count) {
+            return false;
+        }
+        expr = cdr(expr);
+    }
+    for (; expr->type == CONS_TYPE; expr = cdr(expr)) {
+        if (!onlyTailCalls(car(expr), name, count, false)) {
+            return false;
+        }
+    }
+    return onlyTailCalls(expr, name, count, false);
+}
+
+/* Checks if a named let, well formed, can be run as a loop: name is not
+   one of its variables and only occurs in its body in calls that start the
+   next iteration */
+static bool isLoopable(SchemeVal *name, SchemeVal *bindings, SchemeVal *body) {
+    int count = 0;
+    for (; !isEmpty(bindings); bindings = cdr(bindings), count++) {
+        if (!strcmp(car(car(bindings))->s, name->s)) {
+            return false;
+        }
+    }
+    for (; !isEmpty(body); body = cdr(body)) {
+        if (!onlyTailCalls(car(body), name, count, isEmpty(cdr(body)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Checks if expr contains, at any depth outside quoted data, the symbol
+   define, which is taken as a define form to be safe */
+static bool mayDefine(SchemeVal *expr) {
+    if (expr->type == SYMBOL_TYPE) {
+        return !strcmp(expr->s, "define");
+    }
+    if (isForm(expr, "quote", 2, 2)) {
+        return false;
+    }
+    for (; expr->type == CONS_TYPE; expr = cdr(expr)) {
+        if (mayDefine(car(expr))) {
+            return true;
+        }
+    }
+    return expr->type == SYMBOL_TYPE && mayDefine(expr);
+}
+
+/* The binding of symbol in frame or the frames around it, or NULL */
+static SchemeVal *findBinding(SchemeVal *symbol, Frame *frame) {
+    for (; frame != NULL; frame = frame->parent) {
+        SchemeVal *bindings = __atomic_load_n(&frame->bindings, __ATOMIC_ACQUIRE);
+        for (; !isEmpty(bindings); bindings = cdr(bindings)) {
+            if (!strcmp(car(car(bindings))->s, symbol->s)) {
+                return car(bindings);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Checks if value is one of the scratchPrimitives */
+static bool isScratchPrimitive(SchemeVal *value) {
+    if (value->type != PRIMITIVE_TYPE) {
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(scratchPrimitives) / sizeof(scratchPrimitives[0]); i++) {
+        if (!strcmp(primitiveName(value->primitive), scratchPrimitives[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool isScratchSafe(Loop *loop, SchemeVal *expr, SchemeVal *locals, SchemeVal *names);
+
+/* isScratchSafe for each element of list */
+static bool allScratchSafe(Loop *loop, SchemeVal *list, SchemeVal *locals, SchemeVal *names) {
+    for (; !isEmpty(list); list = cdr(list)) {
+        if (!isScratchSafe(loop, car(list), locals, names)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* isScratchSafe for the bindings and body of a let, or a named let whose
+   calls to name are in names */
+static bool isLetScratchSafe(Loop *loop, SchemeVal *bindings, SchemeVal *body,
+                             SchemeVal *locals, SchemeVal *names) {
+    if (properLength(bindings) < 0 || properLength(body) < 1) {
+        return false;
+    }
+    SchemeVal *inner = locals;
+    for (; !isEmpty(bindings); bindings = cdr(bindings)) {
+        SchemeVal *binding = car(bindings);
+        if (properLength(binding) != 2 || car(binding)->type != SYMBOL_TYPE ||
+            !isScratchSafe(loop, car(cdr(binding)), locals, names)) {
+            return false;
+        }
+        inner = cons(car(binding), inner);
+    }
+    return allScratchSafe(loop, body, inner, names);
+}
+
+/* Checks if expr can be evaluated in a scratch heap: nothing it allocates
+   is kept anywhere but in its value. locals are the variables bound inside
+   the loop around expr, which the primitives it calls must not be, and
+   names the names of named lets around it that it may call. The bindings
+   of those primitives are added to the loop's guards. */
+static bool isScratchSafe(Loop *loop, SchemeVal *expr, SchemeVal *locals, SchemeVal *names) {
+    switch (expr->type) {
+        case INT_TYPE:
+        case DOUBLE_TYPE:
+        case STR_TYPE:
+        case BOOL_TYPE:
+        case SYMBOL_TYPE:
+            return true;
+        case CONS_TYPE:
+            break;
+        default:
+            return false;
+    }
+    SchemeVal *first = car(expr);
+    SchemeVal *args = cdr(expr);
+    if (properLength(expr) < 0 || first->type != SYMBOL_TYPE) {
+        return false;
+    }
+    if (containsSymbol(names, first)) {
+        return allScratchSafe(loop, args, locals, names);
+    }
+    if (!isSpecialForm(first)) {
+        SchemeVal *binding = containsSymbol(locals, first) ? NULL : findBinding(first, loop->parent);
+        SchemeVal *value = binding != NULL ? __atomic_load_n(&binding->cdr, __ATOMIC_ACQUIRE) : NULL;
+        if (value == NULL || !isScratchPrimitive(value)) {
+            return false;
+        }
+        loop->guards = cons(cons(binding, value), loop->guards);
+        return allScratchSafe(loop, args, locals, names);
+    }
+    if (isForm(expr, "quote", 2, 2)) {
+        return true;
+    }
+    if (isForm(expr, "if", 3, 4)) {
+        return allScratchSafe(loop, args, locals, names);
+    }
+    if (isForm(expr, "#inline", 5, 5)) {
+        // the copy is used while the guard holds, and it is checked
+        loop->guards = cons(cons(car(args), car(cdr(args))), loop->guards);
+        return isScratchSafe(loop, car(cdr(cdr(args))), locals, names);
+    }
+    if (isForm(expr, "let", 3, -1) && car(args)->type == SYMBOL_TYPE) {
+        SchemeVal *bindings = car(cdr(args));
+        SchemeVal *body = cdr(cdr(args));
+        return properLength(bindings) >= 0 && isLoopable(car(args), bindings, body) &&
+               isLetScratchSafe(loop, bindings, body, locals, cons(car(args), names));
+    }
+    if (isForm(expr, "let", 3, -1)) {
+        return isLetScratchSafe(loop, car(args), cdr(args), locals, names);
+    }
+    char buffer[200];
+    if (isForm(expr, "do", 3, -1) && doError(args, buffer, sizeof(buffer)) == NULL) {
+        SchemeVal *inner = locals;
+        for (SchemeVal *spec = car(args); !isEmpty(spec); spec = cdr(spec)) {
+            if (!isScratchSafe(loop, car(cdr(car(spec))), locals, names)) {
+                return false;
+            }
+            inner = cons(car(car(spec)), inner);
+        }
+        for (SchemeVal *spec = car(args); !isEmpty(spec); spec = cdr(spec)) {
+            if (!allScratchSafe(loop, cdr(cdr(car(spec))), inner, names)) {
+                return false;
+            }
+        }
+        return allScratchSafe(loop, car(cdr(args)), inner, names) &&
+               allScratchSafe(loop, cdr(cdr(args)), inner, names);
+    }
+    return false;
+}
+
+/* isScratchSafe for the last form of the loop's body, a named let's, in
+   tail position: what the loop ends with is evaluated once it has left the
+   scratch heap, so only the parts that decide on an iteration and start
+   the next one need be safe */
+static bool isScratchTail(Loop *loop, SchemeVal *expr, SchemeVal *locals) {
+    if (isForm(expr, "if", 3, 4)) {
+        SchemeVal *branches = cdr(cdr(expr));
+        return isScratchSafe(loop, car(cdr(expr)), locals, makeEmpty()) &&
+               isScratchTail(loop, car(branches), locals) &&
+               (isEmpty(cdr(branches)) || isScratchTail(loop, car(cdr(branches)), locals));
+    }
+    if (isForm(expr, "#inline", 5, 5)) {
+        SchemeVal *args = cdr(expr);
+        loop->guards = cons(cons(car(args), car(cdr(args))), loop->guards);
+        return isScratchTail(loop, car(cdr(cdr(args))), locals);
+    }
+    if (expr->type == CONS_TYPE && car(expr)->type == SYMBOL_TYPE &&
+        !strcmp(car(expr)->s, loop->name->s)) {
+        return allScratchSafe(loop, cdr(expr), locals, makeEmpty());
+    }
+    return true;
+}
+
+/* Decides whether the loop iterates in a scratch heap. Its frame, and
+   anything else it keeps for good, must be made before it starts to. */
+static void planScratch(Loop *loop) {
+    loop->guards = makeEmpty();
+    if (loop->fresh) {
+        return;
+    }
+    SchemeVal *locals = makeEmpty();
+    for (int i = 0; i < loop->count; i++) {
+        locals = cons(loop->vars[i], locals);
+    }
+    bool safe;
+    if (loop->name == NULL) {
+        // a do form's results, like a named let's exit, come afterwards
+        SchemeVal *args = loop->args;
+        safe = isScratchSafe(loop, car(car(cdr(args))), locals, makeEmpty()) &&
+               allScratchSafe(loop, cdr(cdr(args)), locals, makeEmpty());
+        for (SchemeVal *spec = car(args); safe && !isEmpty(spec); spec = cdr(spec)) {
+            safe = allScratchSafe(loop, cdr(cdr(car(spec))), locals, makeEmpty());
+        }
+    } else {
+        SchemeVal *body = loop->body;
+        safe = true;
+        for (; safe && !isEmpty(cdr(body)); body = cdr(body)) {
+            safe = isScratchSafe(loop, car(body), locals, makeEmpty());
+        }
+        safe = safe && isScratchTail(loop, car(body), locals);
+    }
+    loop->scratch = safe;
+}
+
+/* Checks that the primitives the scratch heap was chosen for are still
+   bound where they were */
+static bool guardsHold(Loop *loop) {
+    for (SchemeVal *guard = loop->guards; !isEmpty(guard); guard = cdr(guard)) {
+        if (__atomic_load_n(&car(car(guard))->cdr, __ATOMIC_ACQUIRE) != cdr(car(guard))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Goes back to the heap the loop started in. What the iteration allocated
+   is kept as well, or else freed, and the values of the variables are. */
+static void leaveScratch(Loop *loop, bool keepIteration) {
+    useHeap(loop->previous);
+    if (keepIteration) {
+        adoptHeap(&loop->iteration);
+    } else {
+        tfreeData(&loop->iteration);
+    }
+    adoptHeap(&loop->kept);
+    adoptHeap(&loop->built);
+    loop->scratch = false;
+}
+
+/* Checks if value, if allocated in the scratch heap, can outlive the rest
+   of what was: it refers to no other allocation */
+static bool isAtom(SchemeVal *value) {
+    switch (value->type) {
+        case INT_TYPE:
+        case DOUBLE_TYPE:
+        case BOOL_TYPE:
+        case EMPTY_TYPE:
+        case VOID_TYPE:
+        case UNSPECIFIED_TYPE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Moves value into the loop's built heap if the iteration allocated it or
+   it is kept, along with the parts of it that are. Returns false if one of
+   them is neither a pair nor an atom. */
+static bool keepBuilt(Loop *loop, SchemeVal *value) {
+    while (moveAllocation(&loop->iteration, &loop->built, value) ||
+           moveAllocation(&loop->kept, &loop->built, value)) {
+        if (isAtom(value)) {
+            return true;
+        }
+        if (value->type != CONS_TYPE || !keepBuilt(loop, car(value))) {
+            return false;
+        }
+        value = cdr(value);
+    }
+    return true;
+}
+
+/* Ends an iteration in the scratch heap: keeps the new values, and frees
+   the rest of what the iteration allocated and the old values no variable
+   has any more. New pairs, which may share parts with the old values, are
+   built up until the loop ends instead. Returns false if a new value refers
+   to some other kind of value the iteration allocated. */
+static bool keepValues(Loop *loop, SchemeVal **values) {
+    for (int i = 0; i < loop->count; i++) {
+        if (!isAtom(values[i]) && !keepBuilt(loop, values[i])) {
+            return false;
+        }
+    }
+    Heap kept = {0};
+    for (int i = 0; i < loop->count; i++) {
+        if (isAtom(values[i]) && !moveAllocation(&loop->iteration, &kept, values[i])) {
+            moveAllocation(&loop->kept, &kept, values[i]);
+        }
+    }
+    tfreeData(&loop->kept);
+    loop->kept.active_list = kept.active_list;
+    loop->kept.tail = kept.tail;
+    tfreeData(&loop->iteration);
+    return true;
+}
+
+/* Binds the loop's variables to values in a new frame, made on the frame
+   stack unless it is made afresh each iteration */
+static void bindLoop(Loop *loop, SchemeVal **values) {
+    Frame *frame = NULL;
+    SchemeVal *cells = NULL;
+    if (!loop->fresh && stackFramesEnabled()) {
+        frame = pushFrameStack(sizeof(Frame) + (2 * loop->count + 1) * sizeof(SchemeVal));
+        cells = frame != NULL ? (SchemeVal *)(frame + 1) : NULL;
+    }
+    if (frame == NULL) {
+        frame = talloc(sizeof(Frame));
+    }
+    startFrame(frame, loop->parent, cells);
+    for (int i = 0; i < loop->count; i++) {
+        addBinding(frame, loop->vars[i], values[i], cells != NULL ? &cells[2 * i + 1] : NULL);
+        loop->bindings[i] = car(frame->bindings);
+    }
+    loop->frame = frame;
+}
+
+/* Gives the variables their values for the next iteration */
+static void nextIteration(Loop *loop, SchemeVal **values) {
+    if (loop->scratch && !keepValues(loop, values)) {
+        leaveScratch(loop, true);
+    }
+    if (loop->fresh) {
+        bindLoop(loop, values);
+    } else {
+        for (int i = 0; i < loop->count; i++) {
+            loop->bindings[i]->cdr = values[i];
+        }
+    }
+    if (loop->scratch && !guardsHold(loop)) {
+        leaveScratch(loop, true);
+    }
+}
+
+/* Runs iterations until iterate, which stores the new values of the
+   variables in values, returns false, then evaluates what the loop ends
+   with. In a scratch heap, an error is caught to hand what the iteration
+   allocated back first. */
+static SchemeVal *runLoop(Loop *loop, bool (*iterate)(Loop *, SchemeVal **),
+                          SchemeVal **values) {
+    ErrorHandler handler;
+    bool caught = loop->scratch;
+    if (caught) {
+        pushHandler(&handler);
+        if (setjmp(handler.env) != 0) {
+            popHandler(&handler);
+            if (loop->scratch) {
+                leaveScratch(loop, true);
+            }
+            raiseCondition(lastCondition());
+        }
+        nestHeap(&loop->iteration);
+        loop->previous = useHeap(&loop->iteration);
+    }
+    while (iterate(loop, values)) {
+        nextIteration(loop, values);
+    }
+    if (loop->scratch) {
+        // the test that ended the loop is all that is left
+        leaveScratch(loop, false);
+    }
+    if (caught) {
+        popHandler(&handler);
+    }
+
+    if (loop->name != NULL) {
+        return eval(loop->last, loop->frame);
+    }
+    SchemeVal *result = makeVoid();
+    for (SchemeVal *expr = loop->results; !isEmpty(expr); expr = cdr(expr)) {
+        result = eval(car(expr), loop->frame);
+    }
+    return result;
+}
+
+/* One iteration of a do form: false if its test holds */
+static bool iterateDo(Loop *loop, SchemeVal **values) {
+    SchemeVal *clause = car(cdr(loop->args));
+    if (!isFalse(eval(car(clause), loop->frame))) {
+        loop->results = cdr(clause);
+        return false;
+    }
+    for (SchemeVal *command = cdr(cdr(loop->args)); !isEmpty(command); command = cdr(command)) {
+        eval(car(command), loop->frame);
+    }
+    int i = 0;
+    for (SchemeVal *spec = car(loop->args); !isEmpty(spec); spec = cdr(spec), i++) {
+        SchemeVal *step = cdr(cdr(car(spec)));
+        values[i] = isEmpty(step) ? loop->bindings[i]->cdr : eval(car(step), loop->frame);
+    }
+    return true;
+}
+
+/* One iteration of a named let: evaluates its body up to the tail call
+   that starts the next one, as evalIf and evalInline would, or up to the
+   expression it ends with, and returns false then */
+static bool iterateNamedLet(Loop *loop, SchemeVal **values) {
+    SchemeVal *body = loop->body;
+    for (; !isEmpty(cdr(body)); body = cdr(body)) {
+        eval(car(body), loop->frame);
+    }
+    SchemeVal *expr = car(body);
+    for (;;) {
+        if (isForm(expr, "if", 3, 4)) {
+            useFuel();
+            TRACE_EVAL(expr);
+            countEval(EVAL_IF);
+            SchemeVal *branches = cdr(cdr(expr));
+            if (!isFalse(eval(car(cdr(expr)), loop->frame))) {
+                expr = car(branches);
+            } else if (isEmpty(cdr(branches))) {
+                evalError("missing else clause");
+            } else {
+                expr = car(cdr(branches));
+            }
+        } else if (isForm(expr, "#inline", 5, 5)) {
+            useFuel();
+            TRACE_EVAL(expr);
+            countEval(EVAL_INLINE);
+            SchemeVal *args = cdr(expr);
+            SchemeVal *binding = car(args);
+            bool holds = __atomic_load_n(&binding->cdr, __ATOMIC_ACQUIRE) == car(cdr(args));
+            expr = holds ? car(cdr(cdr(args))) : car(cdr(cdr(cdr(args))));
+        } else {
+            break;
+        }
+    }
+    if (expr->type != CONS_TYPE || car(expr)->type != SYMBOL_TYPE ||
+        strcmp(car(expr)->s, loop->name->s)) {
+        loop->last = expr;
+        return false;
+    }
+    useFuel();
+    TRACE_EVAL(expr);
+    countEval(EVAL_APPLICATION);
+    int i = 0;
+    for (SchemeVal *arg = cdr(expr); !isEmpty(arg); arg = cdr(arg), i++) {
+        values[i] = eval(car(arg), loop->frame);
+    }
+    return true;
+}
+
+/* Room for count pointers on the frame stack, or from talloc if it is
+   full; the loop's variables may be as many as the program likes */
+static SchemeVal **pushArray(int count) {
+    size_t bytes = (count > 0 ? count : 1) * sizeof(SchemeVal *);
+    SchemeVal **array = pushFrameStack(bytes);
+    return array != NULL ? array : talloc(bytes);
+}
+
+// Runs the do form as a loop, or evaluates its expansion under --no-loops
+SchemeVal *evalDo(SchemeVal *args, Frame *frame) {
+    checkDo(args);
+    if (!enabled) {
+        return eval(expandDo(args), frame);
+    }
+    int count = length(car(args));
+    char *mark = markFrameStack();
+    SchemeVal **vars = pushArray(count);
+    SchemeVal **bindings = pushArray(count);
+    SchemeVal **values = pushArray(count);
+    int i = 0;
+    for (SchemeVal *spec = car(args); !isEmpty(spec); spec = cdr(spec), i++) {
+        vars[i] = car(car(spec));
+        values[i] = eval(car(cdr(car(spec))), frame);
+    }
+
+    Loop loop;
+    memset(&loop, 0, sizeof(Loop));
+    loop.parent = frame;
+    loop.vars = vars;
+    loop.bindings = bindings;
+    loop.count = count;
+    loop.args = args;
+    loop.fresh = bodyCaptures(args) || mayDefine(args);
+    bindLoop(&loop, values);
+    planScratch(&loop);
+    SchemeVal *result = runLoop(&loop, iterateDo, values);
+    popFrameStack(mark);
+    return result;
+}
+
+/* Evaluates a named let that cannot run as a loop: binds name, in a frame
+   of its own, to a procedure of the variables and body, and calls it */
+static SchemeVal *callNamedLet(SchemeVal *args, Frame *frame) {
+    runtimeStats.frames++;
+    Frame *procedureFrame = talloc(sizeof(Frame));
+    procedureFrame->parent = frame;
+    procedureFrame->bindings = makeEmpty();
+
+    SchemeVal *params = makeEmpty();
+    SchemeVal *values = makeEmpty();
+    for (SchemeVal *binding = car(cdr(args)); !isEmpty(binding); binding = cdr(binding)) {
+        params = cons(car(car(binding)), params);
+        values = cons(eval(car(cdr(car(binding))), frame), values);
+    }
+    SchemeVal *procedure = evalLambda(cons(reverse(params), cdr(cdr(args))), procedureFrame);
+    defineVariable(car(args), procedure, procedureFrame);
+    return apply(procedure, reverse(values), frame);
+}
+
+// Runs the named let as a loop if it is one, evaluating its expansion under
+// --no-loops
+SchemeVal *evalNamedLet(SchemeVal *args, Frame *frame) {
+    checkNamedLet(args);
+    SchemeVal *name = car(args);
+    SchemeVal *bindingList = car(cdr(args));
+    SchemeVal *body = cdr(cdr(args));
+    if (!enabled) {
+        return eval(expandNamedLet(args), frame);
+    }
+    if (!isLoopable(name, bindingList, body)) {
+        return callNamedLet(args, frame);
+    }
+    int count = length(bindingList);
+    char *mark = markFrameStack();
+    SchemeVal **vars = pushArray(count);
+    SchemeVal **bindings = pushArray(count);
+    SchemeVal **values = pushArray(count);
+    int i = 0;
+    for (SchemeVal *binding = bindingList; !isEmpty(binding); binding = cdr(binding), i++) {
+        vars[i] = car(car(binding));
+        values[i] = eval(car(cdr(car(binding))), frame);
+    }
+
+    Loop loop;
+    memset(&loop, 0, sizeof(Loop));
+    loop.parent = frame;
+    loop.vars = vars;
+    loop.bindings = bindings;
+    loop.count = count;
+    loop.name = name;
+    loop.body = body;
+    loop.fresh = bodyCaptures(body) || mayDefine(body);
+    bindLoop(&loop, values);
+    planScratch(&loop);
+    SchemeVal *result = runLoop(&loop, iterateNamedLet, values);
+    popFrameStack(mark);
+    return result;
+}
@@ -0,0 +1,66 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include "schemeval.h"
+
+#ifndef _LOOP
+#define _LOOP
+
+// Loops: the do form and named let. Each stands for a procedure calling
+// itself, which expandLoop below spells out. eval instead runs them as
+// loops, with one frame of the loop variables that each iteration updates
+// in place, so an iteration costs no frame, binding list or argument list.
+//
+//   (do ((var init step) ...) (test result ...) command ...)
+// binds each var to its init, then until test holds evaluates the commands
+// and sets each var that has a step to it, the steps all evaluated first.
+// It returns the last result, or nothing if there are none.
+//
+//   (let name ((var init) ...) body ...)
+// is a let whose body may call name to start it again with new values. It
+// is run as a loop when name only occurs as the operator of such calls with
+// one argument per variable, in tail position: the last form of the body,
+// or a branch of an if there. Otherwise name is bound to a procedure made
+// in a frame of its own, as expandLoop does.
+//
+// A loop whose parts might make a closure or start a future (escape.h), or
+// define a variable, binds its variables in a new frame each iteration, so
+// what is made in one iteration keeps that iteration's values.
+//
+// A loop made only of constants, variables, quote, if, inlined copies,
+// nested loops and lets, and calls of +, <, null?, car, cdr and cons also
+// runs in constant memory. Each iteration allocates from a scratch heap,
+// which is freed once the new values of the variables are known, keeping
+// only those of them that are numbers, booleans and the like allocated in
+// it, and the pairs made in it for them along with what those hold, which
+// are not freed before the loop ends. A loop that builds a list thus keeps
+// only the list. Should some new value be any other value made in the
+// iteration, or a primitive it calls be rebound, the loop goes on without a
+// scratch heap.
+//
+// --no-loops evaluates loops as their expansion instead. The explicit-stack
+// evaluator (--cek) and the compiler always do.
+
+// On by default. Call before evaluation starts.
+void setLoopsEnabled(bool enabled);
+bool loopsEnabled();
+
+// Evaluates the operands of a do form.
+SchemeVal *evalDo(SchemeVal *args, Frame *frame);
+
+// Evaluates the operands of a named let, whose first one is the name.
+SchemeVal *evalNamedLet(SchemeVal *args, Frame *frame);
+
+// The error evalDo raises for the operands of a do form, or NULL if they
+// are well formed.
+const char *doError(SchemeVal *args, char *buffer, size_t size);
+
+// The expansion of a do form or named let, after raising the error eval
+// would if it is malformed:
+//   ((letrec ((name (lambda (var ...) body ...))) name) init ...)
+// where a do form's loop is named #do and its body is
+//   (if test (let () result ...) (let () command ... (#do step ...)))
+// with a var for each missing step, and nothing returned if there are no
+// results.
+SchemeVal *expandLoop(SchemeVal *expr);
+
+#endif
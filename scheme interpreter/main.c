@@ -1,17 +1,269 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
 #include "tokenizer.h"
 #include "schemeval.h"
 #include "linkedlist.h"
 #include "parser.h"
 #include "talloc.h"
 #include "interpreter.h"
+#include "fasl.h"
+#include "cek.h"
+#include "server.h"
+#include "quota.h"
+#include "profiler.h"
+#include "trace.h"
+#include "compiler.h"
+#include "jit.h"
+#include "inline.h"
+#include "escape.h"
+#include "closure.h"
+#include "loop.h"
 
-int main() {
+/* Evaluates a top-level form in the global frame context */
+static int runForm(SchemeVal *form, void *context) {
+    return interpretForm(form, context);
+}
+
+/* Adds a top-level form to the front of the list context points at */
+static int keepForm(SchemeVal *form, void *context) {
+    SchemeVal **forms = context;
+    *forms = cons(form, *forms);
+    return 0;
+}
 
-    SchemeVal *list = tokenize();
-    SchemeVal *tree = parse(list);
-    interpret(tree);
+// Options that are followed by a value
+static const char *valueOptions[] = {
+    "--image", "--save-image", "--serve", "--workers",
+    "--job-cpu", "--job-timeout", "--job-memory", "--job-output",
+    "--max-steps", "--max-alloc", "--max-time", "--profile", "--profile-hz",
+    "--trace", "--trace-records", "--emit-c",
+};
 
+// Checks if arg is an option that is followed by a value
+bool takesValue(const char *arg) {
+    for (size_t i = 0; i < sizeof(valueOptions) / sizeof(valueOptions[0]); i++) {
+        if (!strcmp(arg, valueOptions[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Reads the program in the files named in argv, or on stdin when there are
+   none and no socket to serve, a top-level form at a time, handing each to
+   action
+   Output: the number of syntax errors plus the errors action returned */
+static int readProgram(int argc, char **argv, bool useCache, bool serving,
+                       FormAction action, void *context) {
+    int errors = 0;
+    bool haveFiles = false;
+    for (int i = 1; i < argc; i++) {
+        if (takesValue(argv[i])) {
+            i++;
+        } else if (strncmp(argv[i], "--", 2)) {
+            errors += loadSource(argv[i], useCache, action, context);
+            haveFiles = true;
+        }
+    }
+    if (!haveFiles && !serving) {
+        errors += readForms(stdin, NULL, action, context);
+    }
+    return errors;
+}
+
+// Usage: interpreter [--cache] [--cek] [--no-jit] [--no-inline] [--no-fold]
+//                    [--no-stack-frames] [--no-flat-closures] [--no-loops]
+//                    [--alloc-stats] [--alloc-profile] [--perf-map]
+//                    [--image FILE] [--save-image FILE]
+//                    [--max-steps N] [--max-alloc MB] [--max-time MS]
+//                    [--profile FILE [--profile-hz N]]
+//                    [--trace FILE [--trace-records N]] [--emit-c FILE]
+//                    [--serve SOCKET [--workers N] [--job-cpu SEC]
+//                     [--job-timeout SEC] [--job-memory MB] [--job-output KB]]
+//                    [file ...]
+// With no files the program is read from stdin. Files are run in order as
+// one program, each top-level form evaluated as soon as it has been read; a
+// form with a syntax error is reported and skipped. With --cache each file's
+// parse tree is kept in "<file>.fasl".
+// --image starts from a saved global environment instead of a fresh one, and
+// --save-image writes the global environment out after the program has run.
+// --cek evaluates on the explicit-stack evaluator, which has no recursion
+// limit and supports re-entering continuations.
+// --no-jit keeps hot closures in the interpreter instead of compiling them
+// to machine code (see jit.h), --no-inline leaves calls of small procedures
+// as calls instead of inlining them, and --no-fold leaves constant
+// expressions to be computed each time they run (see inline.h).
+// --no-stack-frames makes every environment frame with talloc, even those
+// no closure or future can keep (see escape.h), --no-flat-closures makes
+// closures keep the whole frame they are made in (see closure.h), and
+// --no-loops runs do forms and named lets as the recursive procedures they
+// stand for instead of as loops (see loop.h).
+// The --max-* options limit each top-level form to N evaluation steps, MB
+// megabytes allocated and MS milliseconds; a form over its limit fails with
+// an error like any other.
+// --profile samples the Scheme call stack N times a second of CPU time
+// (default 1000) while the program runs, writes the stacks to FILE in the
+// folded format flamegraph tools read, and prints the procedures with the
+// most time to stderr.
+// --trace records eval, apply, heap growth and error events in a ring of the
+// last N (default 1048576) per thread, written to FILE at exit or on a fatal
+// signal; only in interpreters built with -DSCHEME_TRACE (see trace.h).
+// --emit-c writes the program translated to C to FILE instead of running it;
+// see compiler.h.
+// --perf-map names Scheme procedures for Linux perf in /tmp/perf-PID.map.
+// --alloc-stats prints how many allocations the program made to stderr.
+// --alloc-profile counts allocations by the C function and Scheme procedure
+// that made them, and prints the biggest sites to stderr at exit; the
+// (heap-report) primitive prints the same report on demand.
+// --serve runs the files as a prelude and then serves programs sent over the
+// Unix socket SOCKET (see server.h), each one under the --job-* limits.
+int main(int argc, char **argv) {
+    bool useCache = false;
+    bool allocStats = false;
+    bool allocProfile = false;
+    char *imagePath = NULL;
+    char *saveImagePath = NULL;
+    char *socketPath = NULL;
+    char *profilePath = NULL;
+    int profileHz = 1000;
+    char *tracePath = NULL;
+    char *emitPath = NULL;
+    long traceRecords = 1 << 20;
+    ServerOptions serverOptions;
+    defaultServerOptions(&serverOptions);
+    Quota quota = {0, 0, 0};
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--cache")) {
+            useCache = true;
+        } else if (!strcmp(argv[i], "--alloc-stats")) {
+            allocStats = true;
+        } else if (!strcmp(argv[i], "--alloc-profile")) {
+            startAllocationProfile();
+            allocProfile = true;
+        } else if (!strcmp(argv[i], "--perf-map")) {
+            if (!startPerfMap()) {
+                printf("Error: could not create the perf map\n");
+                texit(1);
+            }
+        } else if (!strcmp(argv[i], "--cek")) {
+            setCekEnabled(true);
+        } else if (!strcmp(argv[i], "--no-jit")) {
+            setJitEnabled(false);
+        } else if (!strcmp(argv[i], "--no-inline")) {
+            setInliningEnabled(false);
+        } else if (!strcmp(argv[i], "--no-fold")) {
+            setFoldingEnabled(false);
+        } else if (!strcmp(argv[i], "--no-stack-frames")) {
+            setStackFramesEnabled(false);
+        } else if (!strcmp(argv[i], "--no-flat-closures")) {
+            setFlatClosuresEnabled(false);
+        } else if (!strcmp(argv[i], "--no-loops")) {
+            setLoopsEnabled(false);
+        } else if (!strcmp(argv[i], "--image") && i + 1 < argc) {
+            imagePath = argv[++i];
+        } else if (!strcmp(argv[i], "--save-image") && i + 1 < argc) {
+            saveImagePath = argv[++i];
+        } else if (!strcmp(argv[i], "--serve") && i + 1 < argc) {
+            socketPath = argv[++i];
+        } else if (!strcmp(argv[i], "--workers") && i + 1 < argc) {
+            serverOptions.workers = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--job-cpu") && i + 1 < argc) {
+            serverOptions.cpuSeconds = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--job-timeout") && i + 1 < argc) {
+            serverOptions.wallSeconds = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--job-memory") && i + 1 < argc) {
+            serverOptions.memoryBytes = atol(argv[++i]) * 1024 * 1024;
+        } else if (!strcmp(argv[i], "--job-output") && i + 1 < argc) {
+            serverOptions.outputBytes = atol(argv[++i]) * 1024;
+        } else if (!strcmp(argv[i], "--max-steps") && i + 1 < argc) {
+            quota.steps = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "--max-alloc") && i + 1 < argc) {
+            quota.bytes = atol(argv[++i]) * 1024 * 1024;
+        } else if (!strcmp(argv[i], "--max-time") && i + 1 < argc) {
+            quota.milliseconds = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "--profile") && i + 1 < argc) {
+            profilePath = argv[++i];
+        } else if (!strcmp(argv[i], "--profile-hz") && i + 1 < argc) {
+            profileHz = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (!strcmp(argv[i], "--trace-records") && i + 1 < argc) {
+            traceRecords = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "--emit-c") && i + 1 < argc) {
+            emitPath = argv[++i];
+        }
+    }
+    setFormQuota(&quota);
+    if (tracePath != NULL) {
+#ifdef SCHEME_TRACE
+        if (traceRecords < 1 || !startTrace(tracePath, traceRecords)) {
+            printf("Error: could not start tracing to %s\n", tracePath);
+            texit(1);
+        }
+#else
+        (void)traceRecords;
+        printf("Error: --trace needs an interpreter built with -DSCHEME_TRACE\n");
+        texit(1);
+#endif
+    }
+    if (emitPath != NULL) {
+        SchemeVal *forms = makeEmpty();
+        if (readProgram(argc, argv, useCache, socketPath != NULL, keepForm, &forms) > 0) {
+            texit(1);
+        }
+        FILE *out = fopen(emitPath, "w");
+        if (out == NULL) {
+            printf("Error: could not write %s\n", emitPath);
+            texit(1);
+        }
+        bool compiled = compileProgram(reverse(forms), out);
+        fclose(out);
+        texit(compiled ? 0 : 1);
+    }
+
+    Frame *global;
+    if (imagePath != NULL) {
+        global = loadImage(imagePath);
+        if (global == NULL) {
+            printf("Error: could not load image %s\n", imagePath);
+            texit(1);
+        }
+    } else {
+        global = makeGlobalFrame();
+    }
+    FILE *profileOut = NULL;
+    if (profilePath != NULL) {
+        profileOut = fopen(profilePath, "w");
+        if (profileOut == NULL || !startProfiler(profileHz)) {
+            printf("Error: could not start the profiler for %s\n", profilePath);
+            texit(1);
+        }
+    }
+    int errors = readProgram(argc, argv, useCache, socketPath != NULL, runForm, global);
+    if (profileOut != NULL) {
+        stopProfiler(profileOut, stderr);
+        fclose(profileOut);
+    }
+    if (socketPath != NULL) {
+        return serve(global, socketPath, &serverOptions);
+    }
+
+    if (saveImagePath != NULL && !saveImage(global, saveImagePath)) {
+        printf("Error: could not write image %s\n", saveImagePath);
+        texit(1);
+    }
+
+    if (allocProfile) {
+        allocationReport(stderr);
+    }
+    if (allocStats) {
+        long count, bytes;
+        heapStats(tallocHeap(), &count, &bytes);
+        fprintf(stderr, "allocations: %ld (%ld bytes)\n", count, bytes);
+    }
     tfree();
-    return 0;
+    return errors > 0 ? 1 : 0;
 }
@@ -2,11 +2,22 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <stdbool.h>
+#include <setjmp.h>
 #include "parser.h"
 #include "linkedlist.h"
 #include "schemeval.h"
 #include "talloc.h"
+#include "error.h"
 #include "tokenizer.h"
+#include "position.h"
+
+/* Wraps datum in (quote datum), placed where the quote token was */
+static SchemeVal *quoteDatum(SchemeVal *quoteToken, SchemeVal *datum) {
+    SchemeVal *quoted = cons(makeSymbolToken("quote"), cons(datum, makeEmpty()));
+    setPosition(quoted, quoteToken->position);
+    return quoted;
+}
 
 /* Adds token to parse tree stack, handles parentheses and quotes. 
    Input: stack, current depth, token to add. Output: updated stack */
@@ -15,6 +26,7 @@ SchemeVal *addToParseTree(SchemeVal *stack, int *depth, SchemeVal *token) {
 
     if (token->type == CLOSE_TYPE) {
         SchemeVal *elements = makeEmpty();  
+        SchemeVal *open = NULL;
         bool found_open = false;
 
         // Pop elements until matching OPEN is found
@@ -23,6 +35,7 @@ SchemeVal *addToParseTree(SchemeVal *stack, int *depth, SchemeVal *token) {
             stack = cdr(stack);
 
             if (top->type == OPEN_TYPE) {
+                open = top;
                 found_open = true;
                 *depth -= 1;
                 break;  // Stop at the matching open parenthesis
@@ -31,15 +44,18 @@ SchemeVal *addToParseTree(SchemeVal *stack, int *depth, SchemeVal *token) {
         }
 
         if (!found_open) {
-            printf("Syntax error: unmatched close parenthesis\n");
-            texit(1);
+            char where[64];
+            formatSourcePosition(token->position, where, sizeof(where));
+            syntaxError("unmatched close parenthesis at %s", where);
         }
 
+        // the list is where its open parenthesis was
         SchemeVal *subtree = elements;
+        setPosition(subtree, open->position);
 
         if (!isEmpty(stack) && car(stack)->type == QUOTE_TYPE) {
+            subtree = quoteDatum(car(stack), subtree);
             stack = cdr(stack);  // pop the quote
-            subtree = cons(makeSymbolToken("quote"), cons(subtree, makeEmpty()));
         }
 
         return cons(subtree, stack);
@@ -54,8 +70,8 @@ SchemeVal *addToParseTree(SchemeVal *stack, int *depth, SchemeVal *token) {
     else {
         // normal tokens 
         if (!isEmpty(stack) && car(stack)->type == QUOTE_TYPE) {
-            stack = cdr(stack);
-            return cons(cons(makeSymbolToken("quote"), cons(token, makeEmpty())), stack);
+            SchemeVal *quoted = quoteDatum(car(stack), token);
+            return cons(quoted, cdr(stack));
         }
         return cons(token, stack);
     }
@@ -75,84 +91,187 @@ SchemeVal *parse(SchemeVal *tokens) {
     }
 
     if (depth != 0) {
-        printf("Syntax error: not enough close parentheses\n");
-        texit(1);
+        // point at the innermost list left open
+        SchemeVal *open = stack;
+        while (!isEmpty(open) && car(open)->type != OPEN_TYPE) {
+            open = cdr(open);
+        }
+        char where[64];
+        formatSourcePosition(isEmpty(open) ? 0 : car(open)->position, where, sizeof(where));
+        syntaxError("not enough close parentheses (for the list at %s)", where);
     }
 
     // Handle any remaining top-level quotes
     while (!isEmpty(stack) && car(stack)->type == QUOTE_TYPE) {
         if (isEmpty(cdr(stack))) {
-            printf("Syntax error: quote without expression\n");
-            texit(1);
+            syntaxError("quote without expression");
         }
+        SchemeVal *quoted = quoteDatum(car(stack), car(cdr(stack)));
         stack = cdr(stack);  // pop the quote
-        SchemeVal *quoted = cons(makeSymbolToken("quote"), 
-                               cons(car(stack), makeEmpty()));
         stack = cons(quoted, cdr(stack));
     }
 
     return reverse(stack);
 }
 
-/* Helper function to recursively print syntax tree nodes */
-void printTreeHelper(SchemeVal *tree) {
+// Reads the next top-level datum of input, tokenizing no further than its
+// end. Returns NULL when only spaces and comments are left. A syntax error
+// skips the rest of the bad datum before it unwinds, so that the next call
+// reads the one after it.
+SchemeVal *readDatum(FILE *input) {
+    SchemeVal *stack = makeEmpty();
+    int depth = 0;
+    // the lists open when an error unwinds
+    volatile int open = 0;
+    ErrorHandler handler;
+    pushHandler(&handler);
+    if (setjmp(handler.env) != 0) {
+        popHandler(&handler);
+        skipOpenLists(input, open);
+        raiseCondition(lastCondition());
+    }
+
+    SchemeVal *token;
+    while ((token = nextToken(input)) != NULL) {
+        stack = addToParseTree(stack, &depth, token);
+        open = depth;
+        if (depth == 0 && car(stack)->type != QUOTE_TYPE) {
+            // all that is left below the datum are the quotes before it
+            SchemeVal *datum = car(stack);
+            for (stack = cdr(stack); !isEmpty(stack); stack = cdr(stack)) {
+                datum = quoteDatum(car(stack), datum);
+            }
+            popHandler(&handler);
+            return datum;
+        }
+    }
+    popHandler(&handler);
+
+    if (isEmpty(stack)) {
+        return NULL;
+    }
+    if (depth != 0) {
+        // point at the innermost list left open
+        SchemeVal *innermost = stack;
+        while (!isEmpty(innermost) && car(innermost)->type != OPEN_TYPE) {
+            innermost = cdr(innermost);
+        }
+        char where[64];
+        formatSourcePosition(isEmpty(innermost) ? 0 : car(innermost)->position, where,
+                             sizeof(where));
+        syntaxError("not enough close parentheses (for the list at %s)", where);
+    }
+    syntaxError("quote without expression");
+}
+
+// Reads the top-level data of input one at a time, naming their positions
+// after source, and hands each to action as soon as it has been read. A
+// datum with a syntax error is reported and skipped.
+// Output: the number of syntax errors, plus the errors action returned
+int readForms(FILE *input, const char *source, FormAction action, void *context) {
+    int errors = 0;
+    startTokenizing();
+    while (true) {
+        ErrorHandler handler;
+        setSourceName(source);
+        pushHandler(&handler);
+        if (setjmp(handler.env) != 0) {
+            popHandler(&handler);
+            printCondition(stdout, lastCondition());
+            errors++;
+            continue;
+        }
+        SchemeVal *form = readDatum(input);
+        popHandler(&handler);
+        setSourceName(NULL);
+        if (form == NULL) {
+            return errors;
+        }
+        errors += action(form, context);
+    }
+}
+
+/* Recursively prints a syntax tree node to the given stream */
+void fprintTree(FILE *out, SchemeVal *tree) {
     if (tree == NULL) return;
 
     switch (tree->type) {
         case EMPTY_TYPE:
-            printf("()"); 
+            fprintf(out, "()"); 
             break;
         case CONS_TYPE:
             // Check for (quote ...) 
             if (tree->car->type == SYMBOL_TYPE && !strcmp(tree->car->s, "quote") && 
                 tree->cdr->type == CONS_TYPE && tree->cdr->cdr->type == EMPTY_TYPE) {
                 SchemeVal *quoted = tree->cdr->car;
-                printf("(quote ");
-                printTreeHelper(quoted);
-                printf(")");
+                fprintf(out, "(quote ");
+                fprintTree(out, quoted);
+                fprintf(out, ")");
             } else {
-                printf("(");
+                fprintf(out, "(");
                 while (tree->type == CONS_TYPE) {
-                    printTreeHelper(car(tree));
+                    fprintTree(out, car(tree));
                     tree = cdr(tree);
-                    if (tree->type != EMPTY_TYPE) printf(" ");
+                    if (tree->type != EMPTY_TYPE) fprintf(out, " ");
                 }
                 if (tree->type != EMPTY_TYPE) {
-                    printf(" . ");
-                    printTreeHelper(tree);
+                    fprintf(out, " . ");
+                    fprintTree(out, tree);
                 }
-                printf(")");
+                fprintf(out, ")");
             }
             break;
         case INT_TYPE:
-            printf("%d", tree->i);
+            fprintf(out, "%d", tree->i);
             break;
         case DOUBLE_TYPE:
-            printf("%g", tree->d);
+            fprintf(out, "%g", tree->d);
             break;
         case STR_TYPE:
-            printf("\"%s\"", tree->s);
+            fprintf(out, "\"%s\"", tree->s);
             break;
         case CLOSURE_TYPE:
-            printf("#<procedure>");
+        case COMPILED_TYPE:
+            fprintf(out, "#<procedure>");
             break;
         case SYMBOL_TYPE:
             // special case for the quote symbol itself
             if (!strcmp(tree->s, "quote")) {
-                printf("quote");
+                fprintf(out, "quote");
             } else {
-                printf("%s", tree->s);
+                fprintf(out, "%s", tree->s);
             }
             break;
         case BOOL_TYPE:
-            printf("#%c", tree->b ? 't' : 'f');
+            fprintf(out, "#%c", tree->b ? 't' : 'f');
+            break;
+        case FUTURE_TYPE:
+            fprintf(out, "#<future>");
+            break;
+        case TASK_TYPE:
+            fprintf(out, "#<task>");
+            break;
+        case CHANNEL_TYPE:
+            fprintf(out, "#<channel>");
+            break;
+        case CONTINUATION_TYPE:
+            fprintf(out, "#<continuation>");
+            break;
+        case ERROR_TYPE:
+            fprintf(out, "#<error ");
+            fprintTree(out, tree->message);
+            fprintf(out, ">");
             break;
         default:
-            printf("");
             break;
     }
 }
 
+/* Helper function to recursively print syntax tree nodes */
+void printTreeHelper(SchemeVal *tree) {
+    fprintTree(stdout, tree);
+}
+
 /* Prints the entire syntax tree. Input: syntax tree to print */
 void printTree(SchemeVal *tree) {
     SchemeVal *current = tree;
@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include "schemeval.h"
 
 #ifndef _PARSER
@@ -7,6 +8,21 @@
 // parse tree representing that program.
 SchemeVal *parse(SchemeVal *tokens);
 
+// Reads the next top-level datum from input, tokenizing only as far as its
+// end, or returns NULL at the end of the input. After a syntax error the
+// rest of the bad datum has been skipped, so the next call reads on.
+SchemeVal *readDatum(FILE *input);
+
+// What readForms does with each datum it reads, such as evaluate it; returns
+// the number of errors it ran into.
+typedef int (*FormAction)(SchemeVal *form, void *context);
+
+// Reads input a top-level datum at a time, naming the source of positions
+// source (NULL for none), and hands each to action before reading the next.
+// A syntax error is printed and reading carries on with the datum after it.
+// Returns the number of syntax errors plus the errors action returned.
+int readForms(FILE *input, const char *source, FormAction action, void *context);
+
 SchemeVal *makeSymbolToken(char *symbol);
 
 // Prints the tree to the screen in a readable fashion. It should look just like
@@ -14,5 +30,9 @@ SchemeVal *makeSymbolToken(char *symbol);
 void printTree(SchemeVal *tree);
 void printTreeHelper(SchemeVal *tree);
 
+// Prints a single value or subtree to the given stream, in the same format as
+// printTreeHelper.
+void fprintTree(FILE *out, SchemeVal *tree);
+
 
 #endif
@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include "position.h"
+#include "schemeval.h"
+#include "talloc.h"
+
+// Up to this many source names can be told apart; later ones share the last.
+#define MAX_SOURCES 65535
+
+// An open-addressing table from datum addresses to positions, kept at most
+// half full. Empty entries have a NULL key. Positions pack the source index
+// into the top 16 bits, then the line into 32 bits and the column into the
+// low 16. Each context's own heap has one, made on first use and freed with
+// the heap, so contexts never wait on each other; the lock is only shared
+// with the pool threads running the context's futures.
+typedef struct {
+    SchemeVal *key;
+    SourcePosition position;
+} PositionEntry;
+
+typedef struct PositionTable {
+    PositionEntry *entries;
+    size_t capacity;
+    size_t count;
+    pthread_mutex_t lock;
+} PositionTable;
+
+// source names by index; 0 means unnamed
+static const char *sources[MAX_SOURCES + 1];
+static int sourceCount = 0;
+static pthread_mutex_t sourcesLock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local int currentSource __attribute__((tls_model("initial-exec"))) = 0;
+
+/* Home slot of a key */
+static size_t slotOf(PositionTable *table, SchemeVal *key) {
+    return ((uintptr_t)key >> 4) * 0x9E3779B97F4A7C15ULL >> 20 & (table->capacity - 1);
+}
+
+/* Finds the slot holding key, or the empty slot it would go in */
+static size_t findSlot(PositionTable *table, SchemeVal *key) {
+    size_t i = slotOf(table, key);
+    while (table->entries[i].key != NULL && table->entries[i].key != key) {
+        i = (i + 1) & (table->capacity - 1);
+    }
+    return i;
+}
+
+/* Stores a position, growing the table to stay at most half full */
+static void insert(PositionTable *table, SchemeVal *key, SourcePosition position) {
+    if (2 * (table->count + 1) > table->capacity) {
+        PositionEntry *old = table->entries;
+        size_t oldCapacity = table->capacity;
+        table->capacity = oldCapacity ? 2 * oldCapacity : 1024;
+        table->entries = calloc(table->capacity, sizeof(PositionEntry));
+        table->count = 0;
+        for (size_t i = 0; i < oldCapacity; i++) {
+            if (old[i].key != NULL) {
+                insert(table, old[i].key, old[i].position);
+            }
+        }
+        free(old);
+    }
+    size_t i = findSlot(table, key);
+    if (table->entries[i].key == NULL) {
+        table->entries[i].key = key;
+        table->count++;
+    }
+    table->entries[i].position = position;
+}
+
+/* Removes key, moving later entries of its probe run back into the gap */
+static void removeKey(PositionTable *table, SchemeVal *key) {
+    PositionEntry *entries = table->entries;
+    size_t mask = table->capacity - 1;
+    size_t gap = findSlot(table, key);
+    if (entries[gap].key == NULL) {
+        return;
+    }
+    entries[gap].key = NULL;
+    table->count--;
+    for (size_t i = (gap + 1) & mask; entries[i].key != NULL; i = (i + 1) & mask) {
+        size_t home = slotOf(table, entries[i].key);
+        // move it back unless its home lies in (gap, i]
+        if (((i - home) & mask) >= ((i - gap) & mask)) {
+            entries[gap] = entries[i];
+            entries[i].key = NULL;
+            gap = i;
+        }
+    }
+}
+
+/* The table of the context heap allocates for, kept with the outermost of
+   its parents; made if create is set and there is none yet */
+static PositionTable *tableOf(Heap *heap, bool create) {
+    while (heap->parent != NULL) {
+        heap = heap->parent;
+    }
+    PositionTable *table = __atomic_load_n(&heap->positions, __ATOMIC_ACQUIRE);
+    if (table != NULL || !create) {
+        return table;
+    }
+    PositionTable *made = calloc(1, sizeof(PositionTable));
+    assert(made != NULL);
+    pthread_mutex_init(&made->lock, NULL);
+    // a pool thread working for the same context may get there first
+    if (!__atomic_compare_exchange_n(&heap->positions, &table, made, false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+        pthread_mutex_destroy(&made->lock);
+        free(made);
+        return table;
+    }
+    return made;
+}
+
+// Names the source of positions made on this thread
+void setSourceName(const char *name) {
+    if (name == NULL) {
+        currentSource = 0;
+        return;
+    }
+    pthread_mutex_lock(&sourcesLock);
+    int index = 1;
+    while (index <= sourceCount && strcmp(sources[index], name)) {
+        index++;
+    }
+    if (index > sourceCount) {
+        if (sourceCount < MAX_SOURCES) {
+            sources[++sourceCount] = name;
+        }
+        index = sourceCount;
+    }
+    pthread_mutex_unlock(&sourcesLock);
+    currentSource = index;
+}
+
+// Packs line and column of the current source
+SourcePosition makePosition(int line, int column) {
+    return (SourcePosition)currentSource << 48 | (SourcePosition)(uint32_t)line << 16 |
+           (column > 0xFFFF ? 0xFFFF : column);
+}
+
+// Records where datum is
+void setPosition(SchemeVal *datum, SourcePosition position) {
+    if (position == 0) {
+        return;
+    }
+    PositionTable *table = tableOf(tallocHeap(), true);
+    pthread_mutex_lock(&table->lock);
+    insert(table, datum, position);
+    pthread_mutex_unlock(&table->lock);
+}
+
+// Looks up where datum is
+SourcePosition positionOf(SchemeVal *datum) {
+    PositionTable *table = tableOf(tallocHeap(), false);
+    if (table == NULL) {
+        return 0;
+    }
+    SourcePosition position = 0;
+    pthread_mutex_lock(&table->lock);
+    if (table->count > 0) {
+        position = table->entries[findSlot(table, datum)].position;
+    }
+    pthread_mutex_unlock(&table->lock);
+    return position;
+}
+
+// Records from's position as to's
+void copyPosition(SchemeVal *to, SchemeVal *from) {
+    setPosition(to, positionOf(from));
+}
+
+// Checks if datum has a recorded position
+bool hasPosition(SchemeVal *datum) {
+    return positionOf(datum) != 0;
+}
+
+// Name of a position's source
+const char *positionSource(SourcePosition position) {
+    return sources[position >> 48];
+}
+
+int positionLine(SourcePosition position) {
+    return (position >> 16) & 0xFFFFFFFF;
+}
+
+int positionColumn(SourcePosition position) {
+    return position & 0xFFFF;
+}
+
+// Formats a position as file:line:column
+bool formatSourcePosition(SourcePosition position, char *buffer, size_t size) {
+    if (size > 0) {
+        buffer[0] = '\0';
+    }
+    if (position == 0) {
+        return false;
+    }
+    const char *source = positionSource(position);
+    unsigned line = positionLine(position);
+    unsigned column = positionColumn(position);
+    if (source != NULL) {
+        snprintf(buffer, size, "%s:%u:%u", source, line, column);
+    } else {
+        snprintf(buffer, size, "%u:%u", line, column);
+    }
+    return true;
+}
+
+// Formats datum's position
+bool formatPosition(SchemeVal *datum, char *buffer, size_t size) {
+    return formatSourcePosition(positionOf(datum), buffer, size);
+}
+
+// Drops the positions of heap's allocations
+void forgetPositions(Heap *heap) {
+    PositionTable *table = heap->positions;
+    if (table != NULL) {
+        // a context's own heap: the whole table goes with it
+        heap->positions = NULL;
+        pthread_mutex_destroy(&table->lock);
+        free(table->entries);
+        free(table);
+        return;
+    }
+    table = tableOf(heap, false);
+    if (table == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&table->lock);
+    if (table->count > 0) {
+        for (SchemeVal *node = heap->active_list; node != NULL; node = node->cdr) {
+            removeKey(table, node->car);
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+}
@@ -0,0 +1,61 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "schemeval.h"
+#include "talloc.h"
+
+#ifndef _POSITION
+#define _POSITION
+
+// Source positions of parsed data. The tokenizer notes where each token
+// starts and the parser gives every list the position of its open
+// parenthesis. Positions of lists and symbols live in a side table keyed by
+// the datum's address, so SchemeVal does not grow and eval never touches
+// the table; it is only read when an error or a profile is reported. Each
+// context has its own table, kept with its heap (talloc.h): positions are
+// recorded in and looked up from that of the calling thread's current heap.
+// Punctuation tokens, which have no value, carry theirs in the position
+// field instead.
+
+// A source, line and column packed into one word; 0 for none.
+typedef uint64_t SourcePosition;
+
+// Names the file positions made by the calling thread refer to from now
+// on; NULL for none (stdin, or a program sent over a socket). name must
+// stay valid.
+void setSourceName(const char *name);
+
+// Packs line and column (both from 1) of the current source into a position.
+SourcePosition makePosition(int line, int column);
+
+// Records where datum is; a position of 0 is ignored.
+void setPosition(SchemeVal *datum, SourcePosition position);
+
+// Looks up where datum is; 0 if it has no recorded position.
+SourcePosition positionOf(SchemeVal *datum);
+
+// Records from's position, if it has one, as to's.
+void copyPosition(SchemeVal *to, SchemeVal *from);
+
+// Checks if datum has a recorded position.
+bool hasPosition(SchemeVal *datum);
+
+// Writes a position to buffer as "file:line:column", or "line:column" if
+// its source has no name. Returns false, leaving buffer empty, for 0.
+bool formatSourcePosition(SourcePosition position, char *buffer, size_t size);
+
+// Takes a position apart: the name of its source (NULL if unnamed), its line
+// and its column.
+const char *positionSource(SourcePosition position);
+int positionLine(SourcePosition position);
+int positionColumn(SourcePosition position);
+
+// Formats datum's position as formatSourcePosition does.
+bool formatPosition(SchemeVal *datum, char *buffer, size_t size);
+
+// Drops the positions of everything allocated from heap itself (not its
+// children), or the whole table if heap is a context's own; tfreeHeap calls
+// it before the addresses can be reused.
+void forgetPositions(Heap *heap);
+
+#endif
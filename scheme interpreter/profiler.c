@@ -0,0 +1,667 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "profiler.h"
+#include "schemeval.h"
+#include "interpreter.h"
+#include "parser.h"
+#include "talloc.h"
+#include "linkedlist.h"
+#include "error.h"
+#include "position.h"
+
+// Words in the sample buffer. It is reserved up front, since the signal
+// handler cannot allocate, but only the pages samples reach are backed by
+// memory; at 1000 Hz and 30 frames a sample it holds about nine minutes.
+#define SAMPLE_WORDS (16 * 1024 * 1024)
+// Frames recorded per sample; deeper stacks keep their innermost frames.
+#define MAX_SAMPLE_DEPTH 256
+// Rows in the table stopProfiler prints.
+#define REPORT_ROWS 30
+
+bool profilingEnabled = false;
+bool allocationProfiling = false;
+_Thread_local ProfileFrame *profileTop __attribute__((tls_model("initial-exec"))) = NULL;
+
+// Each sample is a header word, depth * 2 plus one if the stack was cut
+// short, followed by depth SchemeVal pointers, innermost first. A header
+// of SAMPLE_END marks where a sample that did not fit would have started.
+#define SAMPLE_END UINTPTR_MAX
+static uintptr_t *samples = NULL;
+static atomic_size_t samplesUsed = 0;
+static atomic_long samplesDropped = 0;
+static int sampleHz;
+// process CPU time when sampling started, in seconds
+static double startCpu;
+
+/* Process CPU time in seconds */
+static double cpuSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A hash table from pointers to pointers, for the report's lookups
+typedef struct {
+    uintptr_t *keys;
+    void **values;
+    size_t capacity;
+    size_t count;
+} PointerMap;
+
+// names given to closures, keyed by their code so every closure made from
+// the same lambda shares one
+static PointerMap closureNames;
+static pthread_mutex_t namesLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Finds the slot for key, which is either key's or the empty one it would
+   go in */
+static size_t mapFind(PointerMap *map, uintptr_t key) {
+    size_t i = (key >> 4) * 0x9E3779B97F4A7C15ULL & (map->capacity - 1);
+    while (map->keys[i] != 0 && map->keys[i] != key) {
+        i = (i + 1) & (map->capacity - 1);
+    }
+    return i;
+}
+
+/* Returns the value stored under key, or NULL */
+static void *mapGet(PointerMap *map, uintptr_t key) {
+    if (map->capacity == 0) {
+        return NULL;
+    }
+    size_t i = mapFind(map, key);
+    return map->keys[i] == key ? map->values[i] : NULL;
+}
+
+/* Stores value under key, growing the table to stay at most half full */
+static void mapPut(PointerMap *map, uintptr_t key, void *value) {
+    if (2 * (map->count + 1) > map->capacity) {
+        PointerMap grown = {NULL, NULL, map->capacity ? 2 * map->capacity : 64, 0};
+        grown.keys = calloc(grown.capacity, sizeof(uintptr_t));
+        grown.values = calloc(grown.capacity, sizeof(void *));
+        for (size_t i = 0; i < map->capacity; i++) {
+            if (map->keys[i] != 0) {
+                mapPut(&grown, map->keys[i], map->values[i]);
+            }
+        }
+        free(map->keys);
+        free(map->values);
+        *map = grown;
+    }
+    size_t i = mapFind(map, key);
+    if (map->keys[i] == 0) {
+        map->keys[i] = key;
+        map->count++;
+    }
+    map->values[i] = value;
+}
+
+static void mapFree(PointerMap *map) {
+    free(map->keys);
+    free(map->values);
+    memset(map, 0, sizeof(PointerMap));
+}
+
+// Records that the closure value is bound to name
+void nameClosure(SchemeVal *value, char *name) {
+    pthread_mutex_lock(&namesLock);
+    mapPut(&closureNames, (uintptr_t)value->functionCode, name);
+    pthread_mutex_unlock(&namesLock);
+}
+
+/* SIGPROF handler: copies the interrupted thread's shadow stack into the
+   sample buffer. Only touches the buffer and the thread's own stack, so it
+   is safe to run at any point. */
+static void takeSample(int signal) {
+    (void)signal;
+    int savedErrno = errno;
+    uintptr_t frames[MAX_SAMPLE_DEPTH];
+    size_t depth = 0;
+    ProfileFrame *frame = profileTop;
+    while (frame != NULL && depth < MAX_SAMPLE_DEPTH) {
+        frames[depth++] = (uintptr_t)frame->function;
+        frame = frame->caller;
+    }
+
+    size_t start = atomic_fetch_add(&samplesUsed, depth + 1);
+    if (start + depth + 1 > SAMPLE_WORDS) {
+        if (start < SAMPLE_WORDS) {
+            samples[start] = SAMPLE_END;
+        }
+        atomic_fetch_add(&samplesDropped, 1);
+    } else {
+        samples[start] = depth * 2 + (frame != NULL);
+        memcpy(&samples[start + 1], frames, depth * sizeof(uintptr_t));
+    }
+    errno = savedErrno;
+}
+
+// Starts sampling hz times per second of CPU time
+bool startProfiler(int hz) {
+    if (hz <= 0 || hz > 1000000) {
+        return false;
+    }
+    samples = mmap(NULL, SAMPLE_WORDS * sizeof(uintptr_t), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (samples == MAP_FAILED) {
+        samples = NULL;
+        return false;
+    }
+    sampleHz = hz;
+    profilingEnabled = true;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = takeSample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, NULL);
+
+    startCpu = cpuSeconds();
+    struct itimerval timer;
+    timer.it_interval.tv_sec = hz == 1;
+    timer.it_interval.tv_usec = hz == 1 ? 0 : 1000000 / hz;
+    timer.it_value = timer.it_interval;
+    return setitimer(ITIMER_PROF, &timer, NULL) == 0;
+}
+
+// A procedure in the report
+typedef struct {
+    char *name;
+    long self;          // samples with it innermost
+    long total;         // samples with it anywhere on the stack
+    long lastSample;    // the last sample counted in total
+} ProfileEntry;
+
+typedef struct {
+    ProfileEntry *entries;
+    int count;
+    int capacity;
+    // entry index + 1 for each procedure key seen so far
+    PointerMap byKey;
+} ProfileTable;
+
+// Names a procedure for reports; returns a malloc'd string
+char *procedureName(SchemeVal *function) {
+    if (function->type == PRIMITIVE_TYPE) {
+        int index = primitiveIndex(function->pf);
+        return strdup(index >= 0 ? primitiveName(index) : "primitive");
+    }
+    if (function->type == COMPILED_TYPE) {
+        return strdup(function->name);
+    }
+    if (function->type != CLOSURE_TYPE) {
+        return strdup("continuation");
+    }
+    // anonymous closures show their parameter list
+    char *text = NULL;
+    size_t size;
+    FILE *out = open_memstream(&text, &size);
+    pthread_mutex_lock(&namesLock);
+    char *name = mapGet(&closureNames, (uintptr_t)function->functionCode);
+    pthread_mutex_unlock(&namesLock);
+    if (name != NULL) {
+        fputs(name, out);
+    } else {
+        fprintf(out, "lambda ");
+        fprintTree(out, function->paramNames);
+    }
+    // where the lambda is, from its parameter list or else its body
+    char where[300];
+    if (formatPosition(function->paramNames, where, sizeof(where)) ||
+        formatPosition(car(function->functionCode), where, sizeof(where))) {
+        fprintf(out, " %s", where);
+    }
+    fclose(out);
+    return text;
+}
+
+/* Returns the table index of a sampled procedure, adding it if new. Every
+   closure made from one lambda shares an entry, as do procedures with the
+   same name. */
+static int entryIndex(ProfileTable *table, SchemeVal *function) {
+    uintptr_t key = function->type == CLOSURE_TYPE ? (uintptr_t)function->functionCode
+                  : function->type == PRIMITIVE_TYPE ? (uintptr_t)function->pf
+                  : function->type == COMPILED_TYPE ? (uintptr_t)function->code
+                  : (uintptr_t)function;
+    void *found = mapGet(&table->byKey, key);
+    if (found != NULL) {
+        return (int)(intptr_t)found - 1;
+    }
+
+    char *name = procedureName(function);
+    int index = 0;
+    while (index < table->count && strcmp(table->entries[index].name, name)) {
+        index++;
+    }
+    if (index == table->count) {
+        if (table->count == table->capacity) {
+            table->capacity = table->capacity ? 2 * table->capacity : 64;
+            table->entries = realloc(table->entries, table->capacity * sizeof(ProfileEntry));
+        }
+        table->entries[index] = (ProfileEntry){name, 0, 0, -1};
+        table->count++;
+    } else {
+        free(name);
+    }
+    mapPut(&table->byKey, key, (void *)(intptr_t)(index + 1));
+    return index;
+}
+
+static int compareStrings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int compareEntries(const void *a, const void *b) {
+    const ProfileEntry *x = a, *y = b;
+    if (x->total != y->total) {
+        return x->total < y->total ? 1 : -1;
+    }
+    return (x->self < y->self) - (x->self > y->self);
+}
+
+// Stops sampling and writes the folded stacks and the report
+void stopProfiler(FILE *out, FILE *report) {
+    if (samples == NULL) {
+        return;
+    }
+    struct itimerval off;
+    memset(&off, 0, sizeof(off));
+    setitimer(ITIMER_PROF, &off, NULL);
+    signal(SIGPROF, SIG_IGN);
+    double cpu = cpuSeconds() - startCpu;
+    profilingEnabled = allocationProfiling || perfMapEnabled;
+
+    size_t used = atomic_load(&samplesUsed);
+    if (used > SAMPLE_WORDS) {
+        used = SAMPLE_WORDS;
+    }
+    ProfileTable table;
+    memset(&table, 0, sizeof(table));
+    long count = 0;
+    char **stacks = NULL;
+    size_t stackCapacity = 0;
+
+    for (size_t at = 0; at < used && samples[at] != SAMPLE_END; count++) {
+        size_t depth = samples[at] / 2;
+        bool truncated = samples[at] % 2;
+        SchemeVal **frames = (SchemeVal **)&samples[at + 1];
+        at += depth + 1;
+
+        char *line = NULL;
+        size_t size;
+        FILE *folded = open_memstream(&line, &size);
+        fputs(truncated ? "toplevel;..." : "toplevel", folded);
+        for (size_t i = depth; i-- > 0;) {
+            // entryIndex may move the entries, so index them afterwards
+            int index = entryIndex(&table, frames[i]);
+            ProfileEntry *entry = &table.entries[index];
+            fprintf(folded, ";%s", entry->name);
+            if (entry->lastSample != count) {
+                entry->lastSample = count;
+                entry->total++;
+            }
+            if (i == 0) {
+                entry->self++;
+            }
+        }
+        fclose(folded);
+
+        if ((size_t)count == stackCapacity) {
+            stackCapacity = stackCapacity ? 2 * stackCapacity : 1024;
+            stacks = realloc(stacks, stackCapacity * sizeof(char *));
+        }
+        stacks[count] = line;
+    }
+
+    qsort(stacks, count, sizeof(char *), compareStrings);
+    for (long i = 0; i < count;) {
+        long run = 1;
+        while (i + run < count && !strcmp(stacks[i], stacks[i + run])) {
+            run++;
+        }
+        fprintf(out, "%s %ld\n", stacks[i], run);
+        for (long j = i; j < i + run; j++) {
+            free(stacks[j]);
+        }
+        i += run;
+    }
+    free(stacks);
+
+    // The kernel checks CPU timers on scheduler ticks, so the real rate can
+    // be well under the one asked for; weigh samples by the CPU time used.
+    double msPerSample = count > 0 ? cpu * 1000 / count : 0;
+    qsort(table.entries, table.count, sizeof(ProfileEntry), compareEntries);
+    fprintf(report, "profile: %ld samples over %.0f ms of CPU (%.0f Hz, %d asked for), "
+            "%ld dropped\n", count, cpu * 1000, cpu > 0 ? count / cpu : 0.0, sampleHz,
+            atomic_load(&samplesDropped));
+    fprintf(report, "%10s %6s %10s %6s  %s\n", "self ms", "self", "total ms", "total",
+            "procedure");
+    for (int i = 0; i < table.count; i++) {
+        ProfileEntry *entry = &table.entries[i];
+        if (i < REPORT_ROWS && count > 0) {
+            fprintf(report, "%10.0f %5.1f%% %10.0f %5.1f%%  %s\n",
+                    entry->self * msPerSample, 100.0 * entry->self / count,
+                    entry->total * msPerSample, 100.0 * entry->total / count, entry->name);
+        }
+        free(entry->name);
+    }
+    free(table.entries);
+    mapFree(&table.byKey);
+    munmap(samples, SAMPLE_WORDS * sizeof(uintptr_t));
+    samples = NULL;
+}
+
+// An allocation site of the allocation profiler
+typedef struct {
+    const char *function;   // C function that called talloc
+    const char *what;       // the talloc argument, as written
+    uintptr_t procedure;    // key of the Scheme procedure, or 0 at top level
+    char *procedureName;
+    long count;
+    long bytes;
+} AllocationSite;
+
+static AllocationSite *sites = NULL;
+static size_t siteCapacity = 0;
+static size_t siteCount = 0;
+static pthread_mutex_t sitesLock = PTHREAD_MUTEX_INITIALIZER;
+// set while recordAllocation runs, so its own allocations are not counted
+static _Thread_local bool recording = false;
+
+// Starts counting allocations by site
+void startAllocationProfile() {
+    allocationProfiling = true;
+    profilingEnabled = true;
+}
+
+/* Finds the slot of a site in the table, or the empty slot it would take */
+static size_t findSite(const char *function, const char *what, uintptr_t procedure) {
+    size_t hash = ((uintptr_t)function ^ (uintptr_t)what * 31 ^ procedure * 0x9E3779B97F4A7C15ULL);
+    size_t i = (hash ^ hash >> 29) & (siteCapacity - 1);
+    while (sites[i].function != NULL &&
+           (sites[i].function != function || sites[i].what != what ||
+            sites[i].procedure != procedure)) {
+        i = (i + 1) & (siteCapacity - 1);
+    }
+    return i;
+}
+
+/* Doubles the site table */
+static void growSites() {
+    AllocationSite *old = sites;
+    size_t oldCapacity = siteCapacity;
+    siteCapacity = siteCapacity ? 2 * siteCapacity : 256;
+    sites = calloc(siteCapacity, sizeof(AllocationSite));
+    for (size_t i = 0; i < oldCapacity; i++) {
+        if (old[i].function != NULL) {
+            sites[findSite(old[i].function, old[i].what, old[i].procedure)] = old[i];
+        }
+    }
+    free(old);
+}
+
+// Counts an allocation of size bytes made by the named C function
+void recordAllocation(size_t size, const char *function, const char *what) {
+    if (recording) {
+        return;
+    }
+    recording = true;
+    SchemeVal *procedure = profileTop != NULL ? profileTop->function : NULL;
+    uintptr_t key = procedure == NULL ? 0
+                  : procedure->type == CLOSURE_TYPE ? (uintptr_t)procedure->functionCode
+                  : procedure->type == PRIMITIVE_TYPE ? (uintptr_t)procedure->pf
+                  : (uintptr_t)procedure;
+
+    pthread_mutex_lock(&sitesLock);
+    if (2 * (siteCount + 1) > siteCapacity) {
+        growSites();
+    }
+    AllocationSite *site = &sites[findSite(function, what, key)];
+    if (site->function == NULL) {
+        site->function = function;
+        site->what = what;
+        site->procedure = key;
+        site->procedureName = procedure != NULL ? procedureName(procedure) : strdup("toplevel");
+        siteCount++;
+    }
+    site->count++;
+    site->bytes += size;
+    pthread_mutex_unlock(&sitesLock);
+    recording = false;
+}
+
+/* Names the type of what a site allocates, from the talloc argument:
+   sizeof(Frame) is a Frame, strlen(...) + 1 a string */
+static void typeName(const char *what, char *name, size_t size) {
+    size_t length = strlen(what);
+    if (!strncmp(what, "sizeof(", 7) && what[length - 1] == ')') {
+        snprintf(name, size, "%.*s", (int)(length - 8), what + 7);
+    } else if (strstr(what, "strlen") != NULL) {
+        snprintf(name, size, "string");
+    } else if (strstr(what, "sizeof(") != NULL) {
+        // an array: count * sizeof(SchemeVal)
+        const char *type = strstr(what, "sizeof(") + 7;
+        snprintf(name, size, "%.*s[]", (int)strcspn(type, ")"), type);
+    } else {
+        snprintf(name, size, "bytes");
+    }
+}
+
+static int compareSites(const void *a, const void *b) {
+    const AllocationSite *x = *(AllocationSite *const *)a, *y = *(AllocationSite *const *)b;
+    return (x->bytes < y->bytes) - (x->bytes > y->bytes);
+}
+
+// A row of the per-type totals
+typedef struct {
+    char name[64];
+    long count;
+    long bytes;
+} TypeTotal;
+
+static int compareTypes(const void *a, const void *b) {
+    const TypeTotal *x = a, *y = b;
+    return (x->bytes < y->bytes) - (x->bytes > y->bytes);
+}
+
+// Prints the allocation report
+void allocationReport(FILE *out) {
+    pthread_mutex_lock(&sitesLock);
+    AllocationSite **ranked = malloc((siteCount > 0 ? siteCount : 1) * sizeof(AllocationSite *));
+    TypeTotal *types = calloc(siteCount > 0 ? siteCount : 1, sizeof(TypeTotal));
+    size_t typeCount = 0;
+    long count = 0, bytes = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < siteCapacity; i++) {
+        AllocationSite *site = &sites[i];
+        if (site->function == NULL) {
+            continue;
+        }
+        ranked[n++] = site;
+        count += site->count;
+        bytes += site->bytes;
+
+        char name[64];
+        typeName(site->what, name, sizeof(name));
+        size_t t = 0;
+        while (t < typeCount && strcmp(types[t].name, name)) {
+            t++;
+        }
+        if (t == typeCount) {
+            snprintf(types[typeCount++].name, sizeof(types[t].name), "%s", name);
+        }
+        types[t].count += site->count;
+        types[t].bytes += site->bytes;
+    }
+    qsort(ranked, n, sizeof(AllocationSite *), compareSites);
+    qsort(types, typeCount, sizeof(TypeTotal), compareTypes);
+
+    fprintf(out, "allocations: %ld (%ld bytes) from %zu sites\n", count, bytes, n);
+    fprintf(out, "%12s %10s %6s  %s\n", "bytes", "count", "", "type");
+    for (size_t t = 0; t < typeCount; t++) {
+        fprintf(out, "%12ld %10ld %5.1f%%  %s\n", types[t].bytes, types[t].count,
+                bytes > 0 ? 100.0 * types[t].bytes / bytes : 0.0, types[t].name);
+    }
+    fprintf(out, "%12s %10s %6s  %-18s %-22s %s\n", "bytes", "count", "", "type",
+            "C function", "Scheme procedure");
+    for (size_t i = 0; i < n && i < REPORT_ROWS; i++) {
+        char name[64];
+        typeName(ranked[i]->what, name, sizeof(name));
+        fprintf(out, "%12ld %10ld %5.1f%%  %-18s %-22s %s\n", ranked[i]->bytes,
+                ranked[i]->count, bytes > 0 ? 100.0 * ranked[i]->bytes / bytes : 0.0,
+                name, ranked[i]->function, ranked[i]->procedureName);
+    }
+    pthread_mutex_unlock(&sitesLock);
+    free(ranked);
+    free(types);
+}
+
+// Prints the allocation report, or the heap's size without the profiler
+SchemeVal *primitiveHeapReport(SchemeVal *args) {
+    if (!isEmpty(args)) {
+        evalError("heap-report takes no arguments");
+    }
+    fflush(stdout);
+    if (allocationProfiling) {
+        allocationReport(stdout);
+    } else {
+        long count, bytes;
+        heapStats(tallocHeap(), &count, &bytes);
+        printf("heap: %ld allocations (%ld bytes); run with --alloc-profile for sites\n",
+               count, bytes);
+    }
+    return makeVoid();
+}
+
+// Trampolines for perf. Each copy of the code below is a function of its
+// own that calls its fourth argument with the first three, keeping a frame
+// pointer; an entry in /tmp/perf-PID.map names the copy after a procedure.
+#if defined(__x86_64__)
+static const unsigned char trampolineCode[] = {
+    0x55,               // push %rbp
+    0x48, 0x89, 0xe5,   // mov %rsp, %rbp
+    0xff, 0xd1,         // call *%rcx
+    0x5d,               // pop %rbp
+    0xc3,               // ret
+};
+#elif defined(__aarch64__)
+static const uint32_t trampolineCode[] = {
+    0xa9bf7bfd,         // stp x29, x30, [sp, #-16]!
+    0x910003fd,         // mov x29, sp
+    0xd63f0060,         // blr x3
+    0xa8c17bfd,         // ldp x29, x30, [sp], #16
+    0xd65f03c0,         // ret
+};
+#endif
+
+// Bytes between trampolines, and in each block of them mapped at once.
+#define TRAMPOLINE_STRIDE 32
+#define TRAMPOLINE_BLOCK (64 * 1024)
+// Entries in each thread's cache of trampolines.
+#define TRAMPOLINE_CACHE 256
+
+bool perfMapEnabled = false;
+
+static FILE *perfMap = NULL;
+static pthread_mutex_t perfLock = PTHREAD_MUTEX_INITIALIZER;
+// trampolines made so far, keyed like ProfileTable.byKey
+static PointerMap trampolines;
+static char *trampolineBlock = NULL;
+static size_t trampolinesLeft = 0;
+static _Thread_local struct {
+    uintptr_t key;
+    Trampoline trampoline;
+} trampolineCache[TRAMPOLINE_CACHE] __attribute__((tls_model("initial-exec")));
+
+// Opens the perf map and starts naming procedures
+bool startPerfMap() {
+#if defined(__x86_64__) || defined(__aarch64__)
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    perfMap = fopen(path, "w");
+    if (perfMap == NULL) {
+        return false;
+    }
+    perfMapEnabled = true;
+    profilingEnabled = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Adds an entry to the perf map
+void perfMapAdd(const void *start, size_t size, const char *name) {
+    pthread_mutex_lock(&perfLock);
+    if (perfMap != NULL) {
+        fprintf(perfMap, "%lx %zx scheme:%s\n", (unsigned long)(uintptr_t)start, size, name);
+        fflush(perfMap);
+    }
+    pthread_mutex_unlock(&perfLock);
+}
+
+/* Maps a block of trampolines. Every slot gets the code up front, so the
+   block can be made executable once and never written again. */
+static bool mapTrampolineBlock() {
+#if defined(__x86_64__) || defined(__aarch64__)
+    char *block = mmap(NULL, TRAMPOLINE_BLOCK, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED) {
+        return false;
+    }
+    for (size_t at = 0; at < TRAMPOLINE_BLOCK; at += TRAMPOLINE_STRIDE) {
+        memcpy(block + at, trampolineCode, sizeof(trampolineCode));
+    }
+    if (mprotect(block, TRAMPOLINE_BLOCK, PROT_READ | PROT_EXEC) != 0) {
+        munmap(block, TRAMPOLINE_BLOCK);
+        return false;
+    }
+    __builtin___clear_cache(block, block + TRAMPOLINE_BLOCK);
+    trampolineBlock = block;
+    trampolinesLeft = TRAMPOLINE_BLOCK / TRAMPOLINE_STRIDE;
+    return true;
+#else
+    return false;
+#endif
+}
+
+// The trampoline for function, made and named on first use
+Trampoline perfTrampoline(SchemeVal *function) {
+    uintptr_t key = function->type == CLOSURE_TYPE ? (uintptr_t)function->functionCode
+                  : (uintptr_t)function;
+    size_t slot = (key >> 4) & (TRAMPOLINE_CACHE - 1);
+    if (trampolineCache[slot].key == key) {
+        return trampolineCache[slot].trampoline;
+    }
+
+    pthread_mutex_lock(&perfLock);
+    Trampoline trampoline = (Trampoline)mapGet(&trampolines, key);
+    char *name = NULL;
+    if (trampoline == NULL && (trampolinesLeft > 0 || mapTrampolineBlock())) {
+        trampoline = (Trampoline)(void *)trampolineBlock;
+        trampolineBlock += TRAMPOLINE_STRIDE;
+        trampolinesLeft--;
+        mapPut(&trampolines, key, (void *)trampoline);
+        name = procedureName(function);
+    }
+    pthread_mutex_unlock(&perfLock);
+
+    if (name != NULL) {
+        perfMapAdd((void *)trampoline, sizeof(trampolineCode), name);
+        free(name);
+    }
+    if (trampoline != NULL) {
+        trampolineCache[slot].key = key;
+        trampolineCache[slot].trampoline = trampoline;
+    }
+    return trampoline;
+}
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "schemeval.h"
+
+#ifndef _PROFILER
+#define _PROFILER
+
+// A sampling profiler for Scheme code. While it runs, apply keeps a shadow
+// stack of the procedures being called, as a chain of ProfileFrames living
+// in apply's own C stack frames, and a SIGPROF timer copies the chain of
+// whichever thread it interrupts into a preallocated sample buffer. Closures
+// are named after the variable define or letrec bound them to.
+typedef struct ProfileFrame {
+    SchemeVal *function;
+    struct ProfileFrame *caller;
+} ProfileFrame;
+
+// True while any profiler runs, the perf map included; apply only keeps the
+// shadow stack while set.
+extern bool profilingEnabled;
+
+// Innermost frame of the calling thread's shadow stack. Error handlers and
+// coroutine switches save and restore it along with the C stack.
+extern _Thread_local ProfileFrame *profileTop __attribute__((tls_model("initial-exec")));
+
+// Starts sampling hz times per second of CPU time, or as close as the
+// kernel's timer ticks allow. Returns false if the timer or the sample
+// buffer could not be set up.
+bool startProfiler(int hz);
+
+// Stops sampling, writes every sampled stack to out in the folded format
+// flamegraph tools read ("toplevel;caller;callee count" per line), and prints
+// a table of self and total time per procedure to report. Must be called
+// before tfree, while the sampled closures are still allocated.
+void stopProfiler(FILE *out, FILE *report);
+
+// Records that the closure value is bound to name, for the profile report.
+void nameClosure(SchemeVal *value, char *name);
+
+// The name reports give function: a primitive's or compiled procedure's
+// name, or for a closure the variable it was bound to (or its parameter
+// list) and where its lambda is. Returns a malloc'd string.
+char *procedureName(SchemeVal *function);
+
+// The allocation profiler. While it runs, talloc passes every allocation to
+// recordAllocation, which counts it against its site: the C function that
+// called talloc, what was allocated (the talloc argument, such as
+// sizeof(SchemeVal)) and the innermost Scheme procedure being applied.
+extern bool allocationProfiling;
+void startAllocationProfile();
+void recordAllocation(size_t size, const char *function, const char *what);
+
+// Prints the sites that allocated the most bytes, with totals per type.
+void allocationReport(FILE *out);
+
+// (heap-report): prints the allocation report to stdout, or the size of the
+// heap if the allocation profiler is not running.
+SchemeVal *primitiveHeapReport(SchemeVal *args);
+
+// Support for Linux perf, which sees only eval and apply in the interpreter's
+// own stack frames. With the perf map on, apply calls each closure through a
+// trampoline, a tiny function copied once per lambda, and names every
+// trampoline after its procedure in /tmp/perf-PID.map, where perf looks up
+// addresses outside any binary. Sampled call graphs then show the Scheme
+// procedures between the apply frames. Only on x86-64 and AArch64.
+typedef SchemeVal *(*ApplyTarget)(SchemeVal *function, SchemeVal *args, Frame *frame);
+typedef SchemeVal *(*Trampoline)(SchemeVal *function, SchemeVal *args, Frame *frame,
+                                 ApplyTarget target);
+
+extern bool perfMapEnabled;
+
+// Creates the perf map; returns false if it could not be created or this
+// architecture has no trampolines.
+bool startPerfMap();
+
+// Adds an entry naming the machine code at start, for generated code.
+void perfMapAdd(const void *start, size_t size, const char *name);
+
+// The trampoline for function, which calls target(function, args, frame);
+// NULL if none could be made.
+Trampoline perfTrampoline(SchemeVal *function);
+
+// Pushes function onto the shadow stack; entry must stay live until the
+// matching leaveProfile.
+static inline void enterProfile(ProfileFrame *entry, SchemeVal *function) {
+    entry->function = function;
+    entry->caller = profileTop;
+    // the signal handler must never see the frame before it is filled in
+    atomic_signal_fence(memory_order_release);
+    profileTop = entry;
+}
+
+static inline void leaveProfile(ProfileFrame *entry) {
+    profileTop = entry->caller;
+}
+
+#endif
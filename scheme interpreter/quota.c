@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <limits.h>
+#include <time.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+#include "quota.h"
+#include "schemeval.h"
+#include "talloc.h"
+#include "error.h"
+#include "linkedlist.h"
+
+// Steps are handed to a thread, and with a deadline armed the clock is read,
+// this many at a time.
+#define STEPS_PER_SLICE 4096
+// Bytes are handed to a thread this many at a time.
+#define BYTES_PER_SLICE 65536
+
+_Thread_local long fuelCountdown __attribute__((tls_model("initial-exec"))) = LONG_MAX;
+_Thread_local long byteCountdown __attribute__((tls_model("initial-exec"))) = LONG_MAX;
+
+// The limits hit, recorded in a budget so every thread working for the
+// evaluation raises the same error
+enum { NO_LIMIT_HIT, STEP_LIMIT_HIT, BYTE_LIMIT_HIT, TIME_LIMIT_HIT };
+
+struct QuotaBudget {
+    long steps;          // steps not yet handed to a thread, or -1 for no limit
+    long bytes;          // bytes not yet handed to a thread, or -1 for no limit
+    long long deadline;  // CLOCK_MONOTONIC nanoseconds, or 0 for no deadline
+    int hit;             // which limit was hit, if any
+    int references;
+};
+
+// the budget the calling thread draws from, or NULL with no quota armed
+static _Thread_local QuotaBudget *budget = NULL;
+// the error raised once a limit has been hit
+static _Thread_local SchemeVal *exhausted = NULL;
+
+static Quota defaultFormQuota;
+
+/* Reads the monotonic clock in nanoseconds */
+static long long now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Creates an evaluation error object with a fixed message */
+static SchemeVal *makeQuotaError(char *text) {
+    SchemeVal *message = talloc(sizeof(SchemeVal));
+    message->type = STR_TYPE;
+    message->s = text;
+    return makeErrorObject("Evaluation error", message, makeEmpty());
+}
+
+/* Takes up to want from the budget count at left, -1 meaning unlimited, and
+   returns how much it got */
+static long take(long *left, long want) {
+    long old = __atomic_load_n(left, __ATOMIC_RELAXED);
+    long got;
+    do {
+        if (old < 0) {
+            return want;
+        }
+        got = old < want ? old : want;
+    } while (!__atomic_compare_exchange_n(left, &old, old - got, false, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    return got;
+}
+
+/* Gives back to the budget count at left what was taken and not used */
+static void giveBack(long *left, long unused) {
+    if (unused > 0 && __atomic_load_n(left, __ATOMIC_RELAXED) >= 0) {
+        __atomic_fetch_add(left, unused, __ATOMIC_RELAXED);
+    }
+}
+
+/* Raises the error for the limit hit, and makes every later step or
+   allocation on this thread raise it too */
+static _Noreturn void exhaust(int hit) {
+    int none = NO_LIMIT_HIT;
+    __atomic_compare_exchange_n(&budget->hit, &none, hit, false, __ATOMIC_RELAXED,
+                                __ATOMIC_RELAXED);
+    if (exhausted == NULL) {
+        // the error is made here, so lift the limits while allocating it
+        fuelCountdown = LONG_MAX;
+        byteCountdown = LONG_MAX;
+        hit = __atomic_load_n(&budget->hit, __ATOMIC_RELAXED);
+        exhausted = makeQuotaError(hit == STEP_LIMIT_HIT   ? "step limit exceeded"
+                                   : hit == BYTE_LIMIT_HIT ? "allocation limit exceeded"
+                                                           : "time limit exceeded");
+    }
+    fuelCountdown = 0;
+    byteCountdown = 0;
+    raiseCondition(exhausted);
+}
+
+/* Hands the steps and bytes this thread took but did not use back to its
+   budget, and drops the budget */
+static void leaveBudget() {
+    if (budget != NULL) {
+        giveBack(&budget->steps, fuelCountdown > 0 ? fuelCountdown : 0);
+        giveBack(&budget->bytes, byteCountdown > 0 ? byteCountdown : 0);
+    }
+    budget = NULL;
+    fuelCountdown = LONG_MAX;
+    byteCountdown = LONG_MAX;
+    exhausted = NULL;
+}
+
+/* Makes the calling thread draw from joined; its first step and allocation
+   take their slices */
+static void enterBudget(QuotaBudget *joined) {
+    budget = joined;
+    if (joined != NULL) {
+        fuelCountdown = 0;
+        byteCountdown = 0;
+    }
+}
+
+// Arms quota on the calling thread
+void armQuota(const Quota *quota) {
+    disarmQuota();
+    if (quota == NULL || (quota->steps <= 0 && quota->bytes <= 0 && quota->milliseconds <= 0)) {
+        return;
+    }
+
+    QuotaBudget *armed = malloc(sizeof(QuotaBudget));
+    assert(armed != NULL);
+    armed->steps = quota->steps > 0 ? quota->steps : -1;
+    armed->bytes = quota->bytes > 0 ? quota->bytes : -1;
+    armed->deadline = quota->milliseconds > 0 ? now() + quota->milliseconds * 1000000LL : 0;
+    armed->hit = NO_LIMIT_HIT;
+    armed->references = 1;
+    enterBudget(armed);
+}
+
+// Lifts every limit on the calling thread
+void disarmQuota() {
+    QuotaBudget *armed = budget;
+    leaveBudget();
+    releaseQuota(armed);
+}
+
+// Takes a reference to the calling thread's budget
+QuotaBudget *shareQuota() {
+    if (budget != NULL) {
+        __atomic_fetch_add(&budget->references, 1, __ATOMIC_RELAXED);
+    }
+    return budget;
+}
+
+// Drops a reference to shared, freeing it with the last one
+void releaseQuota(QuotaBudget *shared) {
+    if (shared != NULL && __atomic_sub_fetch(&shared->references, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(shared);
+    }
+}
+
+// Switches the calling thread to shared, returning its own budget
+QuotaBudget *joinQuota(QuotaBudget *shared) {
+    QuotaBudget *previous = budget;
+    leaveBudget();
+    enterBudget(shared);
+    return previous;
+}
+
+// Switches the calling thread back to the budget joinQuota returned
+void leaveQuota(QuotaBudget *previous) {
+    leaveBudget();
+    enterBudget(previous);
+}
+
+// Sets the quota interpretIn arms for each top-level form
+void setFormQuota(const Quota *quota) {
+    defaultFormQuota = *quota;
+}
+
+// The quota interpretIn arms for each top-level form
+const Quota *formQuota() {
+    return &defaultFormQuota;
+}
+
+// Steps taken since disarmQuota; with nothing armed the countdown starts at
+// LONG_MAX and never refills
+long stepsSinceDisarm() {
+    return LONG_MAX - fuelCountdown;
+}
+
+// Slow path of useFuel: the current slice of steps is used up
+void fuelCheck() {
+    if (budget == NULL) {
+        fuelCountdown = LONG_MAX;
+        return;
+    }
+    int hit = __atomic_load_n(&budget->hit, __ATOMIC_RELAXED);
+    if (exhausted != NULL || hit != NO_LIMIT_HIT) {
+        exhaust(hit);
+    }
+    if (budget->deadline != 0 && now() >= budget->deadline) {
+        exhaust(TIME_LIMIT_HIT);
+    }
+    long slice = budget->deadline != 0 || budget->steps >= 0 ? STEPS_PER_SLICE : LONG_MAX;
+    slice = take(&budget->steps, slice);
+    if (slice == 0) {
+        exhaust(STEP_LIMIT_HIT);
+    }
+    // count the step that got us here
+    fuelCountdown = slice - 1;
+}
+
+// Slow path of useBytes: the current slice of bytes is used up
+void byteCheck() {
+    if (budget == NULL) {
+        byteCountdown = LONG_MAX;
+        return;
+    }
+    int hit = __atomic_load_n(&budget->hit, __ATOMIC_RELAXED);
+    if (exhausted != NULL || hit != NO_LIMIT_HIT) {
+        exhaust(hit);
+    }
+    // the allocation that got us here is owed out of the next slice
+    long owed = -byteCountdown;
+    long slice = take(&budget->bytes, budget->bytes >= 0 ? BYTES_PER_SLICE + owed : LONG_MAX);
+    if (slice < owed) {
+        exhaust(BYTE_LIMIT_HIT);
+    }
+    byteCountdown = slice - owed;
+}
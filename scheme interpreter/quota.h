@@ -0,0 +1,73 @@
+#include <stddef.h>
+#include "schemeval.h"
+
+#ifndef _QUOTA
+#define _QUOTA
+
+// Limits on a single evaluation: a top-level form run by interpretIn, or one
+// call into an Interp context. A zero field means no limit.
+typedef struct {
+    long steps;          // calls to eval and closure applications
+    long bytes;          // bytes allocated with talloc
+    long milliseconds;   // wall-clock time
+} Quota;
+
+// When a limit is hit, an error is raised and every further step or
+// allocation raises it again, so the evaluation unwinds all the way out even
+// through Scheme exception handlers. An armed quota draws on a budget, which
+// futures and parallel-map chunks take along to the pool threads that run
+// them: their steps and bytes count against the same limits, and the same
+// deadline applies, so splitting the work up does not multiply the limits.
+// Threads take steps and bytes from the budget a slice at a time, so one
+// may run a few thousand steps past a limit another has hit.
+
+// The steps, bytes and deadline left to an armed quota.
+typedef struct QuotaBudget QuotaBudget;
+
+// Arms quota on the calling thread, replacing any armed quota. NULL, or a
+// quota of all zeros, leaves the thread unlimited.
+void armQuota(const Quota *quota);
+void disarmQuota();
+
+// Takes a reference to the budget of the quota armed on the calling thread,
+// for work it hands to another thread; NULL if none is armed.
+QuotaBudget *shareQuota();
+// Drops a reference taken by shareQuota. NULL is ignored.
+void releaseQuota(QuotaBudget *budget);
+
+// Runs the calling thread under budget, which may be NULL, until leaveQuota,
+// returning the budget it ran under before. The caller keeps its reference
+// to budget meanwhile.
+QuotaBudget *joinQuota(QuotaBudget *budget);
+void leaveQuota(QuotaBudget *previous);
+
+// The quota interpretIn arms for each top-level form.
+void setFormQuota(const Quota *quota);
+const Quota *formQuota();
+
+// Steps counted on the calling thread since disarmQuota, while no quota is
+// armed. Used to measure the cost of an evaluation step.
+long stepsSinceDisarm();
+
+// Countdowns to the next slow-path check. Only the functions below should
+// touch them; they are exposed so the checks can be inlined.
+extern _Thread_local long fuelCountdown __attribute__((tls_model("initial-exec")));
+extern _Thread_local long byteCountdown __attribute__((tls_model("initial-exec")));
+void fuelCheck();
+void byteCheck();
+
+// Counts one evaluation step.
+static inline void useFuel() {
+    if (--fuelCountdown < 0) {
+        fuelCheck();
+    }
+}
+
+// Counts an allocation of size bytes.
+static inline void useBytes(size_t size) {
+    if ((byteCountdown -= (long)size) < 0) {
+        byteCheck();
+    }
+}
+
+#endif
@@ -6,7 +6,8 @@
 typedef enum {
   INT_TYPE, DOUBLE_TYPE, STR_TYPE, CONS_TYPE, EMPTY_TYPE, PTR_TYPE,
   OPEN_TYPE, CLOSE_TYPE, BOOL_TYPE, SYMBOL_TYPE, QUOTE_TYPE,
-  UNSPECIFIED_TYPE, VOID_TYPE, CLOSURE_TYPE, PRIMITIVE_TYPE
+  UNSPECIFIED_TYPE, VOID_TYPE, CLOSURE_TYPE, PRIMITIVE_TYPE, ERROR_TYPE,
+  FUTURE_TYPE, TASK_TYPE, CHANNEL_TYPE, CONTINUATION_TYPE, COMPILED_TYPE
 } objectType;
 
 typedef struct SchemeVal {
@@ -24,11 +25,32 @@ typedef struct SchemeVal {
             struct SchemeVal *functionCode;
             struct Frame *frame;
         }; // For CLOSURE_TYPE
+        struct {
+            struct SchemeVal *message;
+            struct SchemeVal *irritants;
+            char *kind;
+        }; // For ERROR_TYPE
         void *ptr;
         bool b;
-        // A primitive style function; just a pointer to it, with the right
-        // signature (pf = primitive function)
-        struct SchemeVal *(*pf)(struct SchemeVal *);
+        // For OPEN_TYPE, CLOSE_TYPE and QUOTE_TYPE tokens: where they are,
+        // as a SourcePosition (see position.h)
+        unsigned long long position;
+        struct {
+            // A primitive style function; just a pointer to it, with the right
+            // signature (pf = primitive function)
+            struct SchemeVal *(*pf)(struct SchemeVal *);
+            // its index in the primitive table
+            int primitive;
+        }; // For PRIMITIVE_TYPE
+        struct {
+            // C code of a procedure translated by the compiler (compiler.h),
+            // called with the procedure itself and its arguments
+            struct SchemeVal *(*code)(struct SchemeVal *self, int argc,
+                                      struct SchemeVal **argv);
+            // the values it closed over, in the order the compiler chose
+            struct SchemeVal **captured;
+            const char *name;
+        }; // For COMPILED_TYPE
     };
 } SchemeVal;
 
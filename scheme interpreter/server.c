@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "server.h"
+#include "schemeval.h"
+#include "interpreter.h"
+#include "tokenizer.h"
+#include "parser.h"
+#include "error.h"
+#include "linkedlist.h"
+
+static volatile sig_atomic_t stopping = 0;
+
+// Fills in the default per-job limits
+void defaultServerOptions(ServerOptions *options) {
+    options->workers = 0;
+    options->cpuSeconds = 10;
+    options->wallSeconds = 30;
+    options->memoryBytes = 1024L * 1024 * 1024;
+    options->outputBytes = 1024L * 1024;
+}
+
+/* Reads exactly size bytes; false on end of file or error */
+static bool readFull(int fd, void *buffer, size_t size) {
+    char *p = buffer;
+    while (size > 0) {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+/* Writes exactly size bytes; false on error */
+static bool writeFull(int fd, const void *buffer, size_t size) {
+    const char *p = buffer;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+/* Applies a resource limit to the calling process, if one is set. The hard
+   limit is one above the soft one, so the CPU limit is reported as SIGXCPU
+   rather than a bare SIGKILL. */
+static void limit(int resource, long value) {
+    if (value > 0) {
+        struct rlimit rl = {.rlim_cur = value, .rlim_max = value + 1};
+        setrlimit(resource, &rl);
+    }
+}
+
+/* Body of a job process: parses and evaluates program with stdout going to
+   the output file, then exits with a job status */
+static _Noreturn void runJobProcess(const char *program, size_t length, Frame *global,
+                                    ServerOptions *options, int outputFd) {
+    dup2(outputFd, STDOUT_FILENO);
+    limit(RLIMIT_CPU, options->cpuSeconds);
+    limit(RLIMIT_AS, options->memoryBytes);
+    limit(RLIMIT_FSIZE, options->outputBytes);
+    alarm(options->wallSeconds);
+
+    SchemeVal *tree = makeEmpty();
+    ErrorHandler handler;
+    pushHandler(&handler);
+    if (setjmp(handler.env) == 0) {
+        if (length > 0) {
+            FILE *input = fmemopen((void *)program, length, "r");
+            tree = parse(tokenizeFile(input));
+            fclose(input);
+        }
+        popHandler(&handler);
+    } else {
+        popHandler(&handler);
+        printCondition(stdout, lastCondition());
+        fflush(stdout);
+        _exit(JOB_ERROR);
+    }
+
+    int errors = interpretIn(tree, global);
+    fflush(stdout);
+    // skip tfree: the whole heap goes away with the process
+    _exit(errors > 0 ? JOB_ERROR : JOB_OK);
+}
+
+/* Runs one program in a fork of this worker and waits for it
+   Output: a job status; the program's output is left in outputFd */
+static uint32_t runJob(const char *program, size_t length, Frame *global,
+                       ServerOptions *options, int outputFd) {
+    ftruncate(outputFd, 0);
+    lseek(outputFd, 0, SEEK_SET);
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        dprintf(outputFd, "Error: could not start job: %s\n", strerror(errno));
+        return JOB_KILLED;
+    }
+    if (pid == 0) {
+        runJobProcess(program, length, global, options, outputFd);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status) == JOB_OK ? JOB_OK : JOB_ERROR;
+    }
+    lseek(outputFd, 0, SEEK_END);
+    dprintf(outputFd, "Error: job killed by signal %d (%s)\n",
+            WTERMSIG(status), strsignal(WTERMSIG(status)));
+    return JOB_KILLED;
+}
+
+/* Answers requests on one connection until the client closes it */
+static void serveConnection(int client, Frame *global, ServerOptions *options, int outputFd) {
+    for (;;) {
+        uint32_t length;
+        if (!readFull(client, &length, sizeof(length))) {
+            return;
+        }
+        length = ntohl(length);
+        if (length > SERVER_MAX_REQUEST) {
+            return;
+        }
+        char *program = malloc(length + 1);
+        if (program == NULL || !readFull(client, program, length)) {
+            free(program);
+            return;
+        }
+        program[length] = '\0';
+
+        uint32_t status = runJob(program, length, global, options, outputFd);
+        free(program);
+
+        off_t size = lseek(outputFd, 0, SEEK_END);
+        char *output = malloc(size > 0 ? size : 1);
+        if (output == NULL || pread(outputFd, output, size, 0) != size) {
+            free(output);
+            return;
+        }
+        uint32_t header[2] = {htonl(status), htonl((uint32_t)size)};
+        bool sent = writeFull(client, header, sizeof(header)) &&
+                    writeFull(client, output, size);
+        free(output);
+        if (!sent) {
+            return;
+        }
+    }
+}
+
+/* Body of a worker process: accepts connections one at a time */
+static _Noreturn void runWorker(int listener, Frame *global, ServerOptions *options) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);
+
+    FILE *output = tmpfile();
+    if (output == NULL) {
+        perror("tmpfile");
+        _exit(1);
+    }
+    for (;;) {
+        int client = accept(listener, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("accept");
+            _exit(1);
+        }
+        serveConnection(client, global, options, fileno(output));
+        close(client);
+    }
+}
+
+/* Forks a worker; returns its pid, or -1 */
+static pid_t startWorker(int listener, Frame *global, ServerOptions *options) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        runWorker(listener, global, options);
+    }
+    return pid;
+}
+
+/* Asks the supervisor loop to stop */
+static void stopServer(int signal) {
+    (void)signal;
+    stopping = 1;
+}
+
+// Binds socketPath, forks the workers and restarts any that die, until
+// SIGINT or SIGTERM.
+// Input: Frame* global (with the prelude evaluated), socket path, options
+// Output: exit status for the process
+int serve(Frame *global, const char *socketPath, ServerOptions *options) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: socket path too long: %s\n", socketPath);
+        return 1;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(listener, 128) < 0) {
+        perror(socketPath);
+        return 1;
+    }
+
+    int count = options->workers > 0 ? options->workers : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (count < 1) {
+        count = 1;
+    }
+    pid_t *workers = calloc(count, sizeof(pid_t));
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stopServer;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    for (int i = 0; i < count; i++) {
+        workers[i] = startWorker(listener, global, options);
+    }
+    fprintf(stderr, "Serving on %s with %d workers\n", socketPath, count);
+
+    while (!stopping) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            if (workers[i] == pid && !stopping) {
+                fprintf(stderr, "Worker %d exited; restarting it\n", (int)pid);
+                workers[i] = startWorker(listener, global, options);
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (workers[i] > 0) {
+            kill(workers[i], SIGTERM);
+            waitpid(workers[i], NULL, 0);
+        }
+    }
+    free(workers);
+    close(listener);
+    unlink(socketPath);
+    return 0;
+}
@@ -0,0 +1,41 @@
+#include <stdint.h>
+#include "schemeval.h"
+
+#ifndef _SERVER
+#define _SERVER
+
+// Server mode: the prelude is evaluated once, then worker processes forked
+// from the warm interpreter accept programs over a Unix domain socket. Each
+// program runs in its own short-lived fork of a worker, so it starts from the
+// prelude's global environment, cannot change it for later jobs, and runs
+// under its own resource limits.
+//
+// Protocol, all integers big-endian. A connection carries any number of
+// requests, answered in order:
+//   request:  uint32 length, then length bytes of Scheme source
+//   response: uint32 status, uint32 length, then length bytes of output
+// The output is what the interpreter would have printed for the program.
+
+#define SERVER_MAX_REQUEST (16 * 1024 * 1024)
+
+// Response statuses
+#define JOB_OK 0      // every form evaluated without error
+#define JOB_ERROR 1   // some form raised an error; the output says which
+#define JOB_KILLED 2  // the job hit a resource limit or crashed
+
+typedef struct {
+    int workers;          // worker processes; 0 means one per core
+    int cpuSeconds;       // CPU time a job may use
+    int wallSeconds;      // wall-clock time a job may take
+    long memoryBytes;     // address space of a job, prelude heap included
+    long outputBytes;     // output a job may print
+} ServerOptions;
+
+// Fills in the default limits.
+void defaultServerOptions(ServerOptions *options);
+
+// Serves jobs on socketPath against the global frame until SIGINT or
+// SIGTERM. Returns the process exit status.
+int serve(Frame *global, const char *socketPath, ServerOptions *options);
+
+#endif
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "stats.h"
+#include "schemeval.h"
+#include "interpreter.h"
+#include "linkedlist.h"
+#include "error.h"
+
+_Thread_local RuntimeStats runtimeStats __attribute__((tls_model("initial-exec")));
+
+// names of the EvalKinds, in order
+static const char *evalKindNames[EVAL_KINDS] = {
+    "constant", "variable", "application", "if", "let", "letrec",
+    "define", "set!", "lambda", "future", "quote", "time", "inline", "do",
+};
+
+/* Reads a clock in nanoseconds */
+static long long readClock(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Evaluation steps as quotas count them: evals and closure applications */
+static long totalSteps() {
+    long steps = runtimeStats.closureCalls;
+    for (int i = 0; i < EVAL_KINDS; i++) {
+        steps += runtimeStats.evals[i];
+    }
+    return steps;
+}
+
+// Takes a mark of the clocks and counters
+void markStats(StatsMark *mark) {
+    mark->wallNs = readClock(CLOCK_MONOTONIC);
+    mark->cpuNs = readClock(CLOCK_PROCESS_CPUTIME_ID);
+    mark->steps = totalSteps();
+    mark->bytes = runtimeStats.bytes;
+    mark->allocations = runtimeStats.allocations;
+}
+
+// Prints what was spent since mark
+void printStatsSince(FILE *out, const StatsMark *mark) {
+    StatsMark now;
+    markStats(&now);
+    fprintf(out, "time: %.3f ms real, %.3f ms cpu, %ld bytes in %ld allocations, %ld steps\n",
+            (now.wallNs - mark->wallNs) / 1e6, (now.cpuNs - mark->cpuNs) / 1e6,
+            now.bytes - mark->bytes, now.allocations - mark->allocations,
+            now.steps - mark->steps);
+}
+
+// Prints every counter
+SchemeVal *primitiveRuntimeStats(SchemeVal *args) {
+    if (!isEmpty(args)) {
+        evalError("runtime-stats takes no arguments");
+    }
+    // copied first, so printing does not count itself
+    RuntimeStats stats = runtimeStats;
+
+    long evals = 0;
+    for (int i = 0; i < EVAL_KINDS; i++) {
+        evals += stats.evals[i];
+    }
+    printf("eval steps: %ld\n", evals);
+    for (int i = 0; i < EVAL_KINDS; i++) {
+        if (stats.evals[i] != 0) {
+            printf("  %-22s %12ld\n", evalKindNames[i], stats.evals[i]);
+        }
+    }
+    printf("closure applications: %ld\n", stats.closureCalls);
+
+    long calls = 0;
+    for (int i = 0; i < primitiveCount(); i++) {
+        calls += stats.primitiveCalls[i];
+    }
+    printf("primitive calls: %ld\n", calls);
+    // most called first; a selection sort is plenty for a few dozen
+    bool listed[MAX_PRIMITIVES] = {false};
+    while (true) {
+        int most = -1;
+        for (int i = 0; i < primitiveCount(); i++) {
+            if (!listed[i] && stats.primitiveCalls[i] != 0 &&
+                (most < 0 || stats.primitiveCalls[i] > stats.primitiveCalls[most])) {
+                most = i;
+            }
+        }
+        if (most < 0) {
+            break;
+        }
+        listed[most] = true;
+        printf("  %-22s %12ld\n", primitiveName(most), stats.primitiveCalls[most]);
+    }
+
+    printf("frames allocated: %ld, %ld of them on the frame stack\n", stats.frames,
+           stats.stackFrames);
+    printf("variable lookups: %ld, %.2f frames searched on average\n", stats.lookups,
+           stats.lookups ? (double)stats.framesWalked / stats.lookups : 0.0);
+    printf("allocated: %ld bytes in %ld allocations\n", stats.bytes, stats.allocations);
+    return makeVoid();
+}
@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include "schemeval.h"
+
+#ifndef _STATS
+#define _STATS
+
+// Runtime counters, always compiled in and cheap enough to leave on: each is
+// a plain increment of a thread-local field on the path it counts. They
+// cover the calling thread only, like quotas; work done by futures and
+// parallel-map on other threads is counted on those threads.
+
+// What eval was asked to evaluate, for counting steps.
+typedef enum {
+    EVAL_CONSTANT, EVAL_VARIABLE, EVAL_APPLICATION, EVAL_IF, EVAL_LET, EVAL_LETREC,
+    EVAL_DEFINE, EVAL_SET, EVAL_LAMBDA, EVAL_FUTURE, EVAL_QUOTE, EVAL_TIME, EVAL_INLINE, EVAL_DO,
+    EVAL_KINDS
+} EvalKind;
+
+// Room for this many primitives in the per-primitive call counts.
+#define MAX_PRIMITIVES 64
+
+typedef struct {
+    long evals[EVAL_KINDS];
+    long closureCalls;
+    long primitiveCalls[MAX_PRIMITIVES];
+    long frames;          // environment frames made by apply, let and letrec
+    long stackFrames;     // of those, frames made on the frame stack (escape.h)
+    long lookups;         // variable lookups
+    long framesWalked;    // frames searched by those lookups
+    long bytes;           // bytes requested from talloc
+    long allocations;     // calls to talloc
+} RuntimeStats;
+
+extern _Thread_local RuntimeStats runtimeStats __attribute__((tls_model("initial-exec")));
+
+static inline void countEval(EvalKind kind) {
+    runtimeStats.evals[kind]++;
+}
+
+// Counts a call of the primitive value function.
+static inline void countPrimitiveCall(SchemeVal *function) {
+    runtimeStats.primitiveCalls[function->primitive]++;
+}
+
+// A point in time and in the counters, taken by (time expr).
+typedef struct {
+    long long wallNs;
+    long long cpuNs;
+    long steps;
+    long bytes;
+    long allocations;
+} StatsMark;
+
+void markStats(StatsMark *mark);
+
+// Prints the time, allocation and steps since mark was taken.
+void printStatsSince(FILE *out, const StatsMark *mark);
+
+// (runtime-stats): prints every counter of the calling thread to stdout.
+SchemeVal *primitiveRuntimeStats(SchemeVal *args);
+
+#endif
@@ -1,13 +1,34 @@
 #include "talloc.h"
+#include "quota.h"
+#include "profiler.h"
+#include "position.h"
+#include "stats.h"
+#include "trace.h"
+#include "jit.h"
+#include "escape.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <sched.h>
+#include <malloc.h>
 
-static SchemeVal *active_list = NULL;
+static Heap processHeap;
+
+// Each thread allocates from its own current heap, so threads running
+// separate interpreter contexts never share a list.
+static _Thread_local Heap *currentHeap = &processHeap;
+static _Thread_local jmp_buf *exitHandler = NULL;
 
 // Allocates memory and tracks it for later cleanup.
 // Returns a pointer to the allocated memory, or NULL if allocation fails.
-void *talloc(size_t size) {
+void *tallocAt(size_t size, const char *function, const char *what) {
+    useBytes(size);
+    runtimeStats.bytes += size;
+    runtimeStats.allocations++;
+    TRACE_ALLOCATED(runtimeStats.bytes, (long)size);
+    if (allocationProfiling) {
+        recordAllocation(size, function, what);
+    }
     void *ptr = malloc(size);
     if (!ptr) return NULL;
 
@@ -16,26 +37,179 @@ void *talloc(size_t size) {
     
     node->type = CONS_TYPE;
     node->car = (SchemeVal*)ptr;
-    node->cdr = active_list;
+    node->cdr = currentHeap->active_list;
 
-    active_list = node;
+    if (currentHeap->active_list == NULL) {
+        currentHeap->tail = node;
+    }
+    currentHeap->active_list = node;
     return ptr;
 }
 
-// Frees all memory previously allocated with talloc.
-// Takes no input and returns nothing.
-void tfree() {
-    while (active_list != NULL) {
-        SchemeVal *current = active_list;
-        active_list = current->cdr;
+// talloc as a function, for code compiled without talloc.h's macro
+void *(talloc)(size_t size) {
+    return tallocAt(size, "talloc", "bytes");
+}
+
+// Frees all memory previously allocated with talloc from the given heap.
+void tfreeHeap(Heap *heap) {
+    // child heaps usually live inside objects of this heap, so go first
+    while (heap->children != NULL) {
+        Heap *child = heap->children;
+        heap->children = child->nextChild;
+        while (atomic_load(&child->busy)) {
+            sched_yield();
+        }
+        tfreeHeap(child);
+    }
+
+    forgetPositions(heap);
+    forgetJitCode(heap);
+    forgetEscapes(heap);
+    while (heap->active_list != NULL) {
+        SchemeVal *current = heap->active_list;
+        heap->active_list = current->cdr;
         
         free(current->car);
         free(current);
     }
+    heap->tail = NULL;
+}
+
+// tfreeHeap without forgetting anything about the heap's pointers
+void tfreeData(Heap *heap) {
+    assert(heap->children == NULL);
+    while (heap->active_list != NULL) {
+        SchemeVal *current = heap->active_list;
+        heap->active_list = current->cdr;
+
+        free(current->car);
+        free(current);
+    }
+    heap->tail = NULL;
+}
+
+// Searches the whole of heap; meant for the few allocations of a scratch heap
+bool heapHolds(Heap *heap, void *pointer) {
+    for (SchemeVal *node = heap->active_list; node != NULL; node = node->cdr) {
+        if (node->car == pointer) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Unlinks the pointer's node from heap and pushes it onto to
+bool moveAllocation(Heap *heap, Heap *to, void *pointer) {
+    SchemeVal *previous = NULL;
+    SchemeVal *node = heap->active_list;
+    while (node != NULL && node->car != pointer) {
+        previous = node;
+        node = node->cdr;
+    }
+    if (node == NULL) {
+        return false;
+    }
+    if (previous == NULL) {
+        heap->active_list = node->cdr;
+    } else {
+        previous->cdr = node->cdr;
+    }
+    if (heap->tail == node) {
+        heap->tail = previous;
+    }
+
+    node->cdr = to->active_list;
+    if (to->active_list == NULL) {
+        to->tail = node;
+    }
+    to->active_list = node;
+    return true;
+}
+
+// Splices heap onto the current heap in constant time, and hands its child
+// heaps over too.
+void adoptHeap(Heap *heap) {
+    if (heap == currentHeap) {
+        return;
+    }
+    if (heap->active_list != NULL) {
+        heap->tail->cdr = currentHeap->active_list;
+        if (currentHeap->active_list == NULL) {
+            currentHeap->tail = heap->tail;
+        }
+        currentHeap->active_list = heap->active_list;
+        heap->active_list = NULL;
+        heap->tail = NULL;
+    }
+
+    while (heap->children != NULL) {
+        Heap *child = heap->children;
+        heap->children = child->nextChild;
+        attachHeap(child);
+    }
+}
+
+// Links child into the current heap's list of children.
+void attachHeap(Heap *child) {
+    nestHeap(child);
+    child->nextChild = currentHeap->children;
+    currentHeap->children = child;
+}
+
+// Gives heap the current heap as its parent.
+void nestHeap(Heap *heap) {
+    heap->parent = currentHeap;
+}
+
+// Frees all memory previously allocated with talloc.
+// Takes no input and returns nothing.
+void tfree() {
+    tfreeHeap(currentHeap);
+}
+
+// Counts the allocations held by heap and its children, and the bytes they
+// occupy (as malloc rounds them, not counting talloc's own list nodes).
+void heapStats(Heap *heap, long *count, long *bytes) {
+    *count = 0;
+    *bytes = 0;
+    for (SchemeVal *node = heap->active_list; node != NULL; node = node->cdr) {
+        (*count)++;
+        *bytes += malloc_usable_size(node->car);
+    }
+    for (Heap *child = heap->children; child != NULL; child = child->nextChild) {
+        long childCount, childBytes;
+        heapStats(child, &childCount, &childBytes);
+        *count += childCount;
+        *bytes += childBytes;
+    }
+}
+
+// Selects the heap talloc uses on this thread; returns the previous one.
+Heap *useHeap(Heap *heap) {
+    Heap *previous = currentHeap;
+    currentHeap = heap != NULL ? heap : &processHeap;
+    return previous;
+}
+
+// Returns the heap talloc uses on this thread.
+Heap *tallocHeap() {
+    return currentHeap;
+}
+
+// Selects where texit jumps to on this thread; returns the previous target.
+jmp_buf *setExitHandler(jmp_buf *handler) {
+    jmp_buf *previous = exitHandler;
+    exitHandler = handler;
+    return previous;
 }
 
 // Frees all tracked memory and exits the program with the given status code.
+// Inside an interpreter context, unwinds to the context instead.
 void texit(int status) {
+    if (exitHandler != NULL) {
+        longjmp(*exitHandler, status != 0 ? status : 1);
+    }
     tfree();
     exit(status);
 }
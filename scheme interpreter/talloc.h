@@ -1,9 +1,33 @@
 #include <stdlib.h>
+#include <stdbool.h>
+#include <setjmp.h>
+#include <stdatomic.h>
 #include "schemeval.h"
 
 #ifndef _TALLOC
 #define _TALLOC
 
+struct PositionTable;
+
+// A heap is the list of every pointer talloc has handed out from it. Each
+// thread allocates from its own current heap, which is a single process-wide
+// heap unless an interpreter context has selected another one.
+typedef struct Heap {
+    SchemeVal *active_list;
+    // oldest node of active_list, so whole heaps can be spliced together
+    SchemeVal *tail;
+    // heaps of futures created while this heap was current; they are freed
+    // with it, once no thread is allocating from them (busy is zero)
+    struct Heap *children;
+    struct Heap *nextChild;
+    atomic_int busy;
+    // the heap of the context this one allocates for, or NULL for a
+    // context's own heap (the process-wide one or an interpreter context's)
+    struct Heap *parent;
+    // source positions recorded for the context, in its own heap (position.h)
+    struct PositionTable *positions;
+} Heap;
+
 // Replacement for malloc that stores the pointers allocated. It should store
 // the pointers in some kind of list; a linked list would do fine, but insert
 // here whatever code you'll need to do so; don't call functions in the
@@ -11,6 +35,12 @@
 // dependencies, since you're going to modify the linked list to use talloc.
 void *talloc(size_t size);
 
+// talloc, naming its caller and what it allocates for the allocation
+// profiler. The talloc macro below fills both in, so every call site is
+// attributed without changes.
+void *tallocAt(size_t size, const char *function, const char *what);
+#define talloc(size) tallocAt((size), __func__, #size)
+
 // Free all pointers allocated by talloc, as well as whatever memory you
 // allocated in lists to hold those pointers.
 void tfree();
@@ -18,7 +48,53 @@ void tfree();
 // Replacement for the C function "exit", that consists of two lines: it calls
 // tfree before calling exit. It's useful to have later on; if an error happens,
 // you can exit your program, and all memory is automatically cleaned up.
+// If the calling thread has installed an exit handler, texit instead jumps
+// to it with status and leaves the heap alone.
 void texit(int status);
 
-#endif
+// Makes heap the current heap of the calling thread (NULL selects the
+// process-wide heap) and returns the previously current heap.
+Heap *useHeap(Heap *heap);
+
+// Returns the current heap of the calling thread.
+Heap *tallocHeap();
+
+// Frees every pointer allocated from heap and from its children.
+void tfreeHeap(Heap *heap);
+
+// Frees every pointer allocated from heap, which must have no children and
+// hold only values made by primitives: none of the bodies, source positions
+// and compiled code tfreeHeap also forgets. Used for the scratch heaps of
+// loops (loop.h), once per iteration.
+void tfreeData(Heap *heap);
+
+// Checks if pointer was allocated from heap.
+bool heapHolds(Heap *heap, void *pointer);
 
+// Moves the allocation at pointer from heap to another heap, to, and
+// returns true, or returns false if heap does not hold it.
+bool moveAllocation(Heap *heap, Heap *to, void *pointer);
+
+// Moves every allocation of heap into the calling thread's current heap, so
+// it is freed along with it. heap is left empty. Used to hand over what
+// worker threads allocated.
+void adoptHeap(Heap *heap);
+
+// Counts the allocations held by heap and its children, and their bytes.
+// Nothing is freed before tfree, so this is everything allocated so far.
+void heapStats(Heap *heap, long *count, long *bytes);
+
+// Makes child a child of the calling thread's current heap, so it is freed
+// along with it. Another thread may keep allocating from child until it
+// clears child->busy.
+void attachHeap(Heap *child);
+
+// Makes heap allocate for the calling thread's current context without
+// making it a child, for heaps that are adopted or freed by hand.
+void nestHeap(Heap *heap);
+
+// Installs handler as the place texit jumps to on the calling thread (NULL
+// restores exiting the process) and returns the previous handler.
+jmp_buf *setExitHandler(jmp_buf *handler);
+
+#endif
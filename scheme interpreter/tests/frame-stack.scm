@@ -0,0 +1,10 @@
+; Every top-level form gets the frame stack, not just the first one to use
+; it: `just test` checks the second (time (fib 18)) allocates no more than
+; the first.
+(define fib
+  (lambda (n)
+    (if (< n 2)
+        n
+        (+ (fib (+ n -1)) (fib (+ n -2))))))
+(time (fib 18))
+(time (fib 18))
@@ -0,0 +1,15 @@
+; flags: --alloc-stats
+; Loops that build lists still iterate in a scratch heap: of what each
+; iteration allocates only the new pairs and what they hold are kept, so the
+; count --alloc-stats prints grows by two allocations an iteration here.
+(define build
+  (lambda (n)
+    (do ((i 0 (+ i 1))
+         (acc '() (cons i acc)))
+        ((< n (+ i 1)) acc))))
+(define count
+  (lambda (lst)
+    (let loop ((l lst) (n 0))
+      (if (null? l) n (loop (cdr l) (+ n 1))))))
+(count (build 20000))
+(car (cdr (build 5)))
@@ -0,0 +1,4 @@
+; The procedure a named let makes keeps the frame of the closure call it is
+; in, so that frame must outlive the call when the procedure is handed out.
+(define mk (lambda (x) (let loop ((i 0)) (if (null? i) x loop))))
+((mk 111) '())
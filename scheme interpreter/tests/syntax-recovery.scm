@@ -0,0 +1,9 @@
+; A malformed form is reported and skipped up to the parenthesis that closes
+; it, and the forms on either side of it still run.
+(define before (+ 1 2))
+(define bad (list before #x ")" (car '(1 2)) ; (
+             "(" before))
+(+ before 10)
+(+ 1 2))
+(cons before '(after))
+(+ before
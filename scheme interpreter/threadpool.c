@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "threadpool.h"
+
+// Worker threads evaluate arbitrary Scheme code, so they get a stack as deep
+// as the main thread's usual limit allows for eval's recursion.
+#define WORKER_STACK_SIZE (64 * 1024 * 1024)
+
+// A worker's double-ended queue. The owner pushes and pops at the tail;
+// thieves take from the head, so they get the oldest (largest) work.
+typedef struct {
+    pthread_mutex_t lock;
+    Task **items;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+} Deque;
+
+typedef struct {
+    int size;
+    Deque *deques;
+    atomic_uint nextDeque;
+    // generation changes whenever work is queued or a wait may be over;
+    // sleepers wait on changed until it moves
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    unsigned long generation;
+} ThreadPool;
+
+static ThreadPool pool;
+static pthread_once_t poolOnce = PTHREAD_ONCE_INIT;
+
+// Index of the calling thread's deque, or -1 for threads outside the pool.
+static _Thread_local int workerIndex = -1;
+
+/* Pushes a task onto the owner's end of a deque */
+static void dequePush(Deque *deque, Task *task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail - deque->head == deque->capacity) {
+        size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+        Task **items = malloc(capacity * sizeof(Task *));
+        assert(items != NULL);
+        for (size_t i = deque->head; i < deque->tail; i++) {
+            items[i - deque->head] = deque->items[i % deque->capacity];
+        }
+        free(deque->items);
+        deque->items = items;
+        deque->tail -= deque->head;
+        deque->head = 0;
+        deque->capacity = capacity;
+    }
+    deque->items[deque->tail++ % deque->capacity] = task;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+/* Takes a task from the owner's end (fromTail) or the thieves' end */
+static Task *dequeTake(Deque *deque, bool fromTail) {
+    Task *task = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head) {
+        if (fromTail) {
+            task = deque->items[--deque->tail % deque->capacity];
+        } else {
+            task = deque->items[deque->head++ % deque->capacity];
+        }
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+/* Wakes every sleeping thread so it rechecks for work or completion */
+static void announce() {
+    pthread_mutex_lock(&pool.lock);
+    pool.generation++;
+    pthread_cond_broadcast(&pool.changed);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* Finds a task for the calling thread: its own newest task first, then the
+   oldest task of any other deque */
+static Task *findTask() {
+    if (workerIndex >= 0) {
+        Task *task = dequeTake(&pool.deques[workerIndex], true);
+        if (task != NULL) {
+            return task;
+        }
+    }
+    int start = workerIndex >= 0 ? workerIndex + 1 : 0;
+    for (int i = 0; i < pool.size; i++) {
+        Task *task = dequeTake(&pool.deques[(start + i) % pool.size], false);
+        if (task != NULL) {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+/* Runs a task and signals its completion */
+static void runTask(Task *task) {
+    atomic_int *pending = task->pending;
+    task->run(task);
+    // task may be freed by its waiter as soon as pending reaches zero
+    if (pending != NULL && atomic_fetch_sub(pending, 1) == 1) {
+        announce();
+    }
+}
+
+/* Main loop of a worker thread */
+static void *workerMain(void *arg) {
+    workerIndex = (int)(long)arg;
+    while (true) {
+        pthread_mutex_lock(&pool.lock);
+        unsigned long seen = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+
+        Task *task = findTask();
+        if (task != NULL) {
+            runTask(task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        while (pool.generation == seen) {
+            pthread_cond_wait(&pool.changed, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+    return NULL;
+}
+
+/* Starts one worker per online core, or SCHEME_WORKERS workers if set */
+static void startPool() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    char *override = getenv("SCHEME_WORKERS");
+    if (override != NULL && atoi(override) > 0) {
+        cores = atoi(override);
+    }
+    pool.size = cores > 0 ? (int)cores : 1;
+    pool.deques = calloc(pool.size, sizeof(Deque));
+    assert(pool.deques != NULL);
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.changed, NULL);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    // every deque must exist before any worker starts stealing
+    for (int i = 0; i < pool.size; i++) {
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+    }
+    for (int i = 0; i < pool.size; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, workerMain, (void *)(long)i) != 0) {
+            fprintf(stderr, "Error: could not start worker thread\n");
+            exit(1);
+        }
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// Returns the number of workers, starting the pool on first use.
+int poolSize() {
+    pthread_once(&poolOnce, startPool);
+    return pool.size;
+}
+
+// Queues a task on the caller's deque, or spreads tasks from outside threads
+// over the workers' deques.
+void poolSubmit(Task *task) {
+    poolSize();
+    int index = workerIndex;
+    if (index < 0) {
+        index = (int)(atomic_fetch_add(&pool.nextDeque, 1) % (unsigned)pool.size);
+    }
+    dequePush(&pool.deques[index], task);
+    announce();
+}
+
+// Helps with queued work until *pending reaches zero.
+void poolWait(atomic_int *pending) {
+    poolSize();
+    while (atomic_load(pending) > 0) {
+        pthread_mutex_lock(&pool.lock);
+        unsigned long seen = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+
+        Task *task = findTask();
+        if (task != NULL) {
+            runTask(task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        while (pool.generation == seen && atomic_load(pending) > 0) {
+            pthread_cond_wait(&pool.changed, &pool.lock);
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
@@ -0,0 +1,28 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#ifndef _THREADPOOL
+#define _THREADPOOL
+
+// A unit of work for the thread pool. Embed a Task as the first member of a
+// larger struct to pass data to run. If pending is not NULL it is decremented
+// once run has returned, which is what poolWait waits on.
+typedef struct Task {
+    void (*run)(struct Task *task);
+    atomic_int *pending;
+} Task;
+
+// Number of worker threads in the pool: one per online core, unless the
+// SCHEME_WORKERS environment variable says otherwise. Starts the pool the
+// first time it is called.
+int poolSize();
+
+// Queues a task. Tasks submitted from a worker go on that worker's own deque;
+// idle workers steal from the other end of busy workers' deques.
+void poolSubmit(Task *task);
+
+// Runs queued tasks on the calling thread until *pending drops to zero, then
+// returns. Safe to call from inside a task.
+void poolWait(atomic_int *pending);
+
+#endif
@@ -10,7 +10,9 @@
  #include "schemeval.h"
  #include "linkedlist.h"
  #include "talloc.h"
+ #include "error.h"
  #include "tokenizer.h"
+ #include "position.h"
  
  #define MAX_TOKEN_LENGTH 300
  
@@ -33,6 +35,48 @@
      return c;
  }
  
+ // Position of the next character of the input being tokenized, and the
+ // column before the last newline read, so it can be put back. Read for
+ // every character, so they use the cheapest thread-local model.
+ static _Thread_local int line __attribute__((tls_model("initial-exec"))) = 1;
+ static _Thread_local int column __attribute__((tls_model("initial-exec"))) = 1;
+ static _Thread_local int previousColumn __attribute__((tls_model("initial-exec"))) = 1;
+ 
+ // Helper function to read a character, keeping track of its position
+ int readChar(FILE *input) {
+     int c = fgetc(input);
+     if (c == '\n') {
+         line++;
+         previousColumn = column;
+         column = 1;
+     } else if (c != EOF) {
+         column++;
+     }
+     return c;
+ }
+ 
+ // Helper function to put back the last character readChar returned
+ void unreadChar(int c, FILE *input) {
+     if (c == EOF) {
+         return;
+     }
+     ungetc(c, input);
+     if (c == '\n') {
+         line--;
+         column = previousColumn;
+     } else {
+         column--;
+     }
+ }
+ 
+ // Helper function to format the current position for syntax errors, with
+ // the name of the file when there is one
+ char *currentPosition() {
+     static _Thread_local char buffer[256];
+     formatSourcePosition(makePosition(line, column), buffer, sizeof(buffer));
+     return buffer;
+ }
+ 
  // Helper function to create a new SchemeVal with string type
  SchemeVal *makeStringToken(char *value) {
      SchemeVal *token = talloc(sizeof(SchemeVal));
@@ -79,6 +123,7 @@
  SchemeVal *makeOpenToken() {
      SchemeVal *token = talloc(sizeof(SchemeVal));
      token->type = OPEN_TYPE;
+     token->position = 0;
      return token;
  }
  
@@ -86,6 +131,7 @@
  SchemeVal *makeCloseToken() {
      SchemeVal *token = talloc(sizeof(SchemeVal));
      token->type = CLOSE_TYPE;
+     token->position = 0;
      return token;
  }
  
@@ -93,22 +139,23 @@
  SchemeVal *makeQuoteToken() {
      SchemeVal *token = talloc(sizeof(SchemeVal));
      token->type = QUOTE_TYPE;
+     token->position = 0;
      return token;
  }
  
  // Helper function to skip whitespace and comments
  void skipWhitespaceAndComments(FILE *input) {
      int c;
-     while ((c = fgetc(input)) != EOF) {
+     while ((c = readChar(input)) != EOF) {
          if (isspace(c)) {
              continue;
          } else if (c == ';') {
              //skip until end of line
-             while ((c = fgetc(input)) != EOF && c != '\n') {
+             while ((c = readChar(input)) != EOF && c != '\n') {
                  continue;
              }
          } else {
-             ungetc(c, input);
+             unreadChar(c, input);
              break;
          }
      }
@@ -120,13 +167,12 @@
      int index = 0;
      int c;
      
-     while ((c = fgetc(input)) != EOF && c != '"' && index < MAX_TOKEN_LENGTH) {
+     while ((c = readChar(input)) != EOF && c != '"' && index < MAX_TOKEN_LENGTH) {
          if (c == '\\') {
              // Handle escape sequences
-             int next = fgetc(input);
+             int next = readChar(input);
              if (next == EOF) {
-                 fprintf(stderr, "Syntax error: unterminated string literal\n");
-                 texit(1);
+                 syntaxError("unterminated string literal at %s", currentPosition());
              }
              buffer[index++] = next;
          } else {
@@ -135,8 +181,7 @@
      }
      
      if (c != '"') {
-         fprintf(stderr, "Syntax error: unterminated string literal\n");
-         texit(1);
+         syntaxError("unterminated string literal at %s", currentPosition());
      }
      
      buffer[index] = '\0';
@@ -152,11 +197,10 @@
      buffer[index++] = firstChar;
      
      int c;
-     while ((c = fgetc(input)) != EOF && (isdigit(c) || c == '.') && index < MAX_TOKEN_LENGTH) {
+     while ((c = readChar(input)) != EOF && (isdigit(c) || c == '.') && index < MAX_TOKEN_LENGTH) {
          if (c == '.') {
              if (hasDecimal) {
-                 fprintf(stderr, "Syntax error: invalid number format\n");
-                 texit(1);
+                 syntaxError("invalid number format at %s", currentPosition());
              }
              hasDecimal = true;
          }
@@ -165,7 +209,7 @@
      
      // Put back the last character if it's not part of the number
      if (!isdigit(c) && c != '.') {
-         ungetc(c, input);
+         unreadChar(c, input);
      }
      
      buffer[index] = '\0';
@@ -173,15 +217,13 @@
      if (hasDecimal) {
          double value;
          if (sscanf(buffer, "%lf", &value) != 1) {
-             fprintf(stderr, "Syntax error: invalid floating-point\n");
-             texit(1);
+             syntaxError("invalid floating-point at %s", currentPosition());
          }
          return makeDoubleToken(value);
      } else {
          int value;
          if (sscanf(buffer, "%d", &value) != 1) {
-             fprintf(stderr, "Syntax error: invalid integer\n");
-             texit(1);
+             syntaxError("invalid integer at %s", currentPosition());
          }
          return makeIntToken(value);
      }
@@ -195,13 +237,13 @@
      buffer[index++] = firstChar;
      
      int c;
-     while ((c = fgetc(input)) != EOF && isSubsequent(c) && index < MAX_TOKEN_LENGTH) {
+     while ((c = readChar(input)) != EOF && isSubsequent(c) && index < MAX_TOKEN_LENGTH) {
          buffer[index++] = c;
      }
      
      // put back the last character if it's not part of the symbol
      if (!isSubsequent(c)) {
-         ungetc(c, input);
+         unreadChar(c, input);
      }
      
      buffer[index] = '\0';
@@ -215,66 +257,117 @@
      return makeSymbolToken(buffer);
  }
  
+ // Starts counting the lines and columns of a new input from 1:1
+ void startTokenizing() {
+     line = 1;
+     column = 1;
+ }
+ 
+ // Reads the next token from the given stream, skipping spaces and comments
+ // before it, and records its line and column (see position.h). Returns NULL
+ // at the end of the input.
+ SchemeVal *nextToken(FILE *input) {
+     skipWhitespaceAndComments(input);
+     int tokenLine = line;
+     int tokenColumn = column;
+     int c = readChar(input);
+     if (c == EOF) {
+         return NULL;
+     }
+     
+     SchemeVal *token = NULL;
+     
+     if (c == '(') {
+         token = makeOpenToken();
+     } else if (c == ')') {
+         token = makeCloseToken();
+     } else if (c == '\'') {
+         token = makeQuoteToken();
+     } else if (c == '"') {
+         token = readString(input);
+     } else if (isdigit(c) || (c == '-' && isdigit(peek(input)))) {
+         token = readNumber(input, c);
+     } else if (c == '#') {
+         int next = readChar(input);
+         if (next == 't' || next == 'f') {
+             token = makeBoolToken(next == 't');
+         } else {
+             syntaxError("invalid boolean at %s", currentPosition());
+         }
+     } else if (isInitial(c)) {
+         token = readSymbol(input, c);
+     } else if (c == '+' || c == '-') {
+         char op[2] = {c, '\0'};
+         token = makeSymbolToken(op);
+     } else {
+         syntaxError("invalid character '%c' at %s", c, currentPosition());
+     }
+     
+     // punctuation carries its position for the parser; of the
+     // rest only symbols are ever reported, so skip numbers and strings
+     if (token->type == OPEN_TYPE || token->type == CLOSE_TYPE ||
+         token->type == QUOTE_TYPE) {
+         token->position = makePosition(tokenLine, tokenColumn);
+     } else if (token->type == SYMBOL_TYPE) {
+         setPosition(token, makePosition(tokenLine, tokenColumn));
+     }
+     return token;
+ }
+ 
+ // Skips what is left of a datum a syntax error stopped in, with depth lists
+ // still open: reads up to the close parenthesis of the outermost of them,
+ // passing over strings and comments, or to the end of the input.
+ void skipOpenLists(FILE *input, int depth) {
+     int c;
+     while (depth > 0 && (c = readChar(input)) != EOF) {
+         if (c == '(') {
+             depth++;
+         } else if (c == ')') {
+             depth--;
+         } else if (c == ';') {
+             while ((c = readChar(input)) != EOF && c != '\n') {
+                 continue;
+             }
+         } else if (c == '"') {
+             while ((c = readChar(input)) != EOF && c != '"') {
+                 if (c == '\\') {
+                     readChar(input);
+                 }
+             }
+         }
+     }
+ }
+ 
  // main tokenize function
- // reads a Scheme program from stdin and turns it into a list of tokens.
+ // reads a Scheme program from the given stream and turns it into a list of tokens.
  // It ignores spaces and comments, and finds numbers, strings, symbols,
  // booleans, parentheses, and quotes. The tokens are returned in the order they appear.
- SchemeVal *tokenize() {
+ // Each token's line and column are recorded (see position.h).
+ SchemeVal *tokenizeFile(FILE *input) {
      SchemeVal *list = makeEmpty();
      SchemeVal *tail = makeEmpty();
-     FILE *input = stdin;
-     int c;
+     SchemeVal *token;
+     startTokenizing();
      
-     while (1) {
-         skipWhitespaceAndComments(input);
-         c = fgetc(input);
-         if (c == EOF) break;
-         
-         SchemeVal *token = NULL;
-         
-         if (c == '(') {
-             token = makeOpenToken();
-         } else if (c == ')') {
-             token = makeCloseToken();
-         } else if (c == '\'') {
-             token = makeQuoteToken();
-         } else if (c == '"') {
-             token = readString(input);
-         } else if (isdigit(c) || (c == '-' && isdigit(peek(input)))) {
-             token = readNumber(input, c);
-         } else if (c == '#') {
-             int next = fgetc(input);
-             if (next == 't' || next == 'f') {
-                 token = makeBoolToken(next == 't');
-             } else {
-                 fprintf(stderr, "Syntax error: invalid boolean\n");
-                 texit(1);
-             }
-         } else if (isInitial(c)) {
-             token = readSymbol(input, c);
-         } else if (c == '+' || c == '-') {
-             char op[2] = {c, '\0'};
-             token = makeSymbolToken(op);
+     while ((token = nextToken(input)) != NULL) {
+         if (isEmpty(list)) {
+             list = cons(token, makeEmpty());
+             tail = list;
          } else {
-             fprintf(stderr, "Syntax error: invalid character '%c'\n", c);
-             texit(1);
-         }
-         
-         if (token != NULL) {
-             if (isEmpty(list)) {
-                 list = cons(token, makeEmpty());
-                 tail = list;
-             } else {
-                 SchemeVal *newCell = cons(token, makeEmpty());
-                 tail->cdr = newCell;
-                 tail = newCell;
-             }
+             SchemeVal *newCell = cons(token, makeEmpty());
+             tail->cdr = newCell;
+             tail = newCell;
          }
      }
      
      return list;
  }
  
+ // reads a Scheme program from stdin and turns it into a list of tokens.
+ SchemeVal *tokenize() {
+     return tokenizeFile(stdin);
+ }
+ 
  // Function to display tokens
  void displayTokens(SchemeVal *list) {
      while (!isEmpty(list)) {
@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include "schemeval.h"
 
 #ifndef _TOKENIZER
@@ -7,6 +8,20 @@
 // tokens.
 SchemeVal *tokenize();
 
+// Read all of the input from the given stream, and return a linked list
+// consisting of the tokens.
+SchemeVal *tokenizeFile(FILE *input);
+
+// Reads a program a token at a time: startTokenizing counts lines and
+// columns from 1:1 again, and nextToken returns the next token of the
+// stream, or NULL at the end of it.
+void startTokenizing();
+SchemeVal *nextToken(FILE *input);
+
+// Skips the rest of a datum a syntax error stopped in with depth lists still
+// open, so that reading can start again after it.
+void skipOpenLists(FILE *input, int depth);
+
 // Displays the contents of the linked list as tokens, with type information
 void displayTokens(SchemeVal *list);
 
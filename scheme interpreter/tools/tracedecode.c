@@ -0,0 +1,262 @@
+// Decodes a trace written by `interpreter --trace FILE` (see trace.h) into
+// the Chrome trace event format, which chrome://tracing and Perfetto show as
+// a timeline: a track per thread with a slice per procedure call, instant
+// events for errors and a counter of how much each thread has allocated.
+//
+// Usage: tracedecode [--evals] TRACE > trace.json
+//
+// --evals also emits an instant event for every eval step, which makes the
+// output many times bigger. Build it with `just trace-decode`.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "../trace.h"
+
+typedef struct {
+    uint64_t key;
+    int order;
+    char *name;
+} Name;
+
+static Name *names = NULL;
+static int nameCount = 0;
+
+// an apply still running at some point of the trace
+typedef struct {
+    uint64_t key;
+    uint32_t type;
+    uint64_t frame;
+} OpenCall;
+
+static bool firstEvent = true;
+
+/* Orders names by key, then by when they were added */
+static int compareNames(const void *a, const void *b) {
+    const Name *x = a, *y = b;
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return x->order - y->order;
+}
+
+/* The most recent name for key, or NULL */
+static char *lookUpName(uint64_t key) {
+    int low = 0, high = nameCount;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (names[middle].key <= key) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low > 0 && names[low - 1].key == key ? names[low - 1].name : NULL;
+}
+
+/* Prints text as a JSON string */
+static void printString(const char *text) {
+    putchar('"');
+    for (const unsigned char *c = (const unsigned char *)text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            printf("\\%c", *c);
+        } else if (*c < 0x20) {
+            printf("\\u%04x", *c);
+        } else {
+            putchar(*c);
+        }
+    }
+    putchar('"');
+}
+
+/* Names a traced procedure */
+static void printCallName(uint64_t key, uint32_t type) {
+    char *name = lookUpName(key);
+    char fallback[64];
+    if (name == NULL) {
+        snprintf(fallback, sizeof(fallback), "%s@%llx",
+                 type == CLOSURE_TYPE ? "lambda" : type == PRIMITIVE_TYPE ? "primitive"
+                                                                          : "continuation",
+                 (unsigned long long)key);
+        name = fallback;
+    }
+    printString(name);
+}
+
+/* Starts the next event object, with the fields every event has */
+static void beginEvent(const char *phase, uint64_t thread, uint64_t time) {
+    printf("%s\n{\"ph\":\"%s\",\"pid\":1,\"tid\":%llu,\"ts\":%.3f", firstEvent ? "" : ",",
+           phase, (unsigned long long)thread, time / 1000.0);
+    firstEvent = false;
+}
+
+/* Ends the calls on top of stack down to (but not including) depth */
+static void endCalls(int *depth, int to, uint64_t thread, uint64_t time) {
+    while (*depth > to) {
+        (*depth)--;
+        beginEvent("E", thread, time);
+        printf("}");
+    }
+}
+
+/* Writes the events of one thread's ring */
+static void decodeRing(const TraceRingHeader *ring, const TraceRecord *records, bool evals) {
+    uint64_t thread = ring->thread;
+    uint64_t count = ring->written < ring->capacity ? ring->written : ring->capacity;
+    uint64_t first = ring->written - count;
+
+    beginEvent("M", thread, 0);
+    printf(",\"name\":\"thread_name\",\"args\":{\"name\":\"thread %llu\"}}",
+           (unsigned long long)thread);
+
+    OpenCall *stack = malloc((count + 1) * sizeof(OpenCall));
+    int depth = 0;
+    uint64_t time = 0;
+    for (uint64_t i = first; i < ring->written; i++) {
+        const TraceRecord *record = &records[i % ring->capacity];
+        time = record->time;
+        switch (record->kind) {
+            case TRACE_CALL: {
+                // the stack grows down, so open calls at or below this
+                // frame were unwound by an error or continuation
+                int keep = depth;
+                while (keep > 0 && stack[keep - 1].frame <= record->extra) {
+                    keep--;
+                }
+                endCalls(&depth, keep, thread, time);
+                stack[depth++] = (OpenCall){record->subject, record->detail, record->extra};
+                beginEvent("B", thread, time);
+                printf(",\"cat\":\"%s\",\"name\":",
+                       record->detail == PRIMITIVE_TYPE ? "primitive" : "closure");
+                printCallName(record->subject, record->detail);
+                printf("}");
+                break;
+            }
+            case TRACE_RETURN: {
+                int keep = depth;
+                while (keep > 0 && stack[keep - 1].frame < record->extra) {
+                    keep--;
+                }
+                // a return whose call fell off the start of the ring has
+                // nothing to close
+                if (keep > 0 && stack[keep - 1].frame == record->extra) {
+                    keep--;
+                }
+                endCalls(&depth, keep, thread, time);
+                break;
+            }
+            case TRACE_EVAL:
+                if (evals) {
+                    beginEvent("i", thread, time);
+                    printf(",\"s\":\"t\",\"cat\":\"eval\",\"name\":\"eval %s\"}",
+                           record->detail == SYMBOL_TYPE ? "variable"
+                           : record->detail == CONS_TYPE ? "form" : "constant");
+                }
+                break;
+            case TRACE_HEAP:
+                beginEvent("C", thread, time);
+                printf(",\"name\":\"allocated\",\"args\":{\"MiB\":%.1f}}",
+                       record->extra / (1024.0 * 1024.0));
+                break;
+            case TRACE_ERROR: {
+                char *message = lookUpName(record->subject);
+                beginEvent("i", thread, time);
+                printf(",\"s\":\"t\",\"cat\":\"error\",\"name\":");
+                printString(message != NULL ? message : "error");
+                printf("}");
+                break;
+            }
+        }
+    }
+    endCalls(&depth, 0, thread, time);
+    free(stack);
+}
+
+int main(int argc, char **argv) {
+    bool evals = false;
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--evals")) {
+            evals = true;
+        } else if (path == NULL) {
+            path = argv[i];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+    if (path == NULL) {
+        fprintf(stderr, "usage: %s [--evals] TRACE > trace.json\n", argv[0]);
+        return 2;
+    }
+
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        perror(path);
+        return 1;
+    }
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    rewind(in);
+    char *data = malloc(size > 0 ? size : 1);
+    if (size < (long)sizeof(TraceHeader) || fread(data, 1, size, in) != (size_t)size) {
+        fprintf(stderr, "%s: not a trace\n", path);
+        return 1;
+    }
+    fclose(in);
+
+    TraceHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) ||
+        header.version != TRACE_VERSION || header.recordSize != sizeof(TraceRecord) ||
+        sizeof(header) + header.nameBytes > (uint64_t)size) {
+        fprintf(stderr, "%s: not a version %d trace\n", path, TRACE_VERSION);
+        return 1;
+    }
+
+    // the name table
+    const char *at = data + sizeof(header);
+    const char *end = at + header.nameBytes;
+    int capacity = 0;
+    while (at + sizeof(uint64_t) + sizeof(uint32_t) <= end) {
+        Name name;
+        uint32_t length;
+        memcpy(&name.key, at, sizeof(uint64_t));
+        memcpy(&length, at + sizeof(uint64_t), sizeof(uint32_t));
+        at += sizeof(uint64_t) + sizeof(uint32_t);
+        if (length > (size_t)(end - at)) {
+            break;
+        }
+        name.name = strndup(at, length);
+        name.order = nameCount;
+        at += length;
+        if (nameCount == capacity) {
+            capacity = capacity ? 2 * capacity : 256;
+            names = realloc(names, capacity * sizeof(Name));
+        }
+        names[nameCount++] = name;
+    }
+    qsort(names, nameCount, sizeof(Name), compareNames);
+
+    printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    at = end;
+    for (uint32_t i = 0; i < header.threads; i++) {
+        TraceRingHeader ring;
+        if (at + sizeof(ring) > data + size) {
+            break;
+        }
+        memcpy(&ring, at, sizeof(ring));
+        at += sizeof(ring);
+        if (ring.capacity > (uint64_t)(data + size - at) / sizeof(TraceRecord)) {
+            fprintf(stderr, "%s: ring of thread %llu is cut short\n", path,
+                    (unsigned long long)ring.thread);
+            break;
+        }
+        decodeRing(&ring, (const TraceRecord *)at, evals);
+        at += ring.capacity * sizeof(TraceRecord);
+    }
+    printf("\n]}\n");
+    return 0;
+}
@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "trace.h"
+#include "schemeval.h"
+#include "interpreter.h"
+
+#ifdef SCHEME_TRACE
+
+// Threads beyond this many are not traced.
+#define MAX_TRACE_THREADS 256
+// Room for names; later names are dropped once it is full.
+#define NAME_BYTES (16 << 20)
+
+typedef struct {
+    TraceRingHeader header;
+    TraceRecord records[];
+} TraceRing;
+
+bool tracing = false;
+
+static char tracePath[4096];
+static pid_t tracePid;
+static long long startNs;
+static uint64_t ringCapacity;
+
+// every ring made so far; a thread makes its own on its first event
+static TraceRing *rings[MAX_TRACE_THREADS];
+static atomic_int ringCount = 0;
+static _Thread_local TraceRing *threadRing __attribute__((tls_model("initial-exec"))) = NULL;
+// set on threads that found no room for a ring
+static _Thread_local bool untraced __attribute__((tls_model("initial-exec"))) = false;
+
+static char *names = NULL;
+static size_t nameBytes = 0;
+static pthread_mutex_t nameLock = PTHREAD_MUTEX_INITIALIZER;
+
+static atomic_bool dumped = false;
+
+static const int fatalSignals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT, SIGTERM, SIGINT};
+
+/* Reads the monotonic clock in nanoseconds */
+static long long nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Appends a name for key to the name table */
+static void addName(uint64_t key, const char *name) {
+    uint32_t length = strlen(name);
+    pthread_mutex_lock(&nameLock);
+    if (nameBytes + sizeof(key) + sizeof(length) + length <= NAME_BYTES) {
+        char *at = names + nameBytes;
+        memcpy(at, &key, sizeof(key));
+        memcpy(at + sizeof(key), &length, sizeof(length));
+        memcpy(at + sizeof(key) + sizeof(length), name, length);
+        nameBytes += sizeof(key) + sizeof(length) + length;
+    }
+    pthread_mutex_unlock(&nameLock);
+}
+
+/* Writes all of size bytes to fd, retrying short writes */
+static void writeAll(int fd, const void *data, size_t size) {
+    const char *at = data;
+    while (size > 0) {
+        ssize_t written = write(fd, at, size);
+        if (written <= 0) {
+            return;
+        }
+        at += written;
+        size -= written;
+    }
+}
+
+// Writes the trace file
+void dumpTrace() {
+    if (!tracing || getpid() != tracePid || atomic_exchange(&dumped, true)) {
+        return;
+    }
+    int fd = open(tracePath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    // a thread may have claimed a slot without filling it in yet
+    int threads = 0;
+    while (threads < atomic_load(&ringCount) && threads < MAX_TRACE_THREADS &&
+           rings[threads] != NULL) {
+        threads++;
+    }
+    TraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.recordSize = sizeof(TraceRecord);
+    header.nameBytes = nameBytes;
+    header.threads = threads;
+    writeAll(fd, &header, sizeof(header));
+    writeAll(fd, names, header.nameBytes);
+    for (int i = 0; i < threads; i++) {
+        writeAll(fd, rings[i], sizeof(TraceRing) + ringCapacity * sizeof(TraceRecord));
+    }
+    close(fd);
+}
+
+/* Dumps the trace on the way out of a fatal signal, then dies of it */
+static void dumpOnSignal(int signal) {
+    dumpTrace();
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_DFL;
+    sigaction(signal, &action, NULL);
+    raise(signal);
+}
+
+// Starts tracing
+bool startTrace(const char *path, long records) {
+    if (strlen(path) >= sizeof(tracePath)) {
+        return false;
+    }
+    names = mmap(NULL, NAME_BYTES, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (names == MAP_FAILED) {
+        names = NULL;
+        return false;
+    }
+    strcpy(tracePath, path);
+    tracePid = getpid();
+    ringCapacity = 1;
+    while (ringCapacity < (uint64_t)records) {
+        ringCapacity *= 2;
+    }
+    for (int i = 0; i < primitiveCount(); i++) {
+        addName((uintptr_t)primitiveFunction(i), primitiveName(i));
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = dumpOnSignal;
+    action.sa_flags = SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    for (size_t i = 0; i < sizeof(fatalSignals) / sizeof(fatalSignals[0]); i++) {
+        sigaction(fatalSignals[i], &action, NULL);
+    }
+    atexit(dumpTrace);
+    startNs = nowNs();
+    tracing = true;
+    return true;
+}
+
+/* Gives the calling thread a stack of its own for signal handlers, so the
+   trace is still dumped when the thread dies of overflowing its stack */
+static void useSignalStack() {
+    stack_t stack;
+    stack.ss_size = 64 * 1024;
+    stack.ss_flags = 0;
+    stack.ss_sp = mmap(NULL, stack.ss_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (stack.ss_sp != MAP_FAILED) {
+        sigaltstack(&stack, NULL);
+    }
+}
+
+/* Makes the calling thread's ring, or returns NULL if there is no room */
+static TraceRing *newRing() {
+    useSignalStack();
+    int index = atomic_fetch_add(&ringCount, 1);
+    if (index >= MAX_TRACE_THREADS) {
+        atomic_fetch_sub(&ringCount, 1);
+        untraced = true;
+        return NULL;
+    }
+    TraceRing *ring = mmap(NULL, sizeof(TraceRing) + ringCapacity * sizeof(TraceRecord),
+                           PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                           -1, 0);
+    if (ring == MAP_FAILED) {
+        // leave an empty ring in the slot, as the count already covers it
+        ring = calloc(1, sizeof(TraceRing));
+        untraced = true;
+    } else {
+        ring->header.capacity = ringCapacity;
+        threadRing = ring;
+    }
+    ring->header.thread = index + 1;
+    rings[index] = ring;
+    return threadRing;
+}
+
+// Appends a record to the calling thread's ring
+void traceEvent(TraceKind kind, uint32_t detail, uint64_t subject, uint64_t extra) {
+    TraceRing *ring = threadRing;
+    if (ring == NULL && (untraced || (ring = newRing()) == NULL)) {
+        return;
+    }
+    TraceRecord *record = &ring->records[ring->header.written & (ringCapacity - 1)];
+    record->time = nowNs() - startNs;
+    record->subject = subject;
+    record->extra = extra;
+    record->kind = kind;
+    record->detail = detail;
+    ring->header.written++;
+}
+
+// Names a closure's lambda after the variable it is bound to
+void traceName(SchemeVal *value, const char *name) {
+    if (value->type == CLOSURE_TYPE) {
+        addName(traceKey(value), name);
+    }
+}
+
+// Records an error, naming it by its message
+void traceError(SchemeVal *condition) {
+    if (condition->type == ERROR_TYPE && condition->message->type == STR_TYPE) {
+        addName((uintptr_t)condition, condition->message->s);
+    }
+    traceEvent(TRACE_ERROR, condition->type, (uintptr_t)condition, 0);
+}
+
+#endif
@@ -0,0 +1,114 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "schemeval.h"
+
+#ifndef _TRACE
+#define _TRACE
+
+// An event trace for post-mortem analysis of latency spikes. Built with
+// -DSCHEME_TRACE (just build-trace) and started with --trace FILE, eval,
+// apply, heap growth and errors write fixed-size records into a ring buffer
+// per thread, keeping the most recent events. The rings are written to FILE
+// when the process exits, through texit or otherwise, or is killed by a
+// fatal signal; tools/tracedecode.c turns the file into a Chrome trace
+// (chrome://tracing or Perfetto). Without SCHEME_TRACE the TRACE_ macros
+// below expand to nothing.
+
+typedef enum {
+    TRACE_EVAL,     // subject: the expression; detail: its type
+    TRACE_CALL,     // apply starting; subject: the procedure's key (see
+                    // traceKey); detail: its type; extra: apply's stack
+                    // frame, so unwound calls can be told apart
+    TRACE_RETURN,   // apply returning; fields as for its TRACE_CALL
+    TRACE_HEAP,     // the thread's talloc total passed another MiB; extra:
+                    // bytes allocated so far
+    TRACE_ERROR,    // an error raised; subject: the condition
+} TraceKind;
+
+typedef struct {
+    uint64_t time;      // nanoseconds since the trace started
+    uint64_t subject;
+    uint64_t extra;
+    uint32_t kind;
+    uint32_t detail;
+} TraceRecord;
+
+// The trace file: a TraceHeader, then header.nameBytes of names, each an
+// 8-byte key, a 4-byte length and that many bytes of text (a later name for
+// a key replaces an earlier one); then header.threads rings, each a
+// TraceRingHeader followed by capacity records. Record i of a ring is in
+// slot i % capacity; only the last capacity of the written ones survive.
+#define TRACE_MAGIC "SCMTRACE"
+#define TRACE_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t nameBytes;
+    uint32_t threads;
+    uint32_t reserved;
+} TraceHeader;
+
+typedef struct {
+    uint64_t thread;
+    uint64_t written;
+    uint64_t capacity;
+} TraceRingHeader;
+
+// The key a procedure is traced under: the body shared by every closure
+// made from one lambda, or the C function of a primitive or compiled lambda.
+static inline uint64_t traceKey(SchemeVal *function) {
+    return function->type == CLOSURE_TYPE ? (uint64_t)(uintptr_t)function->functionCode
+         : function->type == PRIMITIVE_TYPE ? (uint64_t)(uintptr_t)function->pf
+         : function->type == COMPILED_TYPE ? (uint64_t)(uintptr_t)function->code
+         : (uint64_t)(uintptr_t)function;
+}
+
+#ifdef SCHEME_TRACE
+
+extern bool tracing;
+
+// Starts tracing into rings of records entries per thread (rounded up to a
+// power of two), to be written to path. Returns false if the name table
+// could not be set up.
+bool startTrace(const char *path, long records);
+
+// Writes every ring to the trace file; only the first call does anything.
+// Async-signal-safe.
+void dumpTrace();
+
+void traceEvent(TraceKind kind, uint32_t detail, uint64_t subject, uint64_t extra);
+
+// Names the procedure value, for the decoder.
+void traceName(SchemeVal *value, const char *name);
+
+// Records an error and its message.
+void traceError(SchemeVal *condition);
+
+#define TRACE_EVAL(expr) \
+    do { if (tracing) traceEvent(TRACE_EVAL, (expr)->type, (uintptr_t)(expr), 0); } while (0)
+#define TRACE_CALL(function) \
+    do { if (tracing) traceEvent(TRACE_CALL, (function)->type, traceKey(function), \
+                                 (uintptr_t)__builtin_frame_address(0)); } while (0)
+#define TRACE_RETURN(function) \
+    do { if (tracing) traceEvent(TRACE_RETURN, (function)->type, traceKey(function), \
+                                 (uintptr_t)__builtin_frame_address(0)); } while (0)
+#define TRACE_ALLOCATED(total, size) \
+    do { if (tracing && (((total) ^ ((total) - (size))) >> 20)) \
+             traceEvent(TRACE_HEAP, 0, 0, (total)); } while (0)
+#define TRACE_ERROR(condition) do { if (tracing) traceError(condition); } while (0)
+#define TRACE_NAME(value, name) do { if (tracing) traceName((value), (name)); } while (0)
+
+#else
+
+#define TRACE_EVAL(expr) ((void)0)
+#define TRACE_CALL(function) ((void)0)
+#define TRACE_RETURN(function) ((void)0)
+#define TRACE_ALLOCATED(total, size) ((void)0)
+#define TRACE_ERROR(condition) ((void)0)
+#define TRACE_NAME(value, name) ((void)0)
+
+#endif
+
+#endif